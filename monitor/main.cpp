@@ -4,22 +4,105 @@
  */
 
 #include "hardware/clocks.h"
+#include "hardware/dma.h"
+#include "hardware/flash.h"
 #include "hardware/gpio.h"
+#include "hardware/irq.h"
+#include "hardware/pio.h"
 #include "hardware/pwm.h" // Added for clock generation
 #include "hardware/structs/sio.h"
+#include "hardware/structs/systick.h"
+#include "hardware/sync.h"
 #include "pico/multicore.h"
+#include "pico/mutex.h"
 #include "pico/stdlib.h"
 #include "pico/bootrom.h"
 #include "pico/platform.h"
+#include "pico/unique_id.h"
 #include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "bus.pio.h"
+#include "tusb.h"
+
 // --- Config ---
 #define VERSION_STR "0.0.1"
 #define RAM_SIZE 0x20000 // 128KB Virtual RAM
+#define MEM_PAGE_SHIFT 12 // Memory map granule: 4KB pages
+#define MEM_REGIONS 8     // Entries of the region table ('mm')
+#define DIRTY_PAGE_SHIFT 8 // Dirty tracking granule: 256 bytes of ram[]
 #define MAX_CYCLES 4000 // Log buffer size
+#define COM_LOG_PORT 0x2F8 // Default port recorded by CMD_RUN_COMLOG
+#define TRACE_FILTER_RULES 4 // Address range rules of the capture filter
+#define WATCH_POINTS 8 // Memory watchpoints/breakpoints
+#define WATCH_GRANULE_SHIFT 4 // watch_map has one bit per 16 bytes of ram[]
+#define PROF_BUCKETS (RAM_SIZE / 16) // Profiler histogram at the finest granule
+#define CON_EXIT_KEY 0x1D // Ctrl-]: leave the HIDOS VM
+#define SNAP_KEY 0x1C     // Ctrl-\: save a HIDOS snapshot
+#define TRACE_STREAM_BLOCKS 4 // trace_log is split into this many blocks while streaming
+#define TRACE_STREAM_BLOCK_ENTRIES (MAX_CYCLES / TRACE_STREAM_BLOCKS)
+#define TRACE_STREAM_BLOCK_BYTES (TRACE_STREAM_BLOCK_ENTRIES * 8)
+#define COMPACT_HEADER_SIZE 8  // "V30C" + payload length, buffer mode only
+#define COMPACT_MAX_RECORD 6   // header + 3 address bytes + 2 data bytes
+#define COMPACT_SYNC_INTERVAL 64 // Records between full address/data sync points
+#define DISK_BLOCK_SIZE 512
+#define DISK_OVERLAY_BLOCKS 32 // Copy-on-write blocks in SRAM (16KB)
+#define DISK_CACHE_BLOCKS 8    // Read cache for FAT/directory blocks (4KB)
+#define DISK_CACHE_MAX_READ (2 * DISK_BLOCK_SIZE) // Larger reads bypass it
+#define DISK_DMA_RUNS 8 // Queued contiguous copies of one bulk read
+#define VMIO_QUEUE_MAX 32 // Entries served per 'QU' request block
+#define UART_TX_RING 256 // Emulated 16550 transmit buffer per port (power of 2)
+#define UART_RX_RING 64  // ... and receive buffer (power of 2)
+#define UART_FIFO_DEPTH 16 // LSR.THRE needs this much room in the transmit buffer
+#define CON_TX_RING 1024      // HIDOS console output ring (power of 2)
+#define CON_TX_FLUSH_BYTES 256 // Flush once this much output is pending
+#define CON_FLUSH_US 2000     // ... or when core0 has been idle this long
+#define STREAM_POLL_US 100    // hidos_host() wait during 'h stream'
+#define LIVE_RATE_MS 1000     // 'g rate' report interval by default
+#define LIVE_RATE_MIN_MS 100
+#define CON_RX_RING 64        // HIDOS console input ring (power of 2)
+#define CRC_DMA_MIN_LEN 128   // Shorter buffers are cheaper with the table
+#define BIN_MAX_PAYLOAD 4096  // Largest binary protocol frame payload
+#define BIN_MAGIC "\x02\x02V30" // Switches the prompt to the binary protocol
+
+// --- Flash Layout ---
+// Regions at the top of flash, below them the program and disk.img.
+#define DISK_OVERLAY_FLASH_SIZE (128 * 1024)
+#define DISK_OVERLAY_FLASH_OFFSET                                              \
+  (PICO_FLASH_SIZE_BYTES - DISK_OVERLAY_FLASH_SIZE)
+#define SNAPSHOT_FLASH_SIZE (192 * 1024) // HIDOS machine snapshot ('snap')
+#define SNAPSHOT_FLASH_OFFSET (DISK_OVERLAY_FLASH_OFFSET - SNAPSHOT_FLASH_SIZE)
+#define BATCH_FLASH_SIZE RAM_SIZE // Batch autotest image ('batch')
+#define BATCH_FLASH_OFFSET (SNAPSHOT_FLASH_OFFSET - BATCH_FLASH_SIZE)
+
+// --- SRAM Layout ---
+// Built with V30_BANKED_SRAM (CMake option), memmap_banked.ld uses the
+// non-striped SRAM aliases so core1 never waits behind core0's USB/stdio
+// traffic or the disk DMA on the same bank:
+//   SRAM0-1    ram[]
+//   SRAM2      core1 code (CORE1_FUNC) and its per-cycle data (IN_CORE1_BANK)
+//   SRAM3      everything else of core0, heap
+//   SCRATCH_X  core1 stack, SCRATCH_Y core0 stack (as in the SDK default)
+// Without it the SDK's striped layout is kept and CORE1_FUNC is
+// __not_in_flash_func.
+#ifndef V30_BANKED_SRAM
+#define V30_BANKED_SRAM 0
+#endif
+#ifndef V30_RD_TIMING
+#define V30_RD_TIMING 0 // Worst RD response in 'stat' (CMake option)
+#endif
+#if V30_BANKED_SRAM
+#define IN_V30_RAM_BANK __attribute__((section(".v30_ram")))
+#define IN_CORE1_BANK __attribute__((section(".core1_bss")))
+#define CORE1_FUNC(func_name)                                                  \
+  __attribute__((section(".core1_func." #func_name))) func_name
+#else
+#define IN_V30_RAM_BANK
+#define IN_CORE1_BANK
+#define CORE1_FUNC(func_name) __not_in_flash_func(func_name)
+#endif
 
 // --- Pin Definitions ---
 #define PIN_AD_BASE 0
@@ -37,6 +120,14 @@
 #define PIN_A18 28
 #define PIN_A19 29
 
+// --- PIO Bus Engine ---
+#define PIO_BUS pio0
+#define SM_ADDR 0   // v30_addr: address phase
+#define SM_STROBE 1 // v30_strobe: RD/WR phase
+// Bit positions in the v30_strobe RX word (in_base = PIN_WR, wraps at 32)
+#define STROBE_RD_BIT ((PIN_RD - PIN_WR) & 31)
+#define STROBE_AD_SHIFT ((PIN_AD_BASE - PIN_WR) & 31)
+
 // --- Data Structures ---
 enum LogType { LOG_UNUSED = 0, LOG_MEM_RD, LOG_MEM_WR, LOG_IO_RD, LOG_IO_WR };
 
@@ -50,35 +141,283 @@ struct __attribute__((packed)) BusLog {
 };
 
 // --- Globals ---
-uint8_t ram[RAM_SIZE];
-BusLog trace_log[MAX_CYCLES];
+IN_V30_RAM_BANK uint8_t ram[RAM_SIZE];
+IN_CORE1_BANK BusLog trace_log[MAX_CYCLES];
+
+// --- Memory Map ---
+// The 1MB V30 address space is split into 4KB pages. mem_map[] holds a
+// host pointer per page for reads and one for writes, so the bus engine
+// serves SRAM and flash (XIP) directly, without a copy or a type check.
+// A page without a read pointer belongs to a handler (mem_handlers[], by
+// mem_page_handler[]); a page with a read but no write pointer is
+// read-only and drops writes. mem_map_rebuild() fills the table from
+// mem_regions[], later regions overriding earlier ones. The default map is
+// one RAM region over the whole space, so ram[] repeats every RAM_SIZE
+// bytes, as the V30 has always seen it.
+#define MEM_PAGE_SIZE (1u << MEM_PAGE_SHIFT)
+#define MEM_PAGES (0x100000 >> MEM_PAGE_SHIFT)
+static_assert(RAM_SIZE % MEM_PAGE_SIZE == 0, "ram[] must be whole pages");
+
+enum MemType { MEM_RAM = 0, MEM_ROM, MEM_HANDLER };
+
+struct MemRegion {
+  uint32_t start, size; // V30 addresses, page aligned
+  uint8_t type;         // See MemType
+  uint32_t src; // MEM_RAM: ram[] offset (wraps), MEM_ROM: boot.img offset,
+                // MEM_HANDLER: index into mem_handlers[]
+};
+
+struct MemPage {
+  const uint8_t *rd; // Page base for reads, nullptr: handler
+  uint8_t *wr;       // Page base for writes, nullptr: read-only or handler
+};
+
+// Memory-mapped device. Called on core1 from the bus engine, so both
+// functions must live in SRAM.
+struct MemHandler {
+  const char *name;
+  uint16_t (*read)(uint32_t addr); // addr is even, returns the whole word
+  void (*write)(uint32_t addr, uint16_t data, bool bhe_low);
+};
+
+MemRegion mem_regions[MEM_REGIONS];
+uint8_t mem_region_count = 0;
+IN_CORE1_BANK MemPage mem_map[MEM_PAGES];
+IN_CORE1_BANK uint8_t mem_page_handler[MEM_PAGES];
+uint32_t mem_rom_pages = 0; // Pages served from flash
+
+extern const uint8_t _binary_boot_img_start[];
+extern const uint8_t _binary_boot_img_end[];
+
+// --- Dirty Pages ---
+// One byte per DIRTY_PAGE_SIZE of ram[], set when the page is written by the
+// V30, by HIDOS services or by monitor edits. Whole-RAM loads (xr, f, k,
+// FILL_RAM) start a new baseline and clear it. A byte per page instead of a
+// bit keeps the bus engine's store free of a read-modify-write.
+#define DIRTY_PAGE_SIZE (1u << DIRTY_PAGE_SHIFT)
+#define DIRTY_PAGES (RAM_SIZE >> DIRTY_PAGE_SHIFT)
+IN_CORE1_BANK uint8_t ram_dirty[DIRTY_PAGES];
 
 volatile bool stop_request = false;
 
+enum BusEngine { BUS_ENGINE_SIO = 0, BUS_ENGINE_PIO };
+volatile uint8_t bus_engine = BUS_ENGINE_SIO;
+
 volatile int cycle_limit;
 volatile int executed_cycles;
 volatile int execution_time_us;
 
+// Why the last run stopped, set by core1 (reported by the binary protocol).
+enum RunEnd {
+  RUN_END_LIMIT = 0, // cycle_limit reached
+  RUN_END_STOP,      // stop_request
+  RUN_END_LOG_FULL,  // trace_log full
+  RUN_END_NO_ALE,    // Bus timeout waiting for ALE
+  RUN_END_NO_STROBE, // Bus timeout waiting for RD/WR
+  RUN_END_RESYNC,    // ALE without RD/WR (HLT)
+  RUN_END_WATCH,     // Watchpoint hit (see watch_hit)
+};
+volatile uint8_t run_end_reason;
+// Set by core1 with a bus timeout or resync end unless console_quiet; core0
+// prints it (bus_report_end()), as watch_hit_pending.
+volatile bool bus_end_pending = false;
+// Set while the binary protocol owns the USB link: nothing but frames may
+// be written to stdout, so core1 only records run_end_reason.
+volatile bool console_quiet = false;
+
+// --- Trace Streaming ---
+// While streaming, trace_log is a ring of TRACE_STREAM_BLOCKS blocks. Core1
+// fills a block and publishes it by setting its length; core0 sends it to
+// the host and clears the length to hand the block back. Records produced
+// while the next block is still owned by core0 are dropped and counted.
+volatile bool trace_stream_enabled = false;
+volatile uint16_t trace_stream_ready[TRACE_STREAM_BLOCKS]; // records or bytes
+volatile uint32_t trace_stream_dropped;
+volatile uint32_t trace_stream_total;
+
+// --- Trace Format ---
+// TRACE_FMT_COMPACT stores delta-encoded records (see compact_encode()) in
+// the bytes of trace_log instead of one BusLog per cycle.
+enum TraceFormat { TRACE_FMT_RAW = 0, TRACE_FMT_COMPACT };
+volatile uint8_t trace_format = TRACE_FMT_RAW;
+volatile uint32_t trace_compact_bytes; // Payload size after a buffered run
+
+// --- Trace Filter ---
+// Set by the 'tr' command and read by core1 when a run starts. A cycle
+// selected by the logging mode is logged if it matches any rule (or there
+// are none). With a trigger nothing is logged until it fires; in the raw
+// buffered format the last `pre` matching cycles before it are kept too.
+#define TRACE_TYPE_ALL 0x0F // One bit per LogType (bit = type - 1)
+struct TraceRule {
+  uint32_t lo, hi; // Inclusive address range
+  uint8_t types;
+};
+enum TriggerKind { TRIG_NONE = 0, TRIG_ACCESS, TRIG_CYCLES };
+struct TraceFilter {
+  uint8_t rules;
+  TraceRule rule[TRACE_FILTER_RULES];
+  uint8_t trig;       // TriggerKind
+  uint8_t trig_types; // TRIG_ACCESS: cycle types that fire it
+  uint32_t trig_arg;  // TRIG_ACCESS: address, TRIG_CYCLES: bus cycles
+  uint32_t pre;       // Pre-trigger depth, raw buffered format only
+};
+TraceFilter trace_filter;
+volatile uint16_t trace_com_port = COM_LOG_PORT;
+volatile bool trace_triggered; // Trigger fired during the last run
+
+// --- Watchpoints ---
+// Set by 'wp'/'bp' (core0). watch_map marks the granules of ram[] that hold
+// a watchpoint, so an unwatched memory cycle costs one load and test in the
+// bus loop; only a marked granule goes on to compare watch[]. A hit ends the
+// run after the cycle completes and holds the V30 in reset.
+#define WATCH_READ 0x1
+#define WATCH_WRITE 0x2
+struct Watchpoint {
+  uint32_t lo, hi; // Inclusive, ram[] offsets (after map_address())
+  uint8_t types;   // WATCH_READ / WATCH_WRITE
+};
+Watchpoint watch[WATCH_POINTS];
+uint8_t watch_count = 0;
+IN_CORE1_BANK uint32_t watch_map[(RAM_SIZE >> WATCH_GRANULE_SHIFT) / 32];
+struct WatchHit {
+  uint32_t addr;   // V30 address of the cycle
+  uint16_t data;
+  uint8_t type;    // LOG_MEM_RD / LOG_MEM_WR
+  uint8_t index;   // watch[] entry
+  uint32_t cycle;  // Bus cycle number in the run
+};
+WatchHit watch_hit; // Written by core1 before a run ending in RUN_END_WATCH
+// Set by core1 with watch_hit unless console_quiet; core0 prints the hit
+// (watch_report_hit()). Core1 itself never prints: it may run while core0
+// has XIP off for a flash write.
+volatile bool watch_hit_pending = false;
+#define HIDOS_EXIT_TOKEN 0x10000 // Core1 -> hidos_host(): the VM has stopped
+
+// --- Profiler ---
+// Every prof_period-th memory read of a 'g' or HIDOS run bumps the bucket
+// of its address in prof_hist (saturating). Reads are mostly instruction
+// fetches, and bus cycles come at a fixed rate of the V30 clock, so the
+// histogram approximates where the CPU spends its time.
+uint16_t prof_hist[PROF_BUCKETS]; // Sampled, so not in core1's bank
+volatile uint32_t prof_period = 0;   // 0: profiler off
+volatile uint8_t prof_shift = 4;     // Bucket size: 4 = 16 bytes, 8 = 256
+uint32_t prof_countdown = 1;         // Core1, reset by prof_setup()
+volatile uint32_t prof_samples = 0;
+
 // --- Clock Config ---
-struct FreqSetting {
-  uint32_t freq_hz;
-  uint16_t wrap;
-  float div;
+// The V30 clock is PWM on PIN_CLK_OUT: freq = sys / (top * (int + frac/16)).
+// An integer divider gives every period the same length; a fractional one
+// alternates between two lengths one sys clock apart (jitter). An even top
+// gives an exact 50% duty.
+#define SYS_CLOCK_KHZ 250000      // Default sys clock
+#define SYS_CLOCK_MIN_KHZ 125000  // Range searched by 'c <kHz> auto'
+#define SYS_CLOCK_MAX_KHZ 250000  // Boot2 sets up the flash for <= 250MHz
+#define SYS_CLOCK_STEP_KHZ 1000
+#define CLOCK_TOLERANCE_PPM 50 // Errors below this count as exact
+
+struct ClockPlan {
+  uint32_t sys_khz;
+  uint32_t top;   // PWM period in divided clocks (wrap + 1)
+  uint16_t div16; // PWM divider in 1/16ths (8.4 fixed point)
+  uint32_t err_ppm;
 };
 
-const FreqSetting freq_table[] = {{8000000, 4, 6.25f},  {4000000, 4, 12.5f},
-                                  {1000000, 4, 50.0f},  {750000, 4, 66.67f},
-                                  {500000, 4, 100.0f},  {250000, 99, 10.0f},
-                                  {125000, 99, 20.0f},  {50000, 99, 50.0f},
-                                  {10000, 249, 100.0f}, {1000, 999, 250.0f}};
+// Presets listed by 'c' and swept by 'bench'; any other clock works too
+const uint32_t freq_table[] = {8000000, 4000000, 1000000, 750000, 500000,
+                               250000,  125000,  50000,   10000,  1000};
 static uint32_t current_freq_hz = 500000;
+static bool current_clock_tuned = false; // sys clock chosen by 'c <kHz> auto'
+static ClockPlan current_clock;
+
+// --- Bus Turnaround ---
+// On a read the V30 floats AD0-15 in T2, off the same clock edge that
+// drives RD# low, and samples the data at the end of T3. Driving AD0-15
+// before the float completes shorts the two drivers; every ns after it only
+// eats into the data setup time. The float is over by the next clock edge
+// (where an 8086 system enables its transceivers with DEN#) and never
+// takes longer than V30_AD_FLOAT_NS, so the wait after RD# low is
+// min(half a V30 clock, V30_AD_FLOAT_NS), counted in sys clocks.
+#define V30_AD_FLOAT_NS 80       // Worst-case AD float after RD# low
+#define BUS_TURNAROUND_MIN_NS 20 // Never less: GPIO input synchroniser margin
+volatile uint32_t bus_turnaround_cycles; // Set by bus_turnaround_update()
 
 // --- XMODEM Constants ---
 #define SOH 0x01
+#define STX 0x02 // XMODEM-1K block
 #define EOT 0x04
 #define ACK 0x06
 #define NAK 0x15
 #define CAN 0x18
+#define XMODEM_1K_BLOCK 1024
+#define RAW_MAGIC "V30R" // Raw bulk transfer header
+#define RAW_RETRIES 3
+#define PACK_MAGIC "V30P"   // PackBits compressed transfer header
+#define PACK_HEADER_SIZE 8  // PACK_MAGIC + unpacked length
+#define PACK_TOKEN_MAX 129  // Control byte + 128 literal bytes
+
+// --- Transfer Modes (xr/xs/xl/autotest) ---
+// The low bits select the transport, XFER_PACKED ("rle") compresses the data
+// carried by either of them.
+enum XferMode {
+  XFER_XMODEM = 0,
+  XFER_XMODEM_1K,
+  XFER_RAW,
+  XFER_KIND = 0x0F,
+  XFER_PACKED = 0x10,
+};
+
+// --- Statistics ---
+// Shown by 'stat' and BIN_OP_STATS. bus_stats is updated by core1 in the
+// bus loop (one increment per cycle), vmio_stats and usb_stats by core0.
+struct BusStats {
+  uint32_t cycles[4]; // By LogType - 1: mem rd, mem wr, I/O rd, I/O wr
+  uint32_t timeout_ale;
+  uint32_t timeout_strobe;
+  uint32_t resync;
+  uint32_t runs;
+  uint64_t run_cycles; // Sums over all runs, for the average rate
+  uint64_t run_time_us;
+  uint32_t last_cycles;
+  uint32_t last_time_us;
+  uint32_t rd_worst_ticks; // V30_RD_TIMING: sys clocks, RD seen to data driven
+  uint32_t last_read;      // Address of the latest memory read ('g rate')
+};
+IN_CORE1_BANK volatile BusStats bus_stats;
+
+enum VmioDev {
+  VMIO_INIT,
+  VMIO_DISK,
+  VMIO_CON,
+  VMIO_AUX,
+  VMIO_CLOCK,
+  VMIO_PRINTER,
+  VMIO_QUEUE, // One 'QU' doorbell; its entries count under their devices
+  VMIO_UNKNOWN,
+  VMIO_DEVS
+};
+// Service latency: doorbell received to completion token sent
+struct VmioStats {
+  uint32_t count;
+  uint32_t total_us;
+  uint32_t max_us;
+};
+VmioStats vmio_stats[VMIO_DEVS];
+
+void vmio_stats_add(VmioDev dev, uint32_t t) {
+  VmioStats &s = vmio_stats[dev];
+  s.count++;
+  s.total_us += t;
+  if (t > s.max_us)
+    s.max_us = t;
+}
+
+// Bytes through the binary protocol, bulk transfers, XMODEM, trace streams
+// and the HIDOS console (plain monitor text is not counted).
+struct UsbStats {
+  uint32_t bytes_in;
+  uint32_t bytes_out;
+};
+UsbStats usb_stats;
 
 // ==========================================
 //   Hardware Helper Functions
@@ -127,34 +466,529 @@ __force_inline void write_data(uint16_t d) {
  */
 __force_inline uint16_t read_data() { return sio_hw->gpio_in & 0xFFFF; }
 
+// --- USB (two CDC ports) ---
+// The device is a composite of two CDC ACM ports, driven through TinyUSB
+// directly instead of pico_stdio_usb:
+//   CDC 0 (USB_ITF_MONITOR): stdio, i.e. the command line, the binary
+//                            protocol, XMODEM and trace streams
+//   CDC 1 (USB_ITF_CONSOLE): the HIDOS console and the UARTs of 'g'
+// While no terminal has CDC 1 open (DTR low) the console falls back to CDC 0,
+// so a single terminal works as before. Otherwise the monitor port stays
+// usable during a HIDOS session (hidos_monitor_poll()). tud_task() runs from
+// a low priority IRQ raised every USB_TASK_INTERVAL_US; usb_mutex keeps it
+// apart from the CDC calls of either core (core1 may printf).
+#define USB_ITF_MONITOR 0
+#define USB_ITF_CONSOLE 1
+#define USB_TASK_INTERVAL_US 1000
+#define USB_WRITE_TIMEOUT_US 500000 // Give up on a port that stopped reading
+#define USB_VID 0x2E8A // Raspberry Pi
+#define USB_PID 0x000A // Pico SDK CDC
+#define USB_CONFIG_LEN (TUD_CONFIG_DESC_LEN + 2 * TUD_CDC_DESC_LEN)
+
+enum UsbString {
+  USB_STR_LANGID = 0,
+  USB_STR_MANUFACTURER,
+  USB_STR_PRODUCT,
+  USB_STR_SERIAL,
+  USB_STR_MONITOR,
+  USB_STR_CONSOLE,
+};
+
+static const tusb_desc_device_t usb_device_desc = {
+    sizeof(tusb_desc_device_t), TUSB_DESC_DEVICE, 0x0200,
+    TUSB_CLASS_MISC, MISC_SUBCLASS_COMMON, MISC_PROTOCOL_IAD, // IAD composite
+    CFG_TUD_ENDPOINT0_SIZE, USB_VID, USB_PID,
+    0x0200, // bcdDevice, differs from the single-port stdio device
+    USB_STR_MANUFACTURER, USB_STR_PRODUCT, USB_STR_SERIAL, 1};
+
+static const uint8_t usb_config_desc[] = {
+    TUD_CONFIG_DESCRIPTOR(1, 4, 0, USB_CONFIG_LEN, 0, 250),
+    // Interface numbers, string, notification EP, size, data OUT/IN EPs, size
+    TUD_CDC_DESCRIPTOR(0, USB_STR_MONITOR, 0x81, 8, 0x02, 0x82, 64),
+    TUD_CDC_DESCRIPTOR(2, USB_STR_CONSOLE, 0x83, 8, 0x04, 0x84, 64),
+};
+
+static const char *const usb_strings[] = {
+    nullptr, "Raspberry Pi", "V30 Control", nullptr, "V30 Monitor",
+    "V30 Console",
+};
+
+extern "C" const uint8_t *tud_descriptor_device_cb(void) {
+  return (const uint8_t *)&usb_device_desc;
+}
+
+extern "C" const uint8_t *tud_descriptor_configuration_cb(uint8_t) {
+  return usb_config_desc;
+}
+
+extern "C" const uint16_t *tud_descriptor_string_cb(uint8_t index, uint16_t) {
+  static uint16_t desc[32];
+  static char serial[2 * PICO_UNIQUE_BOARD_ID_SIZE_BYTES + 1];
+  uint8_t n;
+  if (index == USB_STR_LANGID) {
+    desc[1] = 0x0409; // English
+    n = 1;
+  } else if (index < count_of(usb_strings)) {
+    const char *s = usb_strings[index];
+    if (index == USB_STR_SERIAL) {
+      if (!serial[0])
+        pico_get_unique_board_id_string(serial, sizeof(serial));
+      s = serial;
+    }
+    for (n = 0; s[n] && n < count_of(desc) - 1; n++)
+      desc[n + 1] = s[n];
+  } else {
+    return nullptr;
+  }
+  desc[0] = (TUSB_DESC_STRING << 8) | (2 * n + 2);
+  return desc;
+}
+
+mutex_t usb_mutex;
+stdio_driver_t stdio_monitor; // stdio on USB_ITF_MONITOR
+static uint usb_task_irq;
+static repeating_timer_t usb_task_timer;
+
+void usb_task_irq_handler() {
+  // Skipped if a CDC call holds the mutex, it runs tud_task() itself
+  if (mutex_try_enter(&usb_mutex, NULL)) {
+    tud_task();
+    mutex_exit(&usb_mutex);
+  }
+}
+
+bool usb_task_timer_cb(repeating_timer_t *) {
+  irq_set_pending(usb_task_irq);
+  return true;
+}
+
+/**
+ * @brief CDCポートがホストに開かれているかを返します。
+ * @param itf CDCの番号
+ * @return DTRが立っている場合true
+ */
+bool cdc_connected(uint8_t itf) {
+  mutex_enter_blocking(&usb_mutex);
+  bool c = tud_cdc_n_connected(itf);
+  mutex_exit(&usb_mutex);
+  return c;
+}
+
+/**
+ * @brief CDCポートに書き込みます。開かれていないポートへの出力と、
+ * USB_WRITE_TIMEOUT_USの間読まれない分は捨てます。
+ * @param itf CDCの番号
+ * @param buf データ
+ * @param len バイト数
+ * @return なし
+ */
+void cdc_write(uint8_t itf, const void *buf, int len) {
+  const uint8_t *p = (const uint8_t *)buf;
+  absolute_time_t deadline = make_timeout_time_us(USB_WRITE_TIMEOUT_US);
+  while (len > 0) {
+    mutex_enter_blocking(&usb_mutex);
+    if (!tud_cdc_n_connected(itf)) {
+      mutex_exit(&usb_mutex);
+      return;
+    }
+    uint32_t n = tud_cdc_n_write(itf, p, len);
+    tud_task();
+    tud_cdc_n_write_flush(itf);
+    mutex_exit(&usb_mutex);
+    if (n > 0) {
+      p += n;
+      len -= n;
+      deadline = make_timeout_time_us(USB_WRITE_TIMEOUT_US);
+    } else if (time_reached(deadline)) {
+      return;
+    }
+  }
+}
+
+/**
+ * @brief CDCポートに届いている分だけ読み出します。
+ * @param itf CDCの番号
+ * @param buf 格納先
+ * @param len 最大バイト数
+ * @return 読み出したバイト数、何も無ければPICO_ERROR_NO_DATA
+ */
+int cdc_read(uint8_t itf, void *buf, int len) {
+  mutex_enter_blocking(&usb_mutex);
+  int n = tud_cdc_n_available(itf) ? tud_cdc_n_read(itf, buf, len) : 0;
+  mutex_exit(&usb_mutex);
+  return n > 0 ? n : PICO_ERROR_NO_DATA;
+}
+
+void stdio_monitor_out_chars(const char *buf, int len) {
+  cdc_write(USB_ITF_MONITOR, buf, len);
+}
+
+int stdio_monitor_in_chars(char *buf, int len) {
+  return cdc_read(USB_ITF_MONITOR, buf, len);
+}
+
+/**
+ * @brief TinyUSBを初期化し、USB_ITF_MONITORをstdioに登録します。
+ * @param なし
+ * @return なし
+ */
+void usb_init() {
+  mutex_init(&usb_mutex);
+  tusb_init();
+  usb_task_irq = user_irq_claim_unused(true);
+  irq_set_exclusive_handler(usb_task_irq, usb_task_irq_handler);
+  irq_set_priority(usb_task_irq, PICO_LOWEST_IRQ_PRIORITY);
+  irq_set_enabled(usb_task_irq, true);
+  add_repeating_timer_us(USB_TASK_INTERVAL_US, usb_task_timer_cb, NULL,
+                         &usb_task_timer);
+  stdio_monitor.out_chars = stdio_monitor_out_chars;
+  stdio_monitor.in_chars = stdio_monitor_in_chars;
+#if PICO_STDIO_ENABLE_CRLF_SUPPORT
+  stdio_monitor.crlf_enabled = true;
+#endif
+  stdio_set_driver_enabled(&stdio_monitor, true);
+}
+
+/**
+ * @brief USB CDCにデータを直接書き込み、usb_statsに数えます。
+ * @param buf データ
+ * @param len バイト数
+ * @return なし
+ */
+void usb_write(const void *buf, int len) {
+  cdc_write(USB_ITF_MONITOR, buf, len);
+  usb_stats.bytes_out += len;
+}
+
+/**
+ * @brief USB CDCから届いている分だけデータを読み出し、usb_statsに数えます。
+ * @param buf 格納先
+ * @param len 最大バイト数
+ * @return 読み出したバイト数 (0以下なら何も届いていない)
+ */
+int usb_read(void *buf, int len) {
+  int n = cdc_read(USB_ITF_MONITOR, buf, len);
+  if (n > 0)
+    usb_stats.bytes_in += n;
+  return n;
+}
+
+/**
+ * @brief V30のコンソール (HIDOS、'g'のUART) に使うCDCを返します。
+ * @param なし
+ * @return USB_ITF_CONSOLEが開かれていればそれ、無ければUSB_ITF_MONITOR
+ * (トレースストリーム中は常にUSB_ITF_CONSOLE)
+ */
+uint8_t console_itf() {
+  if (trace_stream_enabled)
+    return USB_ITF_CONSOLE; // The stream owns the monitor port, even closed
+  return cdc_connected(USB_ITF_CONSOLE) ? USB_ITF_CONSOLE : USB_ITF_MONITOR;
+}
+
+/**
+ * @brief V30のコンソールに書き込み、usb_statsに数えます。
+ * @param buf データ
+ * @param len バイト数
+ * @return なし
+ */
+void console_write(const void *buf, int len) {
+  cdc_write(console_itf(), buf, len);
+  usb_stats.bytes_out += len;
+}
+
+/**
+ * @brief V30のコンソールから1文字読み出します。
+ * @param timeout_us 待つ時間 (0で待たない)
+ * @return 読み出した文字、タイムアウトした場合PICO_ERROR_TIMEOUT
+ */
+int console_getchar(uint32_t timeout_us) {
+  if (console_itf() == USB_ITF_MONITOR)
+    return getchar_timeout_us(timeout_us);
+  absolute_time_t until = make_timeout_time_us(timeout_us);
+  do {
+    uint8_t c;
+    if (cdc_read(USB_ITF_CONSOLE, &c, 1) == 1)
+      return c;
+  } while (!time_reached(until));
+  return PICO_ERROR_TIMEOUT;
+}
+
 /**
- * @brief V30の20ビットアドレスを、Pico上の64KB
- * RAMアドレス空間にマッピングします。
+ * @brief V30の20ビットアドレスをRAM_SIZEで折り返します。
+ * ウォッチポイントとプロファイラの索引に使います。V30から見たメモリの
+ * 中身はmem_map[]で決まります。
  * @param v30_addr V30の物理アドレス
- * @return PicoのRAM内の対応するアドレス
+ * @return 折り返したアドレス (0からRAM_SIZE-1)
  */
 __force_inline uint32_t map_address(uint32_t v30_addr) {
+  static_assert((RAM_SIZE & (RAM_SIZE - 1)) == 0, "RAM_SIZE must be 2^n");
   return v30_addr & (RAM_SIZE - 1);
 }
 
 /**
- * @brief V30に供給するクロックを指定された周波数で生成します。
- * @param freq_hz 目標の周波数 (Hz)
+ * @brief ram[]の範囲を書き換え済みとして記録します。
+ * @param off ram[]内のオフセット
+ * @param len バイト数
  * @return なし
  */
-void setup_clock(uint32_t freq_hz) {
-  const FreqSetting *setting = nullptr;
-  for (const auto &s : freq_table) {
-    if (s.freq_hz == freq_hz) {
-      setting = &s;
-      break;
+void dirty_mark(uint32_t off, uint32_t len) {
+  if (len == 0 || off >= RAM_SIZE)
+    return;
+  if (len > RAM_SIZE - off)
+    len = RAM_SIZE - off;
+  memset(&ram_dirty[off >> DIRTY_PAGE_SHIFT], 1,
+         ((off + len - 1) >> DIRTY_PAGE_SHIFT) - (off >> DIRTY_PAGE_SHIFT) + 1);
+}
+
+void dirty_clear() { memset(ram_dirty, 0, sizeof(ram_dirty)); }
+
+uint16_t CORE1_FUNC(mem_open_read)(uint32_t) { return 0xFFFF; }
+void CORE1_FUNC(mem_open_write)(uint32_t, uint16_t, bool) {}
+
+uint16_t snap_stub_read(uint32_t addr); // See HIDOS Snapshot
+
+// Index 0 is what pages outside every region get. Not const: core1 reads
+// it and must not touch flash.
+enum MemHandlerId { MEM_HANDLER_OPEN = 0, MEM_HANDLER_SNAP };
+MemHandler mem_handlers[] = {
+    {"open", mem_open_read, mem_open_write}, // Nothing there: reads FFFF
+    {"snap", snap_stub_read, mem_open_write}, // Capture/resume code of 'h'
+};
+
+/**
+ * @brief mem_regions[]からmem_map[]を作り直します。
+ * Core1がバスを処理していない間に呼び出してください。
+ * @param なし
+ * @return なし
+ */
+void mem_map_rebuild() {
+  for (uint32_t p = 0; p < MEM_PAGES; p++) {
+    mem_map[p] = {nullptr, nullptr};
+    mem_page_handler[p] = 0;
+  }
+  mem_rom_pages = 0;
+  for (uint32_t i = 0; i < mem_region_count; i++) {
+    const MemRegion &r = mem_regions[i];
+    for (uint32_t off = 0; off < r.size; off += MEM_PAGE_SIZE) {
+      uint32_t p = (r.start + off) >> MEM_PAGE_SHIFT;
+      if (mem_map[p].rd && !mem_map[p].wr)
+        mem_rom_pages--; // Overridden
+      switch (r.type) {
+      case MEM_RAM: {
+        uint8_t *host = &ram[(r.src + off) % RAM_SIZE];
+        mem_map[p] = {host, host};
+        break;
+      }
+      case MEM_ROM:
+        mem_map[p] = {_binary_boot_img_start + r.src + off, nullptr};
+        mem_rom_pages++;
+        break;
+      default:
+        mem_map[p] = {nullptr, nullptr};
+        mem_page_handler[p] = r.src;
+        break;
+      }
     }
   }
+}
 
-  if (!setting) {
-    printf("Error: Clock frequency %lu Hz not supported.\n", freq_hz);
-    return;
+/**
+ * @brief メモリマップを既定の状態 (全空間にram[]を繰り返し配置) に
+ * 戻します。
+ * @param なし
+ * @return なし
+ */
+void mem_map_reset() {
+  mem_regions[0] = {0, 0x100000, MEM_RAM, 0};
+  mem_region_count = 1;
+  mem_map_rebuild();
+}
+
+/**
+ * @brief メモリマップに領域を追加します。
+ * @param r 追加する領域
+ * @return 追加できた場合true、範囲が不正か表が一杯の場合false
+ */
+bool mem_map_add(const MemRegion &r) {
+  // The last page of boot.img may run past its end into whatever follows
+  const uint32_t boot_size = (_binary_boot_img_end - _binary_boot_img_start +
+                              MEM_PAGE_SIZE - 1) & ~(MEM_PAGE_SIZE - 1);
+  if (mem_region_count == MEM_REGIONS || r.size == 0 ||
+      (r.start | r.size) % MEM_PAGE_SIZE != 0 || r.start >= 0x100000 ||
+      r.size > 0x100000 - r.start)
+    return false;
+  if (r.type == MEM_RAM && r.src % MEM_PAGE_SIZE != 0)
+    return false;
+  if (r.type == MEM_ROM && (r.src > boot_size || r.size > boot_size - r.src))
+    return false;
+  if (r.type == MEM_HANDLER && r.src >= count_of(mem_handlers))
+    return false;
+  mem_regions[mem_region_count++] = r;
+  mem_map_rebuild();
+  return true;
+}
+
+/**
+ * @brief V30から見たメモリを1バイト読み出します (モニタ用)。
+ * @param addr V30の物理アドレス
+ * @return 読み出した値
+ */
+uint8_t mem_read8(uint32_t addr) {
+  addr &= 0xFFFFF;
+  const MemPage &pg = mem_map[addr >> MEM_PAGE_SHIFT];
+  if (pg.rd)
+    return pg.rd[addr & (MEM_PAGE_SIZE - 1)];
+  uint16_t w = mem_handlers[mem_page_handler[addr >> MEM_PAGE_SHIFT]].read(
+      addr & ~1);
+  return (addr & 1) ? w >> 8 : w;
+}
+
+/**
+ * @brief V30から見たメモリに1バイト書き込みます (モニタ用)。
+ * 読み出し専用の領域への書き込みは捨てられます。
+ * @param addr V30の物理アドレス
+ * @param value 書き込む値
+ * @return なし
+ */
+void mem_write8(uint32_t addr, uint8_t value) {
+  addr &= 0xFFFFF;
+  const MemPage &pg = mem_map[addr >> MEM_PAGE_SHIFT];
+  if (pg.wr) {
+    uint8_t *w = pg.wr + (addr & (MEM_PAGE_SIZE - 1));
+    *w = value;
+    ram_dirty[(w - ram) >> DIRTY_PAGE_SHIFT] = 1;
+  } else if (!pg.rd)
+    mem_handlers[mem_page_handler[addr >> MEM_PAGE_SHIFT]].write(
+        addr, (addr & 1) ? value << 8 : value, addr & 1);
+}
+
+/**
+ * @brief V30のアドレス範囲が、ram[]上で連続した書き込み可能な領域に
+ * 対応している場合、その先頭を返します。
+ * @param addr V30の物理アドレス
+ * @param len バイト数
+ * @return ram[]内のポインタ。対応していない場合nullptr
+ */
+uint8_t *mem_ram_span(uint32_t addr, uint32_t len) {
+  if (addr >= 0x100000 || len > 0x100000 - addr)
+    return nullptr;
+  uint32_t first = addr >> MEM_PAGE_SHIFT;
+  uint8_t *base = mem_map[first].wr;
+  if (!base)
+    return nullptr;
+  for (uint32_t p = first + 1; len && p <= (addr + len - 1) >> MEM_PAGE_SHIFT;
+       p++) {
+    if (mem_map[p].wr != base + (p - first) * MEM_PAGE_SIZE)
+      return nullptr;
+  }
+  return base + (addr & (MEM_PAGE_SIZE - 1));
+}
+
+/**
+ * @brief 現在のV30クロックとsysクロックから、読み込みサイクルで
+ * AD0-15を駆動するまでの待ち時間を計算し直します。
+ * Core1がバスを処理していない間に呼び出してください。
+ * @param なし
+ * @return なし
+ */
+void bus_turnaround_update() {
+  // V30 clock period in ns from the PWM setting actually in use
+  uint64_t period_ns = (uint64_t)current_clock.top * current_clock.div16 *
+                       1000000 / ((uint64_t)current_clock.sys_khz * 16);
+  uint64_t ns = period_ns / 2;
+  if (ns > V30_AD_FLOAT_NS)
+    ns = V30_AD_FLOAT_NS;
+  if (ns < BUS_TURNAROUND_MIN_NS)
+    ns = BUS_TURNAROUND_MIN_NS;
+  bus_turnaround_cycles =
+      (uint32_t)((ns * clock_get_hz(clk_sys) + 999999999u) / 1000000000u);
+}
+
+/**
+ * @brief PWM設定の良さを大まかに比べるための値を返します。
+ * CLOCK_TOLERANCE_PPMを超える誤差、分数分周 (ジッタ)、奇数の周期
+ * (デューティ比のずれ) の順に重く、小さいほど良い設定です。
+ * @param p PWM設定
+ * @return 比較用の値
+ */
+uint32_t clock_plan_class(const ClockPlan &p) {
+  uint32_t err = p.err_ppm > CLOCK_TOLERANCE_PPM ? p.err_ppm : 0;
+  return (err << 2) | ((p.div16 & 15) ? 2 : 0) | (p.top & 1);
+}
+
+/**
+ * @brief 指定のsysクロックで目標周波数を作るPWM設定を求めます。
+ * clock_plan_class()が同じ候補の中では、誤差が小さく周期の長いものを
+ * 選びます。
+ * @param sys_khz sysクロック (kHz)
+ * @param freq_hz 目標の周波数 (Hz)
+ * @param int_only trueの場合、整数分周だけを探します
+ * @param plan 結果の格納先。既に入っている候補より良い場合だけ更新します
+ * @return planを更新した場合true
+ */
+bool clock_plan(uint32_t sys_khz, uint32_t freq_hz, bool int_only,
+                ClockPlan &plan) {
+  auto worse = [](const ClockPlan &a, const ClockPlan &b) {
+    if (clock_plan_class(a) != clock_plan_class(b))
+      return clock_plan_class(a) > clock_plan_class(b);
+    if (a.err_ppm != b.err_ppm)
+      return a.err_ppm > b.err_ppm;
+    return a.top < b.top;
+  };
+
+  if (freq_hz == 0)
+    return false;
+  uint64_t sys16 = (uint64_t)sys_khz * 1000 * 16; // sys clock in 1/16 Hz
+  bool updated = false;
+  for (uint32_t div16 = 16; div16 < 256 * 16; div16 += int_only ? 16 : 1) {
+    uint64_t step = (uint64_t)freq_hz * div16;
+    uint64_t top = (sys16 + step / 2) / step;
+    if (top > 65536)
+      continue;
+    if (top < 2)
+      break; // Only gets smaller with larger dividers
+    uint64_t made = step * top;
+    uint64_t diff = made > sys16 ? made - sys16 : sys16 - made;
+    ClockPlan c = {sys_khz, (uint32_t)top, (uint16_t)div16,
+                   (uint32_t)(diff * 1000000 / sys16)};
+    if (plan.top == 0 || worse(plan, c)) {
+      plan = c;
+      updated = true;
+    }
+  }
+  return updated;
+}
+
+/**
+ * @brief V30に供給するクロックを指定された周波数で生成します。
+ * @param freq_hz 目標の周波数 (Hz)
+ * @param tune_sys trueの場合、SYS_CLOCK_MIN_KHZからSYS_CLOCK_MAX_KHZの
+ * 範囲でジッタと誤差が最小になるsysクロックを選びます。falseの場合は
+ * SYS_CLOCK_KHZを使います
+ * @return 設定できた場合true、PWMで作れない周波数の場合false
+ */
+bool setup_clock(uint32_t freq_hz, bool tune_sys = false) {
+  ClockPlan plan = {};
+  if (tune_sys) {
+    // Higher sys clocks come first and only lose to a plan of a better
+    // class, so the bus engine keeps as much headroom as the clock allows.
+    for (uint32_t khz = SYS_CLOCK_MAX_KHZ; khz >= SYS_CLOCK_MIN_KHZ;
+         khz -= SYS_CLOCK_STEP_KHZ) {
+      uint vco, postdiv1, postdiv2;
+      ClockPlan c = {};
+      if (!check_sys_clock_khz(khz, &vco, &postdiv1, &postdiv2) ||
+          !clock_plan(khz, freq_hz, true, c))
+        continue;
+      if (plan.top == 0 || clock_plan_class(c) < clock_plan_class(plan))
+        plan = c;
+    }
+    if (plan.top == 0 || plan.err_ppm > CLOCK_TOLERANCE_PPM)
+      clock_plan(SYS_CLOCK_KHZ, freq_hz, false, plan);
+  } else {
+    clock_plan(SYS_CLOCK_KHZ, freq_hz, false, plan);
   }
+  if (plan.top == 0)
+    return false;
 
   // Configure PWM for clock output
   gpio_set_function(PIN_CLK_OUT, GPIO_FUNC_PWM);
@@ -163,19 +997,25 @@ void setup_clock(uint32_t freq_hz) {
   // Stop PWM while reconfiguring to prevent glitches
   pwm_set_enabled(slice_num, false);
 
+  if (clock_get_hz(clk_sys) != plan.sys_khz * 1000) {
+    // Core1 is idle in core1_wait_command(), USB runs from pll_usb
+    set_sys_clock_khz(plan.sys_khz, true);
+  }
+
   pwm_config cfg = pwm_get_default_config();
-  // With 250MHz sys clock, freq = 250M / ((wrap + 1) * div)
-  pwm_config_set_wrap(&cfg, setting->wrap);
-  pwm_config_set_clkdiv(&cfg, setting->div);
+  pwm_config_set_wrap(&cfg, plan.top - 1);
+  pwm_config_set_clkdiv_int_frac(&cfg, plan.div16 >> 4, plan.div16 & 15);
   pwm_init(slice_num, &cfg, true);
 
   // Set 50% duty cycle
-  pwm_set_gpio_level(PIN_CLK_OUT, (setting->wrap + 1) / 2);
+  pwm_set_gpio_level(PIN_CLK_OUT, plan.top / 2);
 
   // Re-enable PWM
   pwm_set_enabled(slice_num, true);
-
-  printf("Clock set to %lu Hz\n", freq_hz);
+  current_clock = plan;
+  current_clock_tuned = tune_sys;
+  bus_turnaround_update();
+  return true;
 }
 
 // ==========================================
@@ -188,214 +1028,435 @@ void setup_clock(uint32_t freq_hz) {
 #define CMD_RUN_COMLOG 4   // Run with COM2 port logging only.
 #define CMD_RUN_HIDOSVM 5   // Run hidos.
 
-void hidos_cpu();
+enum LoggingMode { NO_LOG, IO_LOG, FULL_LOG, COM_LOG };
+
+int run_bus_engine(LoggingMode logging_mode, bool hidos, int *logged_cycles);
+extern uint8_t io_running; // HIDOS VM request in flight (see HidosPolicy)
+extern volatile uint8_t hidos_start_busy; // io_running for the next HIDOS run
+extern volatile uint8_t hidos_logging; // LoggingMode of the next HIDOS run
+
+// --- Compact Trace Encoding ---
+// One record is a header byte followed by 0-3 address bytes and 0-2 data
+// bytes (little endian):
+//   bit 7-6 address: 0 = previous address of this type + 2, 1 = int8 delta,
+//                    2 = int16 delta, 3 = full 20-bit address (3 bytes)
+//   bit 5   BHE# low (BusLog ctrl bit 0)
+//   bit 4-3 type - 1 (LOG_MEM_RD .. LOG_IO_WR)
+//   bit 2-1 data: 0 = 16-bit, 1 = 8-bit (high byte 0), 2 = same as the
+//                 previous record, 3 = one byte repeated in both halves
+//   bit 0   reserved (0)
+// Every COMPACT_SYNC_INTERVAL records, and at the start of every stream
+// block, the history is forgotten so decoding can restart there.
+struct CompactState {
+  uint32_t prev_addr[4];
+  uint16_t prev_data;
+  uint8_t valid;      // bit n: prev_addr[n] is usable, bit 4: prev_data
+  uint8_t since_sync;
+};
+
+__force_inline void compact_reset(CompactState &cs) {
+  cs.valid = 0;
+  cs.since_sync = 0;
+}
 
 /**
- * @brief Core 1のエントリポイント。V30バスサイクルをエミュレートし、Core
- * 0からのコマンドを処理します。
- * この関数は無限ループで実行され、V30のメモリアクセスとI/Oアクセスをハンドリングします。
- * @param なし
- * @return なし
+ * @brief バスログ1件をコンパクト形式に符号化します。
+ * @param p 書き込み先 (COMPACT_MAX_RECORDバイト以上の空きが必要)
+ * @param cs 符号化の状態
+ * @param rec 符号化するレコード
+ * @return 書き込んだバイト数
  */
-void core1_entry() {
-  // Initialize AD0-15 as GPIO pins
-  gpio_init_mask((1 << 16) - 1); // Mask for GP0-15
-  set_ad_dir(false);
-  const uint32_t ctrl_mask = (1 << PIN_ALE) | (1 << PIN_RD) | (1 << PIN_WR) |
-                             (1 << PIN_IOM) | (1 << PIN_BHE);
-  gpio_init_mask(ctrl_mask);
-  gpio_set_dir_in_masked(ctrl_mask);
-  const uint32_t addr_mask =
-      (1 << PIN_A16) | (1 << PIN_A17) | (1 << PIN_A18) | (1 << PIN_A19);
-  gpio_init_mask(addr_mask);
-  gpio_set_dir_in_masked(addr_mask);
+__force_inline uint32_t compact_encode(uint8_t *p, CompactState &cs,
+                                       const BusLog &rec) {
+  if (cs.since_sync++ == COMPACT_SYNC_INTERVAL) {
+    cs.valid = 0;
+    cs.since_sync = 1;
+  }
+  uint32_t t = (rec.type - 1) & 3;
+  uint8_t hdr = ((rec.ctrl & 1) << 5) | (t << 3);
+  uint8_t *q = p + 1;
+
+  int32_t delta = (int32_t)(rec.address - cs.prev_addr[t]);
+  if (!(cs.valid & (1u << t))) {
+    hdr |= 3 << 6;
+    *q++ = rec.address;
+    *q++ = rec.address >> 8;
+    *q++ = rec.address >> 16;
+  } else if (delta == 2) {
+    // hdr |= 0 << 6: sequential prefetch
+  } else if (delta >= -128 && delta <= 127) {
+    hdr |= 1 << 6;
+    *q++ = (uint8_t)delta;
+  } else if (delta >= -32768 && delta <= 32767) {
+    hdr |= 2 << 6;
+    *q++ = (uint8_t)delta;
+    *q++ = (uint8_t)(delta >> 8);
+  } else {
+    hdr |= 3 << 6;
+    *q++ = rec.address;
+    *q++ = rec.address >> 8;
+    *q++ = rec.address >> 16;
+  }
+  cs.prev_addr[t] = rec.address;
+
+  uint16_t d = rec.data;
+  if ((cs.valid & 0x10) && d == cs.prev_data) {
+    hdr |= 2 << 1;
+  } else if ((d >> 8) == 0) {
+    hdr |= 1 << 1;
+    *q++ = d;
+  } else if ((d >> 8) == (d & 0xFF)) {
+    hdr |= 3 << 1;
+    *q++ = d;
+  } else {
+    *q++ = d;
+    *q++ = d >> 8;
+  }
+  cs.prev_data = d;
+  cs.valid |= 0x10 | (1u << t);
 
-  gpio_init(PIN_RESET);
-  gpio_set_dir(PIN_RESET, GPIO_OUT);
-  gpio_put(PIN_RESET, 1);
+  *p = hdr;
+  return q - p;
+}
 
-  while (true) {
-    uint32_t command = multicore_fifo_pop_blocking();
-    stop_request = false;
+// --- Trace Writer (Core 1) ---
+// Destination for logged bus cycles during one run.
+// TW_ARMED waits for the trigger: records only go to the pre-trigger ring
+// (trace_log[0, pre_len)), and trace_trigger() switches to armed_mode.
+enum TraceWriterMode {
+  TW_RAW,
+  TW_COMPACT,
+  TW_STREAM_RAW,
+  TW_STREAM_COMPACT,
+  TW_ARMED
+};
+struct TraceWriter {
+  TraceWriterMode mode;
+  uint32_t block;  // Streaming: block being filled
+  uint32_t pos;    // Records (raw) or bytes (compact) used in buffer/block
+  bool blocked;    // Streaming: next block is still owned by core0
+  CompactState cs;
+  TraceWriterMode armed_mode; // Mode once the trigger fires
+  uint32_t pre_len;           // Pre-trigger ring size (0: none)
+  uint32_t pre_pos;           // Next ring slot
+  uint32_t pre_count;         // Records put into the ring
+};
+IN_CORE1_BANK static TraceWriter tw;
 
-    absolute_time_t start_time = get_absolute_time(); // Start timing here
+__force_inline uint8_t *trace_bytes() { return (uint8_t *)trace_log; }
 
-    int logged_cycles = 0;
-    int bus_cycles = 0;
+/**
+ * @brief トレースストリームの共有状態を初期化します (Core 0、実行開始前)。
+ * @param なし
+ * @return なし
+ */
+void trace_stream_reset() {
+  for (int i = 0; i < TRACE_STREAM_BLOCKS; i++)
+    trace_stream_ready[i] = 0;
+  trace_stream_dropped = 0;
+  trace_stream_total = 0;
+}
 
-    enum LoggingMode { NO_LOG, IO_LOG, FULL_LOG, COM_LOG };
-    LoggingMode logging_mode;
+/**
+ * @brief 実行開始時にログの書き込み先を決めます (Core 1)。
+ * @param streaming ストリーミング中の場合true
+ * @param compact コンパクト形式で記録する場合true
+ * @return なし
+ */
+void trace_writer_begin(bool streaming, bool compact) {
+  if (streaming)
+    tw.mode = compact ? TW_STREAM_COMPACT : TW_STREAM_RAW;
+  else
+    tw.mode = compact ? TW_COMPACT : TW_RAW;
+  tw.block = 0;
+  tw.pos = (tw.mode == TW_COMPACT) ? COMPACT_HEADER_SIZE : 0;
+  trace_compact_bytes = 0;
+  tw.blocked = false;
+  compact_reset(tw.cs);
+
+  tw.pre_len = 0;
+  tw.pre_pos = 0;
+  tw.pre_count = 0;
+  trace_triggered = false;
+  if (trace_filter.trig != TRIG_NONE) {
+    tw.armed_mode = tw.mode;
+    tw.mode = TW_ARMED;
+    if (tw.armed_mode == TW_RAW)
+      tw.pre_len = trace_filter.pre < MAX_CYCLES ? trace_filter.pre
+                                                 : MAX_CYCLES - 1;
+  }
+}
 
-    switch (command) {
-    case CMD_RUN_NOLOG:
-      logging_mode = NO_LOG;
-      break;
-    case CMD_RUN_IOLOG:
-      logging_mode = IO_LOG;
-      break;
-    case CMD_RUN_FULLLOG:
-      logging_mode = FULL_LOG;
-      break;
-    case CMD_RUN_COMLOG:
-      logging_mode = COM_LOG;
-      break;
-    case CMD_RUN_HIDOSVM:
-      hidos_cpu();
-      gpio_put(PIN_RESET, 1);
-      continue;
-    default:
-      // Unknown command, ensure loop terminates immediately.
-      logging_mode = NO_LOG;
-      bus_cycles = cycle_limit + 1; // force exit
-      break;
+/**
+ * @brief ストリームのリングに1レコードを追加します (Core 1)。
+ * ブロックが一杯になるとCore 0に引き渡し、次のブロックが未返却なら
+ * 返却されるまでレコードを破棄して数えます。
+ * @param rec 追加するレコード
+ * @return trace_logの件数に数える場合true (トリガ待ちの間はfalse)
+ */
+bool CORE1_FUNC(trace_put_slow)(const BusLog &rec) {
+  if (tw.mode == TW_ARMED) {
+    if (tw.pre_len != 0) {
+      trace_log[tw.pre_pos] = rec;
+      if (++tw.pre_pos == tw.pre_len)
+        tw.pre_pos = 0;
+      tw.pre_count++;
     }
+    return false;
+  }
+  if (tw.mode == TW_COMPACT) {
+    tw.pos += compact_encode(trace_bytes() + tw.pos, tw.cs, rec);
+    return true;
+  }
 
-    gpio_put(PIN_RESET, 1);
-    sleep_ms(1);
-    gpio_put(PIN_RESET, 0);
-
-    while (true) {
-      // --- Unified Termination Conditions ---
-      if (stop_request)
-        break;
-      if (bus_cycles >= cycle_limit)
-        break;
-      if (logging_mode != NO_LOG && logged_cycles >= MAX_CYCLES)
-        break;
+  if (tw.blocked) {
+    if (trace_stream_ready[tw.block] != 0) {
+      trace_stream_dropped++;
+      return true;
+    }
+    tw.blocked = false;
+  }
+  bool full;
+  if (tw.mode == TW_STREAM_RAW) {
+    trace_log[tw.block * TRACE_STREAM_BLOCK_ENTRIES + tw.pos++] = rec;
+    full = tw.pos == TRACE_STREAM_BLOCK_ENTRIES;
+  } else {
+    tw.pos += compact_encode(
+        trace_bytes() + tw.block * TRACE_STREAM_BLOCK_BYTES + tw.pos, tw.cs,
+        rec);
+    full = tw.pos > TRACE_STREAM_BLOCK_BYTES - COMPACT_MAX_RECORD;
+  }
+  trace_stream_total++;
+  if (full) {
+    __dmb();
+    trace_stream_ready[tw.block] = tw.pos;
+    tw.block = (tw.block + 1) % TRACE_STREAM_BLOCKS;
+    tw.pos = 0;
+    compact_reset(tw.cs); // Every block decodes on its own
+    tw.blocked = trace_stream_ready[tw.block] != 0;
+  }
+  return true;
+}
 
-      absolute_time_t t_start_ale = get_absolute_time();
-      bool ale_detected = false;
-      while (absolute_time_diff_us(t_start_ale, get_absolute_time()) <
-             100000) { // ALE high timeout
-        if (sio_hw->gpio_in & (1 << PIN_ALE)) {
-          ale_detected = true;
-          break;
-        }
-      }
-      if (!ale_detected) {
-        printf("Bus operation timeout (no ale), halt cpu.\n");
-        break; // Break from the bus sniffing loop if ALE is not detected within
-               // timeout (V30 inactive)
-      }
+/**
+ * @brief バスログを1件記録します。
+ * @param rec 記録するレコード
+ * @param logged_cycles 記録済みの件数
+ * @return なし
+ */
+__force_inline void trace_put(const BusLog &rec, int &logged_cycles) {
+  if (tw.mode == TW_RAW)
+    trace_log[logged_cycles] = rec;
+  else if (!trace_put_slow(rec))
+    return;
+  logged_cycles++;
+}
 
-      uint32_t addr = read_addr();
-      bool is_io = !(sio_hw->gpio_in & (1 << PIN_IOM));
+/**
+ * @brief トリガが成立したときに記録を開始します (Core 1)。
+ * 生形式では、以降のログはプリトリガ用のリングの後ろに記録されます。
+ * @param logged_cycles 記録済みの件数
+ * @return なし
+ */
+void CORE1_FUNC(trace_trigger)(int &logged_cycles) {
+  tw.mode = tw.armed_mode;
+  logged_cycles = tw.pre_len;
+  trace_triggered = true;
+}
 
-      // Wait for ALE to go low (no timeout requested here)
-      while (sio_hw->gpio_in & (1 << PIN_ALE))
-        ;
+/**
+ * @brief trace_logの範囲を反転します。
+ * @param a 先頭
+ * @param b 末尾の次
+ * @return なし
+ */
+void trace_reverse(BusLog *a, BusLog *b) {
+  while (a < b - 1) {
+    BusLog t = *a;
+    *a++ = *--b;
+    *b = t;
+  }
+}
 
-      bool done_bus_cycle_op = false;
-      const uint32_t BUS_OPERATION_TIMEOUT_US =
-          100000; // 100ms timeout for RD/WR going low
-      absolute_time_t t_start_bus_operation = get_absolute_time();
-
-      while (!done_bus_cycle_op) {
-        if (absolute_time_diff_us(t_start_bus_operation, get_absolute_time()) >
-            BUS_OPERATION_TIMEOUT_US) {
-          printf("Bus operation timeout (no RD/WR detected low), breaking "
-                 "cycle.\n");
-          break; // Break from this inner loop, which will then break the outer
-                 // cycle loop
-        }
-        uint32_t pins = sio_hw->gpio_in;
-
-        if (!(pins & (1 << PIN_RD))) {
-          sleep_us(3); // これが無いとショートしてデバイスが落ちる。
-          set_ad_dir(true);
-          uint16_t out_data = 0xFFFF;
-          if (!is_io) {
-            // Optimized read: Always read the word-aligned data.
-            // The CPU will select the correct byte (or word) based on A0 and
-            // BHE#.
-            uint32_t aligned_v30_addr = addr & ~1;
-            out_data = ram[map_address(aligned_v30_addr)] |
-                       (ram[map_address(aligned_v30_addr + 1)] << 8);
-          }
-          write_data(out_data);
-
-          if (logging_mode != NO_LOG) {
-            bool should_log =
-                (logging_mode == FULL_LOG) ||
-                (logging_mode == IO_LOG && is_io) ||
-                (logging_mode == COM_LOG && is_io && addr == 0x2F8);
-            if (should_log) {
-              uint8_t ctrl_flags =
-                  (pins & (1u << PIN_BHE)) ? 0 : 1; // 1 if BHE is low
-              trace_log[logged_cycles] = {
-                  addr, out_data, (uint8_t)(is_io ? LOG_IO_RD : LOG_MEM_RD),
-                  ctrl_flags};
-              logged_cycles++;
-            }
-          }
+/**
+ * @brief プリトリガ用のリングを時刻順に並べ、後ろのログと隙間なく
+ * つなげます (Core 1、実行終了後)。
+ * @param logged_cycles 記録済みの件数 (リングを含む)
+ * @return なし
+ */
+void trace_pretrigger_fixup(int logged_cycles) {
+  uint32_t n = tw.pre_len;
+  if (tw.pre_count >= n) {
+    // Wrapped: the oldest record is at pre_pos
+    trace_reverse(trace_log, trace_log + tw.pre_pos);
+    trace_reverse(trace_log + tw.pre_pos, trace_log + n);
+    trace_reverse(trace_log, trace_log + n);
+    return;
+  }
+  uint32_t kept = tw.pre_count;
+  uint32_t post = trace_triggered ? logged_cycles - n : 0;
+  memmove(&trace_log[kept], &trace_log[n], post * sizeof(BusLog));
+  memset(&trace_log[kept + post], 0, (n - kept) * sizeof(BusLog));
+}
 
-          // Wait for RD to go high (no timeout requested here)
-          while (!(sio_hw->gpio_in & (1 << PIN_RD)))
-            ;
-          set_ad_dir(false);
-          done_bus_cycle_op = true;
-        } else if (!(pins & (1 << PIN_WR))) {
-          // Wait for WR to go high (no timeout requested here)
-          while (!(sio_hw->gpio_in & (1 << PIN_WR)))
-            ;
-          uint16_t in_data = read_data();
-
-          if (!is_io) {
-            bool bhe_low = !(pins & (1u << PIN_BHE));
-            bool a0_low = !(addr & 1);
-
-            if (bhe_low && a0_low) { // Word Write to even address
-              ram[map_address(addr)] = in_data & 0xFF;
-              ram[map_address(addr + 1)] = in_data >> 8;
-            } else if (bhe_low && !a0_low) { // High Byte Write to odd address
-              ram[map_address(addr)] = in_data >> 8;
-            } else if (!bhe_low && a0_low) { // Low Byte Write to even address
-              ram[map_address(addr)] = in_data & 0xFF;
-            }
-            // For invalid case (BHE high, A0 high), nothing is written.
-          }
+/**
+ * @brief trace_logが一杯で、これ以上記録できないか判定します。
+ * ストリーミング中は常にfalseです。
+ * @param logged_cycles 記録済みの件数
+ * @return 一杯の場合true
+ */
+__force_inline bool trace_full(int logged_cycles) {
+  if (tw.mode == TW_RAW)
+    return logged_cycles >= MAX_CYCLES;
+  return tw.mode == TW_COMPACT &&
+         tw.pos > sizeof(trace_log) - COMPACT_MAX_RECORD;
+}
 
-          if (logging_mode != NO_LOG) {
-            bool should_log =
-                (logging_mode == FULL_LOG) ||
-                (logging_mode == IO_LOG && is_io) ||
-                (logging_mode == COM_LOG && is_io && addr == 0x2F8);
-            if (should_log) {
-              uint8_t ctrl_flags =
-                  (pins & (1u << PIN_BHE)) ? 0 : 1; // 1 if BHE is low
-              trace_log[logged_cycles] = {
-                  addr, in_data, (uint8_t)(is_io ? LOG_IO_WR : LOG_MEM_WR),
-                  ctrl_flags};
-              logged_cycles++;
-            }
-          }
-          done_bus_cycle_op = true;
-        }
-        // If ALE goes high during an active bus cycle (RD/WR phase), it
-        // indicates an issue or new cycle. This breaks out of the current bus
-        // operation to re-sync with the CPU.
-        if (sio_hw->gpio_in & (1 << PIN_ALE)) {
-          printf("ALE detected high unexpectedly during RD/WR wait, breaking "
-                 "current bus operation.\n");
-          break; // Break from done_bus_cycle_op loop
-        }
-      }
+/**
+ * @brief 実行終了時に書きかけのデータを確定します (Core 1)。
+ * @param logged_cycles 記録したログ件数
+ * @return なし
+ */
+void trace_writer_end(int logged_cycles) {
+  if (tw.pre_len != 0)
+    trace_pretrigger_fixup(logged_cycles);
+  // A trigger that never fired leaves the writer armed as set up in begin
+  TraceWriterMode mode = tw.mode == TW_ARMED ? tw.armed_mode : tw.mode;
+  if (mode == TW_COMPACT) {
+    trace_compact_bytes = tw.pos - COMPACT_HEADER_SIZE;
+  } else if (mode != TW_RAW && !tw.blocked && tw.pos > 0) {
+    __dmb();
+    trace_stream_ready[tw.block] = tw.pos;
+  }
+}
 
-      if (done_bus_cycle_op) {
-        bus_cycles++;
-      } else {
-        // The inner bus operation loop was broken (e.g. by timeout),
-        // so we break the main bus sniffing loop.
-        break;
+/**
+ * @brief Core 0からのコマンドを待ちます。
+ * 待機中もフラッシュ上のコードを実行しないため、その間Core 0はフラッシュを
+ * 書き換えられます (disk_overlay_flush())。
+ * @param なし
+ * @return 受け取ったコマンド
+ */
+uint32_t CORE1_FUNC(core1_wait_command)() {
+  while (!(sio_hw->fifo_st & SIO_FIFO_ST_VLD_BITS))
+    __wfe();
+  return sio_hw->fifo_rd;
+}
+
+/**
+ * @brief 1回の実行のバスサイクル数と時間をbus_statsに加えます (Core 1)。
+ * @param bus_cycles 実行したバスサイクル数
+ * @param time_us 実行時間 (マイクロ秒)
+ * @return なし
+ */
+void CORE1_FUNC(bus_stats_add_run)(uint32_t bus_cycles, uint32_t time_us) {
+  bus_stats.runs++;
+  bus_stats.run_cycles += bus_cycles;
+  bus_stats.run_time_us += time_us;
+  bus_stats.last_cycles = bus_cycles;
+  bus_stats.last_time_us = time_us;
+}
+
+/**
+ * @brief Core 1のエントリポイント。V30バスサイクルをエミュレートし、Core
+ * 0からのコマンドを処理します。
+ * この関数は無限ループで実行され、V30のメモリアクセスとI/Oアクセスをハンドリングします。
+ * @param なし
+ * @return なし
+ */
+void CORE1_FUNC(core1_entry)() {
+  // Initialize AD0-15 as GPIO pins
+  gpio_init_mask((1 << 16) - 1); // Mask for GP0-15
+  set_ad_dir(false);
+  const uint32_t ctrl_mask = (1 << PIN_ALE) | (1 << PIN_RD) | (1 << PIN_WR) |
+                             (1 << PIN_IOM) | (1 << PIN_BHE);
+  gpio_init_mask(ctrl_mask);
+  gpio_set_dir_in_masked(ctrl_mask);
+  const uint32_t addr_mask =
+      (1 << PIN_A16) | (1 << PIN_A17) | (1 << PIN_A18) | (1 << PIN_A19);
+  gpio_init_mask(addr_mask);
+  gpio_set_dir_in_masked(addr_mask);
+
+  gpio_init(PIN_RESET);
+  gpio_set_dir(PIN_RESET, GPIO_OUT);
+  gpio_put(PIN_RESET, 1);
+
+#if V30_RD_TIMING
+  // Core1's own SysTick, free running at the sys clock
+  systick_hw->rvr = 0xFFFFFF;
+  systick_hw->cvr = 0;
+  systick_hw->csr =
+      M0PLUS_SYST_CSR_CLKSOURCE_BITS | M0PLUS_SYST_CSR_ENABLE_BITS;
+#endif
+
+  while (true) {
+    uint32_t command = core1_wait_command();
+    stop_request = false;
+
+    absolute_time_t start_time = get_absolute_time(); // Start timing here
+
+    int logged_cycles = 0;
+    int bus_cycles = 0;
+    trace_writer_begin(trace_stream_enabled,
+                       trace_format == TRACE_FMT_COMPACT);
+
+    LoggingMode logging_mode = NO_LOG;
+    bool run = true;
+
+    switch (command) {
+    case CMD_RUN_NOLOG:
+      logging_mode = NO_LOG;
+      break;
+    case CMD_RUN_IOLOG:
+      logging_mode = IO_LOG;
+      break;
+    case CMD_RUN_FULLLOG:
+      logging_mode = FULL_LOG;
+      break;
+    case CMD_RUN_COMLOG:
+      logging_mode = COM_LOG;
+      break;
+    case CMD_RUN_HIDOSVM:
+      // A resumed snapshot starts with its request already in flight
+      io_running = hidos_start_busy;
+      hidos_start_busy = 0;
+      bus_cycles =
+          run_bus_engine((LoggingMode)hidos_logging, true, &logged_cycles);
+      gpio_put(PIN_RESET, 1);
+      // The VM stopped (watchpoint, Ctrl-] or bus timeout). Take the
+      // completion token of a request core0 is still serving so it is not
+      // read as a command, then let hidos_host() return. Until then core0
+      // may be writing flash, so nothing from flash runs here.
+      if (io_running) {
+        core1_wait_command();
+        io_running = 0;
       }
+      execution_time_us =
+          absolute_time_diff_us(start_time, get_absolute_time());
+      executed_cycles = bus_cycles;
+      bus_stats_add_run(bus_cycles, execution_time_us);
+      if (trace_stream_enabled)
+        trace_writer_end(logged_cycles); // Before cmd_hidos() sends 'TE'
+      multicore_fifo_push_blocking(HIDOS_EXIT_TOKEN);
+      continue;
+    default:
+      // Unknown command, report completion without running the V30.
+      run = false;
+      break;
     }
 
+    if (run)
+      bus_cycles = run_bus_engine(logging_mode, false, &logged_cycles);
+
     absolute_time_t end_time = get_absolute_time();
     execution_time_us =
         absolute_time_diff_us(start_time, end_time); // Store execution time
 
     gpio_put(PIN_RESET, 1);
+    trace_writer_end(logged_cycles);
     executed_cycles = bus_cycles;
+    if (run)
+      bus_stats_add_run(bus_cycles, execution_time_us);
     multicore_fifo_push_blocking(1); // Notify Core 0 of completion
   }
 }
@@ -405,10 +1466,22 @@ void core1_entry() {
 // ==========================================
 
 
-// Shared variable
+// Request handoff
+// OUT 86h: core1 pushes the value through the inter-core FIFO (doorbell) and
+// sets io_running. core0 wakes from WFE in multicore_fifo_pop_blocking(),
+// runs vmio() and pushes a completion token back. IN 88h returns io_running;
+// core1 clears it when it finds the token in its FIFO.
 
-volatile uint8_t io_running = 0; // 1 for running.
-volatile uint16_t io_value = 0; // value for out86.
+uint8_t io_running = 0; // 1 for running. Core1 only.
+volatile uint8_t hidos_start_busy = 0; // Set by snap_launch()
+volatile uint8_t hidos_logging = NO_LOG; // Streamed cycles ('h stream')
+
+// Snapshot capture: the stub at SNAP_STUB_BASE reports SS and SP on
+// SNAP_PORT (see HIDOS Snapshot).
+#define SNAP_PORT 0x8A
+volatile uint16_t snap_regs[2];
+volatile uint8_t snap_reg_count = 0;
+volatile bool snap_request = false; // SNAP_KEY seen, capture at the next CON
 
 // Non shared variable
 
@@ -417,19 +1490,390 @@ uint8_t hidos_loglevel = 9;
 // 1 INFO
 // 2 ERROR
 
+// VMIO device state kept in a snapshot
+unsigned con_wait_count = 0; // Empty 'RW' polls since the last input
+uint64_t clock_offset_us = 0; // Added to the time since boot by io_clock()
+
 // Images
 
 extern const uint8_t _binary_disk_img_start[];
 extern const uint8_t _binary_disk_img_end[];
 extern const uint8_t _binary_disk_img_size[]; // GNU拡張
 
-extern const uint8_t _binary_boot_img_start[];
-extern const uint8_t _binary_boot_img_end[];
-
 const uint8_t *disk_img = _binary_disk_img_start;
 const size_t disk_img_size =
     (size_t)(_binary_disk_img_end - _binary_disk_img_start);
 
+// --- Disk Block Layer ---
+// io_disk() goes through 512-byte blocks instead of reading disk_img
+// directly:
+//   1. disk_overlay: copy-on-write blocks written by the V30 (SRAM)
+//   2. the flash overlay log: overlay blocks written back by
+//      disk_overlay_flush(), newest entry wins
+//   3. disk_img
+// Small reads of 2 and 3 are kept in disk_cache (LRU). Flash is always read
+// through the XIP no-cache alias so disk traffic does not evict core0 code
+// from the XIP cache.
+//
+// Flash overlay log at DISK_OVERLAY_FLASH_OFFSET:
+//   sector 0: "V30D" disk_img_size:u32 reserved[8] then lba:u16 per block
+//             (0xFFFF = unused), appended in place
+//   data:     block i at DISK_OVERLAY_FLASH_OFFSET + FLASH_SECTOR_SIZE + i*512
+// Writing flash needs core1 to run from SRAM only: either idle in
+// core1_wait_command(), or in the HIDOS bus loop while the V30 polls 88h.
+
+#define DISK_OVERLAY_LOG_HEADER 16
+#define DISK_OVERLAY_LOG_BLOCKS                                                \
+  ((DISK_OVERLAY_FLASH_SIZE - FLASH_SECTOR_SIZE) / DISK_BLOCK_SIZE)
+
+uint8_t disk_overlay[DISK_OVERLAY_BLOCKS][DISK_BLOCK_SIZE];
+uint16_t disk_overlay_lba[DISK_OVERLAY_BLOCKS];
+uint32_t disk_overlay_used = 0;
+
+uint16_t disk_log_lba[DISK_OVERLAY_LOG_BLOCKS];
+uint32_t disk_log_used = 0;
+bool disk_log_usable = false; // Region is clear of the program image
+extern char __flash_binary_end;  // Linker symbol: end of the program image
+
+uint8_t disk_cache[DISK_CACHE_BLOCKS][DISK_BLOCK_SIZE];
+uint16_t disk_cache_lba[DISK_CACHE_BLOCKS];
+uint32_t disk_cache_stamp[DISK_CACHE_BLOCKS]; // 0 = empty
+uint32_t disk_cache_clock = 0;
+uint32_t disk_cache_hits = 0;
+uint32_t disk_cache_misses = 0;
+
+/**
+ * @brief フラッシュ上のオフセットを、XIPキャッシュを汚さない読み出し用の
+ * アドレスに変換します。
+ * @param flash_offset フラッシュ先頭からのオフセット
+ * @return 読み出し用のポインタ
+ */
+__force_inline const uint8_t *flash_nocache(uint32_t flash_offset) {
+  return (const uint8_t *)(uintptr_t)(XIP_NOCACHE_NOALLOC_BASE + flash_offset);
+}
+
+const uint8_t *disk_log_header() {
+  return flash_nocache(DISK_OVERLAY_FLASH_OFFSET);
+}
+
+/**
+ * @brief 起動時にフラッシュのオーバーレイログを読み込みます。
+ * ディスクイメージのサイズが一致しないログは無視します。
+ * @param なし
+ * @return なし
+ */
+void disk_overlay_init() {
+  disk_log_usable = (uint32_t)((uintptr_t)&__flash_binary_end - XIP_BASE) <=
+                    DISK_OVERLAY_FLASH_OFFSET;
+  if (!disk_log_usable) {
+    printf("disk: program overlaps the flash overlay log, write-back "
+           "disabled\n");
+    return;
+  }
+  const uint8_t *hdr = disk_log_header();
+  uint32_t size;
+  memcpy(&size, hdr + 4, 4);
+  disk_log_used = 0;
+  if (memcmp(hdr, "V30D", 4) != 0 || size != disk_img_size)
+    return;
+  const uint8_t *p = hdr + DISK_OVERLAY_LOG_HEADER;
+  while (disk_log_used < DISK_OVERLAY_LOG_BLOCKS) {
+    uint16_t lba = p[0] | (p[1] << 8);
+    if (lba == 0xFFFF)
+      break;
+    disk_log_lba[disk_log_used++] = lba;
+    p += 2;
+  }
+}
+
+/**
+ * @brief ブロックの現在の内容の読み出し元を返します (キャッシュを除く)。
+ * @param lba ブロック番号
+ * @return ブロック先頭へのポインタ
+ */
+const uint8_t *disk_block_source(uint32_t lba) {
+  for (uint32_t i = 0; i < disk_overlay_used; i++) {
+    if (disk_overlay_lba[i] == lba)
+      return disk_overlay[i];
+  }
+  for (uint32_t i = disk_log_used; i-- > 0;) {
+    if (disk_log_lba[i] == lba)
+      return flash_nocache(DISK_OVERLAY_FLASH_OFFSET + FLASH_SECTOR_SIZE +
+                           i * DISK_BLOCK_SIZE);
+  }
+  return flash_nocache((uint32_t)(disk_img - (const uint8_t *)XIP_BASE) +
+                       lba * DISK_BLOCK_SIZE);
+}
+
+/**
+ * @brief ブロックを読み出します。フラッシュ上のブロックはキャッシュに
+ * 取り込みます。
+ * @param lba ブロック番号
+ * @return ブロック先頭へのポインタ
+ */
+const uint8_t *disk_block_cached(uint32_t lba) {
+  const uint8_t *src = disk_block_source(lba);
+  if (src >= disk_overlay[0] && src < disk_overlay[DISK_OVERLAY_BLOCKS])
+    return src;
+
+  uint32_t victim = 0;
+  for (uint32_t i = 0; i < DISK_CACHE_BLOCKS; i++) {
+    if (disk_cache_stamp[i] && disk_cache_lba[i] == lba) {
+      disk_cache_stamp[i] = ++disk_cache_clock;
+      disk_cache_hits++;
+      return disk_cache[i];
+    }
+    if (disk_cache_stamp[i] < disk_cache_stamp[victim])
+      victim = i;
+  }
+  disk_cache_misses++;
+  memcpy(disk_cache[victim], src, DISK_BLOCK_SIZE);
+  disk_cache_lba[victim] = lba;
+  disk_cache_stamp[victim] = ++disk_cache_clock;
+  return disk_cache[victim];
+}
+
+/**
+ * @brief キャッシュされたブロックを破棄します。
+ * @param lba ブロック番号
+ * @return なし
+ */
+void disk_cache_invalidate(uint32_t lba) {
+  for (uint32_t i = 0; i < DISK_CACHE_BLOCKS; i++) {
+    if (disk_cache_lba[i] == lba)
+      disk_cache_stamp[i] = 0;
+  }
+}
+
+// --- Disk DMA ---
+// Bulk reads are split into runs of contiguous source bytes (normally one
+// run, broken only by overlay blocks) and copied by one DMA channel while
+// core0 goes back to other work. hidos_host() sends the completion token only
+// after disk_dma_poll() reports the queue empty.
+struct DiskDmaRun {
+  const uint8_t *src;
+  uint8_t *dst;
+  uint32_t len;
+};
+DiskDmaRun disk_dma_runs[DISK_DMA_RUNS];
+uint32_t disk_dma_head = 0; // Next run to start
+uint32_t disk_dma_tail = 0; // Next free slot
+int disk_dma_chan = -1;
+
+/**
+ * @brief 必要ならDMAチャネルで次のランを開始します。
+ * @param なし
+ * @return すべてのランが完了している場合true
+ */
+bool disk_dma_poll() {
+  if (disk_dma_chan < 0)
+    return true;
+  if (dma_channel_is_busy(disk_dma_chan))
+    return false;
+  if (disk_dma_head == disk_dma_tail)
+    return true;
+
+  DiskDmaRun &r = disk_dma_runs[disk_dma_head % DISK_DMA_RUNS];
+  disk_dma_head++;
+  bool aligned = (((uintptr_t)r.src | (uintptr_t)r.dst | r.len) & 3) == 0;
+  dma_channel_config c = dma_channel_get_default_config(disk_dma_chan);
+  channel_config_set_transfer_data_size(&c, aligned ? DMA_SIZE_32 : DMA_SIZE_8);
+  channel_config_set_read_increment(&c, true);
+  channel_config_set_write_increment(&c, true);
+  dma_channel_configure(disk_dma_chan, &c, r.dst, r.src,
+                        aligned ? r.len / 4 : r.len, true);
+  return false;
+}
+
+/**
+ * @brief キューに入っているDMA転送がすべて終わるまで待ちます。
+ * フラッシュの書き換えやキャッシュ経由の読み書きの前に呼びます。
+ * @param なし
+ * @return なし
+ */
+void disk_dma_wait() {
+  while (!disk_dma_poll())
+    tight_loop_contents();
+}
+
+/**
+ * @brief コピーをDMAのキューに追加します。直前のランと連続していれば
+ * 結合します。
+ * @param dst コピー先
+ * @param src コピー元
+ * @param len バイト数
+ * @return なし
+ */
+void disk_dma_copy(uint8_t *dst, const uint8_t *src, uint32_t len) {
+  if (disk_dma_chan < 0) {
+    memcpy(dst, src, len);
+    return;
+  }
+  if (disk_dma_tail != disk_dma_head) {
+    // The last queued run has not started yet, so it may still grow.
+    DiskDmaRun &last = disk_dma_runs[(disk_dma_tail - 1) % DISK_DMA_RUNS];
+    if (last.src + last.len == src && last.dst + last.len == dst) {
+      last.len += len;
+      return;
+    }
+  }
+  while (disk_dma_tail - disk_dma_head == DISK_DMA_RUNS)
+    disk_dma_poll();
+  disk_dma_runs[disk_dma_tail % DISK_DMA_RUNS] = {src, dst, len};
+  disk_dma_tail++;
+}
+
+/**
+ * @brief SRAMのオーバーレイをフラッシュのログに追記し、オーバーレイを
+ * 空にします (Core 0)。
+ * @param なし
+ * @return 成功した場合true、ログが一杯の場合false
+ */
+bool disk_overlay_flush() {
+  disk_dma_wait(); // No XIP reads in flight while flash is programmed
+  if (disk_overlay_used == 0)
+    return true;
+  if (!disk_log_usable)
+    return false;
+  if (disk_log_used + disk_overlay_used > DISK_OVERLAY_LOG_BLOCKS) {
+    printf("disk: flash overlay log full (%lu blocks)\n", disk_log_used);
+    return false;
+  }
+
+  uint8_t page[FLASH_PAGE_SIZE];
+  uint32_t ints = save_and_disable_interrupts();
+  if (disk_log_used == 0) {
+    // (Re)start the log. Data sectors are erased as the log reaches them.
+    flash_range_erase(DISK_OVERLAY_FLASH_OFFSET, FLASH_SECTOR_SIZE);
+    memset(page, 0xFF, sizeof(page));
+    memcpy(page, "V30D", 4);
+    uint32_t size = disk_img_size;
+    memcpy(page + 4, &size, 4);
+    flash_range_program(DISK_OVERLAY_FLASH_OFFSET, page, sizeof(page));
+  }
+
+  uint32_t first = disk_log_used;
+  for (uint32_t i = 0; i < disk_overlay_used; i++) {
+    uint32_t n = disk_log_used++;
+    uint32_t off = DISK_OVERLAY_FLASH_OFFSET + FLASH_SECTOR_SIZE +
+                   n * DISK_BLOCK_SIZE;
+    if (off % FLASH_SECTOR_SIZE == 0)
+      flash_range_erase(off, FLASH_SECTOR_SIZE);
+    flash_range_program(off, disk_overlay[i], DISK_BLOCK_SIZE);
+    disk_log_lba[n] = disk_overlay_lba[i];
+  }
+
+  // Append the index entries. Bytes already programmed are written with
+  // their current value, which NOR flash allows.
+  uint32_t from = DISK_OVERLAY_LOG_HEADER + first * 2;
+  uint32_t to = DISK_OVERLAY_LOG_HEADER + disk_log_used * 2;
+  for (uint32_t p = from / FLASH_PAGE_SIZE * FLASH_PAGE_SIZE; p < to;
+       p += FLASH_PAGE_SIZE) {
+    memcpy(page, disk_log_header() + p, sizeof(page));
+    for (uint32_t b = (p > from ? p : from); b < to && b < p + FLASH_PAGE_SIZE;
+         b += 2) {
+      uint16_t lba = disk_log_lba[(b - DISK_OVERLAY_LOG_HEADER) / 2];
+      page[b - p] = lba;
+      page[b - p + 1] = lba >> 8;
+    }
+    flash_range_program(DISK_OVERLAY_FLASH_OFFSET + p, page, sizeof(page));
+  }
+  restore_interrupts(ints);
+
+  disk_overlay_used = 0;
+  return true;
+}
+
+/**
+ * @brief オーバーレイを破棄し、ディスクを埋め込みイメージの内容に戻します。
+ * @param なし
+ * @return なし
+ */
+void disk_overlay_discard() {
+  disk_overlay_used = 0;
+  if (disk_log_usable && disk_log_used != 0) {
+    uint32_t ints = save_and_disable_interrupts();
+    flash_range_erase(DISK_OVERLAY_FLASH_OFFSET, FLASH_SECTOR_SIZE);
+    restore_interrupts(ints);
+    disk_log_used = 0;
+  }
+  for (uint32_t i = 0; i < DISK_CACHE_BLOCKS; i++)
+    disk_cache_stamp[i] = 0;
+}
+
+/**
+ * @brief ディスクの内容をV30のRAMへ読み出します。
+ * 大きな読み出しはDMAで行い、完了を待たずに戻ります (disk_dma_poll())。
+ * @param dst 読み出し先
+ * @param offset ディスク上のバイトオフセット
+ * @param len バイト数
+ * @return なし
+ */
+void disk_read(uint8_t *dst, uint32_t offset, uint32_t len) {
+  // Bulk reads (file data) bypass the cache so they do not evict the
+  // FAT/directory blocks.
+  bool cache = len <= DISK_CACHE_MAX_READ;
+  disk_dma_wait();
+  while (len > 0) {
+    uint32_t lba = offset / DISK_BLOCK_SIZE;
+    uint32_t in = offset % DISK_BLOCK_SIZE;
+    uint32_t n = DISK_BLOCK_SIZE - in;
+    if (n > len)
+      n = len;
+    if (cache)
+      memcpy(dst, disk_block_cached(lba) + in, n);
+    else
+      disk_dma_copy(dst, disk_block_source(lba) + in, n);
+    dst += n;
+    offset += n;
+    len -= n;
+  }
+}
+
+/**
+ * @brief V30のRAMの内容をディスクへ書き込みます。書き込んだブロックは
+ * オーバーレイに複製され、オーバーレイが一杯ならフラッシュへ書き出します。
+ * @param src 書き込むデータ
+ * @param offset ディスク上のバイトオフセット
+ * @param len バイト数
+ * @return 成功した場合true
+ */
+bool disk_write(const uint8_t *src, uint32_t offset, uint32_t len) {
+  disk_dma_wait();
+  while (len > 0) {
+    uint32_t lba = offset / DISK_BLOCK_SIZE;
+    uint32_t in = offset % DISK_BLOCK_SIZE;
+    uint32_t n = DISK_BLOCK_SIZE - in;
+    if (n > len)
+      n = len;
+
+    uint8_t *blk = nullptr;
+    for (uint32_t i = 0; i < disk_overlay_used; i++) {
+      if (disk_overlay_lba[i] == lba) {
+        blk = disk_overlay[i];
+        break;
+      }
+    }
+    if (!blk) {
+      // Core1 reads flash while a ROM region is mapped, so flash cannot be
+      // written under it
+      if (disk_overlay_used == DISK_OVERLAY_BLOCKS &&
+          (mem_rom_pages != 0 || !disk_overlay_flush()))
+        return false;
+      blk = disk_overlay[disk_overlay_used];
+      if (n != DISK_BLOCK_SIZE)
+        memcpy(blk, disk_block_source(lba), DISK_BLOCK_SIZE); // Copy on write
+      disk_overlay_lba[disk_overlay_used++] = lba;
+      disk_cache_invalidate(lba);
+    }
+    memcpy(blk + in, src, n);
+    src += n;
+    offset += n;
+    len -= n;
+  }
+  return true;
+}
+
 enum {
   IODEV = 0,
   IOIDX = 2,
@@ -441,12 +1885,12 @@ enum {
 
 // Memory access helpers
 uint32_t memr2(uint32_t addr) {
-  return ram[map_address(addr)] | (ram[map_address(addr + 1)] << 8);
+  return mem_read8(addr) | (mem_read8(addr + 1) << 8);
 }
 
 void memw2(uint32_t addr, uint16_t value) {
-  ram[map_address(addr)] = value & 0xFF;
-  ram[map_address(addr + 1)] = value >> 8;
+  mem_write8(addr, value & 0xFF);
+  mem_write8(addr + 1, value >> 8);
 }
 
 uint32_t memr4(uint32_t addr) {
@@ -472,6 +1916,9 @@ int io_init(unsigned addr, unsigned idx, unsigned cmd) {
     case 'D' << 8 | 'O':     // DOS address
       memw2(addr + IOBUF, 0x18000 >> 4);   // Fixed position for MSDOS.SYS
       break;
+    case 'Q' << 8 | 'U': // Request queue (see "Request Queue")
+      memw2(addr + IOBUF, VMIO_QUEUE_MAX);
+      break;
     default:
       return -1;
   }
@@ -489,15 +1936,27 @@ int io_disk(unsigned addr, unsigned idx, unsigned cmd) {
   switch (cmd)
   {
     case 'R' << 8 | 'D':	/* Read */
+    case 'W' << 8 | 'R':	/* Write */
+    {
+      bool wr = cmd == ('W' << 8 | 'R');
       if (hidos_loglevel < 1) {
-        printf("diskrw drive=%d wr=%d addr=%x off=%x len=%d\n", idx, 0, adr, buf, siz);
+        printf("diskrw drive=%d wr=%d addr=%x off=%x len=%d\n", idx, wr, adr, buf, siz);
       }
-      memcpy(ram+adr, disk_img+buf, siz);
-      memw2 (addr + IOBUF, 1);
-
+      uint8_t *mem = mem_ram_span(adr, siz); // DMA needs plain SRAM
+      if (buf > disk_img_size || siz > disk_img_size - buf || !mem) {
+        memw2 (addr + IOBUF, 0);
+        break;
+      }
+      bool ok = true;
+      if (wr) {
+        ok = disk_write(mem, buf, siz);
+      } else {
+        disk_read(mem, buf, siz);
+        dirty_mark(mem - ram, siz);
+      }
+      memw2 (addr + IOBUF, ok ? 1 : 0);
       break;
-    case 'W' << 8 | 'R':	/* Write */
-      memw2 (addr + IOBUF, 0);
+    }
     case 'C' << 8 | 'H':	/* Media change */
       memw2 (addr + IOBUF, 1);
       break;
@@ -507,58 +1966,124 @@ int io_disk(unsigned addr, unsigned idx, unsigned cmd) {
   return 0; // Return 0, but IOBUF indicates failure for the VM
 }
 
+// --- Console Rings ---
+// HIDOS console output is collected in con_tx and handed to the USB CDC
+// driver in bulk, bypassing per-character stdio. Input is read ahead into
+// con_rx. con_service() runs whenever core0 waits in hidos_host().
+uint8_t con_tx[CON_TX_RING];
+uint32_t con_tx_head = 0; // Write position
+uint32_t con_tx_tail = 0; // Next byte to send
+uint8_t con_rx[CON_RX_RING];
+uint32_t con_rx_head = 0;
+uint32_t con_rx_tail = 0;
+
+/**
+ * @brief 送信リングに溜まった出力をUSB CDCに書き出します。
+ * @param なし
+ * @return なし
+ */
+void con_flush() {
+  while (con_tx_tail != con_tx_head) {
+    uint32_t start = con_tx_tail % CON_TX_RING;
+    uint32_t n = con_tx_head - con_tx_tail;
+    if (n > CON_TX_RING - start)
+      n = CON_TX_RING - start; // Up to the wrap, the rest in the next pass
+    console_write(&con_tx[start], n);
+    con_tx_tail += n;
+  }
+}
+
+/**
+ * @brief 出力を送信リングに追加します。一定量溜まると書き出します。
+ * @param src 出力するデータ (V30のRAM上、折り返しを考慮)
+ * @param len バイト数
+ * @return なし
+ */
+void con_write(uint32_t src, uint32_t len) {
+  for (uint32_t i = 0; i < len; i++) {
+    if (con_tx_head - con_tx_tail == CON_TX_RING)
+      con_flush();
+    con_tx[con_tx_head++ % CON_TX_RING] = mem_read8(src + i);
+  }
+  if (con_tx_head - con_tx_tail >= CON_TX_FLUSH_BYTES)
+    con_flush();
+}
+
+/**
+ * @brief USBから届いている入力を受信リングに取り込みます。
+ * @param timeout_us 最初の1文字を待つ時間 (0で待たない)
+ * @return なし
+ */
+void con_poll_input(uint32_t timeout_us) {
+  while (con_rx_head - con_rx_tail < CON_RX_RING) {
+    int c = console_getchar(timeout_us);
+    if (c == PICO_ERROR_TIMEOUT)
+      break;
+    usb_stats.bytes_in++;
+    if (c == CON_EXIT_KEY) {
+      stop_request = true; // core1 ends the VM, hidos_host() returns
+      continue;
+    }
+    if (c == SNAP_KEY) {
+      snap_request = true; // Taken by hidos_host() at the next CON request
+      continue;
+    }
+    con_rx[con_rx_head++ % CON_RX_RING] = (uint8_t)c;
+    timeout_us = 0;
+  }
+}
+
+/**
+ * @brief Core 0の待ち時間に呼び、出力の書き出しと入力の先読みを行います。
+ * @param なし
+ * @return なし
+ */
+void con_service() {
+  con_flush();
+  con_poll_input(0);
+}
+
 int io_con(unsigned addr, unsigned idx, unsigned cmd) {
   if (idx)
     return -1;
-  static unsigned count;
-  static uint16_t last;
   switch (cmd) {
   case 'W' << 8 | '1': // Write one byte
-    count = 0;
-    putchar(ram[map_address(addr + IOBUF)]);
-    fflush(stdout);
+    con_wait_count = 0;
+    con_write(addr + IOBUF, 1);
     break;
   case 'W' << 8 | 'R': // Write
-    count = 0;
-    {
-      uint32_t wr_addr = memr4(addr + IOADR);
-      uint32_t wr_len = memr4(addr + IOSIZ);
-      for (uint32_t i = 0; i < wr_len; i++) {
-        putchar(ram[map_address(wr_addr + i)]);
-      }
-      fflush(stdout);
-    }
+    con_wait_count = 0;
+    con_write(memr4(addr + IOADR), memr4(addr + IOSIZ));
     break;
   case 'R' << 8 | 'P': // Read poll
   case 'R' << 8 | '1': // Read one byte
-    if (!last) {
-      int c = getchar_timeout_us(0); // non-blocking check
-      if (c != PICO_ERROR_TIMEOUT) {
-        last = (uint8_t)c | 0x100;
-      }
-    }
-    if (last) {
-      count = 0;
+  {
+    con_flush(); // Show any prompt before the VM looks for input
+    if (con_rx_head == con_rx_tail)
+      con_poll_input(0);
+    uint16_t last = 0;
+    if (con_rx_head != con_rx_tail) {
+      last = con_rx[con_rx_tail % CON_RX_RING] | 0x100;
+      con_wait_count = 0;
     }
     memw2(addr + IOBUF, last);
-    if (cmd == ('R' << 8 | '1')) {
-      last = 0;
+    if (cmd == ('R' << 8 | '1') && last) {
+      con_rx_tail++;
     }
     break;
+  }
   case 'R' << 8 | 'W': // Read wait (for lower CPU usage)
-    if (last) {
-      count = 0;
-    } else if (count < 16) {
-      count++;
+    con_flush();
+    if (con_rx_head != con_rx_tail) {
+      con_wait_count = 0;
+    } else if (con_wait_count < 16) {
+      con_wait_count++;
     } else {
-      // In common.c, this just polls. Here, we can't just poll without
-      // reading. So we read with a timeout and buffer the character if found.
-      // This should be functionally equivalent for the VM.
-      int c = getchar_timeout_us(10000); // 10ms timeout
-      if (c != PICO_ERROR_TIMEOUT) {
-        last = (uint8_t)c | 0x100; // Buffer the character
-        count = 0;                 // Reset wait counter
-      }
+      // In common.c, this just polls. Here we wait up to 10ms for input
+      // and keep it in the receive ring for the following read.
+      con_poll_input(10000);
+      if (con_rx_head != con_rx_tail)
+        con_wait_count = 0; // Reset wait counter
     }
     break;
   default:
@@ -590,8 +2115,10 @@ int io_clock(unsigned addr, unsigned idx, unsigned cmd) {
   switch (cmd) {
   case 'R' << 8 | 'D': /* Read */
   {
-    // Get elapsed time since boot in microseconds
-    uint64_t elapsed_us = to_us_since_boot(get_absolute_time());
+    // Get elapsed time since boot (or since the snapshot's boot) in
+    // microseconds
+    uint64_t elapsed_us =
+        to_us_since_boot(get_absolute_time()) + clock_offset_us;
 
     uint32_t elapsed_seconds = elapsed_us / 1000000;
     uint32_t remaining_us = elapsed_us % 1000000;
@@ -627,37 +2154,46 @@ int io_printer(unsigned addr, unsigned idx, unsigned cmd) {
   return 0;
 }
 
-void vmio(uint16_t in_data) {
-  // in_dataはパラグラフのアドレス。メモリアドレスにするために16倍する。
-  uint16_t paragraph = in_data;
-  uint32_t addr = in_data << 4;
-
+/**
+ * @brief 1件の要求ブロックを対応するデバイスで処理します。
+ * @param addr 要求ブロックのリニアアドレス
+ * @param ret デバイスの戻り値の格納先 (0: 成功)
+ * @return 処理したデバイス
+ */
+VmioDev vmio_dispatch(uint32_t addr, int &ret) {
   unsigned dev = memr2(addr + IODEV);
   unsigned idx = memr2(addr + IOIDX);
   unsigned cmd = memr2(addr + IOCMD);
   if (hidos_loglevel < 1) {
     printf("HIDOS: pos=%x %c%c %d %c%c\n", addr, dev >> 8, dev &0xFF, idx, cmd >> 8, cmd&0xFF);
   }
-  int ret = -1;
+  ret = -1;
+  VmioDev which = VMIO_UNKNOWN;
 
   switch (dev) {
   case 'I' << 8 | 'N':
     ret = io_init(addr, idx, cmd);
+    which = VMIO_INIT;
     break;
   case 'D' << 8 | 'I':
     ret = io_disk(addr, idx, cmd);
+    which = VMIO_DISK;
     break;
   case 'C' << 8 | 'O':
     ret = io_con(addr, idx, cmd);
+    which = VMIO_CON;
     break;
   case 'A' << 8 | 'U':
     ret = io_aux(addr, idx, cmd);
+    which = VMIO_AUX;
     break;
   case 'C' << 8 | 'L':
     ret = io_clock(addr, idx, cmd);
+    which = VMIO_CLOCK;
     break;
   case 'P' << 8 | 'R':
     ret = io_printer(addr, idx, cmd);
+    which = VMIO_PRINTER;
     break;
   }
 
@@ -665,739 +2201,5094 @@ void vmio(uint16_t in_data) {
     printf("vmio error: ret=%d dev=0x%04X idx=%x cmd=0x%04X\n", ret, dev, idx,
            cmd);
   }
+  return which;
 }
 
-const uint32_t TIMEOUT_CYCLES = 250000 * 200;
+// --- Request Queue ---
+// One OUT 86h may carry several requests. A 'QU' block points at a ring of
+// entries in V30 memory, each a request block (IODEV..IOSIZ) followed by a
+// status word, and all posted entries are served before the completion
+// token: the characters of a console line or the sectors of a multi-sector
+// transfer cost one round trip instead of one each.
+//   'QU' 'RN': IOIDX ring size in entries, IOBUF first entry:u16,
+//              IOADR ring (linear address), IOSIZ entries posted
+//              -> IOBUF entries served
+//   entry:     +0 request block, +IOSTS status:u16 (the device's return
+//              value: 0 done, FFFF failed)
+// 'IN' 'QU' returns VMIO_QUEUE_MAX in IOBUF, so VM_IO.SYS can probe for it;
+// monitors without the queue fail that request.
+#define IOSTS 18
+#define VMIO_QUEUE_ENTRY 20
 
-__force_inline void tiny_delay() {
-  // wait 3us
-  for(volatile int i=0;i<10;i++)
-    __asm("nop");
+/**
+ * @brief 'QU'要求ブロックが指すリングの要求をすべて処理します。
+ * @param addr 'QU'要求ブロックのリニアアドレス
+ * @param idx リングのエントリ数
+ * @param cmd 'RN'
+ * @return 要求ブロックが正しければ0
+ */
+int io_queue(unsigned addr, unsigned idx, unsigned cmd) {
+  uint32_t ring = memr4(addr + IOADR);
+  uint32_t first = memr2(addr + IOBUF);
+  uint32_t posted = memr4(addr + IOSIZ);
+  if (cmd != ('R' << 8 | 'N') || idx == 0 || first >= idx || posted > idx ||
+      posted > VMIO_QUEUE_MAX) {
+    memw2(addr + IOBUF, 0);
+    return -1;
+  }
+  if (hidos_loglevel < 1) {
+    printf("HIDOS: queue ring=%lx first=%lu posted=%lu\n", ring, first,
+           posted);
+  }
+  for (uint32_t k = 0; k < posted; k++) {
+    uint32_t entry = ring + (first + k) % idx * VMIO_QUEUE_ENTRY;
+    // A disk read returns with its DMA still filling ram[]. Disk requests
+    // wait for it themselves, anything else may read what it is filling.
+    if (memr2(entry + IODEV) != ('D' << 8 | 'I'))
+      disk_dma_wait();
+    uint32_t t_start = time_us_32();
+    int ret;
+    VmioDev which = vmio_dispatch(entry, ret); // A nested 'QU' fails here
+    memw2(entry + IOSTS, ret);
+    vmio_stats_add(which, time_us_32() - t_start);
+  }
+  memw2(addr + IOBUF, posted);
+  return 0;
 }
 
-// Run in core1.
-void __not_in_flash_func(hidos_cpu)() {
-  gpio_put(PIN_RESET, 1);
-  sleep_ms(1);
-  gpio_put(PIN_RESET, 0);
+VmioDev vmio(uint16_t in_data) {
+  // in_dataはパラグラフのアドレス。メモリアドレスにするために16倍する。
+  uint16_t paragraph = in_data;
+  uint32_t addr = in_data << 4;
 
-  while (true) {
-    bool ale_detected = false;
-    uint32_t timeout_ctr = TIMEOUT_CYCLES;
-    while (timeout_ctr-->0) { // ALE high timeout
-      if (sio_hw->gpio_in & (1 << PIN_ALE)) {
-        ale_detected = true;
-        break;
-      }
-    }
-    if (!ale_detected) {
-      printf("Bus operation timeout (no ale), halt cpu.\n");
+  if (memr2(addr + IODEV) == ('Q' << 8 | 'U')) {
+    unsigned idx = memr2(addr + IOIDX);
+    unsigned cmd = memr2(addr + IOCMD);
+    if (io_queue(addr, idx, cmd))
+      printf("vmio error: bad queue request idx=%x cmd=0x%04X\n", idx, cmd);
+    return VMIO_QUEUE;
+  }
+  int ret;
+  return vmio_dispatch(addr, ret);
+}
+
+// ==========================================
+//   Core 1: Bus Engine
+// ==========================================
+// One bus-cycle loop, bus_engine_loop<Bus, Policy>(), serves every run mode.
+// Bus is the transport (SioBus polls the pins in software, PioBus talks to
+// bus.pio), Policy decides what is logged and which I/O ports core1 answers
+// itself. Both are resolved at compile time, so NO_LOG and the HIDOS VM carry
+// no logging code at all.
+//
+// bus.pio latches the address on ALE and drives or samples AD0-15 with fixed
+// timing; core1 only moves words between the PIO FIFOs and ram[].
+
+static uint pio_addr_offset;
+static uint pio_strobe_offset;
+static bool pio_programs_loaded = false;
+
+/**
+ * @brief PIOバスエンジンのステートマシンを初期化して起動します。
+ * AD0-15はPIOの制御下に切り替わります。
+ * @param なし
+ * @return なし
+ */
+void pio_bus_start() {
+  if (!pio_programs_loaded) {
+    pio_addr_offset = pio_add_program(PIO_BUS, &v30_addr_program);
+    pio_strobe_offset = pio_add_program(PIO_BUS, &v30_strobe_program);
+    pio_programs_loaded = true;
+  }
+  // pio_sm_init() also clears the FIFOs and restarts the programs.
+  v30_addr_program_init(PIO_BUS, SM_ADDR, pio_addr_offset, PIN_ALE);
+  v30_strobe_program_init(PIO_BUS, SM_STROBE, pio_strobe_offset, PIN_AD_BASE,
+                          PIN_RD, PIN_WR);
+  pio_set_sm_mask_enabled(PIO_BUS, (1u << SM_ADDR) | (1u << SM_STROBE), true);
+}
+
+/**
+ * @brief PIOバスエンジンを停止し、AD0-15をSIOの入力に戻します。
+ * @param なし
+ * @return なし
+ */
+void pio_bus_stop() {
+  pio_set_sm_mask_enabled(PIO_BUS, (1u << SM_ADDR) | (1u << SM_STROBE), false);
+  pio_sm_set_consecutive_pindirs(PIO_BUS, SM_STROBE, PIN_AD_BASE, 16, false);
+  gpio_init_mask((1 << 16) - 1); // Hand GP0-15 back to SIO
+  set_ad_dir(false);
+}
+
+// One decoded bus cycle, filled in by the Bus transport.
+struct BusCycle {
+  uint32_t addr;
+  bool is_io;
+  bool bhe_low;
+  uint16_t data; // Write cycles only
+};
+
+enum BusStrobe { STROBE_READ, STROBE_WRITE, STROBE_TIMEOUT, STROBE_RESYNC };
+
+#define BUS_OPERATION_TIMEOUT_US 100000 // 100ms without ALE or RD/WR
+#define SPIN_ITER_CYCLES 16 // sys clocks per spin_while() iteration (4 polls)
+
+/**
+ * @brief BUS_OPERATION_TIMEOUT_USに相当するspin_while()の反復回数を
+ * 現在のシステムクロックから求めます。
+ * @param なし
+ * @return 反復回数 (1以上)
+ */
+uint32_t bus_timeout_spins() {
+  uint64_t cycles =
+      (uint64_t)clock_get_hz(clk_sys) * BUS_OPERATION_TIMEOUT_US / 1000000u;
+  return (uint32_t)(cycles / SPIN_ITER_CYCLES) + 1;
+}
+
+/**
+ * @brief レジスタの値が変化するまで待ちます。タイムアウトはタイマーを
+ * 読まずに反復回数で数えるため、1回のポーリングはロードと比較だけです。
+ * @param reg ポーリングするレジスタ
+ * @param mask 比較するビット
+ * @param idle 待ち続ける間の (reg & mask) の値
+ * @param spins 最大反復回数 (bus_timeout_spins())
+ * @param seen 最後に読んだレジスタの値の格納先
+ * @return 変化を検出した場合true、タイムアウトした場合false
+ */
+__force_inline bool spin_while(const volatile uint32_t *reg, uint32_t mask,
+                               uint32_t idle, uint32_t spins, uint32_t &seen) {
+  uint32_t v;
+  do {
+    // Unrolled so the countdown costs one decrement per four polls.
+    if (((v = *reg) & mask) != idle)
       break;
-    }
+    if (((v = *reg) & mask) != idle)
+      break;
+    if (((v = *reg) & mask) != idle)
+      break;
+    if (((v = *reg) & mask) != idle)
+      break;
+  } while (--spins);
+  seen = v;
+  return spins != 0;
+}
+
+// --- Transport: software polling of the SIO pins ---
+struct SioBus {
+  uint32_t timeout_spins;
+  uint32_t turnaround; // sys clocks from RD# low to driving AD0-15
+#if V30_RD_TIMING
+  uint32_t rd_driven; // SysTick when answer_read() drove AD0-15
+#endif
+
+  void start() {
+    timeout_spins = bus_timeout_spins();
+    turnaround = bus_turnaround_cycles;
+  }
+  void stop() {}
+
+  /**
+   * @brief ALEを待ち、アドレスを取り込みます。
+   * @param c アドレスとI/O/メモリ種別の格納先
+   * @return ALEを検出した場合true、タイムアウトした場合false
+   */
+  __force_inline bool wait_address(BusCycle &c) {
+    uint32_t pins;
+    if (!spin_while(&sio_hw->gpio_in, 1u << PIN_ALE, 0, timeout_spins, pins))
+      return false;
 
-    uint32_t addr = read_addr();
-    bool is_io = !(sio_hw->gpio_in & (1 << PIN_IOM));
+    c.addr = read_addr();
+    c.is_io = !(sio_hw->gpio_in & (1 << PIN_IOM));
 
     // Wait for ALE to go low (no timeout requested here)
     while (sio_hw->gpio_in & (1 << PIN_ALE))
       ;
+    return true;
+  }
 
-    bool done_bus_cycle_op = false;
-    timeout_ctr = TIMEOUT_CYCLES;
+  /**
+   * @brief RDまたはWRを待ちます。書き込みサイクルではWRの立ち上がりで
+   * データを取り込みます。
+   * @param c BHEと書き込みデータの格納先
+   * @return 検出したストローブの種類
+   */
+  __force_inline BusStrobe wait_strobe(BusCycle &c) {
+    // Idle between ALE and the strobe: RD# and WR# high, ALE low.
+    const uint32_t mask = (1u << PIN_RD) | (1u << PIN_WR) | (1u << PIN_ALE);
+    const uint32_t idle = (1u << PIN_RD) | (1u << PIN_WR);
+    uint32_t pins;
+    if (!spin_while(&sio_hw->gpio_in, mask, idle, timeout_spins, pins))
+      return STROBE_TIMEOUT;
+    if (!(pins & (1 << PIN_RD))) {
+      c.bhe_low = !(pins & (1u << PIN_BHE));
+      return STROBE_READ;
+    }
+    if (!(pins & (1 << PIN_WR))) {
+      c.bhe_low = !(pins & (1u << PIN_BHE));
+      // Wait for WR to go high (no timeout requested here)
+      while (!(sio_hw->gpio_in & (1 << PIN_WR)))
+        ;
+      c.data = read_data();
+      return STROBE_WRITE;
+    }
+    // ALE went high during the RD/WR wait: an ALE-only cycle or a new
+    // cycle.
+    return STROBE_RESYNC;
+  }
 
-    while (!done_bus_cycle_op) {
-      if (--timeout_ctr == 0) {
-        printf("Bus operation timeout (no RD/WR detected low), breaking "
-            "cycle.\n");
-        break; // Break from this inner loop, which will then break the outer
-               // cycle loop
-      }
-      uint32_t pins = sio_hw->gpio_in;
-
-      if (!(pins & (1 << PIN_RD))) {
-        tiny_delay(); // これが無いとショートしてデバイスが落ちる。
-        set_ad_dir(true);
-        uint16_t out_data = 0xFFFF;
-        if (!is_io) {
-          uint32_t aligned_v30_addr = addr & ~1;
-          out_data = ram[map_address(aligned_v30_addr)] |
-            (ram[map_address(aligned_v30_addr + 1)] << 8);
-        } else if (is_io && addr == 0x88) {
-          out_data = io_running;
-        }
-        write_data(out_data);
-
-        // Wait for RD to go high (no timeout requested here)
-        while (!(sio_hw->gpio_in & (1 << PIN_RD)))
-          ;
-        set_ad_dir(false);
-        done_bus_cycle_op = true;
-      } else if (!(pins & (1 << PIN_WR))) {
-        tiny_delay();
-        uint16_t in_data = read_data();
-        // Wait for WR to go high (no timeout requested here)
-        while (!(sio_hw->gpio_in & (1 << PIN_WR)))
-          ;
-
-        if (!is_io) {
-          bool bhe_low = !(pins & (1u << PIN_BHE));
-          bool a0_low = !(addr & 1);
-
-          if (bhe_low && a0_low) { // Word Write to even address
-            ram[map_address(addr)] = in_data & 0xFF;
-            ram[map_address(addr + 1)] = in_data >> 8;
-          } else if (bhe_low && !a0_low) { // High Byte Write to odd address
-            ram[map_address(addr)] = in_data >> 8;
-          } else if (!bhe_low && a0_low) { // Low Byte Write to even address
-            ram[map_address(addr)] = in_data & 0xFF;
-          }
-          // For invalid case (BHE high, A0 high), nothing is written.
-        } else if (is_io && addr == 0x86) {
-          io_value = in_data;
-          __dmb();
-          io_running = 1;
-        }
+  /**
+   * @brief 読み込みサイクルにデータを返し、RDが上がるまで駆動します。
+   * @param data V30に返す16ビットデータ
+   * @return なし
+   */
+  __force_inline void answer_read(uint16_t data) {
+    // これが無いとショートしてデバイスが落ちる。
+    // Counted from here, not from RD# low, so it only errs on the safe side
+    busy_wait_at_least_cycles(turnaround);
+    write_data(data);
+    set_ad_dir(true);
+#if V30_RD_TIMING
+    rd_driven = systick_hw->cvr;
+#endif
+    // Wait for RD to go high (no timeout requested here)
+    while (!(sio_hw->gpio_in & (1 << PIN_RD)))
+      ;
+    set_ad_dir(false);
+  }
+};
 
-        done_bus_cycle_op = true;
-      }
-      // If ALE goes high during an active bus cycle (RD/WR phase), it
-      // indicates an issue or new cycle. This breaks out of the current bus
-      // operation to re-sync with the CPU.
-      if (sio_hw->gpio_in & (1 << PIN_ALE)) {
-        printf("ALE detected high unexpectedly during RD/WR wait, breaking "
-            "current bus operation.\n");
-        break; // Break from done_bus_cycle_op loop
-      }
-    }
+// --- Transport: bus.pio state machines ---
+struct PioBus {
+  uint32_t turnaround; // Upper half of the answer word: SM delay loop count
+  uint32_t timeout_spins;
+#if V30_RD_TIMING
+  uint32_t rd_driven; // SysTick when the SM drives AD0-15 (estimated)
+#endif
+
+  void start() {
+    // The SM loop runs x + 1 cycles after taking the answer, which is
+    // already later than RD# low
+    uint32_t cycles = bus_turnaround_cycles;
+    turnaround = (cycles ? cycles - 1 : 0) << 16;
+    timeout_spins = bus_timeout_spins();
+    pio_bus_start(); // SMs must be running before the first ALE
+  }
+  void stop() { pio_bus_stop(); }
 
-    if (!done_bus_cycle_op) {
-      // The inner bus operation loop was broken (e.g. by timeout),
-      // so we break the main bus sniffing loop.
-      break;
-    }
+  __force_inline bool wait_address(BusCycle &c) {
+    const uint32_t rx_empty_addr = 1u << (PIO_FSTAT_RXEMPTY_LSB + SM_ADDR);
+    uint32_t fstat;
+    if (!spin_while(&PIO_BUS->fstat, rx_empty_addr, rx_empty_addr,
+                    timeout_spins, fstat))
+      return false;
+    uint32_t a = PIO_BUS->rxf[SM_ADDR];
+    c.addr = (a >> 16) | (((a >> (PIN_A16 - PIN_ALE)) & 0xF) << 16);
+    c.is_io = !(a & (1u << (PIN_IOM - PIN_ALE)));
+    c.bhe_low = !(a & (1u << (PIN_BHE - PIN_ALE)));
+    return true;
   }
-}
 
-// Run in core0.
-void hidos_host(uint8_t loglevel) {
-  hidos_loglevel = loglevel;
-  while(true){
-    if (io_running == 0) continue;
-    __dmb();
+  __force_inline BusStrobe wait_strobe(BusCycle &c) {
+    const uint32_t rx_empty_addr = 1u << (PIO_FSTAT_RXEMPTY_LSB + SM_ADDR);
+    const uint32_t rx_empty_strobe = 1u << (PIO_FSTAT_RXEMPTY_LSB + SM_STROBE);
+    const uint32_t both = rx_empty_addr | rx_empty_strobe;
+    uint32_t fstat;
+    if (!spin_while(&PIO_BUS->fstat, both, both, timeout_spins, fstat))
+      return STROBE_TIMEOUT;
+    // Another address word without a strobe means the V30 ran an ALE-only
+    // cycle (e.g. HLT).
+    if (fstat & rx_empty_strobe)
+      return STROBE_RESYNC;
+    uint32_t s = PIO_BUS->rxf[SM_STROBE];
+    if (!(s & (1u << STROBE_RD_BIT)))
+      return STROBE_READ;
+    c.data = (s >> STROBE_AD_SHIFT) & 0xFFFF;
+    return STROBE_WRITE;
+  }
 
-    vmio(io_value);
+  __force_inline void answer_read(uint16_t data) {
+    PIO_BUS->txf[SM_STROBE] = turnaround | data;
+#if V30_RD_TIMING
+    // The SM drives after its delay loop (SysTick counts down)
+    rd_driven = systick_hw->cvr - ((turnaround >> 16) + 1);
+#endif
+  }
+};
 
-    __dmb();
-    io_running = 0;
+// --- UART (16550) ---
+// COM1 (3F8h) and COM2 (2F8h) answer as 16550s with FIFOs in runs without
+// logging ('g', bench, binary RUN mode 0). Core1 serves the registers in the
+// bus loop. Transmitted bytes go through tx[] to core0, which copies them to
+// USB as they come during 'g' (uart_service()); USB input is queued in rx[]
+// of uart_rx_port. LSR reports THRE while tx[] has room for a FIFO load, so a
+// program polling it runs at the rate USB drains. Without the bridge THRE
+// stays set and whatever does not fit in tx[] is dropped (counted). There are
+// no interrupts (INTR is not wired): IIR always reads "none pending".
+#define UART_COM1_PORT 0x3F8
+#define UART_COM2_PORT 0x2F8
+
+enum UartReg {
+  UART_RBR = 0, // THR on write, DLL with DLAB
+  UART_IER,     // DLM with DLAB
+  UART_IIR,     // FCR on write
+  UART_LCR,
+  UART_MCR,
+  UART_LSR,
+  UART_MSR,
+  UART_SCR,
+};
+#define UART_LCR_DLAB 0x80
+#define UART_LSR_DR 0x01
+#define UART_LSR_THRE 0x20
+#define UART_LSR_TEMT 0x40
+
+struct UartPort {
+  uint8_t tx[UART_TX_RING];
+  volatile uint32_t tx_head, tx_tail; // Core1 writes head, core0 tail
+  uint8_t rx[UART_RX_RING];
+  volatile uint32_t rx_head, rx_tail; // Core0 writes head, core1 tail
+  uint8_t ier, lcr, mcr, scr, dll, dlm, fcr, rbr;
+  uint32_t tx_dropped;
+};
+UartPort uart_ports[2];              // COM1, COM2
+volatile bool uart_bridged = false;  // Core0 drains tx[] (during 'g')
+uint8_t uart_rx_port = 1;            // USB input goes to COM2, as COM_LOG_PORT
+
+__force_inline UartPort *uart_port(uint32_t addr) {
+  if ((addr & ~7u) == UART_COM1_PORT)
+    return &uart_ports[0];
+  if ((addr & ~7u) == UART_COM2_PORT)
+    return &uart_ports[1];
+  return nullptr;
+}
+
+/**
+ * @brief UARTのレジスタを読み出します (Core 1)。
+ * @param addr I/Oポート番号
+ * @param data 読み出した値の格納先 (両方のバイトレーンに置く)
+ * @return UARTのポートだった場合true
+ */
+__force_inline bool uart_io_read(uint32_t addr, uint16_t &data) {
+  UartPort *u = uart_port(addr);
+  if (!u)
+    return false;
+  uint8_t v = 0xFF;
+  switch (addr & 7) {
+  case UART_RBR:
+    if (u->lcr & UART_LCR_DLAB) {
+      v = u->dll;
+      break;
+    }
+    if (u->rx_tail != u->rx_head) {
+      __dmb();
+      u->rbr = u->rx[u->rx_tail % UART_RX_RING];
+      u->rx_tail = u->rx_tail + 1;
+    }
+    v = u->rbr;
+    break;
+  case UART_IER:
+    v = (u->lcr & UART_LCR_DLAB) ? u->dlm : u->ier;
+    break;
+  case UART_IIR:
+    v = (u->fcr & 1) ? 0xC1 : 0x01; // FIFOs enabled, no interrupt pending
+    break;
+  case UART_LCR:
+    v = u->lcr;
+    break;
+  case UART_MCR:
+    v = u->mcr;
+    break;
+  case UART_LSR: {
+    uint32_t used = u->tx_head - u->tx_tail;
+    v = (u->rx_head != u->rx_tail ? UART_LSR_DR : 0) |
+        (!uart_bridged || UART_TX_RING - used >= UART_FIFO_DEPTH
+             ? UART_LSR_THRE
+             : 0) |
+        (!uart_bridged || used == 0 ? UART_LSR_TEMT : 0);
+    break;
+  }
+  case UART_MSR:
+    v = 0xB0; // DCD, DSR, CTS
+    break;
+  case UART_SCR:
+    v = u->scr;
+    break;
   }
+  data = v | (v << 8); // The V30 picks the byte lane of the port
+  return true;
 }
 
-// ==========================================
-//   XMODEM Implementation (Simple)
-// ==========================================
 /**
- * @brief
- * XMODEM転送のために、タイムアウト付きで1バイトを標準入力から読み取ります。
- * @param timeout タイムアウト時間 (ミリ秒)
- * @return 読み取った文字。タイムアウトした場合は負数。
+ * @brief UARTのレジスタに書き込みます (Core 1)。
+ * @param addr I/Oポート番号
+ * @param data 書き込みサイクルのデータ (奇数ポートは上位バイト)
+ * @return UARTのポートだった場合true
  */
-int _inbyte(unsigned int timeout) { return getchar_timeout_us(timeout * 1000); }
+__force_inline bool uart_io_write(uint32_t addr, uint16_t data) {
+  UartPort *u = uart_port(addr);
+  if (!u)
+    return false;
+  uint8_t v = (addr & 1) ? data >> 8 : data;
+  switch (addr & 7) {
+  case UART_RBR:
+    if (u->lcr & UART_LCR_DLAB) {
+      u->dll = v;
+    } else if (u->tx_head - u->tx_tail == UART_TX_RING) {
+      u->tx_dropped++;
+    } else {
+      u->tx[u->tx_head % UART_TX_RING] = v;
+      __dmb();
+      u->tx_head = u->tx_head + 1;
+    }
+    break;
+  case UART_IER:
+    if (u->lcr & UART_LCR_DLAB)
+      u->dlm = v;
+    else
+      u->ier = v;
+    break;
+  case UART_IIR:
+    u->fcr = v;
+    if (v & 2)
+      u->rx_tail = u->rx_head; // Clear the receive FIFO
+    break;
+  case UART_LCR:
+    u->lcr = v;
+    break;
+  case UART_MCR:
+    u->mcr = v;
+    break;
+  case UART_SCR:
+    u->scr = v;
+    break;
+  }
+  return true;
+}
 
 /**
- * @brief XMODEM転送のために、1バイトを標準出力に書き込みます。
- * @param c 書き込む文字
+ * @brief UARTを電源投入時の状態に戻します (Core 1の停止中)。
+ * @param なし
  * @return なし
  */
-void _outbyte(int c) {
-  putchar(c);
-  fflush(stdout);
+void uart_reset() {
+  for (UartPort &u : uart_ports) {
+    memset(&u, 0, sizeof(u));
+    u.lcr = 0x03; // 8N1
+  }
 }
 
 /**
- * @brief データバッファのCRC-16-CCITTチェックサムを計算します。
- * @param buf データバッファへのポインタ
- * @param len データの長さ (バイト)
- * @return 計算された16ビットのCRC値
+ * @brief UARTの送信データをUSBへ書き出します (Core 0)。
+ * @param なし
+ * @return なし
  */
-uint16_t crc16_ccitt(const uint8_t *buf, int len) {
-  uint16_t crc = 0;
-  while (len--) {
-    crc ^= *buf++ << 8;
-    for (int i = 0; i < 8; ++i) {
-      if (crc & 0x8000)
-        crc = (crc << 1) ^ 0x1021;
-      else
-        crc = crc << 1;
+void uart_flush_tx() {
+  for (UartPort &u : uart_ports) {
+    uint32_t head = u.tx_head;
+    __dmb();
+    while (u.tx_tail != head) {
+      uint32_t start = u.tx_tail % UART_TX_RING;
+      uint32_t n = head - u.tx_tail;
+      if (n > UART_TX_RING - start)
+        n = UART_TX_RING - start; // Up to the wrap, the rest in the next pass
+      console_write(&u.tx[start], n);
+      u.tx_tail = u.tx_tail + n;
     }
   }
-  return crc;
 }
 
 /**
- * @brief XMODEM-CRCプロトコルを使用してデータを受信します。
- * @param dest 受信したデータを格納するバッファ
- * @param max_len 受信可能な最大バイト数
- * @return なし
+ * @brief UARTの送信データを書き出し、USBからの入力を受信FIFOへ渡します
+ * ('g'の実行中、Core 0)。
+ * @param なし
+ * @return CON_EXIT_KEYを受け取った場合true
  */
-bool xmodem_receive(uint8_t *dest, int max_len) {
-  uint8_t buffer[133]; // SOH + Block# + ~Block# + Data[128] + CRC[2]
-  uint8_t block_num = 1;
-  int total_bytes = 0;
-  int retries = 0;
-  const int max_retries = 16;
-  int c; // Declare c at function scope to avoid goto/initialization error
+bool uart_service() {
+  uart_flush_tx();
+  UartPort &u = uart_ports[uart_rx_port];
+  while (u.rx_head - u.rx_tail < UART_RX_RING) {
+    int c = console_getchar(0);
+    if (c == PICO_ERROR_TIMEOUT)
+      break;
+    usb_stats.bytes_in++;
+    if (c == CON_EXIT_KEY)
+      return true;
+    u.rx[u.rx_head % UART_RX_RING] = (uint8_t)c;
+    __dmb();
+    u.rx_head = u.rx_head + 1;
+  }
+  return false;
+}
 
-  printf("Ready to RECEIVE XMODEM (CRC)...\n");
-  fflush(stdout);
-  stdio_set_translate_crlf(&stdio_usb, false);
+// --- Policies: what to log, which I/O ports core1 handles itself ---
+struct PolicyBase {
+  static constexpr bool kLogs = true;     // false: no trace code at all
+  static constexpr bool kBounded = true;  // honour cycle_limit
+  static constexpr bool kTriggers = false; // check trace_filter's trigger
+  static constexpr bool kProfile = false;  // sample reads into prof_hist
+  __force_inline static bool io_read(uint32_t, uint16_t &) { return false; }
+  __force_inline static void io_write(uint32_t, uint16_t) {}
+  __force_inline static bool trigger_hit(uint8_t, uint32_t, int) {
+    return false;
+  }
+};
 
-  // 1. Start transfer: Send 'C' until sender responds with SOH
-  while (retries < max_retries) {
-    _outbyte('C');
-    c = _inbyte(3000);
-    if (c == SOH) {
-      goto receive_loop; // First SOH received, start main loop
-    }
-    retries++;
+struct NoLogPolicy : PolicyBase {
+  static constexpr bool kLogs = false;
+  __force_inline static bool should_log(uint8_t, uint32_t) { return false; }
+  __force_inline static bool io_read(uint32_t addr, uint16_t &data) {
+    return uart_io_read(addr, data);
   }
-  printf("Error: No response from sender.\n");
-  stdio_set_translate_crlf(&stdio_usb, true);
-  return false;
+  __force_inline static void io_write(uint32_t addr, uint16_t data) {
+    uart_io_write(addr, data);
+  }
+};
 
-receive_loop:
-  retries = 0;
-  while (retries <
-         max_retries) { // The loop should only terminate on EOT or retry limit.
-    // The first SOH was already received, or consumed at the end of the
-    // previous loop iteration.
-    // 2. Receive the rest of the block
-    buffer[0] = SOH;
-    for (int i = 1; i < 133; i++) {
-      c = _inbyte(1000);
-      if (c < 0) {
-        // Timeout while receiving packet data
-        while (_inbyte(50) >= 0)
-          ; // Flush
-        _outbyte(NAK);
-        retries++;
-        goto receive_loop_start_sync; // Go wait for a new SOH
-      }
-      buffer[i] = (uint8_t)c;
-    }
+struct FullLogPolicy : PolicyBase {
+  __force_inline static bool should_log(uint8_t, uint32_t) { return true; }
+};
 
-    // 3. Validate block
-    // Check block number
-    if (buffer[1] == block_num && buffer[2] == (uint8_t)~block_num) {
-      // CRC check
-      uint16_t crc_calc = crc16_ccitt(&buffer[3], 128);
-      uint16_t crc_remote = ((uint16_t)buffer[131] << 8) | buffer[132];
+struct IoLogPolicy : PolicyBase {
+  __force_inline static bool should_log(uint8_t type, uint32_t) {
+    return type >= LOG_IO_RD;
+  }
+};
 
-      if (crc_calc == crc_remote) {
-        // Block is good, copy data, but prevent buffer overflow.
-        if (total_bytes + 128 > max_len) {
-          printf("Error: XMODEM data exceeds max_len. Aborting.\n");
-          stdio_set_translate_crlf(&stdio_usb, true);
-          _outbyte(CAN);
-          _outbyte(CAN);
-          return false;
-        }
-        memcpy(&dest[total_bytes], &buffer[3], 128);
-        total_bytes += 128;
-        block_num++;
-        retries = 0;
-        _outbyte(ACK);
-        // Correctly handled packet, now wait for EOT or next SOH
-      } else {
-        // CRC error
-        _outbyte(NAK);
-        retries++;
-        goto receive_loop_start_sync;
-      }
-    } else if (buffer[1] == (uint8_t)(block_num - 1)) {
-      // This is a re-sent packet of the one we just processed. ACK it and move
-      // on.
-      _outbyte(ACK);
-      retries = 0;
-    } else {
-      // Block number mismatch
-      _outbyte(NAK);
-      retries++;
-      goto receive_loop_start_sync;
-    }
+struct ComLogPolicy : PolicyBase {
+  __force_inline static bool should_log(uint8_t type, uint32_t addr) {
+    return type >= LOG_IO_RD && addr == trace_com_port;
+  }
+};
 
-    // 4. Check for EOT or next SOH
-    c = _inbyte(2000);
-    if (c == EOT) {
-      _outbyte(ACK);
-      printf("\nTransfer complete. Received %d bytes.\n", total_bytes);
-      // Recommended to wait a moment and eat any duplicate EOTs
-      sleep_ms(500);
-      while (_inbyte(100) >= 0)
-        ;
-      stdio_set_translate_crlf(&stdio_usb, true);
+// A logging mode narrowed down by trace_filter's rules and trigger.
+template <class Base> struct FilterPolicy : Base {
+  static constexpr bool kTriggers = true;
+  __force_inline static bool should_log(uint8_t type, uint32_t addr) {
+    if (!Base::should_log(type, addr))
+      return false;
+    if (trace_filter.rules == 0)
       return true;
-    } else if (c == SOH) {
-      // Next block starts, loop continues and will process it
-      continue;
-    } else if (c < 0) {
-      // Timeout waiting for EOT or SOH, ask for re-send
-      _outbyte(NAK);
-      retries++;
+    for (uint32_t i = 0; i < trace_filter.rules; i++) {
+      const TraceRule &r = trace_filter.rule[i];
+      if ((r.types >> (type - 1)) & 1 && addr >= r.lo && addr <= r.hi)
+        return true;
     }
-
-  receive_loop_start_sync:
-    // This is a recovery point. We lost sync, so wait for a fresh SOH.
-    while (true) {
-      c = _inbyte(1000);
-      if (c == SOH) {
-        goto receive_loop;
-      } else if (c < 0) {
-        _outbyte(NAK);
-        break; // Break from inner while to outer while to check retries
-      }
+    return false;
+  }
+  __force_inline static bool trigger_hit(uint8_t type, uint32_t addr,
+                                         int bus_cycles) {
+    if (trace_filter.trig == TRIG_CYCLES)
+      return (uint32_t)bus_cycles >= trace_filter.trig_arg;
+    return addr == trace_filter.trig_arg &&
+           ((trace_filter.trig_types >> (type - 1)) & 1);
+  }
+};
+
+// HIDOS VM: port 0x86 passes a request to core0 (vmio()), port 0x88 reads
+// back whether it is still being served (see "Request handoff"), port 0x8A
+// takes the registers of a snapshot capture. Runs until reset.
+struct HidosPolicy : NoLogPolicy {
+  static constexpr bool kBounded = false;
+  __force_inline static bool io_read(uint32_t addr, uint16_t &data) {
+    if (addr != 0x88)
+      return false;
+    if (io_running && (sio_hw->fifo_st & SIO_FIFO_ST_VLD_BITS)) {
+      (void)sio_hw->fifo_rd; // Completion token from hidos_host()
+      io_running = 0;
+    }
+    data = io_running;
+    return true;
+  }
+  __force_inline static void io_write(uint32_t addr, uint16_t data) {
+    if (addr == SNAP_PORT) {
+      if (snap_reg_count < count_of(snap_regs))
+        snap_regs[snap_reg_count++] = data;
+      return;
+    }
+    if (addr != 0x86 || io_running)
+      return; // One request in flight; VM_IO.SYS polls 88h before the next
+    io_running = 1;
+    sio_hw->fifo_wr = data;
+    __sev();
+  }
+};
+
+// HIDOS VM streaming its bus cycles ('h stream'). The logging mode is read
+// from hidos_logging, so one loop serves all of them.
+struct HidosLogPolicy : HidosPolicy {
+  static constexpr bool kLogs = true;
+  __force_inline static bool should_log(uint8_t type, uint32_t addr) {
+    if (hidos_logging == FULL_LOG)
+      return true;
+    return type >= LOG_IO_RD &&
+           (hidos_logging == IO_LOG || addr == trace_com_port);
+  }
+};
+
+// Adds the sampling profiler to a policy without logging.
+template <class Base> struct ProfilePolicy : Base {
+  static constexpr bool kProfile = true;
+};
+
+/**
+ * @brief watch_mapで印の付いたグラニュールへのアクセスを、各ウォッチ
+ * ポイントと照合します (Core 1)。
+ * @param c 完了したバスサイクル
+ * @param write 書き込みサイクルの場合true
+ * @param bus_cycles これまでのバスサイクル数
+ * @return ウォッチポイントに一致した場合true (watch_hitに記録します)
+ */
+bool CORE1_FUNC(watch_check)(const BusCycle &c, bool write,
+                             int bus_cycles) {
+  uint32_t lo = map_address(c.addr);
+  uint32_t hi = (c.bhe_low && !(c.addr & 1)) ? lo + 1 : lo; // Word access
+  uint8_t type = write ? WATCH_WRITE : WATCH_READ;
+  for (uint32_t i = 0; i < watch_count; i++) {
+    const Watchpoint &w = watch[i];
+    if ((w.types & type) && lo <= w.hi && hi >= w.lo) {
+      watch_hit = {c.addr, c.data, (uint8_t)(write ? LOG_MEM_WR : LOG_MEM_RD),
+                   (uint8_t)i, (uint32_t)bus_cycles};
+      return true;
     }
   }
-  // If we fall through the main while loop, it's due to retries or max_len
-  // exceeded without EOT.
-  _outbyte(CAN);
-  _outbyte(CAN); // Abort transfer
-  stdio_set_translate_crlf(&stdio_usb, true);
   return false;
 }
 
 /**
- * @brief XMODEM-CRCプロトコルを使用してデータを送信します。
- * @param src 送信するデータが格納されたバッファ
- * @param len 送信するデータのバイト数
- * @return なし
+ * @brief V30を起動し、バスサイクルを処理し続けます (Core 1)。
+ * 停止要求、サイクル数の上限、ログ満杯、バスのタイムアウトで終了します。
+ * @tparam Bus バスの入出力方式 (SioBus / PioBus)
+ * @tparam Policy ログ取得とI/Oポートの処理方針
+ * @param logged_cycles 記録したログ件数を格納する変数へのポインタ
+ * @return 実行したバスサイクル数
  */
-bool xmodem_send(uint8_t *src, int len) {
-  printf("Ready to SEND XMODEM...\n");
-  fflush(stdout);
-  stdio_set_translate_crlf(&stdio_usb, false);
-  int c;
-  int retries;
+template <class Bus, class Policy>
+int CORE1_FUNC(bus_engine_loop)(int *logged_cycles) {
+  Bus bus;
+  bus.start();
+  gpio_put(PIN_RESET, 1);
+  sleep_ms(1);
+  gpio_put(PIN_RESET, 0);
 
-  // 1. Initial Handshake - wait for a single 'C' to start
-  for (retries = 0; retries < 10; retries++) {
-    c = _inbyte(10000);
-    if (c != 'C') {
-      printf("XMODEM Send: Handshake failed. Expected 'C', got 0x%02X\n", c);
-      fflush(stdout);
-      _outbyte(CAN);
-      _outbyte(CAN);
-      continue;
+  int bus_cycles = 0;
+  int logged = 0;
+  uint8_t end;
+  while (true) {
+    // --- Unified Termination Conditions ---
+    if (stop_request) {
+      end = RUN_END_STOP;
+      break;
+    }
+    if (Policy::kBounded && bus_cycles >= cycle_limit) {
+      end = RUN_END_LIMIT;
+      break;
+    }
+    if (Policy::kLogs && trace_full(logged)) {
+      end = RUN_END_LOG_FULL;
+      break;
     }
-    break;
-  }
 
-  // 2. Handle 0-byte file transfer
-  if (len == 0) {
-    _outbyte(EOT);
-    _inbyte(2000); // Consume ACK
-    stdio_set_translate_crlf(&stdio_usb, true);
-    printf("XMODEM Send: 0-byte transfer complete.\n");
-    fflush(stdout);
-    return true;
-  }
+    BusCycle c;
+    if (!bus.wait_address(c)) {
+      bus_end_pending = !console_quiet;
+      end = RUN_END_NO_ALE;
+      bus_stats.timeout_ale++;
+      break;
+    }
+    BusStrobe strobe = bus.wait_strobe(c);
+#if V30_RD_TIMING
+    uint32_t rd_t0 = systick_hw->cvr; // RD# just seen (unused for writes)
+#endif
+    if (strobe == STROBE_TIMEOUT) {
+      bus_end_pending = !console_quiet;
+      end = RUN_END_NO_STROBE;
+      bus_stats.timeout_strobe++;
+      break;
+    }
+    if (strobe == STROBE_RESYNC) {
+      bus_end_pending = !console_quiet;
+      end = RUN_END_RESYNC;
+      bus_stats.resync++;
+      break;
+    }
 
-  // 3. Main data transfer loop
-  uint8_t packetno = 1;
-  for (int sent_len = 0; sent_len < len;) {
-    retries = 0;
-    while (retries < 10) {
-      // 3.1 Send packet
-      _outbyte(SOH);
-      _outbyte(packetno);
-      _outbyte(~packetno);
-
-      uint8_t buff[128];
-      memset(buff, 0x1A, 128); // Pad
-      int bytes_to_copy = (len - sent_len) > 128 ? 128 : (len - sent_len);
-      if (bytes_to_copy > 0) {
-        memcpy(buff, &src[sent_len], bytes_to_copy);
+    uint32_t addr = c.addr;
+    // Only the lookup goes before answer_read(): the turnaround wait starts
+    // there, so everything else waits until the data is on the bus.
+    if (strobe == STROBE_READ) {
+      uint16_t out_data = 0xFFFF;
+      if (!c.is_io) {
+        // Always read the word-aligned data. The CPU will select the correct
+        // byte (or word) based on A0 and BHE#. A word never crosses a page.
+        const MemPage &pg = mem_map[addr >> MEM_PAGE_SHIFT];
+        uint32_t off = addr & (MEM_PAGE_SIZE - 2);
+        if (pg.rd)
+          out_data = pg.rd[off] | (pg.rd[off + 1] << 8);
+        else
+          out_data =
+              mem_handlers[mem_page_handler[addr >> MEM_PAGE_SHIFT]].read(
+                  addr & ~1);
+      } else {
+        Policy::io_read(addr, out_data);
       }
-      for (int i = 0; i < 128; i++)
-        _outbyte(buff[i]);
-
-      uint16_t crc = crc16_ccitt(buff, 128);
-      _outbyte(crc >> 8);
-      _outbyte(crc & 0xFF);
-
-      // 3.2 Wait for ACK
-      c = _inbyte(5000);
-      if (c == ACK) {
-        break; // Success
+      bus.answer_read(out_data);
+      bus_stats.cycles[c.is_io ? 2 : 0]++;
+      if (!c.is_io)
+        bus_stats.last_read = addr;
+#if V30_RD_TIMING
+      uint32_t rd_ticks = (rd_t0 - bus.rd_driven) & 0xFFFFFF; // Counts down
+      if (rd_ticks > bus_stats.rd_worst_ticks)
+        bus_stats.rd_worst_ticks = rd_ticks;
+#endif
+      c.data = out_data;
+      if (Policy::kProfile && !c.is_io && --prof_countdown == 0) {
+        prof_countdown = prof_period;
+        uint32_t b = map_address(addr) >> prof_shift;
+        if (prof_hist[b] != 0xFFFF)
+          prof_hist[b]++;
+        prof_samples++;
       }
-      // On NAK or timeout, retry
-      retries++;
+    } else {
+      uint16_t in_data = c.data;
+      if (!c.is_io) {
+        const MemPage &pg = mem_map[addr >> MEM_PAGE_SHIFT];
+        uint8_t *w = pg.wr ? pg.wr + (addr & (MEM_PAGE_SIZE - 1)) : nullptr;
+        bool a0_low = !(addr & 1);
+        if (!w) {
+          if (!pg.rd) // Read-only pages drop the write
+            mem_handlers[mem_page_handler[addr >> MEM_PAGE_SHIFT]].write(
+                addr, in_data, c.bhe_low);
+        } else if (c.bhe_low && a0_low) { // Word Write to even address
+          w[0] = in_data & 0xFF;
+          w[1] = in_data >> 8; // Never crosses a dirty page
+        } else if (c.bhe_low && !a0_low) { // High Byte Write to odd address
+          w[0] = in_data >> 8;
+        } else if (!c.bhe_low && a0_low) { // Low Byte Write to even address
+          w[0] = in_data & 0xFF;
+        }
+        // For invalid case (BHE high, A0 high), nothing is written.
+        if (w)
+          ram_dirty[(w - ram) >> DIRTY_PAGE_SHIFT] = 1;
+      } else {
+        Policy::io_write(addr, in_data);
+      }
+      bus_stats.cycles[c.is_io ? 3 : 1]++;
     }
 
-    if (retries >= 10) {
-      _outbyte(CAN);
-      _outbyte(CAN);
-      stdio_set_translate_crlf(&stdio_usb, true);
-      printf("XMODEM Send: Failed to get ACK for packet %d\n", packetno);
-      fflush(stdout);
-      return false;
+    if (Policy::kLogs) {
+      uint8_t type = strobe == STROBE_READ
+                         ? (c.is_io ? LOG_IO_RD : LOG_MEM_RD)
+                         : (c.is_io ? LOG_IO_WR : LOG_MEM_WR);
+      if (Policy::kTriggers && tw.mode == TW_ARMED &&
+          Policy::trigger_hit(type, addr, bus_cycles))
+        trace_trigger(logged);
+      if (Policy::should_log(type, addr))
+        trace_put({addr, c.data, type, (uint8_t)(c.bhe_low ? 1 : 0)}, logged);
+    }
+    if (!c.is_io) {
+      uint32_t g = map_address(addr) >> WATCH_GRANULE_SHIFT;
+      if (((watch_map[g / 32] >> (g % 32)) & 1) &&
+          watch_check(c, strobe == STROBE_WRITE, bus_cycles)) {
+        bus_cycles++;
+        if (!console_quiet)
+          watch_hit_pending = true;
+        end = RUN_END_WATCH;
+        break;
+      }
     }
+    bus_cycles++;
+  }
 
-    // 3.3 Increment for next packet
-    sent_len += 128;
-    packetno++;
+  bus.stop();
+  run_end_reason = end;
+  *logged_cycles = logged;
+  return bus_cycles;
+}
+
+/**
+ * @brief 選択中のバスエンジンとログ取得モードに対応する
+ * bus_engine_loop()の特殊化を呼び出します。
+ * @tparam Bus バスの入出力方式
+ * @param logging_mode ログ取得モード
+ * @param hidos trueの場合、HIDOS VMとして実行します
+ * @param logged_cycles 記録したログ件数を格納する変数へのポインタ
+ * @return 実行したバスサイクル数
+ */
+template <class Bus>
+int CORE1_FUNC(run_bus_with)(LoggingMode logging_mode, bool hidos,
+                             int *logged_cycles) {
+  bool profile = prof_period != 0;
+  if (hidos && logging_mode != NO_LOG)
+    return bus_engine_loop<Bus, FilterPolicy<HidosLogPolicy>>(logged_cycles);
+  if (hidos)
+    return profile
+               ? bus_engine_loop<Bus, ProfilePolicy<HidosPolicy>>(logged_cycles)
+               : bus_engine_loop<Bus, HidosPolicy>(logged_cycles);
+  // Unfiltered runs keep the lean loops without the rule checks
+  bool filtered = trace_filter.rules != 0 || trace_filter.trig != TRIG_NONE;
+  switch (logging_mode) {
+  case FULL_LOG:
+    return filtered
+               ? bus_engine_loop<Bus, FilterPolicy<FullLogPolicy>>(logged_cycles)
+               : bus_engine_loop<Bus, FullLogPolicy>(logged_cycles);
+  case IO_LOG:
+    return filtered
+               ? bus_engine_loop<Bus, FilterPolicy<IoLogPolicy>>(logged_cycles)
+               : bus_engine_loop<Bus, IoLogPolicy>(logged_cycles);
+  case COM_LOG:
+    return filtered
+               ? bus_engine_loop<Bus, FilterPolicy<ComLogPolicy>>(logged_cycles)
+               : bus_engine_loop<Bus, ComLogPolicy>(logged_cycles);
+  default:
+    return profile
+               ? bus_engine_loop<Bus, ProfilePolicy<NoLogPolicy>>(logged_cycles)
+               : bus_engine_loop<Bus, NoLogPolicy>(logged_cycles);
   }
+}
 
-  // 4. End of Transmission
-  retries = 0;
-  while (retries < 10) {
-    _outbyte(EOT);
-    c = _inbyte(2000);
-    if (c == ACK) {
-      stdio_set_translate_crlf(&stdio_usb, true);
-      printf("\nSend complete.\n");
-      fflush(stdout);
-      return true;
+/**
+ * @brief V30を実行します (Core 1)。
+ * @param logging_mode ログ取得モード
+ * @param hidos trueの場合、HIDOS VMとして実行します
+ * @param logged_cycles 記録したログ件数を格納する変数へのポインタ
+ * @return 実行したバスサイクル数
+ */
+int CORE1_FUNC(run_bus_engine)(LoggingMode logging_mode, bool hidos,
+                               int *logged_cycles) {
+  if (bus_engine == BUS_ENGINE_PIO)
+    return run_bus_with<PioBus>(logging_mode, hidos, logged_cycles);
+  return run_bus_with<SioBus>(logging_mode, hidos, logged_cycles);
+}
+
+bool snap_capture(uint16_t request);
+void hidos_monitor_command(char *line);
+bool trace_stream_send();
+
+/**
+ * @brief 'h stream'の間、溜まったトレースのブロックをモニタ側のCDCへ送り、
+ * そこからの任意の1バイトでVMを停止します ('ts'と同じ)。
+ * @param なし
+ * @return なし
+ */
+void hidos_stream_poll() {
+  while (trace_stream_send())
+    con_service(); // Frames take a while, keep the console moving
+  if (getchar_timeout_us(0) != PICO_ERROR_TIMEOUT)
+    stop_request = true;
+}
+
+/**
+ * @brief HIDOSのコンソールが別のCDCにある間、モニタ側で状態を見るだけの
+ * コマンドを受け付けます (hidos_host()の待ち時間に呼びます)。
+ * @param なし
+ * @return なし
+ */
+void hidos_monitor_poll() {
+  static char line[64];
+  static uint32_t len = 0;
+  if (console_itf() == USB_ITF_MONITOR)
+    return; // The console has the monitor port
+  int c;
+  while ((c = getchar_timeout_us(0)) != PICO_ERROR_TIMEOUT) {
+    usb_stats.bytes_in++;
+    if (c == CON_EXIT_KEY) {
+      stop_request = true;
+    } else if (c == '\r' || c == '\n') {
+      line[len] = 0;
+      len = 0;
+      printf("\n");
+      hidos_monitor_command(line);
+      printf("hidos> ");
+    } else if ((c == '\b' || c == 0x7F) && len > 0) {
+      len--;
+      printf("\b \b");
+    } else if (isprint(c) && len < sizeof(line) - 1) {
+      line[len++] = (char)c;
+      putchar(c);
     }
-    retries++;
   }
+}
 
-  stdio_set_translate_crlf(&stdio_usb, true);
-  printf("XMODEM Send: Failed to get final ACK for EOT.\n");
-  fflush(stdout);
-  return false;
+// Run in core0. Returns when core1 reports that the VM has stopped.
+// pending: request of a resumed snapshot that is served first (-1: none).
+void hidos_host(uint8_t loglevel, int32_t pending) {
+  hidos_loglevel = loglevel;
+  while(true){
+    // Sleeps in WFE until core1 rings the doorbell, waking every
+    // CON_FLUSH_US to push out console output and read ahead input.
+    uint32_t value;
+    if (pending >= 0) {
+      value = pending;
+      pending = -1;
+    } else {
+      uint32_t wait_us = trace_stream_enabled ? STREAM_POLL_US : CON_FLUSH_US;
+      while (!multicore_fifo_pop_timeout_us(wait_us, &value)) {
+        con_service();
+        if (trace_stream_enabled)
+          hidos_stream_poll();
+        else
+          hidos_monitor_poll();
+      }
+    }
+    if (value == HIDOS_EXIT_TOKEN) {
+      con_flush();
+      return;
+    }
+    // The V30 spins in the 88h poll loop while DOS waits for the console:
+    // a quiescent point to capture the machine at.
+    if (snap_request && trace_stream_enabled)
+      snap_request = false; // Resuming restarts core1's half of the stream
+    if (snap_request && memr2((value << 4) + IODEV) == ('C' << 8 | 'O')) {
+      snap_request = false;
+      snap_capture(value);
+    }
+
+    uint32_t t_start = time_us_32();
+    VmioDev dev = vmio(value);
+    // A disk read may still be copying into ram[] in the background.
+    while (!disk_dma_poll())
+      con_service();
+
+    __dmb(); // ram[] updates by vmio() before the completion token
+    multicore_fifo_push_blocking(1);
+    vmio_stats_add(dev, time_us_32() - t_start);
+  }
 }
 
 // ==========================================
-//   Monitor Commands
+//   XMODEM Implementation (Simple)
 // ==========================================
 /**
- * @brief 'k'
- * コマンドを処理します。リンクされた boot.img の内容をRAMの先頭にロードします。
- * @param arg_str コマンドの引数文字列 (未使用)
- * @return なし
+ * @brief
+ * XMODEM転送のために、タイムアウト付きで1バイトを標準入力から読み取ります。
+ * @param timeout タイムアウト時間 (ミリ秒)
+ * @return 読み取った文字。タイムアウトした場合は負数。
  */
-void cmd_load_boot(const char *arg_str) {
-    const size_t boot_img_size = (size_t)(_binary_boot_img_end - _binary_boot_img_start);
-    if (boot_img_size > RAM_SIZE) {
-        printf("Error: boot.img size (%u) is larger than RAM size (%u).\n", (unsigned int)boot_img_size, (unsigned int)RAM_SIZE);
-        return;
-    }
-    memcpy(ram, _binary_boot_img_start, boot_img_size);
-    printf("Loaded boot.img (%u bytes) into RAM at address 0x00000.\n", (unsigned int)boot_img_size);
+int _inbyte(unsigned int timeout) {
+  int c = getchar_timeout_us(timeout * 1000);
+  if (c >= 0)
+    usb_stats.bytes_in++;
+  return c;
 }
 
 /**
- * @brief 'd' (dump)
- * コマンドを処理します。指定されたアドレスからメモリの内容を16進数とASCIIで表示します。
- * @param arg_str コマンドの引数文字列 (アドレスと長さ)
+ * @brief XMODEM転送のために、1バイトを標準出力に書き込みます。
+ * @param c 書き込む文字
  * @return なし
  */
-void cmd_dump(const char *arg_str) {
-  char args[128];
-  strncpy(args, arg_str, sizeof(args) - 1);
-  args[sizeof(args) - 1] = 0;
-  char *addr_str = strtok(args, " ");
-  char *len_str = strtok(NULL, " ");
-  uint32_t addr = addr_str ? strtol(addr_str, NULL, 16) : 0;
-  int len = len_str ? strtol(len_str, NULL, 10) : 256;
+void _outbyte(int c) {
+  putchar(c);
+  fflush(stdout);
+  usb_stats.bytes_out++;
+}
 
-  for (int i = 0; i < len; i += 16) {
-    printf("%05lX: ", addr + i);
-    for (int j = 0; j < 16; j++)
-      printf(i + j < len ? "%02X " : "   ", ram[map_address(addr + i + j)]);
-    printf("|");
-    for (int j = 0; j < 16; j++)
-      putchar(i + j < len && isprint(ram[map_address(addr + i + j)])
-                  ? ram[map_address(addr + i + j)]
-                  : '.');
-    printf("|\n");
+// --- CRC-16-CCITT (XMODEM: poly 0x1021, init 0, not reflected) ---
+// crc16_ccitt() uses the DMA sniffer for blocks of CRC_DMA_MIN_LEN bytes and
+// more when crc16_init() found it to agree with the table, and the 256-entry
+// table otherwise.
+struct Crc16Table {
+  uint16_t v[256];
+  constexpr Crc16Table() : v() {
+    for (int n = 0; n < 256; n++) {
+      uint16_t crc = n << 8;
+      for (int i = 0; i < 8; ++i)
+        crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+      v[n] = crc;
+    }
   }
+};
+static constexpr Crc16Table crc16_tab;
+
+static int crc_dma_chan = -1; // -1: sniffer not used
+
+/**
+ * @brief テーブルを使ってCRC-16-CCITTを計算します。
+ * @param buf データバッファへのポインタ
+ * @param len データの長さ (バイト)
+ * @param crc 初期値 (分割したデータでは前の部分のCRC)
+ * @return 計算された16ビットのCRC値
+ */
+uint16_t crc16_table(const uint8_t *buf, int len, uint16_t crc = 0) {
+  while (len--)
+    crc = (crc << 8) ^ crc16_tab.v[(crc >> 8) ^ *buf++];
+  return crc;
 }
 
 /**
- * @brief 'e' (edit)
- * コマンドを処理します。指定されたアドレスのメモリの内容を書き換えます。
- * @param arg_str コマンドの引数文字列 (アドレスと書き込むデータ)
+ * @brief DMAスニファでCRC-16-CCITTを計算します。
+ * データはダミーの宛先へ転送され、通過したバイトからCRCが求まります。
+ * @param buf データバッファへのポインタ
+ * @param len データの長さ (バイト)
+ * @return 計算された16ビットのCRC値
+ */
+uint16_t crc16_dma(const uint8_t *buf, int len) {
+  static volatile uint8_t sink;
+  dma_channel_config c = dma_channel_get_default_config(crc_dma_chan);
+  channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+  channel_config_set_read_increment(&c, true);
+  channel_config_set_write_increment(&c, false);
+  channel_config_set_sniff_enable(&c, true);
+  dma_hw->sniff_data = 0;
+  dma_sniffer_enable(crc_dma_chan, DMA_SNIFF_CTRL_CALC_VALUE_CRC16, true);
+  dma_channel_configure(crc_dma_chan, &c, &sink, buf, len, true);
+  dma_channel_wait_for_finish_blocking(crc_dma_chan);
+  dma_sniffer_disable();
+  return dma_hw->sniff_data & 0xFFFF;
+}
+
+/**
+ * @brief CRC計算にDMAスニファを使えるか確認します。
+ * 既知のデータでテーブル版と結果が一致した場合だけ使用します。
+ * @param なし
  * @return なし
  */
-void cmd_edit(const char *arg_str) {
-  char args[128];
-  strncpy(args, arg_str, sizeof(args) - 1);
-  args[sizeof(args) - 1] = 0;
-  char *addr_str = strtok(args, " ");
-  if (!addr_str) {
-    printf("Usage: e <addr> <val> ...\n");
+void crc16_init() {
+  static_assert(crc16_tab.v[1] == 0x1021, "CRC table generation");
+  int chan = dma_claim_unused_channel(false);
+  if (chan < 0)
     return;
+  crc_dma_chan = chan;
+  static const uint8_t probe[] = "123456789";
+  if (crc16_dma(probe, 9) != 0x31C3 || crc16_table(probe, 9) != 0x31C3) {
+    dma_channel_unclaim(chan);
+    crc_dma_chan = -1;
   }
-  uint32_t addr = strtol(addr_str, NULL, 16);
-  char *val_str;
-  while ((val_str = strtok(NULL, " ")) != NULL) {
-    ram[map_address(addr++)] = (uint8_t)strtol(val_str, NULL, 16);
+}
+
+/**
+ * @brief データバッファのCRC-16-CCITTチェックサムを計算します。
+ * @param buf データバッファへのポインタ
+ * @param len データの長さ (バイト)
+ * @return 計算された16ビットのCRC値
+ */
+uint16_t crc16_ccitt(const uint8_t *buf, int len) {
+  if (crc_dma_chan >= 0 && len >= CRC_DMA_MIN_LEN)
+    return crc16_dma(buf, len);
+  return crc16_table(buf, len);
+}
+
+// --- Packed Transfers ---
+// With the "rle" option the transfer carries the data PackBits compressed,
+// in the token format of the HIDOS snapshot:
+//   "V30P" size:u32 tokens...
+// size is the unpacked length, so the XMODEM padding after the last token is
+// ignored. XMODEM and the raw bulk protocol are unchanged and check the
+// packed bytes. Neither end holds the packed stream: XferSource packs as the
+// frames are filled, XferSink unpacks each received block into the
+// destination.
+
+/**
+ * @brief PackBitsのトークンを1つ作ります。
+ * 制御バイト0-127はその数+1バイトのリテラル、129-255は次の1バイトの
+ * 257-n回の繰り返しです。3バイト以上の連続を繰り返しにします。
+ * @param src 圧縮するデータ
+ * @param len 残りのバイト数 (1以上)
+ * @param tok トークンの格納先 (PACK_TOKEN_MAXバイト)
+ * @param tok_len トークンのバイト数を返します
+ * @return 消費した入力のバイト数
+ */
+uint32_t pack_token(const uint8_t *src, uint32_t len, uint8_t *tok,
+                    int *tok_len) {
+  uint32_t run = 1;
+  while (run < len && run < 128 && src[run] == src[0])
+    run++;
+  if (run >= 3) {
+    tok[0] = 257 - run;
+    tok[1] = src[0];
+    *tok_len = 2;
+    return run;
   }
-  printf("Updated.\n");
+  // Literal bytes up to the next run of three
+  uint32_t n = 0;
+  while (n < len && n < 128 &&
+         !(n + 2 < len && src[n] == src[n + 1] && src[n] == src[n + 2]))
+    n++;
+  tok[0] = n - 1;
+  memcpy(&tok[1], src, n);
+  *tok_len = n + 1;
+  return n;
 }
 
+// Data to send, as is or packed on the fly
+struct XferSource {
+  const uint8_t *src;
+  uint32_t len;
+  uint32_t pos; // Next input byte
+  bool packed;
+  uint8_t tok[PACK_TOKEN_MAX]; // Token being sent (the header first)
+  int tok_len;
+  int tok_pos;
+};
+
 /**
- * @brief 'f' (fill)
- * コマンドを処理します。指定されたバイト値でメモリ全体を埋めます。
- * @param arg_str コマンドの引数文字列 (16進数のバイト値)
+ * @brief 送信データを先頭に戻します (再送の前にも呼びます)。
+ * @param s 送信データ
  * @return なし
  */
-void cmd_fill(const char *arg_str) {
-  uint8_t fill_val = 0xF4; // Default to HLT
-  if (arg_str && strlen(arg_str) > 0) {
-    fill_val = (uint8_t)strtol(arg_str, NULL, 16);
+void xfer_source_rewind(XferSource &s) {
+  s.pos = 0;
+  s.tok_pos = 0;
+  s.tok_len = 0;
+  if (s.packed) {
+    memcpy(s.tok, PACK_MAGIC, 4);
+    memcpy(&s.tok[4], &s.len, 4);
+    s.tok_len = PACK_HEADER_SIZE;
   }
-  memset(ram, fill_val, RAM_SIZE);
-  printf("Memory filled with 0x%02X.\n", fill_val);
 }
 
-// --- Assembler/Disassembler ---
-const char *const reg_names[] = {"ax", "cx", "dx", "bx",
-                                 "sp", "bp", "si", "di"};
-const char *const reg_names8[] = {"al", "cl", "dl", "bl",
-                                  "ah", "ch", "dh", "bh"};
+/**
+ * @brief 送信データを準備します。
+ * @param s 送信データ
+ * @param src 送信するデータ
+ * @param len 送信するデータのバイト数
+ * @param packed trueの場合、PackBitsで圧縮して送信します
+ * @return なし
+ */
+void xfer_source_init(XferSource &s, const uint8_t *src, uint32_t len,
+                      bool packed) {
+  s.src = src;
+  s.len = len;
+  s.packed = packed;
+  xfer_source_rewind(s);
+}
+
+/**
+ * @brief 送信データの続きを取り出します。
+ * @param s 送信データ
+ * @param dst 格納先
+ * @param n 取り出す最大バイト数
+ * @return 取り出したバイト数 (0で終わり)
+ */
+int xfer_source_read(XferSource &s, uint8_t *dst, int n) {
+  if (!s.packed) {
+    uint32_t k = s.len - s.pos < (uint32_t)n ? s.len - s.pos : n;
+    memcpy(dst, &s.src[s.pos], k);
+    s.pos += k;
+    return k;
+  }
+  int got = 0;
+  while (got < n) {
+    if (s.tok_pos == s.tok_len) {
+      if (s.pos == s.len)
+        break;
+      s.pos += pack_token(&s.src[s.pos], s.len - s.pos, s.tok, &s.tok_len);
+      s.tok_pos = 0;
+    }
+    int k = s.tok_len - s.tok_pos < n - got ? s.tok_len - s.tok_pos : n - got;
+    memcpy(&dst[got], &s.tok[s.tok_pos], k);
+    s.tok_pos += k;
+    got += k;
+  }
+  return got;
+}
+
+/**
+ * @brief 回線に流れるバイト数とそのCRCを求めます。
+ * 圧縮する場合は一度すべて圧縮してみて数えます。
+ * @param s 送信データ (先頭に戻ります)
+ * @param crc CRC-16-CCITTを返します (nullptrなら求めません)
+ * @return 回線に流れるバイト数
+ */
+uint32_t xfer_source_measure(XferSource &s, uint16_t *crc) {
+  if (!s.packed) {
+    if (crc)
+      *crc = crc16_ccitt(s.src, s.len);
+    return s.len;
+  }
+  uint8_t chunk[256];
+  uint32_t total = 0;
+  uint16_t c = 0;
+  int n;
+  while ((n = xfer_source_read(s, chunk, sizeof(chunk))) > 0) {
+    if (crc)
+      c = crc16_table(chunk, n, c);
+    total += n;
+  }
+  xfer_source_rewind(s);
+  if (crc)
+    *crc = c;
+  return total;
+}
+
+// Where received data goes, as is or unpacked on the fly
+struct XferSink {
+  uint8_t *dest;
+  uint32_t max_len;
+  uint32_t len; // Bytes written to dest
+  bool packed;
+  bool bad;       // Overflow or not a packed stream
+  uint8_t hdr[PACK_HEADER_SIZE];
+  int hdr_len;
+  uint32_t size;  // Unpacked length from the header
+  uint32_t lit;   // Literal bytes still to copy
+  uint32_t rep;   // Non-zero: the next byte is repeated this many times
+};
+
+/**
+ * @brief 受信先を空にします (再送の前にも呼びます)。
+ * @param s 受信先
+ * @return なし
+ */
+void xfer_sink_reset(XferSink &s) {
+  s.len = 0;
+  s.bad = false;
+  s.hdr_len = 0;
+  s.size = 0;
+  s.lit = 0;
+  s.rep = 0;
+}
+
+/**
+ * @brief 受信先を準備します。
+ * @param s 受信先
+ * @param dest 受信したデータを格納するバッファ
+ * @param max_len 受信可能な最大バイト数
+ * @param packed trueの場合、PackBitsの圧縮データとして展開します
+ * @return なし
+ */
+void xfer_sink_init(XferSink &s, uint8_t *dest, uint32_t max_len,
+                    bool packed) {
+  s.dest = dest;
+  s.max_len = max_len;
+  s.packed = packed;
+  xfer_sink_reset(s);
+}
+
+/**
+ * @brief 受信したバイト列を受信先に渡します。
+ * @param s 受信先
+ * @param p 受信したデータ
+ * @param n バイト数
+ * @return 受け付けた場合true、溢れたか圧縮データが壊れている場合false
+ */
+bool xfer_sink_write(XferSink &s, const uint8_t *p, uint32_t n) {
+  if (!s.packed) {
+    if (n > s.max_len - s.len) {
+      s.bad = true;
+      return false;
+    }
+    memcpy(&s.dest[s.len], p, n);
+    s.len += n;
+    return true;
+  }
+  while (n > 0 && !s.bad) {
+    if (s.hdr_len < PACK_HEADER_SIZE) {
+      s.hdr[s.hdr_len++] = *p++;
+      n--;
+      if (s.hdr_len == PACK_HEADER_SIZE) {
+        memcpy(&s.size, &s.hdr[4], 4);
+        s.bad = memcmp(s.hdr, PACK_MAGIC, 4) != 0 || s.size > s.max_len;
+      }
+    } else if (s.len == s.size && s.lit == 0 && s.rep == 0) {
+      break; // XMODEM padding after the last token
+    } else if (s.lit > 0) {
+      uint32_t k = s.lit < n ? s.lit : n;
+      if (k > s.size - s.len) {
+        s.bad = true;
+        break;
+      }
+      memcpy(&s.dest[s.len], p, k);
+      s.len += k;
+      s.lit -= k;
+      p += k;
+      n -= k;
+    } else if (s.rep > 0) {
+      if (s.rep > s.size - s.len) {
+        s.bad = true;
+        break;
+      }
+      memset(&s.dest[s.len], *p, s.rep);
+      s.len += s.rep;
+      s.rep = 0;
+      p++;
+      n--;
+    } else {
+      uint8_t c = *p++;
+      n--;
+      if (c < 128)
+        s.lit = c + 1;
+      else if (c > 128)
+        s.rep = 257 - c;
+    }
+  }
+  return !s.bad;
+}
+
+/**
+ * @brief 受信したデータが揃ったか確認します。
+ * @param s 受信先
+ * @return 溢れずに受信でき、圧縮データはヘッダの長さまで展開できた場合
+ * true
+ */
+bool xfer_sink_done(const XferSink &s) {
+  if (!s.packed)
+    return !s.bad;
+  return !s.bad && s.hdr_len == PACK_HEADER_SIZE && s.len == s.size &&
+         s.lit == 0 && s.rep == 0;
+}
+
+/**
+ * @brief XMODEM-CRCプロトコルを使用してデータを受信します。
+ * @param dest 受信したデータを格納するバッファ
+ * @param max_len 受信可能な最大バイト数
+ * @param packed trueの場合、PackBitsの圧縮データとして展開します
+ * @return 成功した場合true
+ */
+bool xmodem_receive(uint8_t *dest, int max_len, bool packed) {
+  // SOH/STX + Block# + ~Block# + Data[128 or 1024] + CRC[2]
+  uint8_t buffer[XMODEM_1K_BLOCK + 5];
+  XferSink sink;
+  xfer_sink_init(sink, dest, max_len, packed);
+  uint8_t hdr = SOH; // Header of the block being received
+  uint8_t block_num = 1;
+  int total_bytes = 0;
+  int retries = 0;
+  const int max_retries = 16;
+  int c; // Declare c at function scope to avoid goto/initialization error
+
+  printf("Ready to RECEIVE XMODEM (CRC)...\n");
+  fflush(stdout);
+  stdio_set_translate_crlf(&stdio_monitor, false);
+
+  // 1. Start transfer: Send 'C' until sender responds with SOH
+  while (retries < max_retries) {
+    _outbyte('C');
+    c = _inbyte(3000);
+    if (c == SOH || c == STX) {
+      hdr = c;
+      goto receive_loop; // First SOH received, start main loop
+    }
+    retries++;
+  }
+  printf("Error: No response from sender.\n");
+  stdio_set_translate_crlf(&stdio_monitor, true);
+  return false;
+
+receive_loop:
+  retries = 0;
+  while (retries <
+         max_retries) { // The loop should only terminate on EOT or retry limit.
+    // The first SOH was already received, or consumed at the end of the
+    // previous loop iteration.
+    // 2. Receive the rest of the block
+    int block_size = hdr == STX ? XMODEM_1K_BLOCK : 128;
+    buffer[0] = hdr;
+    for (int i = 1; i < block_size + 5; i++) {
+      c = _inbyte(1000);
+      if (c < 0) {
+        // Timeout while receiving packet data
+        while (_inbyte(50) >= 0)
+          ; // Flush
+        _outbyte(NAK);
+        retries++;
+        goto receive_loop_start_sync; // Go wait for a new SOH
+      }
+      buffer[i] = (uint8_t)c;
+    }
+
+    // 3. Validate block
+    // Check block number
+    if (buffer[1] == block_num && buffer[2] == (uint8_t)~block_num) {
+      // CRC check
+      uint16_t crc_calc = crc16_ccitt(&buffer[3], block_size);
+      uint16_t crc_remote = ((uint16_t)buffer[block_size + 3] << 8) |
+                            buffer[block_size + 4];
+
+      if (crc_calc == crc_remote) {
+        // Block is good, copy data, but prevent buffer overflow.
+        if (!xfer_sink_write(sink, &buffer[3], block_size)) {
+          _outbyte(CAN);
+          _outbyte(CAN);
+          stdio_set_translate_crlf(&stdio_monitor, true);
+          printf(packed ? "Error: Bad packed data or exceeds max_len. "
+                          "Aborting.\n"
+                        : "Error: XMODEM data exceeds max_len. Aborting.\n");
+          return false;
+        }
+        total_bytes += block_size;
+        block_num++;
+        retries = 0;
+        _outbyte(ACK);
+        // Correctly handled packet, now wait for EOT or next SOH
+      } else {
+        // CRC error
+        _outbyte(NAK);
+        retries++;
+        goto receive_loop_start_sync;
+      }
+    } else if (buffer[1] == (uint8_t)(block_num - 1)) {
+      // This is a re-sent packet of the one we just processed. ACK it and move
+      // on.
+      _outbyte(ACK);
+      retries = 0;
+    } else {
+      // Block number mismatch
+      _outbyte(NAK);
+      retries++;
+      goto receive_loop_start_sync;
+    }
+
+    // 4. Check for EOT or next SOH
+    c = _inbyte(2000);
+    if (c == EOT) {
+      _outbyte(ACK);
+      // Recommended to wait a moment and eat any duplicate EOTs
+      sleep_ms(500);
+      while (_inbyte(100) >= 0)
+        ;
+      stdio_set_translate_crlf(&stdio_monitor, true);
+      if (!xfer_sink_done(sink)) {
+        printf("\nError: Packed data ended early (%lu of %lu bytes).\n",
+               sink.len, sink.size);
+        return false;
+      }
+      if (packed)
+        printf("\nTransfer complete. Received %lu bytes (%d packed).\n",
+               sink.len, total_bytes);
+      else
+        printf("\nTransfer complete. Received %d bytes.\n", total_bytes);
+      return true;
+    } else if (c == SOH || c == STX) {
+      // Next block starts, loop continues and will process it
+      hdr = c;
+      continue;
+    } else if (c < 0) {
+      // Timeout waiting for EOT or SOH, ask for re-send
+      _outbyte(NAK);
+      retries++;
+    }
+
+  receive_loop_start_sync:
+    // This is a recovery point. We lost sync, so wait for a fresh SOH.
+    while (true) {
+      c = _inbyte(1000);
+      if (c == SOH || c == STX) {
+        hdr = c;
+        goto receive_loop;
+      } else if (c < 0) {
+        _outbyte(NAK);
+        break; // Break from inner while to outer while to check retries
+      }
+    }
+  }
+  // If we fall through the main while loop, it's due to retries or max_len
+  // exceeded without EOT.
+  _outbyte(CAN);
+  _outbyte(CAN); // Abort transfer
+  stdio_set_translate_crlf(&stdio_monitor, true);
+  return false;
+}
+
+/**
+ * @brief XMODEM-CRCプロトコルを使用してデータを送信します。
+ * @param src 送信するデータが格納されたバッファ
+ * @param len 送信するデータのバイト数
+ * @param use_1k trueの場合、1024バイトのブロック(STX)で送信します
+ * @param packed trueの場合、PackBitsで圧縮して送信します
+ * @return 成功した場合true
+ */
+bool xmodem_send(const uint8_t *src, int len, bool use_1k, bool packed) {
+  XferSource source;
+  xfer_source_init(source, src, len, packed);
+  len = xfer_source_measure(source, nullptr);
+  printf("Ready to SEND XMODEM...\n");
+  fflush(stdout);
+  stdio_set_translate_crlf(&stdio_monitor, false);
+  int c;
+  int retries;
+
+  // 1. Initial Handshake - wait for a single 'C' to start
+  for (retries = 0; retries < 10; retries++) {
+    c = _inbyte(10000);
+    if (c != 'C') {
+      printf("XMODEM Send: Handshake failed. Expected 'C', got 0x%02X\n", c);
+      fflush(stdout);
+      _outbyte(CAN);
+      _outbyte(CAN);
+      continue;
+    }
+    break;
+  }
+
+  // 2. Handle 0-byte file transfer
+  if (len == 0) {
+    _outbyte(EOT);
+    _inbyte(2000); // Consume ACK
+    stdio_set_translate_crlf(&stdio_monitor, true);
+    printf("XMODEM Send: 0-byte transfer complete.\n");
+    fflush(stdout);
+    return true;
+  }
+
+  // 3. Main data transfer loop
+  uint8_t packetno = 1;
+  int block_size = 128;
+  for (int sent_len = 0; sent_len < len;) {
+    // 1K blocks while a full one remains (less padding at the end)
+    block_size = (use_1k && len - sent_len >= XMODEM_1K_BLOCK) ? XMODEM_1K_BLOCK
+                                                               : 128;
+    // 3.1 Build the frame once, retries send it again as is
+    uint8_t frame[XMODEM_1K_BLOCK + 5];
+    uint8_t *buff = &frame[3];
+    frame[0] = block_size == XMODEM_1K_BLOCK ? STX : SOH;
+    frame[1] = packetno;
+    frame[2] = ~packetno;
+    int got = xfer_source_read(source, buff, block_size);
+    memset(&buff[got], 0x1A, block_size - got); // Pad
+    uint16_t crc = crc16_ccitt(buff, block_size);
+    buff[block_size] = crc >> 8;
+    buff[block_size + 1] = crc & 0xFF;
+
+    retries = 0;
+    while (retries < 10) {
+      // 3.2 Send packet, the whole frame in one write
+      fwrite(frame, 1, block_size + 5, stdout);
+      fflush(stdout);
+      usb_stats.bytes_out += block_size + 5;
+
+      // 3.3 Wait for ACK
+      c = _inbyte(5000);
+      if (c == ACK) {
+        break; // Success
+      }
+      // On NAK or timeout, retry
+      retries++;
+    }
+
+    if (retries >= 10) {
+      _outbyte(CAN);
+      _outbyte(CAN);
+      stdio_set_translate_crlf(&stdio_monitor, true);
+      printf("XMODEM Send: Failed to get ACK for packet %d\n", packetno);
+      fflush(stdout);
+      return false;
+    }
+
+    // 3.4 Increment for next packet
+    sent_len += block_size;
+    packetno++;
+  }
+
+  // 4. End of Transmission
+  retries = 0;
+  while (retries < 10) {
+    _outbyte(EOT);
+    c = _inbyte(2000);
+    if (c == ACK) {
+      stdio_set_translate_crlf(&stdio_monitor, true);
+      printf("\nSend complete.\n");
+      fflush(stdout);
+      return true;
+    }
+    retries++;
+  }
+
+  stdio_set_translate_crlf(&stdio_monitor, true);
+  printf("XMODEM Send: Failed to get final ACK for EOT.\n");
+  fflush(stdout);
+  return false;
+}
+
+/**
+ * @brief USBから指定バイト数を受信します。
+ * @param dst 格納先
+ * @param len バイト数
+ * @param timeout_ms 受信が途切れてから諦めるまでの時間 (ミリ秒)
+ * @return すべて受信できた場合true
+ */
+bool raw_read(uint8_t *dst, int len, uint32_t timeout_ms) {
+  uint32_t last = time_us_32();
+  while (len > 0) {
+    int n = usb_read(dst, len);
+    if (n > 0) {
+      dst += n;
+      len -= n;
+      last = time_us_32();
+    } else if (time_us_32() - last > timeout_ms * 1000) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief 生のバルク転送でデータを受信します。
+ * 形式: "V30R" len:u32 data[len] crc16:u16 (CRCはビッグエンディアン)。
+ * 受信側はCRCが一致すればACK、しなければNAKを返し、送信側は全体を再送します。
+ * @param dest 受信したデータを格納するバッファ
+ * @param max_len 受信可能な最大バイト数
+ * @param packed trueの場合、PackBitsの圧縮データとして展開します
+ * @return 成功した場合true
+ */
+bool raw_receive(uint8_t *dest, int max_len, bool packed) {
+  printf("Ready to RECEIVE RAW...\n");
+  fflush(stdout);
+  stdio_set_translate_crlf(&stdio_monitor, false);
+  bool ok = false;
+  for (int attempt = 0; attempt < RAW_RETRIES && !ok; attempt++) {
+    uint8_t hdr[8];
+    if (!raw_read(hdr, sizeof(hdr), 30000) ||
+        memcmp(hdr, RAW_MAGIC, 4) != 0) {
+      break;
+    }
+    uint32_t len;
+    memcpy(&len, &hdr[4], 4);
+    if (!packed && len > (uint32_t)max_len) {
+      _outbyte(CAN);
+      break;
+    }
+    uint8_t crc_buf[2];
+    uint16_t crc = 0;
+    bool got;
+    if (packed) {
+      // Unpack as it arrives, the packed stream is never held in full
+      XferSink sink;
+      xfer_sink_init(sink, dest, max_len, true);
+      uint8_t chunk[XMODEM_1K_BLOCK];
+      got = true;
+      for (uint32_t off = 0; off < len && got; off += sizeof(chunk)) {
+        uint32_t n = len - off < sizeof(chunk) ? len - off : sizeof(chunk);
+        got = raw_read(chunk, n, 1000);
+        crc = crc16_table(chunk, n, crc);
+        xfer_sink_write(sink, chunk, n);
+      }
+      got = got && raw_read(crc_buf, 2, 1000);
+      if (got && crc == ((crc_buf[0] << 8) | crc_buf[1]) &&
+          !xfer_sink_done(sink)) {
+        _outbyte(CAN);
+        stdio_set_translate_crlf(&stdio_monitor, true);
+        printf("\nError: Bad packed data or exceeds max_len.\n");
+        return false;
+      }
+      len = sink.len;
+    } else {
+      got = raw_read(dest, len, 1000) && raw_read(crc_buf, 2, 1000);
+      if (got)
+        crc = crc16_ccitt(dest, len);
+    }
+    if (!got) {
+      while (_inbyte(50) >= 0)
+        ; // Flush
+      _outbyte(NAK);
+      continue;
+    }
+    ok = crc == ((crc_buf[0] << 8) | crc_buf[1]);
+    _outbyte(ok ? ACK : NAK);
+    if (ok) {
+      stdio_set_translate_crlf(&stdio_monitor, true);
+      printf("\nTransfer complete. Received %lu bytes.\n", len);
+      return true;
+    }
+  }
+  stdio_set_translate_crlf(&stdio_monitor, true);
+  printf("\nRaw receive failed.\n");
+  return false;
+}
+
+/**
+ * @brief 生のバルク転送でデータを送信します (形式はraw_receive()を参照)。
+ * 受信側の'R'を待ってから送信し、ACKを受け取るまで全体を再送します。
+ * @param src 送信するデータが格納されたバッファ
+ * @param len 送信するデータのバイト数
+ * @param packed trueの場合、PackBitsで圧縮して送信します
+ * @return 成功した場合true
+ */
+bool raw_send(const uint8_t *src, int len, bool packed) {
+  printf("Ready to SEND RAW...\n");
+  fflush(stdout);
+  stdio_set_translate_crlf(&stdio_monitor, false);
+  XferSource source;
+  xfer_source_init(source, src, len, packed);
+  uint16_t crc;
+  uint32_t ulen = xfer_source_measure(source, &crc);
+  uint8_t hdr[8] = {'V', '3', '0', 'R'};
+  memcpy(&hdr[4], &ulen, 4);
+  const uint8_t tail[2] = {(uint8_t)(crc >> 8), (uint8_t)crc};
+
+  int c = _inbyte(10000);
+  for (int attempt = 0; attempt < RAW_RETRIES && c == 'R'; attempt++) {
+    usb_write(hdr, sizeof(hdr));
+    if (!packed) {
+      for (int off = 0; off < len; off += XMODEM_1K_BLOCK) {
+        int n = len - off > XMODEM_1K_BLOCK ? XMODEM_1K_BLOCK : len - off;
+        usb_write(&src[off], n);
+      }
+    } else {
+      uint8_t chunk[XMODEM_1K_BLOCK];
+      int n;
+      xfer_source_rewind(source);
+      while ((n = xfer_source_read(source, chunk, sizeof(chunk))) > 0)
+        usb_write(chunk, n);
+    }
+    usb_write(tail, sizeof(tail));
+    c = _inbyte(10000);
+    if (c == ACK) {
+      stdio_set_translate_crlf(&stdio_monitor, true);
+      printf("\nSend complete.\n");
+      return true;
+    }
+    if (c == NAK)
+      c = 'R'; // Send it all again
+  }
+  stdio_set_translate_crlf(&stdio_monitor, true);
+  printf("\nRaw send failed (0x%02X).\n", c);
+  return false;
+}
+
+/**
+ * @brief 指定された転送方式でデータを受信します。
+ * XMODEM-1Kのブロックは通常のXMODEM受信でも受け付けます。
+ * @param mode 転送方式
+ * @param dest 受信したデータを格納するバッファ
+ * @param max_len 受信可能な最大バイト数
+ * @return 成功した場合true
+ */
+bool xfer_receive(XferMode mode, uint8_t *dest, int max_len) {
+  bool packed = mode & XFER_PACKED;
+  if ((mode & XFER_KIND) == XFER_RAW)
+    return raw_receive(dest, max_len, packed);
+  return xmodem_receive(dest, max_len, packed);
+}
+
+/**
+ * @brief 指定された転送方式でデータを送信します。
+ * @param mode 転送方式
+ * @param src 送信するデータが格納されたバッファ
+ * @param len 送信するデータのバイト数
+ * @return 成功した場合true
+ */
+bool xfer_send(XferMode mode, const uint8_t *src, int len) {
+  bool packed = mode & XFER_PACKED;
+  if ((mode & XFER_KIND) == XFER_RAW)
+    return raw_send(src, len, packed);
+  return xmodem_send(src, len, (mode & XFER_KIND) == XFER_XMODEM_1K, packed);
+}
+
+/**
+ * @brief 転送方式の指定を1語加えます。
+ * @param mode それまでの転送方式
+ * @param word "1k"、"bulk" または "rle" (それ以外は無視します)
+ * @return 転送方式
+ */
+XferMode xfer_mode_add(XferMode mode, const char *word) {
+  int m = mode;
+  if (strcmp(word, "1k") == 0)
+    m = (m & ~XFER_KIND) | XFER_XMODEM_1K;
+  else if (strcmp(word, "bulk") == 0)
+    m = (m & ~XFER_KIND) | XFER_RAW;
+  else if (strcmp(word, "rle") == 0)
+    m |= XFER_PACKED;
+  return (XferMode)m;
+}
+
+/**
+ * @brief 転送方式の指定を解釈します。
+ * @param args 空白区切りの "1k"、"bulk"、"rle" (指定がなければXMODEM)
+ * @return 転送方式
+ */
+XferMode parse_xfer_mode(const char *args) {
+  XferMode mode = XFER_XMODEM;
+  char word[8];
+  while (*args) {
+    int n = strcspn(args, " ");
+    if (n > 0 && n < (int)sizeof(word)) {
+      memcpy(word, args, n);
+      word[n] = 0;
+      mode = xfer_mode_add(mode, word);
+    }
+    args += n;
+    args += strspn(args, " ");
+  }
+  return mode;
+}
+
+// ==========================================
+//   HIDOS Snapshot
+// ==========================================
+// Ctrl-\ in a HIDOS session saves the machine to flash; the next 'h'
+// resumes it instead of booting DOS again. The capture is taken while the
+// V30 spins in the 88h poll of the INT 86h handler in boot.img, waiting for
+// a CON request to be served:
+//   1. vector 3 -> SNAP_STUB_BASE, IN AX,88h (HIDOS_POLL_ADDR) -> INT 3
+//   2. the stub pushes every register, reports SS:SP on SNAP_PORT and
+//      spins; core0 stops the VM and puts the poll loop back
+//   3. ram[], the disk overlay and the VMIO device state go to flash
+// To resume, the reset vector jumps to the other half of the stub, which
+// loads SS:SP, pops the registers and IRETs back into the poll loop, with
+// the saved request in flight again. Both stub pages (SNAP_STUB_BASE and
+// the reset vector's page) are mapped to the "snap" handler for the whole
+// 'h' session; the reset jump goes to boot.img for a cold boot.
+//
+// Flash at SNAPSHOT_FLASH_OFFSET, below the disk overlay log:
+//   page 0: SnapHeader, programmed last, so a torn save reads as no snapshot
+//   data:   overlay blocks[overlay_used], ram[] in PackBits
+// A snapshot is stale once the flash overlay log changed (the disk under
+// the saved DOS is not the same any more).
+#define SNAP_STUB_BASE 0xF0000
+#define SNAP_RESET_PAGE 0xFF000
+#define SNAP_RESUME_IP 0x10
+#define HIDOS_POLL_ADDR 0x1FFF7   // IN AX,88h in boot.img's INT 86h handler
+#define HIDOS_VMIO_VECTOR 0x1FFF0005 // INT 86h -> 1FFF:0005
+#define SNAP_CAPTURE_TIMEOUT_US 100000
+
+struct SnapHeader {
+  char magic[4]; // "V30S"
+  uint32_t disk_img_size;
+  uint32_t disk_log_used; // Flash overlay log entries at the capture
+  uint32_t data_len;      // Bytes after the header page
+  uint32_t overlay_used;
+  uint16_t overlay_lba[DISK_OVERLAY_BLOCKS];
+  uint16_t ss, sp;        // V30 stack after the capture stub's pushes
+  uint16_t request;       // Paragraph of the CON request in flight
+  uint16_t crc;           // crc16_ccitt() of the data
+  uint32_t con_wait_count;
+  uint64_t clock_us;      // io_clock() time at the capture
+};
+static_assert(sizeof(SnapHeader) <= FLASH_PAGE_SIZE, "header is one page");
+static_assert(SNAPSHOT_FLASH_SIZE >=
+                  FLASH_PAGE_SIZE + DISK_OVERLAY_BLOCKS * DISK_BLOCK_SIZE +
+                      RAM_SIZE + RAM_SIZE / 128,
+              "worst case PackBits output must fit");
+
+SnapHeader snap; // State of the running session (last capture or resume)
+
+// Served by snap_stub_read(); SRAM, as core1 fetches it.
+uint8_t snap_stub_code[0x20] = {
+    // F000:0000 capture, entered by INT 3 from the patched poll loop
+    0x60,            // PUSHA
+    0x1E,            // PUSH DS
+    0x06,            // PUSH ES
+    0x8C, 0xD0,      // MOV AX,SS
+    0xE7, SNAP_PORT, // OUT 8Ah,AX
+    0x89, 0xE0,      // MOV AX,SP
+    0xE7, SNAP_PORT, // OUT 8Ah,AX
+    0xEB, 0xFE,      // JMP $ until core1 stops
+    0xF4, 0xF4, 0xF4,
+    // F000:0010 resume, SS and SP filled in by snap_launch()
+    0xB8, 0x00, 0x00, // MOV AX,ss
+    0x8E, 0xD0,       // MOV SS,AX
+    0xBC, 0x00, 0x00, // MOV SP,sp
+    0x07,             // POP ES
+    0x1F,             // POP DS
+    0x61,             // POPA
+    0xCF,             // IRET into the poll loop (TEST AX,AX)
+    0xF4, 0xF4, 0xF4, 0xF4,
+};
+uint8_t snap_reset_jmp[5] = {0xEA, 0x00, 0x00, 0x00, 0x10}; // At xFF0
+
+/**
+ * @brief スナップショット用のスタブを返すメモリハンドラです (Core 1)。
+ * ページ先頭にスタブ、0xFF0にリセット時のジャンプを置き、それ以外は
+ * HLTを返します。
+ * @param addr V30のアドレス (偶数)
+ * @return 読み出した16ビット値
+ */
+uint16_t CORE1_FUNC(snap_stub_read)(uint32_t addr) {
+  uint32_t off = addr & (MEM_PAGE_SIZE - 1);
+  uint8_t b[2];
+  for (int i = 0; i < 2; i++, off++) {
+    if (off < sizeof(snap_stub_code))
+      b[i] = snap_stub_code[off];
+    else if (off - 0xFF0 < sizeof(snap_reset_jmp))
+      b[i] = snap_reset_jmp[off - 0xFF0];
+    else
+      b[i] = 0xF4; // HLT
+  }
+  return b[0] | (b[1] << 8);
+}
+
+/**
+ * @brief フラッシュのスナップショット領域がプログラムと重なっていないか
+ * を調べます。
+ * @param なし
+ * @return 使用できる場合true
+ */
+bool snap_flash_usable() {
+  return (uint32_t)((uintptr_t)&__flash_binary_end - XIP_BASE) <=
+         SNAPSHOT_FLASH_OFFSET;
+}
+
+// Page buffer of snap_save(). Static: core0's stack is small.
+static struct {
+  uint32_t off; // Flash offset of page[]
+  uint32_t fill;
+  uint8_t page[FLASH_PAGE_SIZE];
+} snap_out;
+
+/**
+ * @brief スナップショットのデータに1バイト追加します。ページが埋まると
+ * フラッシュに書き込み、セクタの先頭では先に消去します。
+ * @param b 追加するバイト
+ * @return なし
+ */
+void snap_put(uint8_t b) {
+  snap_out.page[snap_out.fill++] = b;
+  if (snap_out.fill < FLASH_PAGE_SIZE)
+    return;
+  uint32_t ints = save_and_disable_interrupts();
+  if (snap_out.off % FLASH_SECTOR_SIZE == 0)
+    flash_range_erase(snap_out.off, FLASH_SECTOR_SIZE);
+  flash_range_program(snap_out.off, snap_out.page, FLASH_PAGE_SIZE);
+  restore_interrupts(ints);
+  snap_out.off += FLASH_PAGE_SIZE;
+  snap_out.fill = 0;
+}
+
+/**
+ * @brief PackBits形式で圧縮してスナップショットに追加します
+ * (トークンはpack_token()を参照)。
+ * @param src 圧縮するデータ
+ * @param len バイト数
+ * @return なし
+ */
+void snap_pack(const uint8_t *src, uint32_t len) {
+  uint8_t tok[PACK_TOKEN_MAX];
+  int tok_len;
+  for (uint32_t i = 0; i < len;) {
+    i += pack_token(&src[i], len - i, tok, &tok_len);
+    for (int k = 0; k < tok_len; k++)
+      snap_put(tok[k]);
+  }
+}
+
+/**
+ * @brief PackBits形式のデータを展開します。
+ * @param src 圧縮データ
+ * @param len 圧縮データのバイト数
+ * @param dst 展開先
+ * @param size 展開先のバイト数
+ * @return ちょうどsizeバイトに展開できた場合true
+ */
+bool snap_unpack(const uint8_t *src, uint32_t len, uint8_t *dst,
+                 uint32_t size) {
+  const uint8_t *end = src + len;
+  uint32_t o = 0;
+  while (src < end) {
+    uint8_t c = *src++;
+    if (c < 128) {
+      uint32_t n = c + 1;
+      if (n > size - o || n > (uint32_t)(end - src))
+        return false;
+      memcpy(dst + o, src, n);
+      src += n;
+      o += n;
+    } else if (c > 128) {
+      uint32_t n = 257 - c;
+      if (n > size - o || src == end)
+        return false;
+      memset(dst + o, *src++, n);
+      o += n;
+    }
+  }
+  return o == size;
+}
+
+/**
+ * @brief snapの内容と現在のram[]・ディスクオーバーレイをフラッシュに
+ * 保存します (Core 1が停止している間)。
+ * @param なし
+ * @return 保存できた場合true
+ */
+bool snap_save() {
+  if (!snap_flash_usable()) {
+    printf("snap: program overlaps the snapshot area, not saved\n");
+    return false;
+  }
+  uint32_t t_start = time_us_32();
+  uint32_t ints = save_and_disable_interrupts();
+  flash_range_erase(SNAPSHOT_FLASH_OFFSET, FLASH_SECTOR_SIZE); // Old one gone
+  restore_interrupts(ints);
+
+  snap_out.off = SNAPSHOT_FLASH_OFFSET + FLASH_PAGE_SIZE;
+  snap_out.fill = 0;
+  for (uint32_t i = 0; i < disk_overlay_used; i++) {
+    for (uint32_t b = 0; b < DISK_BLOCK_SIZE; b++)
+      snap_put(disk_overlay[i][b]);
+  }
+  snap_pack(ram, RAM_SIZE);
+  snap.data_len = snap_out.off + snap_out.fill -
+                  (SNAPSHOT_FLASH_OFFSET + FLASH_PAGE_SIZE);
+  while (snap_out.fill != 0)
+    snap_put(0xFF); // Program the last partial page
+  snap.crc = crc16_ccitt(
+      flash_nocache(SNAPSHOT_FLASH_OFFSET + FLASH_PAGE_SIZE), snap.data_len);
+
+  uint8_t page[FLASH_PAGE_SIZE];
+  memset(page, 0xFF, sizeof(page));
+  memcpy(page, &snap, sizeof(snap));
+  ints = save_and_disable_interrupts();
+  flash_range_program(SNAPSHOT_FLASH_OFFSET, page, sizeof(page));
+  restore_interrupts(ints);
+  printf("snap: saved %lu bytes in %lu ms\n", snap.data_len,
+         (time_us_32() - t_start) / 1000);
+  return true;
+}
+
+/**
+ * @brief フラッシュのスナップショットの見出しを検査します。
+ * @param h 見出しの格納先
+ * @return 形式が正しくCRCが一致する場合true (ディスクとの一致は見ない)
+ */
+bool snap_read_header(SnapHeader &h) {
+  memcpy(&h, flash_nocache(SNAPSHOT_FLASH_OFFSET), sizeof(h));
+  if (memcmp(h.magic, "V30S", 4) != 0 ||
+      h.overlay_used > DISK_OVERLAY_BLOCKS ||
+      h.data_len < h.overlay_used * DISK_BLOCK_SIZE ||
+      h.data_len > SNAPSHOT_FLASH_SIZE - FLASH_PAGE_SIZE)
+    return false;
+  return crc16_ccitt(flash_nocache(SNAPSHOT_FLASH_OFFSET + FLASH_PAGE_SIZE),
+                     h.data_len) == h.crc;
+}
+
+/**
+ * @brief フラッシュのスナップショットをram[]・ディスクオーバーレイ・
+ * VMIOの状態に読み戻します。
+ * @param なし
+ * @return 再開できる場合true、無いか古い場合false (コールドブートする)
+ */
+bool snap_load() {
+  uint32_t t_start = time_us_32();
+  SnapHeader h;
+  if (!snap_flash_usable() || !snap_read_header(h))
+    return false;
+  if (h.disk_img_size != disk_img_size || h.disk_log_used != disk_log_used) {
+    printf("snap: disk changed since the snapshot, booting\n");
+    return false;
+  }
+  const uint8_t *data = flash_nocache(SNAPSHOT_FLASH_OFFSET + FLASH_PAGE_SIZE);
+  uint32_t overlay_bytes = h.overlay_used * DISK_BLOCK_SIZE;
+  if (!snap_unpack(data + overlay_bytes, h.data_len - overlay_bytes, ram,
+                   RAM_SIZE)) {
+    printf("snap: snapshot damaged, booting\n");
+    return false;
+  }
+  dirty_clear();
+  memcpy(disk_overlay, data, overlay_bytes);
+  memcpy(disk_overlay_lba, h.overlay_lba, sizeof(disk_overlay_lba));
+  disk_overlay_used = h.overlay_used;
+  for (uint32_t i = 0; i < DISK_CACHE_BLOCKS; i++)
+    disk_cache_stamp[i] = 0;
+  con_wait_count = h.con_wait_count;
+  clock_offset_us = h.clock_us - to_us_since_boot(get_absolute_time());
+  snap = h;
+  printf("snap: restored in %lu ms\n", (time_us_32() - t_start) / 1000);
+  return true;
+}
+
+/**
+ * @brief HIDOS VMを開始します。resumeの場合はsnapのレジスタから、
+ * 要求を処理中の状態で再開します。
+ * @param resume trueで再開、falseでboot.imgから起動
+ * @return なし
+ */
+void snap_launch(bool resume) {
+  if (resume) {
+    snap_stub_code[SNAP_RESUME_IP + 1] = snap.ss;
+    snap_stub_code[SNAP_RESUME_IP + 2] = snap.ss >> 8;
+    snap_stub_code[SNAP_RESUME_IP + 6] = snap.sp;
+    snap_stub_code[SNAP_RESUME_IP + 7] = snap.sp >> 8;
+    const uint8_t jmp[] = {0xEA, SNAP_RESUME_IP, 0x00,
+                           (uint8_t)(SNAP_STUB_BASE >> 4),
+                           (uint8_t)(SNAP_STUB_BASE >> 12)};
+    memcpy(snap_reset_jmp, jmp, sizeof(jmp));
+    hidos_start_busy = 1;
+  } else {
+    const uint8_t jmp[] = {0xEA, 0x00, 0x00, 0x00, 0x10}; // As boot.img
+    memcpy(snap_reset_jmp, jmp, sizeof(jmp));
+  }
+  __dmb();
+  multicore_fifo_push_blocking(CMD_RUN_HIDOSVM);
+}
+
+/**
+ * @brief 実行中のHIDOS VMのスナップショットを取り、保存して同じ状態から
+ * 再開します (hidos_host()がCON要求を処理する前に呼びます)。
+ * @param request 処理前のCON要求のパラグラフ
+ * @return 再開まで行った場合true、取れなかった場合false (VMはそのまま)
+ */
+bool snap_capture(uint16_t request) {
+  uint32_t vec = memr2(0x86 * 4) | (memr2(0x86 * 4 + 2) << 16);
+  if (vec != HIDOS_VMIO_VECTOR || mem_read8(HIDOS_POLL_ADDR) != 0xE5 ||
+      mem_read8(HIDOS_POLL_ADDR + 1) != 0x88) {
+    printf("snap: INT 86h handler not found, no snapshot\n");
+    return false;
+  }
+  con_flush();
+  uint32_t vec3 = memr2(3 * 4) | (memr2(3 * 4 + 2) << 16);
+  snap_reg_count = 0;
+  memw2(3 * 4, 0x0000);
+  memw2(3 * 4 + 2, SNAP_STUB_BASE >> 4);
+  // The operand first: the V30 fetches the loop from HIDOS_POLL_ADDR on,
+  // so it sees IN AX,03h or INT 3, never INT 88h.
+  mem_write8(HIDOS_POLL_ADDR + 1, 0x03);
+  __dmb();
+  mem_write8(HIDOS_POLL_ADDR, 0xCD);
+
+  uint32_t t_start = time_us_32();
+  while (snap_reg_count < count_of(snap_regs) &&
+         time_us_32() - t_start < SNAP_CAPTURE_TIMEOUT_US)
+    con_service();
+  bool captured = snap_reg_count == count_of(snap_regs);
+  if (captured) {
+    stop_request = true;
+    multicore_fifo_push_blocking(1); // Completion of request, see core1
+    while (multicore_fifo_pop_blocking() != HIDOS_EXIT_TOKEN)
+      ;
+  }
+  mem_write8(HIDOS_POLL_ADDR, 0xE5);
+  mem_write8(HIDOS_POLL_ADDR + 1, 0x88);
+  memw2(3 * 4, vec3);
+  memw2(3 * 4 + 2, vec3 >> 16);
+  if (!captured) {
+    printf("snap: V30 did not reach the capture stub\n");
+    return false;
+  }
+
+  memcpy(snap.magic, "V30S", 4);
+  snap.disk_img_size = disk_img_size;
+  snap.disk_log_used = disk_log_used;
+  snap.overlay_used = disk_overlay_used;
+  memcpy(snap.overlay_lba, disk_overlay_lba, sizeof(snap.overlay_lba));
+  snap.ss = snap_regs[0];
+  snap.sp = snap_regs[1];
+  snap.request = request;
+  snap.con_wait_count = con_wait_count;
+  snap.clock_us = to_us_since_boot(get_absolute_time()) + clock_offset_us;
+  snap_save();
+  snap_launch(true); // hidos_host() serves request next, as if nothing happened
+  return true;
+}
+
+// ==========================================
+//   Monitor Commands
+// ==========================================
+/**
+ * @brief 'k'
+ * コマンドを処理します。リンクされた boot.img の内容をRAMの先頭にロードします。
+ * @param arg_str コマンドの引数文字列 (未使用)
+ * @return なし
+ */
+void cmd_load_boot(const char *arg_str) {
+    const size_t boot_img_size = (size_t)(_binary_boot_img_end - _binary_boot_img_start);
+    if (boot_img_size > RAM_SIZE) {
+        printf("Error: boot.img size (%u) is larger than RAM size (%u).\n", (unsigned int)boot_img_size, (unsigned int)RAM_SIZE);
+        return;
+    }
+    memcpy(ram, _binary_boot_img_start, boot_img_size);
+    dirty_clear();
+    printf("Loaded boot.img (%u bytes) into RAM at address 0x00000.\n", (unsigned int)boot_img_size);
+}
+
+/**
+ * @brief トレースストリームの1フレームを送信します。
+ * フレーム形式 (リトルエンディアン):
+ *   'T' 'S' count:u16 dropped:u32 BusLog[count]
+ *   'T' 'C' bytes:u16 dropped:u32 compact records (see compact_encode())
+ *   'T' 'E' 0:u16     dropped:u32 total:u32 bus_cycles:u32 time_us:u32
+ *                     end:u32 (RunEnd)
+ * @param tag フレーム種別 ('S'/'C' データ, 'E' 終了)
+ * @param data 続けて送るデータ
+ * @param len dataのバイト数
+ * @param count ヘッダに入れるレコード数 (コンパクト形式ではバイト数)
+ * @return なし
+ */
+void send_stream_frame(char tag, const void *data, int len, uint16_t count) {
+  uint32_t dropped = trace_stream_dropped;
+  uint8_t hdr[8] = {'T', (uint8_t)tag, (uint8_t)count, (uint8_t)(count >> 8)};
+  memcpy(&hdr[4], &dropped, 4);
+  fwrite(hdr, 1, sizeof(hdr), stdout);
+  if (len > 0)
+    fwrite(data, 1, len, stdout);
+  fflush(stdout);
+  usb_stats.bytes_out += sizeof(hdr) + len;
+}
+
+// Core0: next ring block to send
+static uint32_t trace_stream_next;
+
+/**
+ * @brief トレースストリームを開始します (Core 0、実行開始前)。
+ * 終了まではフレーム以外を出力しないよう、Core 1の表示も止めます。
+ * @param なし
+ * @return それまでのconsole_quiet (trace_stream_end()に渡します)
+ */
+bool trace_stream_begin() {
+  trace_stream_reset();
+  trace_stream_next = 0;
+  trace_stream_enabled = true;
+
+  printf("Ready to STREAM trace...\n");
+  fflush(stdout);
+  stdio_set_translate_crlf(&stdio_monitor, false);
+  // Core1's end-of-run messages would land between the frames; the reason
+  // goes into the 'TE' tail instead.
+  bool saved_quiet = console_quiet;
+  console_quiet = true;
+  return saved_quiet;
+}
+
+/**
+ * @brief Core 1が引き渡したブロックがあれば1つ送信し、Core 1に返します。
+ * @param なし
+ * @return 送信した場合true
+ */
+bool trace_stream_send() {
+  uint32_t block = trace_stream_next;
+  uint16_t n = trace_stream_ready[block];
+  if (n == 0)
+    return false;
+  __dmb();
+  if (trace_format == TRACE_FMT_COMPACT)
+    send_stream_frame('C', trace_bytes() + block * TRACE_STREAM_BLOCK_BYTES, n,
+                      n);
+  else
+    send_stream_frame('S', &trace_log[block * TRACE_STREAM_BLOCK_ENTRIES],
+                      n * sizeof(BusLog), n);
+  trace_stream_ready[block] = 0;
+  trace_stream_next = (block + 1) % TRACE_STREAM_BLOCKS;
+  return true;
+}
+
+/**
+ * @brief 終了フレームを送ってトレースストリームを終えます (Core 0、
+ * Core 1の終了後に残りのブロックを送ってから呼びます)。
+ * @param saved_quiet trace_stream_begin()が返した値
+ * @return なし
+ */
+void trace_stream_end(bool saved_quiet) {
+  uint32_t tail[4] = {trace_stream_total, (uint32_t)executed_cycles,
+                      (uint32_t)execution_time_us, run_end_reason};
+  send_stream_frame('E', tail, sizeof(tail), 0);
+  trace_stream_enabled = false;
+  console_quiet = saved_quiet;
+  // The ring contents are not a valid buffered log for 'xl'
+  memset(trace_log, 0, sizeof(trace_log));
+  trace_compact_bytes = 0;
+  stdio_set_translate_crlf(&stdio_monitor, true);
+  printf("\nStream complete. Records: %lu, Dropped: %lu, Bus Cycles: %d, "
+         "Time: %d us, End: %u\n",
+         trace_stream_total, trace_stream_dropped, executed_cycles,
+         execution_time_us, run_end_reason);
+}
+
+/**
+ * @brief V30を実行しながらバスログをホストへ連続送信します。
+ * Core 1がリングに書き込んだブロックを順に送信し、Core 1の終了または
+ * ホストからの任意の1バイトで停止します。
+ * @param run_cmd Core 1に送る実行コマンド (CMD_RUN_FULLLOG など)
+ * @return なし
+ */
+void run_trace_stream(uint32_t run_cmd) {
+  bool saved_quiet = trace_stream_begin();
+  cycle_limit = 0x7FFFFFFF;
+
+  multicore_fifo_push_blocking(run_cmd);
+  bool finished = false;
+  while (true) {
+    if (trace_stream_send())
+      continue;
+    if (finished)
+      break; // Core 1 is done and every published block has been sent
+    if (multicore_fifo_rvalid()) {
+      multicore_fifo_pop_blocking();
+      finished = true; // Drain what trace_writer_end() published
+      continue;
+    }
+    if (getchar_timeout_us(0) != PICO_ERROR_TIMEOUT)
+      stop_request = true;
+  }
+  trace_stream_end(saved_quiet);
+}
+
+// --- Disassembler ---
+// Table-driven decoder for the 8086 instruction set, the 80186 additions the
+// V30 implements (PUSHA, ENTER, IMUL imm, shifts by imm, ...) and the V30's
+// own 0F page (bit and BCD string instructions). disasm_ops[] is indexed by
+// the opcode; entries with a group take the mnemonic from disasm_groups[] by
+// ModRM.reg. Relative branch targets are shown as physical addresses, since
+// CS is not known.
+#define DISASM_MAX_PREFIXES 8
+#define DISASM_WINDOW 16 // Bytes a caller provides: prefixes + longest form
+#define DISASM_TEXT 64   // Output buffer size for disasm_decode()
+
+const char *const reg_names[] = {"ax", "cx", "dx", "bx",
+                                 "sp", "bp", "si", "di"};
+const char *const reg_names8[] = {"al", "cl", "dl", "bl",
+                                  "ah", "ch", "dh", "bh"};
+const char *const sreg_names[] = {"es", "cs", "ss", "ds"};
+const char *const modrm_bases[] = {"bx+si", "bx+di", "bp+si", "bp+di",
+                                   "si",    "di",    "bp",    "bx"};
+
+enum DisasmOperand : uint8_t {
+  DA_NONE = 0,
+  DA_EB,    // ModRM r/m, byte
+  DA_EV,    // ModRM r/m, word
+  DA_GB,    // ModRM reg, byte register
+  DA_GV,    // ModRM reg, word register
+  DA_SW,    // ModRM reg, segment register
+  DA_M,     // ModRM memory without a size (lea, les, lds, bound)
+  DA_MP,    // ModRM memory holding a far pointer
+  DA_IB,    // imm8
+  DA_IV,    // imm16
+  DA_IBS,   // imm8, sign-extended to a word
+  DA_JB,    // rel8
+  DA_JV,    // rel16
+  DA_AP,    // ptr16:16
+  DA_OB,    // [moffs16], byte
+  DA_OV,    // [moffs16], word
+  DA_AL,
+  DA_AX,
+  DA_CL,
+  DA_DX,
+  DA_ONE,   // Shift count 1
+  DA_THREE, // int 3
+  DA_RB,    // Byte register in opcode bits 0-2
+  DA_RV,    // Word register in opcode bits 0-2
+  DA_ES,
+  DA_CS,
+  DA_SS,
+  DA_DS,
+  DA_ESC,   // Coprocessor opcode number, then the r/m operand
+};
+
+enum DisasmGroup : uint8_t {
+  DG_NONE = 0,
+  DG_ALU,     // 80-83
+  DG_SHIFT,   // C0, C1, D0-D3
+  DG_UNARY8,  // F6
+  DG_UNARY16, // F7
+  DG_INCDEC,  // FE
+  DG_MISC,    // FF
+  DG_POP,     // 8F
+  DG_MOV,     // C6, C7
+};
+
+#define DF_PREFIX 0x1 // Prefix byte, mn is what gets printed
+#define DF_SEG 0x2    // ... a segment override
+#define DF_FLOW 0x4   // Never falls through (jmp, call, ret, int, hlt)
+
+struct DisasmOp {
+  const char *mn; // nullptr: invalid, or the mnemonic comes from the group
+  uint8_t group;  // DisasmGroup
+  uint8_t flags;  // DF_*
+  uint8_t op[3];  // DisasmOperand; a group entry with operands overrides
+};
+
+constexpr DisasmOp disasm_ops[256] = {
+    {"add", 0, 0, {DA_EB, DA_GB}},                           // 00
+    {"add", 0, 0, {DA_EV, DA_GV}},                           // 01
+    {"add", 0, 0, {DA_GB, DA_EB}},                           // 02
+    {"add", 0, 0, {DA_GV, DA_EV}},                           // 03
+    {"add", 0, 0, {DA_AL, DA_IB}},                           // 04
+    {"add", 0, 0, {DA_AX, DA_IV}},                           // 05
+    {"push", 0, 0, {DA_ES}},                                 // 06
+    {"pop", 0, 0, {DA_ES}},                                  // 07
+    {"or", 0, 0, {DA_EB, DA_GB}},                            // 08
+    {"or", 0, 0, {DA_EV, DA_GV}},                            // 09
+    {"or", 0, 0, {DA_GB, DA_EB}},                            // 0A
+    {"or", 0, 0, {DA_GV, DA_EV}},                            // 0B
+    {"or", 0, 0, {DA_AL, DA_IB}},                            // 0C
+    {"or", 0, 0, {DA_AX, DA_IV}},                            // 0D
+    {"push", 0, 0, {DA_CS}},                                 // 0E
+    {nullptr, 0, 0, {}},                                     // 0F
+    {"adc", 0, 0, {DA_EB, DA_GB}},                           // 10
+    {"adc", 0, 0, {DA_EV, DA_GV}},                           // 11
+    {"adc", 0, 0, {DA_GB, DA_EB}},                           // 12
+    {"adc", 0, 0, {DA_GV, DA_EV}},                           // 13
+    {"adc", 0, 0, {DA_AL, DA_IB}},                           // 14
+    {"adc", 0, 0, {DA_AX, DA_IV}},                           // 15
+    {"push", 0, 0, {DA_SS}},                                 // 16
+    {"pop", 0, 0, {DA_SS}},                                  // 17
+    {"sbb", 0, 0, {DA_EB, DA_GB}},                           // 18
+    {"sbb", 0, 0, {DA_EV, DA_GV}},                           // 19
+    {"sbb", 0, 0, {DA_GB, DA_EB}},                           // 1A
+    {"sbb", 0, 0, {DA_GV, DA_EV}},                           // 1B
+    {"sbb", 0, 0, {DA_AL, DA_IB}},                           // 1C
+    {"sbb", 0, 0, {DA_AX, DA_IV}},                           // 1D
+    {"push", 0, 0, {DA_DS}},                                 // 1E
+    {"pop", 0, 0, {DA_DS}},                                  // 1F
+    {"and", 0, 0, {DA_EB, DA_GB}},                           // 20
+    {"and", 0, 0, {DA_EV, DA_GV}},                           // 21
+    {"and", 0, 0, {DA_GB, DA_EB}},                           // 22
+    {"and", 0, 0, {DA_GV, DA_EV}},                           // 23
+    {"and", 0, 0, {DA_AL, DA_IB}},                           // 24
+    {"and", 0, 0, {DA_AX, DA_IV}},                           // 25
+    {"es:", 0, DF_PREFIX | DF_SEG, {}},                      // 26
+    {"daa", 0, 0, {}},                                       // 27
+    {"sub", 0, 0, {DA_EB, DA_GB}},                           // 28
+    {"sub", 0, 0, {DA_EV, DA_GV}},                           // 29
+    {"sub", 0, 0, {DA_GB, DA_EB}},                           // 2A
+    {"sub", 0, 0, {DA_GV, DA_EV}},                           // 2B
+    {"sub", 0, 0, {DA_AL, DA_IB}},                           // 2C
+    {"sub", 0, 0, {DA_AX, DA_IV}},                           // 2D
+    {"cs:", 0, DF_PREFIX | DF_SEG, {}},                      // 2E
+    {"das", 0, 0, {}},                                       // 2F
+    {"xor", 0, 0, {DA_EB, DA_GB}},                           // 30
+    {"xor", 0, 0, {DA_EV, DA_GV}},                           // 31
+    {"xor", 0, 0, {DA_GB, DA_EB}},                           // 32
+    {"xor", 0, 0, {DA_GV, DA_EV}},                           // 33
+    {"xor", 0, 0, {DA_AL, DA_IB}},                           // 34
+    {"xor", 0, 0, {DA_AX, DA_IV}},                           // 35
+    {"ss:", 0, DF_PREFIX | DF_SEG, {}},                      // 36
+    {"aaa", 0, 0, {}},                                       // 37
+    {"cmp", 0, 0, {DA_EB, DA_GB}},                           // 38
+    {"cmp", 0, 0, {DA_EV, DA_GV}},                           // 39
+    {"cmp", 0, 0, {DA_GB, DA_EB}},                           // 3A
+    {"cmp", 0, 0, {DA_GV, DA_EV}},                           // 3B
+    {"cmp", 0, 0, {DA_AL, DA_IB}},                           // 3C
+    {"cmp", 0, 0, {DA_AX, DA_IV}},                           // 3D
+    {"ds:", 0, DF_PREFIX | DF_SEG, {}},                      // 3E
+    {"aas", 0, 0, {}},                                       // 3F
+    {"inc", 0, 0, {DA_RV}},                                  // 40
+    {"inc", 0, 0, {DA_RV}},                                  // 41
+    {"inc", 0, 0, {DA_RV}},                                  // 42
+    {"inc", 0, 0, {DA_RV}},                                  // 43
+    {"inc", 0, 0, {DA_RV}},                                  // 44
+    {"inc", 0, 0, {DA_RV}},                                  // 45
+    {"inc", 0, 0, {DA_RV}},                                  // 46
+    {"inc", 0, 0, {DA_RV}},                                  // 47
+    {"dec", 0, 0, {DA_RV}},                                  // 48
+    {"dec", 0, 0, {DA_RV}},                                  // 49
+    {"dec", 0, 0, {DA_RV}},                                  // 4A
+    {"dec", 0, 0, {DA_RV}},                                  // 4B
+    {"dec", 0, 0, {DA_RV}},                                  // 4C
+    {"dec", 0, 0, {DA_RV}},                                  // 4D
+    {"dec", 0, 0, {DA_RV}},                                  // 4E
+    {"dec", 0, 0, {DA_RV}},                                  // 4F
+    {"push", 0, 0, {DA_RV}},                                 // 50
+    {"push", 0, 0, {DA_RV}},                                 // 51
+    {"push", 0, 0, {DA_RV}},                                 // 52
+    {"push", 0, 0, {DA_RV}},                                 // 53
+    {"push", 0, 0, {DA_RV}},                                 // 54
+    {"push", 0, 0, {DA_RV}},                                 // 55
+    {"push", 0, 0, {DA_RV}},                                 // 56
+    {"push", 0, 0, {DA_RV}},                                 // 57
+    {"pop", 0, 0, {DA_RV}},                                  // 58
+    {"pop", 0, 0, {DA_RV}},                                  // 59
+    {"pop", 0, 0, {DA_RV}},                                  // 5A
+    {"pop", 0, 0, {DA_RV}},                                  // 5B
+    {"pop", 0, 0, {DA_RV}},                                  // 5C
+    {"pop", 0, 0, {DA_RV}},                                  // 5D
+    {"pop", 0, 0, {DA_RV}},                                  // 5E
+    {"pop", 0, 0, {DA_RV}},                                  // 5F
+    {"pusha", 0, 0, {}},                                     // 60
+    {"popa", 0, 0, {}},                                      // 61
+    {"bound", 0, 0, {DA_GV, DA_M}},                          // 62
+    {nullptr, 0, 0, {}},                                     // 63
+    {"repnc", 0, DF_PREFIX, {}},                             // 64
+    {"repc", 0, DF_PREFIX, {}},                              // 65
+    {nullptr, 0, 0, {}},                                     // 66
+    {nullptr, 0, 0, {}},                                     // 67
+    {"push", 0, 0, {DA_IV}},                                 // 68
+    {"imul", 0, 0, {DA_GV, DA_EV, DA_IV}},                   // 69
+    {"push", 0, 0, {DA_IBS}},                                // 6A
+    {"imul", 0, 0, {DA_GV, DA_EV, DA_IBS}},                  // 6B
+    {"insb", 0, 0, {}},                                      // 6C
+    {"insw", 0, 0, {}},                                      // 6D
+    {"outsb", 0, 0, {}},                                     // 6E
+    {"outsw", 0, 0, {}},                                     // 6F
+    {"jo", 0, 0, {DA_JB}},                                   // 70
+    {"jno", 0, 0, {DA_JB}},                                  // 71
+    {"jb", 0, 0, {DA_JB}},                                   // 72
+    {"jnb", 0, 0, {DA_JB}},                                  // 73
+    {"jz", 0, 0, {DA_JB}},                                   // 74
+    {"jnz", 0, 0, {DA_JB}},                                  // 75
+    {"jbe", 0, 0, {DA_JB}},                                  // 76
+    {"ja", 0, 0, {DA_JB}},                                   // 77
+    {"js", 0, 0, {DA_JB}},                                   // 78
+    {"jns", 0, 0, {DA_JB}},                                  // 79
+    {"jp", 0, 0, {DA_JB}},                                   // 7A
+    {"jnp", 0, 0, {DA_JB}},                                  // 7B
+    {"jl", 0, 0, {DA_JB}},                                   // 7C
+    {"jge", 0, 0, {DA_JB}},                                  // 7D
+    {"jle", 0, 0, {DA_JB}},                                  // 7E
+    {"jg", 0, 0, {DA_JB}},                                   // 7F
+    {nullptr, DG_ALU, 0, {DA_EB, DA_IB}},                    // 80
+    {nullptr, DG_ALU, 0, {DA_EV, DA_IV}},                    // 81
+    {nullptr, DG_ALU, 0, {DA_EB, DA_IB}},                    // 82
+    {nullptr, DG_ALU, 0, {DA_EV, DA_IBS}},                   // 83
+    {"test", 0, 0, {DA_EB, DA_GB}},                          // 84
+    {"test", 0, 0, {DA_EV, DA_GV}},                          // 85
+    {"xchg", 0, 0, {DA_EB, DA_GB}},                          // 86
+    {"xchg", 0, 0, {DA_EV, DA_GV}},                          // 87
+    {"mov", 0, 0, {DA_EB, DA_GB}},                           // 88
+    {"mov", 0, 0, {DA_EV, DA_GV}},                           // 89
+    {"mov", 0, 0, {DA_GB, DA_EB}},                           // 8A
+    {"mov", 0, 0, {DA_GV, DA_EV}},                           // 8B
+    {"mov", 0, 0, {DA_EV, DA_SW}},                           // 8C
+    {"lea", 0, 0, {DA_GV, DA_M}},                            // 8D
+    {"mov", 0, 0, {DA_SW, DA_EV}},                           // 8E
+    {nullptr, DG_POP, 0, {DA_EV}},                           // 8F
+    {"nop", 0, 0, {}},                                       // 90
+    {"xchg", 0, 0, {DA_AX, DA_RV}},                          // 91
+    {"xchg", 0, 0, {DA_AX, DA_RV}},                          // 92
+    {"xchg", 0, 0, {DA_AX, DA_RV}},                          // 93
+    {"xchg", 0, 0, {DA_AX, DA_RV}},                          // 94
+    {"xchg", 0, 0, {DA_AX, DA_RV}},                          // 95
+    {"xchg", 0, 0, {DA_AX, DA_RV}},                          // 96
+    {"xchg", 0, 0, {DA_AX, DA_RV}},                          // 97
+    {"cbw", 0, 0, {}},                                       // 98
+    {"cwd", 0, 0, {}},                                       // 99
+    {"call", 0, DF_FLOW, {DA_AP}},                           // 9A
+    {"wait", 0, 0, {}},                                      // 9B
+    {"pushf", 0, 0, {}},                                     // 9C
+    {"popf", 0, 0, {}},                                      // 9D
+    {"sahf", 0, 0, {}},                                      // 9E
+    {"lahf", 0, 0, {}},                                      // 9F
+    {"mov", 0, 0, {DA_AL, DA_OB}},                           // A0
+    {"mov", 0, 0, {DA_AX, DA_OV}},                           // A1
+    {"mov", 0, 0, {DA_OB, DA_AL}},                           // A2
+    {"mov", 0, 0, {DA_OV, DA_AX}},                           // A3
+    {"movsb", 0, 0, {}},                                     // A4
+    {"movsw", 0, 0, {}},                                     // A5
+    {"cmpsb", 0, 0, {}},                                     // A6
+    {"cmpsw", 0, 0, {}},                                     // A7
+    {"test", 0, 0, {DA_AL, DA_IB}},                          // A8
+    {"test", 0, 0, {DA_AX, DA_IV}},                          // A9
+    {"stosb", 0, 0, {}},                                     // AA
+    {"stosw", 0, 0, {}},                                     // AB
+    {"lodsb", 0, 0, {}},                                     // AC
+    {"lodsw", 0, 0, {}},                                     // AD
+    {"scasb", 0, 0, {}},                                     // AE
+    {"scasw", 0, 0, {}},                                     // AF
+    {"mov", 0, 0, {DA_RB, DA_IB}},                           // B0
+    {"mov", 0, 0, {DA_RB, DA_IB}},                           // B1
+    {"mov", 0, 0, {DA_RB, DA_IB}},                           // B2
+    {"mov", 0, 0, {DA_RB, DA_IB}},                           // B3
+    {"mov", 0, 0, {DA_RB, DA_IB}},                           // B4
+    {"mov", 0, 0, {DA_RB, DA_IB}},                           // B5
+    {"mov", 0, 0, {DA_RB, DA_IB}},                           // B6
+    {"mov", 0, 0, {DA_RB, DA_IB}},                           // B7
+    {"mov", 0, 0, {DA_RV, DA_IV}},                           // B8
+    {"mov", 0, 0, {DA_RV, DA_IV}},                           // B9
+    {"mov", 0, 0, {DA_RV, DA_IV}},                           // BA
+    {"mov", 0, 0, {DA_RV, DA_IV}},                           // BB
+    {"mov", 0, 0, {DA_RV, DA_IV}},                           // BC
+    {"mov", 0, 0, {DA_RV, DA_IV}},                           // BD
+    {"mov", 0, 0, {DA_RV, DA_IV}},                           // BE
+    {"mov", 0, 0, {DA_RV, DA_IV}},                           // BF
+    {nullptr, DG_SHIFT, 0, {DA_EB, DA_IB}},                  // C0
+    {nullptr, DG_SHIFT, 0, {DA_EV, DA_IB}},                  // C1
+    {"ret", 0, DF_FLOW, {DA_IV}},                            // C2
+    {"ret", 0, DF_FLOW, {}},                                 // C3
+    {"les", 0, 0, {DA_GV, DA_M}},                            // C4
+    {"lds", 0, 0, {DA_GV, DA_M}},                            // C5
+    {nullptr, DG_MOV, 0, {DA_EB, DA_IB}},                    // C6
+    {nullptr, DG_MOV, 0, {DA_EV, DA_IV}},                    // C7
+    {"enter", 0, 0, {DA_IV, DA_IB}},                         // C8
+    {"leave", 0, 0, {}},                                     // C9
+    {"retf", 0, DF_FLOW, {DA_IV}},                           // CA
+    {"retf", 0, DF_FLOW, {}},                                // CB
+    {"int", 0, DF_FLOW, {DA_THREE}},                         // CC
+    {"int", 0, DF_FLOW, {DA_IB}},                            // CD
+    {"into", 0, 0, {}},                                      // CE
+    {"iret", 0, DF_FLOW, {}},                                // CF
+    {nullptr, DG_SHIFT, 0, {DA_EB, DA_ONE}},                 // D0
+    {nullptr, DG_SHIFT, 0, {DA_EV, DA_ONE}},                 // D1
+    {nullptr, DG_SHIFT, 0, {DA_EB, DA_CL}},                  // D2
+    {nullptr, DG_SHIFT, 0, {DA_EV, DA_CL}},                  // D3
+    {"aam", 0, 0, {DA_IB}},                                  // D4
+    {"aad", 0, 0, {DA_IB}},                                  // D5
+    {nullptr, 0, 0, {}},                                     // D6
+    {"xlat", 0, 0, {}},                                      // D7
+    {"esc", 0, 0, {DA_ESC}},                                 // D8
+    {"esc", 0, 0, {DA_ESC}},                                 // D9
+    {"esc", 0, 0, {DA_ESC}},                                 // DA
+    {"esc", 0, 0, {DA_ESC}},                                 // DB
+    {"esc", 0, 0, {DA_ESC}},                                 // DC
+    {"esc", 0, 0, {DA_ESC}},                                 // DD
+    {"esc", 0, 0, {DA_ESC}},                                 // DE
+    {"esc", 0, 0, {DA_ESC}},                                 // DF
+    {"loopnz", 0, 0, {DA_JB}},                               // E0
+    {"loopz", 0, 0, {DA_JB}},                                // E1
+    {"loop", 0, 0, {DA_JB}},                                 // E2
+    {"jcxz", 0, 0, {DA_JB}},                                 // E3
+    {"in", 0, 0, {DA_AL, DA_IB}},                            // E4
+    {"in", 0, 0, {DA_AX, DA_IB}},                            // E5
+    {"out", 0, 0, {DA_IB, DA_AL}},                           // E6
+    {"out", 0, 0, {DA_IB, DA_AX}},                           // E7
+    {"call", 0, DF_FLOW, {DA_JV}},                           // E8
+    {"jmp", 0, DF_FLOW, {DA_JV}},                            // E9
+    {"jmp", 0, DF_FLOW, {DA_AP}},                            // EA
+    {"jmp", 0, DF_FLOW, {DA_JB}},                            // EB
+    {"in", 0, 0, {DA_AL, DA_DX}},                            // EC
+    {"in", 0, 0, {DA_AX, DA_DX}},                            // ED
+    {"out", 0, 0, {DA_DX, DA_AL}},                           // EE
+    {"out", 0, 0, {DA_DX, DA_AX}},                           // EF
+    {"lock", 0, DF_PREFIX, {}},                              // F0
+    {nullptr, 0, 0, {}},                                     // F1
+    {"repne", 0, DF_PREFIX, {}},                             // F2
+    {"rep", 0, DF_PREFIX, {}},                               // F3
+    {"hlt", 0, DF_FLOW, {}},                                 // F4
+    {"cmc", 0, 0, {}},                                       // F5
+    {nullptr, DG_UNARY8, 0, {DA_EB}},                        // F6
+    {nullptr, DG_UNARY16, 0, {DA_EV}},                       // F7
+    {"clc", 0, 0, {}},                                       // F8
+    {"stc", 0, 0, {}},                                       // F9
+    {"cli", 0, 0, {}},                                       // FA
+    {"sti", 0, 0, {}},                                       // FB
+    {"cld", 0, 0, {}},                                       // FC
+    {"std", 0, 0, {}},                                       // FD
+    {nullptr, DG_INCDEC, 0, {DA_EB}},                        // FE
+    {nullptr, DG_MISC, 0, {DA_EV}},                          // FF
+
+};
+
+constexpr DisasmOp disasm_groups[][8] = {
+    // DG_ALU
+    {{"add"}, {"or"}, {"adc"}, {"sbb"}, {"and"}, {"sub"}, {"xor"}, {"cmp"}},
+    // DG_SHIFT (/6 is an undocumented alias of shl, as /1 of test below)
+    {{"rol"}, {"ror"}, {"rcl"}, {"rcr"}, {"shl"}, {"shr"}, {"shl"}, {"sar"}},
+    // DG_UNARY8
+    {{"test", 0, 0, {DA_EB, DA_IB}},
+     {"test", 0, 0, {DA_EB, DA_IB}},
+     {"not"},
+     {"neg"},
+     {"mul"},
+     {"imul"},
+     {"div"},
+     {"idiv"}},
+    // DG_UNARY16
+    {{"test", 0, 0, {DA_EV, DA_IV}},
+     {"test", 0, 0, {DA_EV, DA_IV}},
+     {"not"},
+     {"neg"},
+     {"mul"},
+     {"imul"},
+     {"div"},
+     {"idiv"}},
+    // DG_INCDEC
+    {{"inc"}, {"dec"}, {}, {}, {}, {}, {}, {}},
+    // DG_MISC
+    {{"inc"},
+     {"dec"},
+     {"call", 0, DF_FLOW, {DA_EV}},
+     {"call", 0, DF_FLOW, {DA_MP}},
+     {"jmp", 0, DF_FLOW, {DA_EV}},
+     {"jmp", 0, DF_FLOW, {DA_MP}},
+     {"push"},
+     {}},
+    // DG_POP
+    {{"pop"}, {}, {}, {}, {}, {}, {}, {}},
+    // DG_MOV
+    {{"mov"}, {}, {}, {}, {}, {}, {}, {}},
+};
+
+// V30 0F page, second bytes 10-3F. FF is BRKEM imm8.
+constexpr DisasmOp disasm_ops_0f[0x30] = {
+    {"test1", 0, 0, {DA_EB, DA_CL}}, // 10
+    {"test1", 0, 0, {DA_EV, DA_CL}}, // 11
+    {"clr1", 0, 0, {DA_EB, DA_CL}},  // 12
+    {"clr1", 0, 0, {DA_EV, DA_CL}},  // 13
+    {"set1", 0, 0, {DA_EB, DA_CL}},  // 14
+    {"set1", 0, 0, {DA_EV, DA_CL}},  // 15
+    {"not1", 0, 0, {DA_EB, DA_CL}},  // 16
+    {"not1", 0, 0, {DA_EV, DA_CL}},  // 17
+    {"test1", 0, 0, {DA_EB, DA_IB}}, // 18
+    {"test1", 0, 0, {DA_EV, DA_IB}}, // 19
+    {"clr1", 0, 0, {DA_EB, DA_IB}},  // 1A
+    {"clr1", 0, 0, {DA_EV, DA_IB}},  // 1B
+    {"set1", 0, 0, {DA_EB, DA_IB}},  // 1C
+    {"set1", 0, 0, {DA_EV, DA_IB}},  // 1D
+    {"not1", 0, 0, {DA_EB, DA_IB}},  // 1E
+    {"not1", 0, 0, {DA_EV, DA_IB}},  // 1F
+    {"add4s"},                       // 20
+    {},                              // 21
+    {"sub4s"},                       // 22
+    {},                              // 23
+    {},                              // 24
+    {},                              // 25
+    {"cmp4s"},                       // 26
+    {},                              // 27
+    {"rol4", 0, 0, {DA_EB}},         // 28
+    {},                              // 29
+    {"ror4", 0, 0, {DA_EB}},         // 2A
+    {},                              // 2B
+    {},                              // 2C
+    {},                              // 2D
+    {},                              // 2E
+    {},                              // 2F
+    {},                              // 30
+    {"ins", 0, 0, {DA_EB, DA_GB}},   // 31
+    {},                              // 32
+    {"ext", 0, 0, {DA_EB, DA_GB}},   // 33
+    {},                              // 34
+    {},                              // 35
+    {},                              // 36
+    {},                              // 37
+    {},                              // 38
+    {"ins", 0, 0, {DA_EB, DA_IB}},   // 39
+    {},                              // 3A
+    {"ext", 0, 0, {DA_EB, DA_IB}},   // 3B
+    {},                              // 3C
+    {},                              // 3D
+    {},                              // 3E
+    {},                              // 3F
+};
+constexpr DisasmOp disasm_brkem = {"brkem", 0, DF_FLOW, {DA_IB}};
+
+// Bounds-checked reader over the caller's byte window
+struct DisasmCursor {
+  const uint8_t *p;
+  int avail;
+  int pos;
+  bool ok;
+  uint8_t u8() {
+    if (pos >= avail) {
+      ok = false;
+      return 0;
+    }
+    return p[pos++];
+  }
+  uint16_t u16() {
+    uint8_t lo = u8();
+    return lo | (u8() << 8);
+  }
+};
+
+/**
+ * @brief 命令がModRMバイトを持つかを返します。
+ * @param op 命令の表の要素
+ * @return ModRMバイトを持つ場合true
+ */
+bool disasm_has_modrm(const DisasmOp &op) {
+  if (op.group)
+    return true;
+  for (uint8_t k : op.op) {
+    if ((k >= DA_EB && k <= DA_MP) || k == DA_ESC)
+      return true;
+  }
+  return false;
+}
+
+/**
+ * @brief 1命令を逆アセンブルします。
+ * @param code 命令の先頭からのバイト列
+ * @param avail codeの有効なバイト数
+ * @param addr 命令の物理アドレス (相対分岐の飛び先の表示用)
+ * @param out 結果の文字列の格納先 (DISASM_TEXTバイト以上)
+ * @param flow 命令が次の命令へ進まない場合trueを格納します (NULL可)
+ * @return 命令のバイト数。availが足りない場合0
+ */
+int disasm_decode(const uint8_t *code, int avail, uint32_t addr, char *out,
+                  bool *flow) {
+  DisasmCursor c = {code, avail, 0, true};
+  const char *seg = nullptr, *rep = nullptr;
+  bool lock = false;
+  const DisasmOp *op;
+  uint8_t opcode;
+  for (int n = 0;; n++) {
+    opcode = c.u8();
+    if (!c.ok)
+      return 0;
+    op = &disasm_ops[opcode];
+    if (!(op->flags & DF_PREFIX))
+      break;
+    if (n == DISASM_MAX_PREFIXES) {
+      op = nullptr;
+      break;
+    }
+    if (op->flags & DF_SEG)
+      seg = op->mn;
+    else if (opcode == 0xF0)
+      lock = true;
+    else
+      rep = op->mn;
+  }
+  if (op && opcode == 0x0F) {
+    uint8_t op2 = c.u8();
+    if (!c.ok)
+      return 0;
+    op = op2 == 0xFF ? &disasm_brkem
+         : (op2 >= 0x10 && op2 < 0x40 && disasm_ops_0f[op2 - 0x10].mn)
+             ? &disasm_ops_0f[op2 - 0x10]
+             : nullptr;
+  }
+
+  uint8_t modrm = 0;
+  const char *mn = op ? op->mn : nullptr;
+  const uint8_t *kinds = op ? op->op : nullptr;
+  uint8_t flags = op ? op->flags : 0;
+  if (op && disasm_has_modrm(*op)) {
+    modrm = c.u8();
+    if (op->group) {
+      const DisasmOp &g = disasm_groups[op->group - 1][(modrm >> 3) & 7];
+      mn = g.mn;
+      if (g.op[0] != DA_NONE)
+        kinds = g.op;
+      flags |= g.flags;
+    }
+  }
+  int mod = modrm >> 6, rm = modrm & 7;
+  for (int i = 0; mn && i < 3; i++) {
+    if ((kinds[i] == DA_M || kinds[i] == DA_MP) && mod == 3)
+      mn = nullptr; // lea, les, lds, bound need a memory operand
+  }
+  if (!mn) {
+    sprintf(out, "db 0x%02X", code[0]);
+    if (flow)
+      *flow = false;
+    return 1;
+  }
+
+  // Displacement of a memory r/m operand
+  int16_t disp = 0;
+  bool direct = false;
+  if (op && disasm_has_modrm(*op) && mod != 3) {
+    if (mod == 0 && rm == 6) {
+      direct = true;
+      disp = c.u16();
+    } else if (mod == 1) {
+      disp = (int8_t)c.u8();
+    } else if (mod == 2) {
+      disp = c.u16();
+    }
+  }
+
+  // A memory operand needs a size unless a register operand implies it
+  bool sized = false;
+  for (int i = 0; i < 3; i++) {
+    uint8_t k = kinds[i];
+    if (k == DA_GB || k == DA_GV || k == DA_SW || k == DA_AL ||
+        k == DA_AX || k == DA_RB || k == DA_RV)
+      sized = true;
+  }
+
+  char ops[DISASM_TEXT] = {0};
+  char *p = ops;
+  bool seg_used = false;
+  for (int i = 0; i < 3 && kinds[i] != DA_NONE; i++) {
+    uint8_t k = kinds[i];
+    if (i > 0)
+      p += sprintf(p, ", ");
+    switch (k) {
+    case DA_ESC:
+      p += sprintf(p, "0x%02X, ", ((opcode & 7) << 3) | ((modrm >> 3) & 7));
+      // fall through
+    case DA_EB:
+    case DA_EV:
+    case DA_M:
+    case DA_MP:
+      if (mod == 3) {
+        p += sprintf(p, "%s", k == DA_EB ? reg_names8[rm] : reg_names[rm]);
+        break;
+      }
+      if (k == DA_MP)
+        p += sprintf(p, "far ");
+      else if (!sized && (k == DA_EB || k == DA_EV))
+        p += sprintf(p, k == DA_EB ? "byte " : "word ");
+      if (seg) {
+        p += sprintf(p, "%s", seg);
+        seg_used = true;
+      }
+      if (direct)
+        p += sprintf(p, "[0x%04X]", (uint16_t)disp);
+      else if (disp)
+        p += sprintf(p, "[%s%c0x%X]", modrm_bases[rm], disp < 0 ? '-' : '+',
+                     disp < 0 ? -disp : disp);
+      else
+        p += sprintf(p, "[%s]", modrm_bases[rm]);
+      break;
+    case DA_GB:
+      p += sprintf(p, "%s", reg_names8[(modrm >> 3) & 7]);
+      break;
+    case DA_GV:
+      p += sprintf(p, "%s", reg_names[(modrm >> 3) & 7]);
+      break;
+    case DA_SW:
+      p += sprintf(p, "%s", sreg_names[(modrm >> 3) & 3]);
+      break;
+    case DA_IB:
+      p += sprintf(p, "0x%02X", c.u8());
+      break;
+    case DA_IV:
+      p += sprintf(p, "0x%04X", c.u16());
+      break;
+    case DA_IBS: {
+      int8_t v = c.u8();
+      p += sprintf(p, "%s0x%02X", v < 0 ? "-" : "", v < 0 ? -v : v);
+      break;
+    }
+    case DA_JB:
+    case DA_JV: {
+      int16_t rel = k == DA_JB ? (int8_t)c.u8() : (int16_t)c.u16();
+      p += sprintf(p, "0x%05lX", (addr + c.pos + rel) & 0xFFFFF);
+      break;
+    }
+    case DA_AP: {
+      uint16_t off = c.u16();
+      p += sprintf(p, "far 0x%04X:0x%04X", c.u16(), off);
+      break;
+    }
+    case DA_OB:
+    case DA_OV:
+      if (seg) {
+        p += sprintf(p, "%s", seg);
+        seg_used = true;
+      }
+      p += sprintf(p, "[0x%04X]", c.u16());
+      break;
+    case DA_AL:
+      p += sprintf(p, "al");
+      break;
+    case DA_AX:
+      p += sprintf(p, "ax");
+      break;
+    case DA_CL:
+      p += sprintf(p, "cl");
+      break;
+    case DA_DX:
+      p += sprintf(p, "dx");
+      break;
+    case DA_ONE:
+      p += sprintf(p, "1");
+      break;
+    case DA_THREE:
+      p += sprintf(p, "3");
+      break;
+    case DA_RB:
+      p += sprintf(p, "%s", reg_names8[opcode & 7]);
+      break;
+    case DA_RV:
+      p += sprintf(p, "%s", reg_names[opcode & 7]);
+      break;
+    case DA_ES:
+    case DA_CS:
+    case DA_SS:
+    case DA_DS:
+      p += sprintf(p, "%s", sreg_names[k - DA_ES]);
+      break;
+    }
+  }
+  if (!c.ok)
+    return 0;
+
+  sprintf(out, "%s%s%s%s%s%s", lock ? "lock " : "", rep ? rep : "",
+          rep ? " " : "", seg && !seg_used ? seg : "",
+          seg && !seg_used ? " " : "", mn);
+  if (ops[0])
+    sprintf(out + strlen(out), " %s", ops);
+  if (flow)
+    *flow = flags & DF_FLOW;
+  return c.pos;
+}
+
+// --- Trace Annotation ---
+// The V30 has no queue status pins on this board, so code fetches are told
+// from data reads by their addresses: a fetch continues the current stream
+// of sequential memory reads. A read elsewhere starts a candidate stream,
+// which replaces the current one once the next read continues it (a jump
+// target); otherwise it was data. Instructions are printed when their last
+// byte has been fetched. After an unconditional transfer the rest of the
+// prefetched stream is not executed and is not decoded.
+struct FetchStream {
+  bool valid;
+  bool stopped;  // Past a DF_FLOW instruction
+  uint32_t base; // V30 address of buf[0], the next undecoded byte
+  uint8_t len;
+  uint8_t buf[DISASM_WINDOW];
+};
+struct FetchTracker {
+  FetchStream cur, cand;
+};
+
+/**
+ * @brief ストリームにバイトを追加します。
+ * @param s 追加先
+ * @param b バイト列
+ * @param n バイト数
+ * @return なし
+ */
+void fetch_append(FetchStream &s, const uint8_t *b, int n) {
+  for (int i = 0; i < n; i++) {
+    if (s.len == DISASM_WINDOW) { // Undecodable run, start afresh
+      s.base += s.len;
+      s.len = 0;
+    }
+    s.buf[s.len++] = b[i];
+  }
+}
+
+/**
+ * @brief バスログの1件を取り込み、取り込みで揃った命令を表示します。
+ * @param t 状態 (最初の呼び出しの前に0で初期化します)
+ * @param rec バスサイクルの記録
+ * @return なし
+ */
+void fetch_track(FetchTracker &t, const BusLog &rec) {
+  if (rec.type != LOG_MEM_RD)
+    return;
+  // Bytes the cycle read: the word at an even address, or one byte
+  uint32_t start = rec.address;
+  uint8_t b[2];
+  int n = 1;
+  if (start & 1) {
+    b[0] = rec.data >> 8;
+  } else {
+    b[0] = rec.data & 0xFF;
+    if (rec.ctrl & 1) // BHE low
+      b[n++] = rec.data >> 8;
+  }
+
+  auto extends = [start](const FetchStream &s) {
+    return s.valid && ((s.base + s.len) & 0xFFFFF) == start;
+  };
+  if (extends(t.cur)) {
+    fetch_append(t.cur, b, n);
+  } else if (extends(t.cand)) {
+    t.cur = t.cand;
+    t.cand.valid = false;
+    fetch_append(t.cur, b, n);
+  } else {
+    t.cand = {true, false, start, 0, {}};
+    fetch_append(t.cand, b, n);
+    return;
+  }
+
+  FetchStream &s = t.cur;
+  while (s.len > 0) {
+    int used = s.len; // Stopped streams are only followed, not decoded
+    if (!s.stopped) {
+      char text[DISASM_TEXT];
+      bool flow;
+      used = disasm_decode(s.buf, s.len, s.base, text, &flow);
+      if (used == 0)
+        break;
+      printf("      ; %05lX: %s\n", s.base, text);
+      s.stopped = flow;
+    }
+    memmove(s.buf, s.buf + used, s.len - used);
+    s.len -= used;
+    s.base = (s.base + used) & 0xFFFFF;
+  }
+}
+
+// --- Trace Log Access (Core 0) ---
+struct CompactReader {
+  const uint8_t *p;
+  const uint8_t *end;
+  CompactState cs;
+};
+
+/**
+ * @brief コンパクト形式のレコードを1件復号します。
+ * @param r 読み出し位置と復号の状態
+ * @param rec 復号したレコードの格納先
+ * @return 復号できた場合true、データの終わりまたは不正なデータの場合false
+ */
+bool compact_next(CompactReader &r, BusLog &rec) {
+  if (r.p >= r.end)
+    return false;
+  CompactState &cs = r.cs;
+  if (cs.since_sync++ == COMPACT_SYNC_INTERVAL) {
+    cs.valid = 0;
+    cs.since_sync = 1;
+  }
+  uint8_t hdr = *r.p++;
+  uint32_t t = (hdr >> 3) & 3;
+  uint32_t am = hdr >> 6;
+  uint32_t dm = (hdr >> 1) & 3;
+  int len = (am == 3 ? 3 : am) + (dm == 0 ? 2 : (dm == 2 ? 0 : 1));
+  if (r.end - r.p < len || (am != 3 && !(cs.valid & (1u << t))) ||
+      (dm == 2 && !(cs.valid & 0x10)))
+    return false;
+
+  uint32_t addr = cs.prev_addr[t];
+  if (am == 0) {
+    addr += 2;
+  } else if (am == 1) {
+    addr += (int8_t)r.p[0];
+  } else if (am == 2) {
+    addr += (int16_t)(r.p[0] | (r.p[1] << 8));
+  } else {
+    addr = r.p[0] | (r.p[1] << 8) | ((uint32_t)r.p[2] << 16);
+  }
+  r.p += (am == 3 ? 3 : am);
+
+  uint16_t d = cs.prev_data;
+  if (dm == 0) {
+    d = r.p[0] | (r.p[1] << 8);
+    r.p += 2;
+  } else if (dm == 1) {
+    d = r.p[0];
+    r.p += 1;
+  } else if (dm == 3) {
+    d = r.p[0] | (r.p[0] << 8);
+    r.p += 1;
+  }
+
+  cs.prev_addr[t] = addr;
+  cs.prev_data = d;
+  cs.valid |= 0x10 | (1u << t);
+  rec = {addr, d, (uint8_t)(t + 1), (uint8_t)((hdr >> 5) & 1)};
+  return true;
+}
+
+/**
+ * @brief バッファに記録されたログを表形式で表示します。
+ * @param annotate trueの場合、命令フェッチと見られる読み込みから復元した
+ * 命令を併せて表示します (Trace Annotation)
+ * @return なし
+ */
+void print_trace_log(bool annotate) {
+  FetchTracker ft = {};
+  const char *types[] = {"RD", "WR", "IR", "IW"};
+  if (trace_filter.trig != TRIG_NONE && !trace_triggered)
+    printf("(Trigger not hit, showing the pre-trigger buffer only)\n");
+  printf("ADDR  |B|TY|DATA\n");
+  if (trace_format == TRACE_FMT_COMPACT) {
+    CompactReader r = {trace_bytes() + COMPACT_HEADER_SIZE,
+                       trace_bytes() + COMPACT_HEADER_SIZE +
+                           trace_compact_bytes};
+    compact_reset(r.cs);
+    BusLog rec;
+    while (compact_next(r, rec)) {
+      printf("%05lX|%s|%s|%04X\n", rec.address, (rec.ctrl & 1 ? "B" : "-"),
+             types[rec.type - 1], rec.data);
+      if (annotate)
+        fetch_track(ft, rec);
+    }
+    return;
+  }
+  for (int i = 0; i < MAX_CYCLES; i++) {
+    if (trace_log[i].type != LOG_UNUSED) {
+      // Type is now 1-based (0 is unused)
+      if (trace_log[i].type > 0 && trace_log[i].type <= 4) {
+        printf("%05lX|%s|%s|%04X\n", trace_log[i].address,
+               (trace_log[i].ctrl & 1 ? "B" : "-"),
+               types[trace_log[i].type - 1], trace_log[i].data);
+        if (annotate)
+          fetch_track(ft, trace_log[i]);
+      }
+    }
+  }
+}
+
+/**
+ * @brief トレースの記録形式を切り替えます。
+ * @param format TRACE_FMT_RAW または TRACE_FMT_COMPACT
+ * @return なし
+ */
+void set_trace_format(uint8_t format) {
+  trace_format = format;
+  // The buffered log is only readable in the format it was taken in
+  memset(trace_log, 0, sizeof(trace_log));
+  trace_compact_bytes = 0;
+}
+
+/**
+ * @brief サイクル種別の指定 (m/i/r/w の組み合わせ) を解釈します。
+ * m: メモリ, i: I/O, r: 読み込み, w: 書き込み。省略した側は両方を含みます。
+ * @param s 指定文字列 (NULLなら全種別)
+ * @return 種別のビットマスク (不正な文字がある場合0)
+ */
+uint8_t parse_trace_types(const char *s) {
+  uint8_t space = 0, dir = 0;
+  for (; s && *s; s++) {
+    switch (*s) {
+    case 'm': space |= 0x3; break; // LOG_MEM_RD, LOG_MEM_WR
+    case 'i': space |= 0xC; break; // LOG_IO_RD, LOG_IO_WR
+    case 'r': dir |= 0x5; break;
+    case 'w': dir |= 0xA; break;
+    default: return 0;
+    }
+  }
+  return (space ? space : TRACE_TYPE_ALL) & (dir ? dir : TRACE_TYPE_ALL);
+}
+
+/**
+ * @brief 種別のビットマスクを m/i/r/w 形式で表示します。
+ * @param types 種別のビットマスク
+ * @return なし
+ */
+void print_trace_types(uint8_t types) {
+  const char *types_str[] = {"RD", "WR", "IR", "IW"};
+  for (int t = 0; t < 4; t++) {
+    if (types & (1 << t))
+      printf(" %s", types_str[t]);
+  }
+}
+
+/**
+ * @brief 'tr' (trace filter)
+ * コマンドを処理します。ログを取るアドレス範囲とトリガを設定・表示します。
+ * @param arg_str コマンドの引数文字列
+ * @return なし
+ */
+void cmd_trace_filter(const char *arg_str) {
+  char args[128];
+  strncpy(args, arg_str, sizeof(args) - 1);
+  args[sizeof(args) - 1] = 0;
+  char *sub = strtok(args, " ");
+  char *a1 = strtok(NULL, " ");
+  char *a2 = strtok(NULL, " ");
+  char *a3 = strtok(NULL, " ");
+  TraceFilter &f = trace_filter;
+
+  if (!sub) {
+    // Show the current settings below
+  } else if (strcmp(sub, "clear") == 0) {
+    f.rules = 0;
+    f.trig = TRIG_NONE;
+    f.pre = 0;
+  } else if (strcmp(sub, "add") == 0) {
+    uint8_t types = parse_trace_types(a3);
+    if (!a1 || !a2 || !types) {
+      printf("Usage: tr add <lo> <hi> [m|i][r|w]\n");
+      return;
+    }
+    if (f.rules == TRACE_FILTER_RULES) {
+      printf("Error: At most %d rules.\n", TRACE_FILTER_RULES);
+      return;
+    }
+    f.rule[f.rules++] = {(uint32_t)strtol(a1, NULL, 16),
+                         (uint32_t)strtol(a2, NULL, 16), types};
+  } else if (strcmp(sub, "port") == 0) {
+    if (!a1) {
+      printf("Usage: tr port <port>\n");
+      return;
+    }
+    trace_com_port = strtol(a1, NULL, 16);
+  } else if (strcmp(sub, "trig") == 0) {
+    if (a1 && strcmp(a1, "off") == 0) {
+      f.trig = TRIG_NONE;
+    } else if (a1 && strcmp(a1, "cycles") == 0 && a2) {
+      f.trig = TRIG_CYCLES;
+      f.trig_arg = strtol(a2, NULL, 10);
+    } else if (a1 && parse_trace_types(a2)) {
+      f.trig = TRIG_ACCESS;
+      f.trig_arg = strtol(a1, NULL, 16);
+      f.trig_types = parse_trace_types(a2);
+    } else {
+      printf("Usage: tr trig <addr> [m|i][r|w] | cycles <n> | off\n");
+      return;
+    }
+  } else if (strcmp(sub, "pre") == 0) {
+    int n = a1 ? strtol(a1, NULL, 10) : -1;
+    if (n < 0 || n >= MAX_CYCLES) {
+      printf("Usage: tr pre <0-%d>\n", MAX_CYCLES - 1);
+      return;
+    }
+    f.pre = n;
+  } else {
+    printf("Error: Unknown subcommand '%s'. Use add, port, trig, pre or "
+           "clear.\n",
+           sub);
+    return;
+  }
+
+  printf("COM log port: %03X\n", trace_com_port);
+  if (f.rules == 0)
+    printf("Rules: none (log everything the mode selects)\n");
+  for (uint32_t i = 0; i < f.rules; i++) {
+    printf("Rule %lu: %05lX-%05lX", i, f.rule[i].lo, f.rule[i].hi);
+    print_trace_types(f.rule[i].types);
+    printf("\n");
+  }
+  if (f.trig == TRIG_NONE) {
+    printf("Trigger: off\n");
+    return;
+  }
+  if (f.trig == TRIG_CYCLES) {
+    printf("Trigger: after %lu bus cycles", f.trig_arg);
+  } else {
+    printf("Trigger: %05lX", f.trig_arg);
+    print_trace_types(f.trig_types);
+  }
+  printf(", %lu pre-trigger cycles%s\n", f.pre,
+         f.pre && trace_format != TRACE_FMT_RAW ? " (raw format only)" : "");
+}
+
+/**
+ * @brief watch[]からwatch_mapを作り直します (Core 0、実行していない間)。
+ * @param なし
+ * @return なし
+ */
+void watch_rebuild() {
+  memset(watch_map, 0, sizeof(watch_map));
+  for (uint32_t i = 0; i < watch_count; i++) {
+    for (uint32_t g = watch[i].lo >> WATCH_GRANULE_SHIFT;
+         g <= watch[i].hi >> WATCH_GRANULE_SHIFT; g++)
+      watch_map[g / 32] |= 1u << (g % 32);
+  }
+}
+
+/**
+ * @brief Core 1がバスのタイムアウトや再同期で実行を終えた場合、その理由を
+ * 表示します (Core 0)。
+ * @param なし
+ * @return なし
+ */
+void bus_report_end() {
+  if (!bus_end_pending)
+    return;
+  bus_end_pending = false;
+  if (run_end_reason == RUN_END_NO_ALE)
+    printf("Bus operation timeout (no ale), halt cpu.\n");
+  else if (run_end_reason == RUN_END_NO_STROBE)
+    printf("Bus operation timeout (no RD/WR detected low), breaking "
+           "cycle.\n");
+  else if (run_end_reason == RUN_END_RESYNC)
+    printf("ALE detected high unexpectedly during RD/WR wait, breaking "
+           "current bus operation.\n");
+}
+
+/**
+ * @brief Core 1が記録したウォッチポイントの一致を表示します (Core 0)。
+ * @param なし
+ * @return なし
+ */
+void watch_report_hit() {
+  if (!watch_hit_pending)
+    return;
+  watch_hit_pending = false;
+  printf("Watchpoint %d hit: %s %05lX = %04X (bus cycle %lu)\n",
+         watch_hit.index, watch_hit.type == LOG_MEM_WR ? "WR" : "RD",
+         watch_hit.addr, watch_hit.data, watch_hit.cycle);
+}
+
+/**
+ * @brief ウォッチポイントを追加します。
+ * @param addr V30のアドレス
+ * @param len バイト数
+ * @param types WATCH_READ / WATCH_WRITE
+ * @return 追加できた場合true
+ */
+bool watch_add(uint32_t addr, uint32_t len, uint8_t types) {
+  uint32_t lo = map_address(addr);
+  if (watch_count == WATCH_POINTS || len == 0 || len > RAM_SIZE - lo ||
+      !types)
+    return false;
+  watch[watch_count++] = {lo, lo + len - 1, types};
+  watch_rebuild();
+  return true;
+}
+
+/**
+ * @brief 'wp' (watchpoint) / 'bp' (breakpoint)
+ * コマンドを処理します。メモリへのアクセスでV30を停止する条件を設定・表示します。
+ * ブレークポイントは命令フェッチ(読み込み)のウォッチポイントで、
+ * 先読みのため実行より少し前に成立することがあります。
+ * @param arg_str コマンドの引数文字列
+ * @param breakpoint 'bp'の場合true
+ * @return なし
+ */
+void cmd_watch(const char *arg_str, bool breakpoint) {
+  char args[128];
+  strncpy(args, arg_str, sizeof(args) - 1);
+  args[sizeof(args) - 1] = 0;
+  char *a1 = strtok(args, " ");
+  char *a2 = strtok(NULL, " ");
+  char *a3 = strtok(NULL, " ");
+
+  if (!a1) {
+    // List below
+  } else if (strcmp(a1, "clear") == 0) {
+    watch_count = 0;
+    watch_rebuild();
+  } else if (strcmp(a1, "del") == 0) {
+    int n = a2 ? strtol(a2, NULL, 10) : -1;
+    if (n < 0 || n >= watch_count) {
+      printf("Error: No watchpoint %d.\n", n);
+      return;
+    }
+    for (int i = n; i + 1 < watch_count; i++)
+      watch[i] = watch[i + 1];
+    watch_count--;
+    watch_rebuild();
+  } else {
+    uint32_t addr = strtol(a1, NULL, 16);
+    uint32_t len = 1;
+    uint8_t types = breakpoint ? WATCH_READ : WATCH_WRITE;
+    if (!breakpoint) {
+      if (a2)
+        len = strtol(a2, NULL, 16);
+      if (a3)
+        types = (strchr(a3, 'r') ? WATCH_READ : 0) |
+                (strchr(a3, 'w') ? WATCH_WRITE : 0);
+    }
+    if (!watch_add(addr, len, types)) {
+      printf("Error: Cannot add watchpoint (max %d, range inside RAM).\n",
+             WATCH_POINTS);
+      return;
+    }
+  }
+
+  if (watch_count == 0)
+    printf("No watchpoints.\n");
+  for (uint32_t i = 0; i < watch_count; i++) {
+    printf("%lu: %05lX-%05lX %s%s\n", i, watch[i].lo, watch[i].hi,
+           watch[i].types & WATCH_READ ? "R" : "",
+           watch[i].types & WATCH_WRITE ? "W" : "");
+  }
+}
+
+/**
+ * @brief プロファイラを設定し、ヒストグラムを消去します (実行していない間)。
+ * @param period 何回のメモリ読み込みごとに1回数えるか (0で停止)
+ * @param bucket_shift バケットの大きさ (4: 16バイト, 8: 256バイト)
+ * @return なし
+ */
+void prof_setup(uint32_t period, uint8_t bucket_shift) {
+  memset(prof_hist, 0, sizeof(prof_hist));
+  prof_samples = 0;
+  prof_shift = bucket_shift;
+  prof_countdown = period ? period : 1;
+  prof_period = period;
+}
+
+/**
+ * @brief 'pf' (profile)
+ * コマンドを処理します。サンプリングプロファイラの設定と、回数の多い
+ * アドレス範囲の表示・送信を行います。
+ * @param arg_str コマンドの引数文字列
+ * @return なし
+ */
+void cmd_profile(const char *arg_str) {
+  char args[128];
+  strncpy(args, arg_str, sizeof(args) - 1);
+  args[sizeof(args) - 1] = 0;
+  char *sub = strtok(args, " ");
+  char *a1 = strtok(NULL, " ");
+  char *a2 = strtok(NULL, " ");
+  int top = 16;
+
+  if (sub && strcmp(sub, "on") == 0) {
+    int bucket = a1 ? strtol(a1, NULL, 10) : 16;
+    int period = a2 ? strtol(a2, NULL, 10) : 16;
+    if ((bucket != 16 && bucket != 256) || period <= 0) {
+      printf("Usage: pf on [16|256] [period]\n");
+      return;
+    }
+    prof_setup(period, bucket == 16 ? 4 : 8);
+    printf("Profiler on: 1 sample per %d memory reads, %d-byte buckets "
+           "(g and h runs).\n",
+           period, bucket);
+    return;
+  } else if (sub && strcmp(sub, "off") == 0) {
+    prof_period = 0;
+    printf("Profiler off.\n");
+    return;
+  } else if (sub && strcmp(sub, "clear") == 0) {
+    prof_setup(prof_period, prof_shift);
+    printf("Profile cleared.\n");
+    return;
+  } else if (sub && strcmp(sub, "save") == 0) {
+    XferMode mode = xfer_mode_add(parse_xfer_mode(a1 ? a1 : ""), a2 ? a2 : "");
+    if (!xfer_send(mode, (uint8_t *)prof_hist,
+                   (RAM_SIZE >> prof_shift) * sizeof(uint16_t)))
+      printf("Profile send failed.\n");
+    return;
+  } else if (sub && strcmp(sub, "top") == 0) {
+    top = a1 ? strtol(a1, NULL, 10) : 16;
+    if (top < 1 || top > 64)
+      top = 16;
+  } else if (sub) {
+    printf("Error: Unknown subcommand '%s'. Use on, off, clear, top or "
+           "save.\n",
+           sub);
+    return;
+  }
+
+  uint32_t buckets = RAM_SIZE >> prof_shift;
+  uint32_t total = 0;
+  for (uint32_t b = 0; b < buckets; b++)
+    total += prof_hist[b];
+  printf("Profiler %s, %lu samples, %d-byte buckets\n",
+         prof_period ? "on" : "off", prof_samples, 1 << prof_shift);
+  if (total == 0)
+    return;
+  printf("ADDR        |COUNT|   %%\n");
+  // Repeatedly pick the largest bucket below the previous pick
+  uint32_t prev_count = 0xFFFFFFFF, prev_b = 0;
+  for (int n = 0; n < top; n++) {
+    uint32_t best = 0, best_b = 0;
+    for (uint32_t b = 0; b < buckets; b++) {
+      uint32_t v = prof_hist[b];
+      bool below = v < prev_count || (v == prev_count && b > prev_b);
+      if (below && v > best) {
+        best = v;
+        best_b = b;
+      }
+    }
+    if (best == 0)
+      break;
+    printf("%05lX-%05lX|%5lu|%3lu.%lu\n", best_b << prof_shift,
+           ((best_b + 1) << prof_shift) - 1, best, best * 100 / total,
+           best * 1000 / total % 10);
+    prev_count = best;
+    prev_b = best_b;
+  }
+}
+
+/**
+ * @brief 統計情報のカウンタをすべて消去します (実行していない間)。
+ * @param なし
+ * @return なし
+ */
+void stats_clear() {
+  memset((void *)&bus_stats, 0, sizeof(bus_stats));
+  memset(vmio_stats, 0, sizeof(vmio_stats));
+  memset(&usb_stats, 0, sizeof(usb_stats));
+}
+
+/**
+ * @brief 'stat' (statistics)
+ * コマンドを処理します。バス、HIDOS VMのI/O要求、USBの統計情報を表示します。
+ * @param arg_str "clear" でカウンタを消去します
+ * @return なし
+ */
+void cmd_stat(const char *arg_str) {
+  if (strcmp(arg_str, "clear") == 0) {
+    stats_clear();
+    printf("Statistics cleared.\n");
+    return;
+  }
+  const volatile BusStats &b = bus_stats;
+  printf("Bus: %lu runs, mem RD %lu WR %lu, I/O RD %lu WR %lu\n", b.runs,
+         b.cycles[0], b.cycles[1], b.cycles[2], b.cycles[3]);
+  uint64_t run_cycles = b.run_cycles, run_time_us = b.run_time_us;
+  printf("Rate: last %lu cycles/s, average %lu cycles/s\n",
+         b.last_time_us
+             ? (uint32_t)((uint64_t)b.last_cycles * 1000000 / b.last_time_us)
+             : 0,
+         run_time_us ? (uint32_t)(run_cycles * 1000000 / run_time_us) : 0);
+  printf("Timeouts: ALE %lu, RD/WR %lu, unexpected ALE %lu\n", b.timeout_ale,
+         b.timeout_strobe, b.resync);
+#if V30_RD_TIMING
+  // From the strobe seen by core1 to the data handed to the transport
+  printf("RD response: worst %lu clocks (%lu ns), %s SRAM\n",
+         b.rd_worst_ticks,
+         (uint32_t)((uint64_t)b.rd_worst_ticks * 1000000000 /
+                    clock_get_hz(clk_sys)),
+         V30_BANKED_SRAM ? "banked" : "striped");
+#endif
+
+  const char *names[VMIO_DEVS] = {"init",  "disk",    "con",   "aux",
+                                  "clock", "printer", "queue", "other"};
+  printf("VMIO    |  COUNT| AVG us| MAX us\n");
+  for (int i = 0; i < VMIO_DEVS; i++) {
+    const VmioStats &s = vmio_stats[i];
+    if (s.count == 0)
+      continue;
+    printf("%-8s|%7lu|%7lu|%7lu\n", names[i], s.count, s.total_us / s.count,
+           s.max_us);
+  }
+  printf("USB: %lu bytes in, %lu bytes out (transfers, streams, HIDOS "
+         "console)\n",
+         usb_stats.bytes_in, usb_stats.bytes_out);
+}
+
+/**
+ * @brief メモリマップの領域一覧を表示します。
+ * @param なし
+ * @return なし
+ */
+void mem_map_print() {
+  for (uint32_t i = 0; i < mem_region_count; i++) {
+    const MemRegion &r = mem_regions[i];
+    printf("%lu: %05lX-%05lX ", i, r.start, r.start + r.size - 1);
+    if (r.type == MEM_RAM)
+      printf("ram  ram[%05lX] (wraps at %05X)\n", r.src, RAM_SIZE);
+    else if (r.type == MEM_ROM)
+      printf("rom  boot.img+%05lX (flash, read-only)\n", r.src);
+    else
+      printf("%-4s handler\n", mem_handlers[r.src].name);
+  }
+  printf("Later entries override earlier ones. Unmapped pages read FFFF.\n");
+}
+
+/**
+ * @brief 'mm' (memory map)
+ * コマンドを処理します。V30のアドレス空間にram[]、boot.img (フラッシュ
+ * のROM)、ハンドラを割り当てます。アドレスと長さは16進数で、4KB単位です。
+ *   mm                                一覧
+ *   mm ram <addr> <len> [ram_offset]
+ *   mm rom <addr> [len] [img_offset]  boot.imgをコピーせずに割り当て
+ *   mm <handler> <addr> <len>         例: mm open E0000 10000
+ *   mm reset                          既定 (全空間にram[]を繰り返し配置)
+ * @param arg_str コマンドの引数文字列
+ * @return なし
+ */
+void cmd_memmap(const char *arg_str) {
+  char args[128];
+  strncpy(args, arg_str, sizeof(args) - 1);
+  args[sizeof(args) - 1] = 0;
+  char *kind = strtok(args, " ");
+  if (!kind) {
+    mem_map_print();
+    return;
+  }
+  if (strcmp(kind, "reset") == 0) {
+    mem_map_reset();
+    mem_map_print();
+    return;
+  }
+  char *addr_str = strtok(NULL, " ");
+  char *len_str = strtok(NULL, " ");
+  char *src_str = strtok(NULL, " ");
+  MemRegion r = {addr_str ? (uint32_t)strtoul(addr_str, NULL, 16) : 0,
+                 len_str ? (uint32_t)strtoul(len_str, NULL, 16) : 0, MEM_RAM,
+                 src_str ? (uint32_t)strtoul(src_str, NULL, 16) : 0};
+  if (strcmp(kind, "rom") == 0) {
+    r.type = MEM_ROM;
+    if (!len_str) // Default: the whole image, rounded up to whole pages
+      r.size = (_binary_boot_img_end - _binary_boot_img_start +
+                MEM_PAGE_SIZE - 1) & ~(MEM_PAGE_SIZE - 1);
+  } else if (strcmp(kind, "ram") != 0) {
+    r.type = MEM_HANDLER;
+    r.src = count_of(mem_handlers);
+    for (uint32_t i = 0; i < count_of(mem_handlers); i++) {
+      if (strcmp(kind, mem_handlers[i].name) == 0)
+        r.src = i;
+    }
+    if (r.src == count_of(mem_handlers)) {
+      printf("Usage: mm [ram|rom|open <addr> <len> [offset]|reset]\n");
+      return;
+    }
+  }
+  if (!addr_str || !mem_map_add(r)) {
+    printf("Error: bad region (4KB aligned, within 1MB, at most %d "
+           "entries).\n",
+           MEM_REGIONS);
+    return;
+  }
+  mem_map_print();
+}
+
+/**
+ * @brief 'dirty'
+ * コマンドを処理します。前回の消去以降に書き換えられたram[]の範囲を
+ * DIRTY_PAGE_SIZE単位で表示します。
+ * @param arg_str "clear" で記録を消去します
+ * @return なし
+ */
+void cmd_dirty(const char *arg_str) {
+  if (strcmp(arg_str, "clear") == 0) {
+    dirty_clear();
+    printf("Dirty pages cleared.\n");
+    return;
+  }
+  uint32_t pages = 0;
+  for (uint32_t i = 0; i < DIRTY_PAGES; i++) {
+    if (!ram_dirty[i])
+      continue;
+    uint32_t first = i;
+    while (i + 1 < DIRTY_PAGES && ram_dirty[i + 1])
+      i++;
+    printf("ram[%05lX-%05lX]\n", first << DIRTY_PAGE_SHIFT,
+           ((i + 1) << DIRTY_PAGE_SHIFT) - 1);
+    pages += i - first + 1;
+  }
+  printf("%lu of %d pages (%d bytes each) dirty.\n", pages, DIRTY_PAGES,
+         DIRTY_PAGE_SIZE);
+}
+
+/**
+ * @brief 'h'
+ * コマンドを処理します。有効なスナップショットがあればそこから再開し、
+ * 無ければboot.imgを読み込んでHIDOSを起動します。
+ *   h [boot] [loglevel] [stream [io|com2]]
+ *   boot: スナップショットを使わずに起動
+ *   stream: コンソールを2つ目のCDCに置いたまま、バスログをこのCDCへ
+ *           'ts'と同じフレームで連続送信します (スナップショットは取れません)
+ * @param arg_str コマンドの引数文字列
+ * @return なし
+ */
+void cmd_hidos(const char *arg_str) {
+  char args[32];
+  strncpy(args, arg_str, sizeof(args) - 1);
+  args[sizeof(args) - 1] = 0;
+  bool boot = false;
+  int loglevel = 9;
+  uint8_t logging = NO_LOG;
+  for (char *tok = strtok(args, " "); tok; tok = strtok(NULL, " ")) {
+    if (strcmp(tok, "boot") == 0)
+      boot = true;
+    else if (strcmp(tok, "stream") == 0) {
+      if (logging == NO_LOG)
+        logging = FULL_LOG;
+    } else if (strcmp(tok, "io") == 0)
+      logging = IO_LOG;
+    else if (strcmp(tok, "com2") == 0)
+      logging = COM_LOG;
+    else
+      loglevel = strtol(tok, NULL, 10);
+  }
+  if (logging != NO_LOG && !cdc_connected(USB_ITF_CONSOLE)) {
+    printf("Error: h stream needs the console on the second USB port.\n");
+    return;
+  }
+
+  MemRegion saved_regions[MEM_REGIONS];
+  uint8_t saved_region_count = mem_region_count;
+  memcpy(saved_regions, mem_regions, sizeof(saved_regions));
+  if (!mem_map_add({SNAP_STUB_BASE, MEM_PAGE_SIZE, MEM_HANDLER,
+                    MEM_HANDLER_SNAP}) ||
+      !mem_map_add({SNAP_RESET_PAGE, MEM_PAGE_SIZE, MEM_HANDLER,
+                    MEM_HANDLER_SNAP})) {
+    mem_region_count = saved_region_count;
+    mem_map_rebuild();
+    printf("Error: memory map full, HIDOS needs two more regions.\n");
+    return;
+  }
+
+  bool resume = !boot && snap_load();
+  if (resume) {
+    printf("Resume HIDOS snapshot (Ctrl-] to leave, Ctrl-\\ to snapshot)\n");
+  } else {
+    cmd_load_boot("");
+    con_wait_count = 0;
+    clock_offset_us = 0;
+    printf("Start embedded HIDOS machine (Ctrl-] to leave, Ctrl-\\ to "
+           "snapshot)\n");
+  }
+  bool saved_quiet = false;
+  if (logging != NO_LOG)
+    saved_quiet = trace_stream_begin(); // Any byte here stops, as 'ts'
+  else if (console_itf() != USB_ITF_MONITOR)
+    printf("Console on the second USB port, this one takes d, l, stat, "
+           "dirty, dk and pf top.\nhidos> ");
+  hidos_logging = logging;
+  snap_launch(resume);
+  hidos_host(loglevel, resume ? snap.request : -1);
+  hidos_logging = NO_LOG;
+  if (logging != NO_LOG) {
+    while (trace_stream_send())
+      ; // What trace_writer_end() published
+    trace_stream_end(saved_quiet);
+  }
+  printf("\nHIDOS machine stopped.\n");
+
+  memcpy(mem_regions, saved_regions, sizeof(saved_regions));
+  mem_region_count = saved_region_count;
+  mem_map_rebuild();
+}
+
+/**
+ * @brief 'snap'
+ * コマンドを処理します。フラッシュのHIDOSスナップショットを表示します。
+ * @param arg_str "clear" でスナップショットを消去します
+ * @return なし
+ */
+void cmd_snap(const char *arg_str) {
+  if (strcmp(arg_str, "clear") == 0) {
+    uint32_t ints = save_and_disable_interrupts();
+    flash_range_erase(SNAPSHOT_FLASH_OFFSET, FLASH_SECTOR_SIZE);
+    restore_interrupts(ints);
+    printf("Snapshot cleared.\n");
+    return;
+  } else if (strlen(arg_str) > 0) {
+    printf("Usage: snap [clear]\n");
+    return;
+  }
+  SnapHeader h;
+  if (!snap_flash_usable()) {
+    printf("No snapshot: program overlaps the snapshot area.\n");
+  } else if (!snap_read_header(h)) {
+    printf("No snapshot.\n");
+  } else {
+    uint32_t sec = h.clock_us / 1000000;
+    printf("Snapshot: %lu bytes (%lu overlay blocks), SS:SP %04X:%04X, "
+           "clock %lu:%02lu:%02lu%s\n",
+           h.data_len, h.overlay_used, h.ss, h.sp, sec / 3600, sec / 60 % 60,
+           sec % 60,
+           h.disk_img_size != disk_img_size || h.disk_log_used != disk_log_used
+               ? ", stale (disk changed)"
+               : "");
+  }
+}
+
+/**
+ * @brief 'uart'
+ * コマンドを処理します。エミュレートしている16550の状態を表示し、
+ * 'g'以外の実行で溜まった送信データを書き出します。
+ *   uart [com1|com2]   com1/com2: 'g'でUSBの入力を渡すポート
+ * @param arg_str コマンドの引数文字列
+ * @return なし
+ */
+void cmd_uart(const char *arg_str) {
+  if (strcmp(arg_str, "com1") == 0) {
+    uart_rx_port = 0;
+  } else if (strcmp(arg_str, "com2") == 0) {
+    uart_rx_port = 1;
+  } else if (strlen(arg_str) > 0) {
+    printf("Usage: uart [com1|com2]\n");
+    return;
+  }
+  static const uint16_t bases[] = {UART_COM1_PORT, UART_COM2_PORT};
+  for (int i = 0; i < 2; i++) {
+    const UartPort &u = uart_ports[i];
+    uint16_t div = u.dll | (u.dlm << 8);
+    printf("COM%d %03X: LCR %02X, divisor %u (%lu baud), sent %lu, dropped "
+           "%lu, pending %lu%s\n",
+           i + 1, bases[i], u.lcr, div, div ? 115200 / div : 0, u.tx_head,
+           u.tx_dropped, u.tx_head - u.tx_tail,
+           i == uart_rx_port ? ", input" : "");
+  }
+  if (uart_ports[0].tx_head != uart_ports[0].tx_tail ||
+      uart_ports[1].tx_head != uart_ports[1].tx_tail) {
+    printf("--- pending output ---\n");
+    uart_flush_tx();
+    printf("\n");
+  }
+}
+
+/**
+ * @brief ホストへ送るログのバイト数を求めます。
+ * コンパクト形式では先頭に "V30C" とペイロード長のヘッダを書き込みます。
+ * @param entries ログ件数の格納先 (コンパクト形式ではバイト数)
+ * @return 送信するバイト数 (ログが空なら0)
+ */
+int trace_log_send_size(int *entries) {
+  if (trace_format == TRACE_FMT_COMPACT) {
+    uint32_t n = trace_compact_bytes;
+    *entries = n;
+    if (n == 0)
+      return 0;
+    memcpy(trace_bytes(), "V30C", 4);
+    memcpy(trace_bytes() + 4, &n, 4);
+    return COMPACT_HEADER_SIZE + n;
+  }
+  int valid_cycles = 0;
+  for (int i = 0; i < MAX_CYCLES; i++) {
+    if (trace_log[i].type == LOG_UNUSED) {
+      break; // Stop at the first unused entry
+    }
+    valid_cycles++;
+  }
+  *entries = valid_cycles;
+  return valid_cycles * sizeof(BusLog);
+}
+
+/**
+ * @brief 'd' (dump)
+ * コマンドを処理します。指定されたアドレスからメモリの内容を16進数とASCIIで表示します。
+ * @param arg_str コマンドの引数文字列 (アドレスと長さ)
+ * @return なし
+ */
+void cmd_dump(const char *arg_str) {
+  char args[128];
+  strncpy(args, arg_str, sizeof(args) - 1);
+  args[sizeof(args) - 1] = 0;
+  char *addr_str = strtok(args, " ");
+  char *len_str = strtok(NULL, " ");
+  uint32_t addr = addr_str ? strtol(addr_str, NULL, 16) : 0;
+  int len = len_str ? strtol(len_str, NULL, 10) : 256;
+
+  for (int i = 0; i < len; i += 16) {
+    printf("%05lX: ", addr + i);
+    for (int j = 0; j < 16; j++)
+      printf(i + j < len ? "%02X " : "   ", mem_read8(addr + i + j));
+    printf("|");
+    for (int j = 0; j < 16; j++)
+      putchar(i + j < len && isprint(mem_read8(addr + i + j))
+                  ? mem_read8(addr + i + j)
+                  : '.');
+    printf("|\n");
+  }
+}
+
+/**
+ * @brief 'e' (edit)
+ * コマンドを処理します。指定されたアドレスのメモリの内容を書き換えます。
+ * @param arg_str コマンドの引数文字列 (アドレスと書き込むデータ)
+ * @return なし
+ */
+void cmd_edit(const char *arg_str) {
+  char args[128];
+  strncpy(args, arg_str, sizeof(args) - 1);
+  args[sizeof(args) - 1] = 0;
+  char *addr_str = strtok(args, " ");
+  if (!addr_str) {
+    printf("Usage: e <addr> <val> ...\n");
+    return;
+  }
+  uint32_t addr = strtol(addr_str, NULL, 16);
+  char *val_str;
+  while ((val_str = strtok(NULL, " ")) != NULL) {
+    mem_write8(addr++, (uint8_t)strtol(val_str, NULL, 16));
+  }
+  printf("Updated.\n");
+}
+
+/**
+ * @brief 'f' (fill)
+ * コマンドを処理します。指定されたバイト値でメモリ全体を埋めます。
+ * @param arg_str コマンドの引数文字列 (16進数のバイト値)
+ * @return なし
+ */
+void cmd_fill(const char *arg_str) {
+  uint8_t fill_val = 0xF4; // Default to HLT
+  if (arg_str && strlen(arg_str) > 0) {
+    fill_val = (uint8_t)strtol(arg_str, NULL, 16);
+  }
+  memset(ram, fill_val, RAM_SIZE);
+  dirty_clear();
+  printf("Memory filled with 0x%02X.\n", fill_val);
+}
+
+// --- Assembler/Disassembler ---
+/**
+ * @brief 16ビットレジスタ名を対応する3ビットのコードに変換します。
+ * @param name レジスタ名 (例: "ax", "cx")
+ * @return レジスタコード (0-7)。見つからない場合は-1。
+ */
+int reg_to_code(const char *name) {
+  if (!name)
+    return -1;
+  for (int i = 0; i < 8; i++) {
+    if (strcasecmp(name, reg_names[i]) == 0)
+      return i;
+  }
+  return -1;
+}
+
+/**
+ * @brief レジスタコードを対応する16ビットレジスタ名に変換します。
+ * @param code レジスタコード (0-7)
+ * @return レジスタ名を表す文字列。無効なコードの場合は "???"。
+ */
+const char *code_to_reg(int code) {
+  if (code >= 0 && code < 8)
+    return reg_names[code];
+  return "??";
+}
+
+/**
+ * @brief 1行のアセンブリコードをマシン語に変換（アセンブル）します。
+ * @param addr 命令を書き込むメモリのアドレス
+ * @param arg_str アセンブリ命令の文字列 (例: "mov ax, 1234")
+ * @return アセンブルされた命令のバイト数。エラーの場合は0。
+ */
+int assemble_instruction(uint32_t addr, const char *arg_str) {
+  char args[256];
+  strncpy(args, arg_str, sizeof(args) - 1);
+  args[sizeof(args) - 1] = 0;
+
+  char *mnemonic = strtok(args, " ");
+  if (!mnemonic) {
+    return 0;
+  }
+
+  char *op1_str = strtok(NULL, ", ");
+  char *op2_str = strtok(NULL, ", ");
+  int bytes = 0;
+
+  if (strcasecmp(mnemonic, "nop") == 0) {
+    mem_write8(addr, 0x90);
+    bytes = 1;
+  } else if (strcasecmp(mnemonic, "mov") == 0) {
+    int reg1 = reg_to_code(op1_str);
+    if (reg1 != -1 && op2_str) { // mov reg, imm
+      int imm = strtol(op2_str, NULL, 16);
+      mem_write8(addr, 0xB8 + reg1);
+      mem_write8(addr + 1, imm & 0xFF);
+      mem_write8(addr + 2, imm >> 8);
+      bytes = 3;
+    } else if (op1_str[0] == '[' && op2_str &&
+               reg_to_code(op2_str) == 0) { // mov [imm], ax
+      int imm = strtol(op1_str + 1, NULL, 16);
+      mem_write8(addr, 0xA3);
+      mem_write8(addr + 1, imm & 0xFF);
+      mem_write8(addr + 2, imm >> 8);
+      bytes = 3;
+    }
+  } else if (strcasecmp(mnemonic, "add") == 0) {
+    int reg1 = reg_to_code(op1_str);
+    int reg2 = reg_to_code(op2_str);
+    if (reg1 != -1 && reg2 != -1) {
+      mem_write8(addr, 0x01);
+      mem_write8(addr + 1, 0xC0 | (reg2 << 3) | reg1); // ModR/M
+      bytes = 2;
+    }
+  } else if (strcasecmp(mnemonic, "xchg") == 0) {
+    int reg1 = reg_to_code(op1_str);
+    int reg2 = reg_to_code(op2_str);
+    if (reg1 == 0 && reg2 != -1) { // xchg ax, reg
+      mem_write8(addr, 0x90 + reg2);
+      bytes = 1;
+    } else if (reg2 == 0 && reg1 != -1) { // xchg reg, ax
+      mem_write8(addr, 0x90 + reg1);
+      bytes = 1;
+    }
+  } else if (strcasecmp(mnemonic, "loop") == 0) {
+    uint32_t target = strtol(op1_str, NULL, 16);
+    int8_t offset = target - (addr + 2);
+    mem_write8(addr, 0xE2);
+    mem_write8(addr + 1, offset);
+    bytes = 2;
+  } else if (strcasecmp(mnemonic, "jmp") == 0) {
+    char *target_str = op1_str;
+    if (op1_str && strcasecmp(op1_str, "far") == 0) {
+      target_str = op2_str;
+    }
+
+    if (!target_str) { // No operand for jmp
+      return 0;
+    }
+
+    char *colon_pos = strchr(target_str, ':');
+    if (colon_pos) {     // Far jump: segment:offset
+      *colon_pos = '\0'; // Null-terminate segment part
+      uint16_t segment = (uint16_t)strtol(target_str, NULL, 16);
+      uint16_t offset = (uint16_t)strtol(colon_pos + 1, NULL,
+                                         16); // Offset part starts after colon
+
+      mem_write8(addr, 0xEA); // JMP FAR opcode
+      mem_write8(addr + 1, offset & 0xFF);
+      mem_write8(addr + 2, (offset >> 8) & 0xFF);
+      mem_write8(addr + 3, segment & 0xFF);
+      mem_write8(addr + 4, (segment >> 8) & 0xFF);
+      bytes = 5;
+    } else { // Near jump: relative to current IP
+      uint32_t target = strtol(target_str, NULL, 16);
+      int8_t offset = target - (addr + 2); // EB opcode is 2 bytes
+      mem_write8(addr, 0xEB);       // JMP NEAR rel8 opcode
+      mem_write8(addr + 1, offset);
+      bytes = 2;
+    }
+  }
+  // NEW HANDLER FOR DB
+  else if (strcasecmp(mnemonic, "db") == 0) {
+    // The issue is that op1_str and op2_str are tokenized before this handler.
+    // We need to process them and then continue tokenizing.
+    if (op1_str) {
+      mem_write8(addr + bytes, (uint8_t)strtol(op1_str, NULL, 16));
+      bytes++;
+    } else {
+      return 0; // No arguments for db.
+    }
+
+    if (op2_str) {
+      mem_write8(addr + bytes, (uint8_t)strtol(op2_str, NULL, 16));
+      bytes++;
+    }
+
+    char *next_op_str;
+    while ((next_op_str = strtok(NULL, " ,")) != NULL) {
+      mem_write8(addr + bytes, (uint8_t)strtol(next_op_str, NULL, 16));
+      bytes++;
+    }
+  }
+
+  if (bytes > 0) {
+    printf(" ->");
+    for (int i = 0; i < bytes; i++)
+      printf(" %02X", mem_read8(addr + i));
+    return bytes;
+  } else {
+    return 0;
+  }
+}
+
+/**
+ * @brief 'l' (disassemble)
+ * コマンドを処理します。指定されたアドレスからメモリの内容を逆アセンブルします。
+ * @param arg_str コマンドの引数文字列 (アドレスと長さ)
+ * @return なし
+ */
+void cmd_disasm(const char *arg_str) {
+  char args[128];
+  strncpy(args, arg_str, sizeof(args) - 1);
+  args[sizeof(args) - 1] = 0;
+  char *addr_str = strtok(args, " ");
+  char *len_str = strtok(NULL, " ");
+  uint32_t addr = addr_str ? strtol(addr_str, NULL, 16) : 0;
+  int len = len_str ? strtol(len_str, NULL, 10) : 16;
+
+  // Sliding window: each byte is read through the memory map once
+  uint8_t code[DISASM_WINDOW];
+  for (int i = 0; i < DISASM_WINDOW; i++)
+    code[i] = mem_read8(addr + i);
+  uint32_t pc = addr;
+  while (pc < addr + len) {
+    char disasm_str[DISASM_TEXT];
+    int bytes = disasm_decode(code, DISASM_WINDOW, pc & 0xFFFFF, disasm_str,
+                              nullptr);
+
+    char hex_dump[32] = {0};
+    char *p = hex_dump;
+    for (int i = 0; i < bytes && i < 8; i++)
+      p += sprintf(p, "%02X ", code[i]);
+
+    printf("%05lX: %-18s %s\n", pc & 0xFFFFF, hex_dump, disasm_str);
+    pc += bytes;
+    memmove(code, code + bytes, DISASM_WINDOW - bytes);
+    for (int i = DISASM_WINDOW - bytes; i < DISASM_WINDOW; i++)
+      code[i] = mem_read8(pc + i);
+  }
+}
+
+/**
+ * @brief HIDOSの実行中にモニタのCDCで受けたコマンドを処理します。
+ * V30を動かすものやフラッシュを書き換えるものは受け付けません。
+ * @param line 入力された行 (書き換えます)
+ * @return なし
+ */
+void hidos_monitor_command(char *line) {
+  char *cmd = strtok(line, " ");
+  if (!cmd)
+    return;
+  char *rest = strtok(NULL, "");
+  const char *args = rest ? rest : "";
+  if (strcmp(cmd, "d") == 0)
+    cmd_dump(args);
+  else if (strcmp(cmd, "l") == 0)
+    cmd_disasm(args);
+  else if (strcmp(cmd, "stat") == 0 && args[0] == 0)
+    cmd_stat(args);
+  else if (strcmp(cmd, "dirty") == 0 && args[0] == 0)
+    cmd_dirty(args);
+  else if (strcmp(cmd, "dk") == 0 && args[0] == 0)
+    printf("Disk: overlay %lu/%d blocks, flash log %lu/%d blocks\n",
+           disk_overlay_used, DISK_OVERLAY_BLOCKS, disk_log_used,
+           DISK_OVERLAY_LOG_BLOCKS);
+  else if (strcmp(cmd, "pf") == 0 && strncmp(args, "top", 3) == 0)
+    cmd_profile(args);
+  else
+    printf("While HIDOS runs: d, l, stat, dirty, dk, pf top (Ctrl-] stops "
+           "the VM)\n");
+}
+
+/**
+ * @brief V30を1回実行して終了を待ちます。
+ * @param run_cmd Core 1に送る実行コマンド (CMD_RUN_NOLOG など)
+ * @param cycles 実行するバスサイクル数 (0で無制限)
+ * @param timeout_ms これを超えると停止要求を出します (0で無制限)
+ * @return 時間内に終了した場合true、停止要求で止めた場合false
+ */
+bool run_v30(uint32_t run_cmd, uint32_t cycles, uint32_t timeout_ms) {
+  cycle_limit = (cycles == 0 || cycles > 0x7FFFFFFF) ? 0x7FFFFFFF : cycles;
+  multicore_fifo_push_blocking(run_cmd);
+  uint32_t done;
+  if (timeout_ms == 0)
+    multicore_fifo_pop_blocking();
+  else if (!multicore_fifo_pop_timeout_us((uint64_t)timeout_ms * 1000, &done)) {
+    stop_request = true;
+    multicore_fifo_pop_blocking();
+    return false;
+  }
+  return true;
+}
+
+// --- Live Rate ('g rate') ---
+// While 'g' runs, core0 samples the counters core1 keeps anyway (one
+// increment of bus_stats.cycles[] per cycle and one store of last_read per
+// memory read, both after the data is driven) and prints the rates over
+// each interval. No lock: every word is read atomically, and words read a
+// few cycles apart do not change a rate.
+struct LiveSample {
+  uint64_t t_us;
+  uint32_t cycles; // All bus cycles
+  uint32_t io;     // I/O cycles among them
+};
+
+/**
+ * @brief Core 1のカウンタを読み取ります (Core 0)。
+ * @param なし
+ * @return 読み取った時刻とカウンタ
+ */
+LiveSample live_sample() {
+  LiveSample s;
+  s.t_us = time_us_64();
+  s.io = bus_stats.cycles[2] + bus_stats.cycles[3];
+  s.cycles = bus_stats.cycles[0] + bus_stats.cycles[1] + s.io;
+  return s;
+}
+
+/**
+ * @brief 前回の読み取りからのバスサイクルの速度を表示します (Core 0)。
+ * 1バスサイクルは最短4クロックなので、クロック/4に対する割合も示します。
+ * @param prev 前回の読み取り (今回の値に更新します)
+ * @param start 'g'の開始時の読み取り
+ * @return なし
+ */
+void live_report(LiveSample &prev, const LiveSample &start) {
+  LiveSample now = live_sample();
+  uint64_t dt = now.t_us - prev.t_us;
+  if (dt == 0)
+    return;
+  uint32_t rate = (uint64_t)(now.cycles - prev.cycles) * 1000000 / dt;
+  uint32_t io_rate = (uint64_t)(now.io - prev.io) * 1000000 / dt;
+  uint32_t max_rate = current_freq_hz / 4;
+  printf("[g] %lus: %lu cycles/s (%lu%% of clk/4), I/O %lu/s, last read "
+         "%05lX, %lu cycles\n",
+         (uint32_t)((now.t_us - start.t_us) / 1000000), rate,
+         max_rate ? (uint32_t)((uint64_t)rate * 100 / max_rate) : 0, io_rate,
+         bus_stats.last_read, now.cycles - start.cycles);
+  prev = now;
+}
+
+// --- Benchmark ---
+// bench_program fills 512 bytes at 0200h with 3, 10, 17, ... , folds them
+// into a rotating word checksum at 0100h and halts. The result and the bus
+// cycle count are the same on every clean run, so each clock in freq_table
+// can be checked against a run at the slowest benchmarked clock.
+#define BENCH_RESULT_ADDR 0x0100
+#define BENCH_MIN_HZ 50000      // Slower clocks take seconds per run
+#define BENCH_TIMEOUT_MS 2000   // A run not done by then is a hang
+#define BENCH_MAX_CYCLES 100000 // Runaway guard, a clean run is far below
+
+const uint8_t bench_program[] = {
+    0xFC,             //       cld
+    0x31, 0xC0,       //       xor ax, ax
+    0x8E, 0xD8,       //       mov ds, ax
+    0x8E, 0xC0,       //       mov es, ax
+    0x8E, 0xD0,       //       mov ss, ax
+    0xBC, 0x00, 0x10, //       mov sp, 1000h
+    0xBF, 0x00, 0x02, //       mov di, 0200h
+    0xB9, 0x00, 0x02, //       mov cx, 512
+    0xB0, 0x03,       //       mov al, 3
+    0xAA,             // fill: stosb
+    0x04, 0x07,       //       add al, 7
+    0xE2, 0xFB,       //       loop fill
+    0xBE, 0x00, 0x02, //       mov si, 0200h
+    0xB9, 0x00, 0x01, //       mov cx, 256
+    0x31, 0xDB,       //       xor bx, bx
+    0xAD,             // sum:  lodsw
+    0x01, 0xC3,       //       add bx, ax
+    0xD1, 0xC3,       //       rol bx, 1
+    0xE2, 0xF9,       //       loop sum
+    0x89, 0x1E, 0x00, 0x01, //  mov [0100h], bx
+    0xF4,             //       hlt
+};
+const uint8_t bench_reset_vector[] = {0xEA, 0x00, 0x00, 0x00, 0x00};
+
+/**
+ * @brief bench_programが0100hに書き込むはずの値を計算します。
+ * @param なし
+ * @return 期待されるチェックサム
+ */
+uint16_t bench_expected() {
+  uint16_t bx = 0;
+  for (uint32_t i = 0; i < 512; i += 2) {
+    uint16_t w = (uint8_t)(3 + 7 * i) | ((uint8_t)(3 + 7 * (i + 1)) << 8);
+    bx += w;
+    bx = (bx << 1) | (bx >> 15);
+  }
+  return bx;
+}
+
+/**
+ * @brief 'bench' (benchmark)
+ * コマンドを処理します。freq_tableの各周波数でbench_programを実行し、
+ * 結果とバスサイクル数を検証して、安定して動く最も速いクロックを探します。
+ * V30のRAMの内容は上書きされます。
+ * @param arg_str 周波数ごとの実行回数 (省略時3)
+ * @return なし
+ */
+void cmd_bench(const char *arg_str) {
+  int runs = strlen(arg_str) > 0 ? strtol(arg_str, NULL, 10) : 3;
+  if (runs < 1 || runs > 100) {
+    printf("Usage: bench [runs (1-100)]\n");
+    return;
+  }
+  uint32_t saved_freq = current_freq_hz;
+  bool saved_tuned = current_clock_tuned;
+  uint8_t saved_watch = watch_count;
+  uint32_t saved_prof = prof_period;
+  MemRegion saved_regions[MEM_REGIONS];
+  uint8_t saved_region_count = mem_region_count;
+  memcpy(saved_regions, mem_regions, sizeof(saved_regions));
+  bool saved_quiet = console_quiet;
+  watch_count = 0; // Whatever is set up for debugging must not stop a run
+  prof_period = 0;
+  mem_map_reset(); // bench_program is placed in the default map
+  console_quiet = true; // Every run ends in HLT, one bus timeout message each
+
+  uint16_t expected = bench_expected();
+  uint32_t ref_cycles = 0;
+  uint32_t fastest = 0;
+  printf("Bench: %d runs per clock, expect %04X at %04X (%s bus)\n", runs,
+         expected, BENCH_RESULT_ADDR,
+         bus_engine == BUS_ENGINE_PIO ? "pio" : "sio");
+  printf("   kHz| OK|BAD|CYC|HANG| CYCLES|     us| CYCLES/s\n");
+  for (int f = count_of(freq_table) - 1; f >= 0; f--) {
+    uint32_t hz = freq_table[f];
+    if (hz < BENCH_MIN_HZ)
+      continue;
+    setup_clock(hz);
+    int ok = 0, bad = 0, bad_cycles = 0, hang = 0;
+    uint32_t cycles = 0, time_us = 0;
+    for (int r = 0; r < runs; r++) {
+      memset(ram, 0xF4, RAM_SIZE);
+      memcpy(ram, bench_program, sizeof(bench_program));
+      memcpy(&ram[0xFFFF0 % RAM_SIZE], bench_reset_vector,
+             sizeof(bench_reset_vector));
+      dirty_clear();
+      if (!run_v30(CMD_RUN_NOLOG, BENCH_MAX_CYCLES, BENCH_TIMEOUT_MS) ||
+          run_end_reason == RUN_END_LIMIT) {
+        hang++;
+        continue;
+      }
+      uint16_t result =
+          ram[BENCH_RESULT_ADDR] | (ram[BENCH_RESULT_ADDR + 1] << 8);
+      if (result != expected) {
+        bad++;
+        continue;
+      }
+      cycles = executed_cycles;
+      time_us = execution_time_us;
+      if (run_end_reason == RUN_END_NO_ALE &&
+          time_us > BUS_OPERATION_TIMEOUT_US)
+        time_us -= BUS_OPERATION_TIMEOUT_US; // Idle wait after HLT
+      if (ref_cycles == 0)
+        ref_cycles = cycles; // Slowest clean run is the reference
+      if (cycles != ref_cycles) {
+        bad_cycles++;
+        continue;
+      }
+      ok++;
+    }
+    printf("%6lu|%3d|%3d|%3d|%4d|%7lu|%7lu|%9lu\n", hz / 1000, ok, bad,
+           bad_cycles, hang, cycles, time_us,
+           time_us ? (uint32_t)((uint64_t)cycles * 1000000 / time_us) : 0);
+    if (ok == runs)
+      fastest = hz;
+  }
+
+  console_quiet = saved_quiet;
+  current_freq_hz = saved_freq;
+  setup_clock(current_freq_hz, saved_tuned);
+  watch_count = saved_watch;
+  prof_period = saved_prof;
+  memcpy(mem_regions, saved_regions, sizeof(saved_regions));
+  mem_region_count = saved_region_count;
+  mem_map_rebuild();
+  if (fastest)
+    printf("Fastest clock with all runs clean: %lu kHz\n", fastest / 1000);
+  else
+    printf("No clock passed every run.\n");
+}
+
+// --- Batch Autotest ---
+// 'batch' receives a batch image (transfer options as xr), keeps it in flash
+// at BATCH_FLASH_OFFSET and runs its tests back to back; 'batch run' runs
+// the stored image again. Image, little endian:
+//   BatchHeader, BatchTest[count], then the data the entries point at
+// A binary is PackBits tokens (pack_token(), without the V30P header)
+// unpacked to ram[load_addr], so a 128KB image padded with NOPs takes about
+// 2KB. Every test starts from ram[] filled with `fill` and the
+// default memory map. The check compares ram[expect_addr] (BATCH_CHECK_RAM)
+// or the bytes written to the COM log port (BATCH_CHECK_COM, 'tr port',
+// needs a logging mode) with the expected bytes. The results go back in one
+// transfer:
+//   "V30T" count:u16 passed:u16 BatchResult[count] output[]
+// output holds the COM log port bytes of every logged test, as far as
+// BATCH_OUT_SIZE reaches, located by out_off/out_len.
+#define BATCH_MAX_TESTS 32
+#define BATCH_OUT_SIZE 2048
+#define BATCH_NO_MISMATCH 0xFFFFFFFF
+
+enum BatchCheck { BATCH_CHECK_NONE = 0, BATCH_CHECK_RAM, BATCH_CHECK_COM };
+enum BatchStatus { BATCH_PASS = 0, BATCH_FAIL, BATCH_BAD_ENTRY };
+
+struct BatchHeader {
+  char magic[4];  // "V30B"
+  uint16_t count; // Tests
+  uint16_t crc;   // crc16_ccitt() of the len bytes after the header
+  uint32_t len;
+};
+
+struct BatchTest {
+  uint32_t bin_off, bin_len;       // PackBits tokens in the image
+  uint32_t load_addr, load_len;    // ... unpacked to ram[] here
+  uint32_t cycles;                 // Bus cycle limit (0: none)
+  uint32_t timeout_ms;             // Stop request after this (0: none)
+  uint32_t freq_hz;                // V30 clock (0: the monitor's clock)
+  uint32_t expect_off, expect_len; // Expected bytes in the image
+  uint32_t expect_addr;            // BATCH_CHECK_RAM: compared at ram[] here
+  uint8_t mode;  // As BIN_OP_RUN: 0 no log, 1 full, 2 I/O, 3 COM
+  uint8_t check; // BatchCheck
+  uint8_t fill;  // ram[] is filled with this before loading
+  uint8_t reserved;
+};
+
+struct BatchResult {
+  uint32_t bus_cycles;
+  uint32_t time_us;
+  uint32_t mismatch; // First differing byte of the check (BATCH_NO_MISMATCH)
+  uint16_t out_off;  // COM log port bytes in output[]
+  uint16_t out_len;
+  uint8_t end;       // RunEnd
+  uint8_t status;    // BatchStatus
+  uint16_t reserved;
+};
+static_assert(sizeof(BatchHeader) == 12 && sizeof(BatchTest) == 44 &&
+                  sizeof(BatchResult) == 20,
+              "batch image layout");
+
+// The reply; output[] is moved up behind results[count] before sending.
+static struct {
+  char magic[4]; // "V30T"
+  uint16_t count;
+  uint16_t passed;
+  BatchResult results[BATCH_MAX_TESTS];
+  uint8_t output[BATCH_OUT_SIZE];
+} batch_report;
+
+/**
+ * @brief フラッシュのバッチ領域がプログラムと重なっていないかを調べます。
+ * @param なし
+ * @return 使用できる場合true
+ */
+bool batch_flash_usable() {
+  return (uint32_t)((uintptr_t)&__flash_binary_end - XIP_BASE) <=
+         BATCH_FLASH_OFFSET;
+}
+
+/**
+ * @brief バッチイメージのヘッダとCRCを確認します。
+ * @param img イメージの先頭
+ * @param size イメージを置ける最大バイト数
+ * @return テストの数、不正な場合-1
+ */
+int batch_check(const uint8_t *img, uint32_t size) {
+  BatchHeader h;
+  memcpy(&h, img, sizeof(h));
+  if (memcmp(h.magic, "V30B", 4) != 0) {
+    printf("[BATCH] No batch image.\n");
+    return -1;
+  }
+  if (h.count == 0 || h.count > BATCH_MAX_TESTS ||
+      h.len > size - sizeof(h) ||
+      h.count * sizeof(BatchTest) > h.len) {
+    printf("[BATCH] Bad image: %u tests, %lu bytes (max %d tests, %lu "
+           "bytes).\n",
+           h.count, h.len, BATCH_MAX_TESTS, (uint32_t)(size - sizeof(h)));
+    return -1;
+  }
+  if (crc16_ccitt(img + sizeof(h), h.len) != h.crc) {
+    printf("[BATCH] Image CRC mismatch.\n");
+    return -1;
+  }
+  return h.count;
+}
+
+/**
+ * @brief 受信したバッチイメージをフラッシュに書き込みます (Core 0)。
+ * 割り込みはセクタごとに禁止します。
+ * @param img イメージ (RAM上、セクタ単位で読み出せること)
+ * @param len バイト数
+ * @return なし
+ */
+void batch_store(const uint8_t *img, uint32_t len) {
+  for (uint32_t off = 0; off < len; off += FLASH_SECTOR_SIZE) {
+    uint32_t ints = save_and_disable_interrupts();
+    flash_range_erase(BATCH_FLASH_OFFSET + off, FLASH_SECTOR_SIZE);
+    flash_range_program(BATCH_FLASH_OFFSET + off, img + off,
+                        FLASH_SECTOR_SIZE);
+    restore_interrupts(ints);
+  }
+}
+
+/**
+ * @brief バッチのテストを1件実行して結果を判定します。
+ * freq_hzが0のテストは呼び出し時のクロックで実行します。
+ * @param img バッチイメージ
+ * @param len イメージのバイト数
+ * @param t テストの定義
+ * @param r 結果の格納先
+ * @param out_used batch_report.outputの使用済みバイト数 (更新します)
+ * @return なし
+ */
+void batch_run_test(const uint8_t *img, uint32_t len, const BatchTest &t,
+                    BatchResult &r, uint32_t &out_used) {
+  static const uint32_t run_cmds[] = {CMD_RUN_NOLOG, CMD_RUN_FULLLOG,
+                                      CMD_RUN_IOLOG, CMD_RUN_COMLOG};
+  memset(&r, 0, sizeof(r));
+  r.mismatch = BATCH_NO_MISMATCH;
+  r.out_off = out_used;
+  r.status = BATCH_BAD_ENTRY;
+  if (t.mode >= count_of(run_cmds) || t.check > BATCH_CHECK_COM ||
+      t.bin_off > len || t.bin_len > len - t.bin_off ||
+      t.expect_off > len || t.expect_len > len - t.expect_off ||
+      t.load_addr > RAM_SIZE || t.load_len > RAM_SIZE - t.load_addr ||
+      (t.check == BATCH_CHECK_RAM &&
+       (t.expect_addr > RAM_SIZE || t.expect_len > RAM_SIZE - t.expect_addr)) ||
+      (t.check == BATCH_CHECK_COM && t.mode == 0) ||
+      (t.freq_hz != 0 && !setup_clock(t.freq_hz)))
+    return;
+  memset(ram, t.fill, RAM_SIZE);
+  if (!snap_unpack(img + t.bin_off, t.bin_len, &ram[t.load_addr], t.load_len))
+    return;
+  dirty_clear();
+  memset(trace_log, 0, sizeof(trace_log));
+  run_v30(run_cmds[t.mode], t.cycles, t.timeout_ms);
+  r.bus_cycles = executed_cycles;
+  r.time_us = execution_time_us;
+  r.end = run_end_reason;
+
+  const uint8_t *expect = img + t.expect_off;
+  uint32_t n = 0; // COM log port bytes written by the program
+  for (int i = 0; t.mode != 0 && i < MAX_CYCLES; i++) {
+    const BusLog &rec = trace_log[i];
+    if (rec.type != LOG_IO_WR || rec.address != trace_com_port)
+      continue;
+    uint8_t b = (rec.address & 1) ? rec.data >> 8 : rec.data;
+    if (t.check == BATCH_CHECK_COM && r.mismatch == BATCH_NO_MISMATCH &&
+        (n >= t.expect_len || expect[n] != b))
+      r.mismatch = n;
+    if (out_used < BATCH_OUT_SIZE)
+      batch_report.output[out_used++] = b;
+    n++;
+  }
+  r.out_len = out_used - r.out_off;
+  if (t.check == BATCH_CHECK_COM && r.mismatch == BATCH_NO_MISMATCH &&
+      n != t.expect_len)
+    r.mismatch = n; // Output ended early
+  if (t.check == BATCH_CHECK_RAM) {
+    for (uint32_t i = 0; i < t.expect_len; i++) {
+      if (ram[t.expect_addr + i] != expect[i]) {
+        r.mismatch = i;
+        break;
+      }
+    }
+  }
+  r.status = r.mismatch == BATCH_NO_MISMATCH ? BATCH_PASS : BATCH_FAIL;
+}
+
+/**
+ * @brief 'batch' コマンドを処理します。バッチイメージを受信して
+ * フラッシュに保存し (runの場合は保存済みのものを使い)、全テストを実行して
+ * 結果をまとめて送信します。V30のRAMの内容は上書きされます。
+ * @param arg_str [run] [1k|bulk] [rle]
+ * @return なし
+ */
+void cmd_batch(const char *arg_str) {
+  static const char *const status_names[] = {"PASS", "FAIL", "BAD"};
+  XferMode xfer = parse_xfer_mode(arg_str);
+  bool rerun = strncmp(arg_str, "run", 3) == 0 &&
+               (arg_str[3] == 0 || arg_str[3] == ' ');
+  if (!batch_flash_usable()) {
+    printf("[BATCH] Program overlaps the batch flash area.\n");
+    return;
+  }
+  if (!rerun) {
+    printf("[BATCH] Receiving batch image...\n");
+    fflush(stdout);
+    if (!xfer_receive(xfer, ram, RAM_SIZE)) {
+      printf("[BATCH] Aborting: Failed to receive the batch image.\n");
+      return;
+    }
+    if (batch_check(ram, BATCH_FLASH_SIZE) < 0)
+      return;
+    BatchHeader h;
+    memcpy(&h, ram, sizeof(h));
+    batch_store(ram, sizeof(h) + h.len);
+  }
+  const uint8_t *img = flash_nocache(BATCH_FLASH_OFFSET);
+  int count = batch_check(img, BATCH_FLASH_SIZE);
+  if (count < 0)
+    return;
+  uint32_t len = sizeof(BatchHeader) + ((const BatchHeader *)img)->len;
+
+  uint32_t saved_freq = current_freq_hz;
+  bool saved_tuned = current_clock_tuned;
+  uint8_t saved_watch = watch_count;
+  uint32_t saved_prof = prof_period;
+  uint8_t saved_format = trace_format;
+  TraceFilter saved_filter = trace_filter;
+  bool saved_quiet = console_quiet;
+  MemRegion saved_regions[MEM_REGIONS];
+  uint8_t saved_region_count = mem_region_count;
+  memcpy(saved_regions, mem_regions, sizeof(saved_regions));
+  watch_count = 0; // Leftover debugging setup must not stop a test
+  prof_period = 0;
+  trace_filter.rules = 0; // ... nor narrow the log the COM check reads
+  trace_filter.trig = TRIG_NONE;
+  trace_filter.pre = 0;
+  mem_map_reset();
+  console_quiet = true; // Tests end in HLT, one bus timeout message each
+  if (trace_format != TRACE_FMT_RAW)
+    set_trace_format(TRACE_FMT_RAW); // COM bytes are read from the records
+
+  uint32_t out_used = 0;
+  int passed = 0;
+  bool clock_changed = false;
+  for (int i = 0; i < count; i++) {
+    BatchTest t;
+    memcpy(&t, img + sizeof(BatchHeader) + i * sizeof(BatchTest), sizeof(t));
+    BatchResult &r = batch_report.results[i];
+    if (t.freq_hz == 0 && clock_changed)
+      setup_clock(saved_freq, saved_tuned); // Back to the monitor's clock
+    clock_changed = t.freq_hz != 0;
+    batch_run_test(img, len, t, r, out_used);
+    if (r.status == BATCH_PASS)
+      passed++;
+    printf("[BATCH] Test %d/%d: %s, %lu cycles, %lu us, end %u", i + 1, count,
+           status_names[r.status], r.bus_cycles, r.time_us, r.end);
+    if (r.status == BATCH_FAIL)
+      printf(", mismatch at +%lu", r.mismatch);
+    printf("\n");
+    fflush(stdout);
+  }
+
+  console_quiet = saved_quiet;
+  current_freq_hz = saved_freq;
+  setup_clock(current_freq_hz, saved_tuned);
+  watch_count = saved_watch;
+  prof_period = saved_prof;
+  trace_filter = saved_filter;
+  memcpy(mem_regions, saved_regions, sizeof(saved_regions));
+  mem_region_count = saved_region_count;
+  mem_map_rebuild();
+  if (saved_format != TRACE_FMT_RAW)
+    set_trace_format(saved_format);
+
+  memcpy(batch_report.magic, "V30T", 4);
+  batch_report.count = count;
+  batch_report.passed = passed;
+  uint8_t *output = (uint8_t *)&batch_report.results[count];
+  memmove(output, batch_report.output, out_used);
+  int send_bytes = output + out_used - (uint8_t *)&batch_report;
+  printf("[BATCH] %d of %d tests passed. Sending results (%d bytes)...\n",
+         passed, count, send_bytes);
+  fflush(stdout);
+  sleep_ms(500); // Give the receiver a moment to get ready, as autotest
+  if (!xfer_send(xfer, (uint8_t *)&batch_report, send_bytes))
+    printf("[BATCH] Failed to send the results.\n");
+}
+
+// ==========================================
+//   Binary Host Protocol
+// ==========================================
+// Entered from the text prompt by BIN_MAGIC. Every request is answered by
+// exactly one response; nothing else is written to USB meanwhile.
+//   request:  0xA5 op:u8 len:u16 payload[len] crc16:u16
+//   response: 0x5A op:u8 status:u8 len:u16 payload[len] crc16:u16
+// Integers are little endian except the CRC (big endian, as in XMODEM),
+// which covers everything after the start byte.
+enum BinOp {
+  BIN_OP_PING = 0x01,      // -> version:char[8] ram_size:u32 max_payload:u16
+  BIN_OP_WRITE_RAM = 0x02, // addr:u32 data[]
+  BIN_OP_READ_RAM = 0x03,  // addr:u32 len:u16 -> data[len]
+  BIN_OP_FILL_RAM = 0x04,  // value:u8
+  BIN_OP_SET_CLOCK = 0x05, // freq_hz:u32 [tune_sys:u8]
+                           // -> sys_khz:u32 top:u32 div16:u16 err_ppm:u32
+  BIN_OP_SET_TRACE = 0x06, // format:u8 (TraceFormat)
+  BIN_OP_RUN = 0x07,       // mode:u8 cycles:u32 timeout_ms:u32
+                           // -> bus_cycles:u32 time_us:u32 end:u8
+                           //    watch_addr:u32 watch_data:u16 watch_index:u8
+  BIN_OP_LOG_INFO = 0x08,  // -> format:u8 entries:u32 bytes:u32
+  BIN_OP_READ_LOG = 0x09,  // offset:u32 len:u16 -> data[len]
+  BIN_OP_STATS = 0x0A,     // -> see bin_stats()
+  BIN_OP_SET_FILTER = 0x0B, // com_port:u16 trig:u8 trig_types:u8 trig_arg:u32
+                            // pre:u32 rules:u8 {lo:u32 hi:u32 types:u8}[]
+  BIN_OP_SET_WATCH = 0x0C, // {addr:u32 len:u32 types:u8}[] (replaces all)
+  BIN_OP_SET_PROFILE = 0x0D, // period:u32 bucket_shift:u8 (4 or 8), clears
+  BIN_OP_READ_PROFILE = 0x0E, // offset:u32 len:u16 -> prof_hist bytes
+  BIN_OP_CLEAR_STATS = 0x0F, // Same as 'stat clear'
+  BIN_OP_DIRTY_MAP = 0x10, // clear:u8 -> page_size:u16 pages:u16 bitmap[]
+  BIN_OP_READ_DIRTY = 0x11, // first_page:u16
+                            // -> next_page:u16 {page:u16 data[page_size]}[]
+  BIN_OP_EXIT = 0x7F,      // Back to the text monitor
+};
+
+enum BinStatus {
+  BIN_OK = 0,
+  BIN_ERR_CRC,    // Request damaged, resend
+  BIN_ERR_OP,     // Unknown opcode
+  BIN_ERR_ARG,    // Bad length or out of range argument
+  BIN_ERR_FAILED, // Valid request that could not be carried out
+};
+
+// Core0's stack is small, frames live in static buffers
+static uint8_t bin_rx[BIN_MAX_PAYLOAD + 5];
+static uint8_t bin_tx[BIN_MAX_PAYLOAD + 7];
+
+__force_inline uint32_t bin_get32(const uint8_t *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+__force_inline void bin_put32(uint8_t *p, uint32_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
 
 /**
- * @brief 16ビットレジスタ名を対応する3ビットのコードに変換します。
- * @param name レジスタ名 (例: "ax", "cx")
- * @return レジスタコード (0-7)。見つからない場合は-1。
+ * @brief 応答フレームを送信します。
+ * @param op 要求のオペコード
+ * @param status 結果 (BinStatus)
+ * @param payload 応答データ
+ * @param len 応答データのバイト数
+ * @return なし
  */
-int reg_to_code(const char *name) {
-  if (!name)
-    return -1;
-  for (int i = 0; i < 8; i++) {
-    if (strcasecmp(name, reg_names[i]) == 0)
-      return i;
-  }
-  return -1;
+void bin_reply(uint8_t op, uint8_t status, const uint8_t *payload, int len) {
+  uint8_t *f = bin_tx;
+  f[0] = 0x5A;
+  f[1] = op;
+  f[2] = status;
+  f[3] = len;
+  f[4] = len >> 8;
+  if (len > 0 && payload != &f[5])
+    memcpy(&f[5], payload, len);
+  uint16_t crc = crc16_ccitt(&f[1], len + 4);
+  f[5 + len] = crc >> 8;
+  f[6 + len] = crc;
+  usb_write(f, len + 7);
 }
 
 /**
- * @brief レジスタコードを対応する16ビットレジスタ名に変換します。
- * @param code レジスタコード (0-7)
- * @return レジスタ名を表す文字列。無効なコードの場合は "???"。
+ * @brief V30を1回実行して終了を待ちます (BIN_OP_RUN)。
+ * @param mode 0: ログなし, 1: 全ログ, 2: I/Oログ, 3: COMログ
+ * @param cycles 実行するバスサイクル数 (0で無制限)
+ * @param timeout_ms これを超えると停止要求を出します (0で無制限)
+ * @return なし
  */
-const char *code_to_reg(int code) {
-  if (code >= 0 && code < 8)
-    return reg_names[code];
-  return "??";
+void bin_run(uint8_t mode, uint32_t cycles, uint32_t timeout_ms) {
+  static const uint32_t run_cmds[] = {CMD_RUN_NOLOG, CMD_RUN_FULLLOG,
+                                      CMD_RUN_IOLOG, CMD_RUN_COMLOG};
+  memset(trace_log, 0, sizeof(trace_log));
+  run_v30(run_cmds[mode], cycles, timeout_ms);
 }
 
 /**
- * @brief 1行のアセンブリコードをマシン語に変換（アセンブル）します。
- * @param addr 命令を書き込むメモリのアドレス
- * @param arg_str アセンブリ命令の文字列 (例: "mov ax, 1234")
- * @return アセンブルされた命令のバイト数。エラーの場合は0。
+ * @brief 統計情報を応答用に詰めます (BIN_OP_STATS)。
+ * @param p 格納先
+ * @return 書き込んだバイト数
  */
-int assemble_instruction(uint32_t addr, const char *arg_str) {
-  char args[256];
-  strncpy(args, arg_str, sizeof(args) - 1);
-  args[sizeof(args) - 1] = 0;
-
-  char *mnemonic = strtok(args, " ");
-  if (!mnemonic) {
-    return 0;
+int bin_stats(uint8_t *p) {
+  // executed_cycles, execution_time_us, run_end_reason, trace stream
+  // records/dropped, disk overlay/log/cache counters, profiler samples,
+  // then the 'stat' counters: bus cycles by type, timeouts, resyncs, runs,
+  // run cycles/time (u64 as lo, hi), vmio count/total/max per VmioDev,
+  // USB bytes in/out, the 'QU' doorbells and the worst RD response (sys
+  // clocks, 0 unless built with V30_RD_TIMING). New fields are only ever
+  // appended.
+  bin_put32(&p[0], executed_cycles);
+  bin_put32(&p[4], execution_time_us);
+  bin_put32(&p[8], run_end_reason);
+  bin_put32(&p[12], trace_stream_total);
+  bin_put32(&p[16], trace_stream_dropped);
+  bin_put32(&p[20], disk_overlay_used);
+  bin_put32(&p[24], disk_log_used);
+  bin_put32(&p[28], disk_cache_hits);
+  bin_put32(&p[32], disk_cache_misses);
+  bin_put32(&p[36], prof_samples);
+  int n = 40;
+  const volatile BusStats &b = bus_stats;
+  for (int i = 0; i < 4; i++, n += 4)
+    bin_put32(&p[n], b.cycles[i]);
+  const uint32_t bus[] = {b.timeout_ale,
+                          b.timeout_strobe,
+                          b.resync,
+                          b.runs,
+                          (uint32_t)b.run_cycles,
+                          (uint32_t)(b.run_cycles >> 32),
+                          (uint32_t)b.run_time_us,
+                          (uint32_t)(b.run_time_us >> 32)};
+  for (uint32_t v : bus) {
+    bin_put32(&p[n], v);
+    n += 4;
   }
+  // VMIO_QUEUE came later than the payload layout, so it follows the USB
+  // counters instead of taking its VmioDev slot.
+  for (int i = 0; i < VMIO_DEVS; i++) {
+    if (i == VMIO_QUEUE)
+      continue;
+    bin_put32(&p[n], vmio_stats[i].count);
+    bin_put32(&p[n + 4], vmio_stats[i].total_us);
+    bin_put32(&p[n + 8], vmio_stats[i].max_us);
+    n += 12;
+  }
+  bin_put32(&p[n], usb_stats.bytes_in);
+  bin_put32(&p[n + 4], usb_stats.bytes_out);
+  n += 8;
+  bin_put32(&p[n], vmio_stats[VMIO_QUEUE].count);
+  bin_put32(&p[n + 4], vmio_stats[VMIO_QUEUE].total_us);
+  bin_put32(&p[n + 8], vmio_stats[VMIO_QUEUE].max_us);
+  bin_put32(&p[n + 12], b.rd_worst_ticks);
+  return n + 16;
+}
 
-  char *op1_str = strtok(NULL, ", ");
-  char *op2_str = strtok(NULL, ", ");
-  int bytes = 0;
-
-  if (strcasecmp(mnemonic, "nop") == 0) {
-    ram[map_address(addr)] = 0x90;
-    bytes = 1;
-  } else if (strcasecmp(mnemonic, "mov") == 0) {
-    int reg1 = reg_to_code(op1_str);
-    if (reg1 != -1 && op2_str) { // mov reg, imm
-      int imm = strtol(op2_str, NULL, 16);
-      ram[map_address(addr)] = 0xB8 + reg1;
-      ram[map_address(addr + 1)] = imm & 0xFF;
-      ram[map_address(addr + 2)] = imm >> 8;
-      bytes = 3;
-    } else if (op1_str[0] == '[' && op2_str &&
-               reg_to_code(op2_str) == 0) { // mov [imm], ax
-      int imm = strtol(op1_str + 1, NULL, 16);
-      ram[map_address(addr)] = 0xA3;
-      ram[map_address(addr + 1)] = imm & 0xFF;
-      ram[map_address(addr + 2)] = imm >> 8;
-      bytes = 3;
+/**
+ * @brief バイナリプロトコルの要求を1件処理します。
+ * @param op オペコード
+ * @param p 要求データ
+ * @param len 要求データのバイト数
+ * @return BIN_OP_EXITを受け取った場合false
+ */
+bool bin_dispatch(uint8_t op, const uint8_t *p, int len) {
+  uint8_t *out = &bin_tx[5]; // Replies are built in place
+  switch (op) {
+  case BIN_OP_PING: {
+    memset(out, 0, 8);
+    strncpy((char *)out, VERSION_STR, 8);
+    bin_put32(&out[8], RAM_SIZE);
+    out[12] = BIN_MAX_PAYLOAD & 0xFF;
+    out[13] = BIN_MAX_PAYLOAD >> 8;
+    bin_reply(op, BIN_OK, out, 14);
+    break;
+  }
+  case BIN_OP_WRITE_RAM: {
+    uint32_t addr = len >= 4 ? bin_get32(p) : RAM_SIZE;
+    if (len < 4 || addr > RAM_SIZE || (uint32_t)(len - 4) > RAM_SIZE - addr) {
+      bin_reply(op, BIN_ERR_ARG, nullptr, 0);
+      break;
     }
-  } else if (strcasecmp(mnemonic, "add") == 0) {
-    int reg1 = reg_to_code(op1_str);
-    int reg2 = reg_to_code(op2_str);
-    if (reg1 != -1 && reg2 != -1) {
-      ram[map_address(addr)] = 0x01;
-      ram[map_address(addr + 1)] = 0xC0 | (reg2 << 3) | reg1; // ModR/M
-      bytes = 2;
+    memcpy(&ram[addr], p + 4, len - 4);
+    bin_reply(op, BIN_OK, nullptr, 0);
+    break;
+  }
+  case BIN_OP_READ_RAM: {
+    if (len != 6) {
+      bin_reply(op, BIN_ERR_ARG, nullptr, 0);
+      break;
     }
-  } else if (strcasecmp(mnemonic, "xchg") == 0) {
-    int reg1 = reg_to_code(op1_str);
-    int reg2 = reg_to_code(op2_str);
-    if (reg1 == 0 && reg2 != -1) { // xchg ax, reg
-      ram[map_address(addr)] = 0x90 + reg2;
-      bytes = 1;
-    } else if (reg2 == 0 && reg1 != -1) { // xchg reg, ax
-      ram[map_address(addr)] = 0x90 + reg1;
-      bytes = 1;
+    uint32_t addr = bin_get32(p);
+    uint32_t n = p[4] | (p[5] << 8);
+    if (n > BIN_MAX_PAYLOAD || addr > RAM_SIZE || n > RAM_SIZE - addr) {
+      bin_reply(op, BIN_ERR_ARG, nullptr, 0);
+      break;
     }
-  } else if (strcasecmp(mnemonic, "loop") == 0) {
-    uint32_t target = strtol(op1_str, NULL, 16);
-    int8_t offset = target - (addr + 2);
-    ram[map_address(addr)] = 0xE2;
-    ram[map_address(addr + 1)] = offset;
-    bytes = 2;
-  } else if (strcasecmp(mnemonic, "jmp") == 0) {
-    char *target_str = op1_str;
-    if (op1_str && strcasecmp(op1_str, "far") == 0) {
-      target_str = op2_str;
+    bin_reply(op, BIN_OK, &ram[addr], n);
+    break;
+  }
+  case BIN_OP_FILL_RAM:
+    if (len != 1) {
+      bin_reply(op, BIN_ERR_ARG, nullptr, 0);
+      break;
     }
-
-    if (!target_str) { // No operand for jmp
-      return 0;
+    memset(ram, p[0], RAM_SIZE);
+    dirty_clear();
+    bin_reply(op, BIN_OK, nullptr, 0);
+    break;
+  case BIN_OP_SET_CLOCK:
+    if (len != 4 && len != 5) {
+      bin_reply(op, BIN_ERR_ARG, nullptr, 0);
+      break;
     }
-
-    char *colon_pos = strchr(target_str, ':');
-    if (colon_pos) {     // Far jump: segment:offset
-      *colon_pos = '\0'; // Null-terminate segment part
-      uint16_t segment = (uint16_t)strtol(target_str, NULL, 16);
-      uint16_t offset = (uint16_t)strtol(colon_pos + 1, NULL,
-                                         16); // Offset part starts after colon
-
-      ram[map_address(addr)] = 0xEA; // JMP FAR opcode
-      ram[map_address(addr + 1)] = offset & 0xFF;
-      ram[map_address(addr + 2)] = (offset >> 8) & 0xFF;
-      ram[map_address(addr + 3)] = segment & 0xFF;
-      ram[map_address(addr + 4)] = (segment >> 8) & 0xFF;
-      bytes = 5;
-    } else { // Near jump: relative to current IP
-      uint32_t target = strtol(target_str, NULL, 16);
-      int8_t offset = target - (addr + 2); // EB opcode is 2 bytes
-      ram[map_address(addr)] = 0xEB;       // JMP NEAR rel8 opcode
-      ram[map_address(addr + 1)] = offset;
-      bytes = 2;
+    if (!setup_clock(bin_get32(p), len == 5 && p[4])) {
+      bin_reply(op, BIN_ERR_ARG, nullptr, 0);
+      break;
+    }
+    current_freq_hz = bin_get32(p);
+    bin_put32(&out[0], current_clock.sys_khz);
+    bin_put32(&out[4], current_clock.top);
+    out[8] = current_clock.div16 & 0xFF;
+    out[9] = current_clock.div16 >> 8;
+    bin_put32(&out[10], current_clock.err_ppm);
+    bin_reply(op, BIN_OK, out, 14);
+    break;
+  case BIN_OP_SET_TRACE:
+    if (len != 1 || p[0] > TRACE_FMT_COMPACT) {
+      bin_reply(op, BIN_ERR_ARG, nullptr, 0);
+      break;
     }
+    set_trace_format(p[0]);
+    bin_reply(op, BIN_OK, nullptr, 0);
+    break;
+  case BIN_OP_RUN:
+    if (len != 9 || p[0] > 3) {
+      bin_reply(op, BIN_ERR_ARG, nullptr, 0);
+      break;
+    }
+    bin_run(p[0], bin_get32(&p[1]), bin_get32(&p[5]));
+    bin_put32(&out[0], executed_cycles);
+    bin_put32(&out[4], execution_time_us);
+    out[8] = run_end_reason;
+    bin_put32(&out[9], watch_hit.addr);
+    out[13] = watch_hit.data & 0xFF;
+    out[14] = watch_hit.data >> 8;
+    out[15] = watch_hit.index;
+    bin_reply(op, BIN_OK, out, 16);
+    break;
+  case BIN_OP_LOG_INFO: {
+    int entries;
+    int bytes = trace_log_send_size(&entries);
+    out[0] = trace_format;
+    bin_put32(&out[1], entries);
+    bin_put32(&out[5], bytes);
+    bin_reply(op, BIN_OK, out, 9);
+    break;
   }
-  // NEW HANDLER FOR DB
-  else if (strcasecmp(mnemonic, "db") == 0) {
-    // The issue is that op1_str and op2_str are tokenized before this handler.
-    // We need to process them and then continue tokenizing.
-    if (op1_str) {
-      ram[map_address(addr + bytes)] = (uint8_t)strtol(op1_str, NULL, 16);
-      bytes++;
-    } else {
-      return 0; // No arguments for db.
+  case BIN_OP_READ_LOG: {
+    if (len != 6) {
+      bin_reply(op, BIN_ERR_ARG, nullptr, 0);
+      break;
     }
-
-    if (op2_str) {
-      ram[map_address(addr + bytes)] = (uint8_t)strtol(op2_str, NULL, 16);
-      bytes++;
+    uint32_t off = bin_get32(p);
+    uint32_t n = p[4] | (p[5] << 8);
+    if (n > BIN_MAX_PAYLOAD || off > sizeof(trace_log) ||
+        n > sizeof(trace_log) - off) {
+      bin_reply(op, BIN_ERR_ARG, nullptr, 0);
+      break;
     }
-
-    char *next_op_str;
-    while ((next_op_str = strtok(NULL, " ,")) != NULL) {
-      ram[map_address(addr + bytes)] = (uint8_t)strtol(next_op_str, NULL, 16);
-      bytes++;
+    bin_reply(op, BIN_OK, trace_bytes() + off, n);
+    break;
+  }
+  case BIN_OP_STATS:
+    bin_reply(op, BIN_OK, out, bin_stats(out));
+    break;
+  case BIN_OP_SET_FILTER: {
+    uint32_t rules = len >= 13 ? p[12] : 0;
+    if (len < 13 || p[2] > TRIG_CYCLES || rules > TRACE_FILTER_RULES ||
+        len != 13 + 9 * (int)rules || bin_get32(&p[8]) >= MAX_CYCLES) {
+      bin_reply(op, BIN_ERR_ARG, nullptr, 0);
+      break;
     }
+    trace_com_port = p[0] | (p[1] << 8);
+    trace_filter.trig = p[2];
+    trace_filter.trig_types = p[3];
+    trace_filter.trig_arg = bin_get32(&p[4]);
+    trace_filter.pre = bin_get32(&p[8]);
+    trace_filter.rules = rules;
+    for (uint32_t i = 0; i < rules; i++) {
+      const uint8_t *r = &p[13 + 9 * i];
+      trace_filter.rule[i] = {bin_get32(r), bin_get32(r + 4), r[8]};
+    }
+    bin_reply(op, BIN_OK, nullptr, 0);
+    break;
   }
-
-  if (bytes > 0) {
-    printf(" ->");
-    for (int i = 0; i < bytes; i++)
-      printf(" %02X", ram[map_address(addr + i)]);
-    return bytes;
-  } else {
-    return 0;
+  case BIN_OP_SET_WATCH: {
+    if (len % 9 != 0 || len / 9 > WATCH_POINTS) {
+      bin_reply(op, BIN_ERR_ARG, nullptr, 0);
+      break;
+    }
+    watch_count = 0;
+    bool ok = true;
+    for (int i = 0; i < len; i += 9)
+      ok = ok && watch_add(bin_get32(&p[i]), bin_get32(&p[i + 4]), p[i + 8]);
+    if (!ok) {
+      watch_count = 0;
+      watch_rebuild();
+    }
+    bin_reply(op, ok ? BIN_OK : BIN_ERR_ARG, nullptr, 0);
+    break;
+  }
+  case BIN_OP_SET_PROFILE:
+    if (len != 5 || (p[4] != 4 && p[4] != 8)) {
+      bin_reply(op, BIN_ERR_ARG, nullptr, 0);
+      break;
+    }
+    prof_setup(bin_get32(p), p[4]);
+    bin_reply(op, BIN_OK, nullptr, 0);
+    break;
+  case BIN_OP_READ_PROFILE: {
+    if (len != 6) {
+      bin_reply(op, BIN_ERR_ARG, nullptr, 0);
+      break;
+    }
+    uint32_t off = bin_get32(p);
+    uint32_t n = p[4] | (p[5] << 8);
+    if (n > BIN_MAX_PAYLOAD || off > sizeof(prof_hist) ||
+        n > sizeof(prof_hist) - off) {
+      bin_reply(op, BIN_ERR_ARG, nullptr, 0);
+      break;
+    }
+    bin_reply(op, BIN_OK, (const uint8_t *)prof_hist + off, n);
+    break;
   }
+  case BIN_OP_CLEAR_STATS:
+    stats_clear();
+    bin_reply(op, BIN_OK, nullptr, 0);
+    break;
+  case BIN_OP_DIRTY_MAP:
+    if (len != 1) {
+      bin_reply(op, BIN_ERR_ARG, nullptr, 0);
+      break;
+    }
+    out[0] = DIRTY_PAGE_SIZE & 0xFF;
+    out[1] = DIRTY_PAGE_SIZE >> 8;
+    out[2] = DIRTY_PAGES & 0xFF;
+    out[3] = DIRTY_PAGES >> 8;
+    memset(&out[4], 0, DIRTY_PAGES / 8);
+    for (uint32_t i = 0; i < DIRTY_PAGES; i++) {
+      if (ram_dirty[i])
+        out[4 + i / 8] |= 1 << (i % 8);
+    }
+    if (p[0])
+      dirty_clear();
+    bin_reply(op, BIN_OK, out, 4 + DIRTY_PAGES / 8);
+    break;
+  case BIN_OP_READ_DIRTY: {
+    // As many dirty pages from first_page on as fit in one frame
+    uint32_t page = len == 2 ? p[0] | (p[1] << 8) : DIRTY_PAGES + 1;
+    if (page > DIRTY_PAGES) {
+      bin_reply(op, BIN_ERR_ARG, nullptr, 0);
+      break;
+    }
+    int n = 2;
+    for (; page < DIRTY_PAGES; page++) {
+      if (!ram_dirty[page])
+        continue;
+      if (n + 2 + (int)DIRTY_PAGE_SIZE > BIN_MAX_PAYLOAD)
+        break;
+      out[n++] = page & 0xFF;
+      out[n++] = page >> 8;
+      memcpy(&out[n], &ram[page << DIRTY_PAGE_SHIFT], DIRTY_PAGE_SIZE);
+      n += DIRTY_PAGE_SIZE;
+    }
+    out[0] = page & 0xFF;
+    out[1] = page >> 8;
+    bin_reply(op, BIN_OK, out, n);
+    break;
+  }
+  case BIN_OP_EXIT:
+    bin_reply(op, BIN_OK, nullptr, 0);
+    return false;
+  default:
+    bin_reply(op, BIN_ERR_OP, nullptr, 0);
+    break;
+  }
+  return true;
 }
 
 /**
- * @brief 'l' (disassemble)
- * コマンドを処理します。指定されたアドレスからメモリの内容を逆アセンブルします。
- * @param arg_str コマンドの引数文字列 (アドレスと長さ)
+ * @brief バイナリプロトコルのセッションを実行します。
+ * BIN_OP_EXITを受け取るとテキストモニタに戻ります。
+ * @param なし
  * @return なし
  */
-void cmd_disasm(const char *arg_str) {
-  char args[128];
-  strncpy(args, arg_str, sizeof(args) - 1);
-  args[sizeof(args) - 1] = 0;
-  char *addr_str = strtok(args, " ");
-  char *len_str = strtok(NULL, " ");
-  uint32_t addr = addr_str ? strtol(addr_str, NULL, 16) : 0;
-  int len = len_str ? strtol(len_str, NULL, 10) : 16;
-
-  uint32_t pc = addr;
-  while (pc < addr + len) {
-    uint32_t current_pc = pc;
-    uint8_t opcode = ram[map_address(pc)];
-    int bytes = 1;
-    char disasm_str[128] = {0};
-    char hex_dump[32] = {0};
-
-    if (opcode == 0x90) {
-      sprintf(disasm_str, "nop");
-    } else if (opcode >= 0xB0 && opcode <= 0xB7) {
-      bytes = 2;
-      uint8_t imm = ram[map_address(pc + 1)];
-      sprintf(disasm_str, "mov %s, 0x%02X", reg_names8[opcode - 0xB0], imm);
-    } else if (opcode >= 0xB8 && opcode <= 0xBF) {
-      bytes = 3;
-      uint16_t imm = ram[map_address(pc + 1)] | (ram[map_address(pc + 2)] << 8);
-      sprintf(disasm_str, "mov %s, 0x%04X", code_to_reg(opcode - 0xB8), imm);
-    } else if (opcode == 0x04) {
-      bytes = 2;
-      uint8_t imm = ram[map_address(pc + 1)];
-      sprintf(disasm_str, "add al, 0x%02X", imm);
-    } else if (opcode == 0xA2) {
-      bytes = 3;
-      uint16_t mem_addr =
-          ram[map_address(pc + 1)] | (ram[map_address(pc + 2)] << 8);
-      sprintf(disasm_str, "mov [0x%04X], al", mem_addr);
-    } else if (opcode == 0xA3) {
-      bytes = 3;
-      uint16_t mem_addr =
-          ram[map_address(pc + 1)] | (ram[map_address(pc + 2)] << 8);
-      sprintf(disasm_str, "mov [0x%04X], ax", mem_addr);
-    } else if (opcode == 0x01) {
-      bytes = 2;
-      uint8_t modrm = ram[map_address(pc + 1)];
-      if ((modrm >> 6) == 3) { // reg, reg
-        int reg1 = modrm & 7;
-        int reg2 = (modrm >> 3) & 7;
-        sprintf(disasm_str, "add %s, %s", code_to_reg(reg1), code_to_reg(reg2));
-      }
-    } else if (opcode >= 0x91 && opcode <= 0x97) {
-      bytes = 1;
-      sprintf(disasm_str, "xchg ax, %s", code_to_reg(opcode - 0x90));
-    } else if (opcode == 0xE2) {
-      bytes = 2;
-      int8_t offset = ram[map_address(pc + 1)];
-      sprintf(disasm_str, "loop 0x%04lX", pc + 2 + offset);
-    } else if (opcode == 0xEB) {
-      bytes = 2;
-      int8_t offset = ram[map_address(pc + 1)];
-      sprintf(disasm_str, "jmp 0x%04lX", pc + 2 + offset);
-    } else if (opcode == 0xEA) { // JMP FAR segment:offset
-      bytes = 5;
-      uint16_t offset =
-          ram[map_address(pc + 1)] | (ram[map_address(pc + 2)] << 8);
-      uint16_t segment =
-          ram[map_address(pc + 3)] | (ram[map_address(pc + 4)] << 8);
-      sprintf(disasm_str, "jmp far 0x%04X:0x%04X", segment, offset);
-    } else if (opcode == 0xF4) {
-      bytes = 1;
-      sprintf(disasm_str, "hlt");
-    } else {
-      sprintf(disasm_str, "db 0x%02X", opcode);
+void binary_session() {
+  console_quiet = true;
+  stdio_set_translate_crlf(&stdio_monitor, false);
+  while (true) {
+    int c = getchar();
+    usb_stats.bytes_in++;
+    if (c != 0xA5)
+      continue; // Resync on the start byte
+    uint8_t *f = bin_rx;
+    if (!raw_read(f, 3, 1000))
+      continue;
+    uint8_t op = f[0];
+    int len = f[1] | (f[2] << 8);
+    if (len > BIN_MAX_PAYLOAD || !raw_read(f + 3, len + 2, 1000)) {
+      bin_reply(op, BIN_ERR_CRC, nullptr, 0);
+      continue;
     }
-
-    char *p = hex_dump;
-    for (int i = 0; i < bytes; i++)
-      p += sprintf(p, "%02X ", ram[map_address(current_pc + i)]);
-
-    printf("%05lX: %-12s %s\n", current_pc, hex_dump, disasm_str);
-    pc += bytes;
+    uint16_t crc = (f[3 + len] << 8) | f[4 + len];
+    if (crc16_ccitt(f, len + 3) != crc) {
+      bin_reply(op, BIN_ERR_CRC, nullptr, 0);
+      continue;
+    }
+    if (!bin_dispatch(op, f + 3, len))
+      break;
   }
+  stdio_set_translate_crlf(&stdio_monitor, true);
+  console_quiet = false;
+}
+
+/**
+ * @brief V30_BANKED_SRAMの場合、Core 1のコードをSRAM2へコピーし、専用
+ * バンクの変数を0で初期化します (crt0はこれらの領域を扱いません)。
+ * @param なし
+ * @return なし
+ */
+void sram_layout_init() {
+#if V30_BANKED_SRAM
+  extern uint8_t __core1_func_start__[], __core1_func_end__[],
+      __core1_func_source__[];
+  extern uint8_t __core1_bss_start__[], __core1_bss_end__[];
+  extern uint8_t __v30_ram_start__[], __v30_ram_end__[];
+  memcpy(__core1_func_start__, __core1_func_source__,
+         __core1_func_end__ - __core1_func_start__);
+  memset(__core1_bss_start__, 0, __core1_bss_end__ - __core1_bss_start__);
+  memset(__v30_ram_start__, 0, __v30_ram_end__ - __v30_ram_start__);
+#endif
 }
 
 // ==========================================
@@ -1411,9 +7302,10 @@ void cmd_disasm(const char *arg_str) {
  * @return 0 (ただし、無限ループのため通常は返らない)
  */
 int main() {
-  set_sys_clock_khz(250000, true);
+  sram_layout_init();
+  set_sys_clock_khz(SYS_CLOCK_KHZ, true);
   // stdio_init_all();
-  stdio_usb_init();
+  usb_init();
 
   gpio_init(PIN_LED);
   gpio_set_dir(PIN_LED, GPIO_OUT);
@@ -1422,16 +7314,34 @@ int main() {
   setup_clock(current_freq_hz);
 
   memset(ram, 0xF4, RAM_SIZE); // Default to HLT
+  mem_map_reset();
+  disk_overlay_init();
+  disk_dma_chan = dma_claim_unused_channel(false); // memcpy if none is free
+  crc16_init();
   multicore_launch_core1(core1_entry);
 
   char line[128], *argv[16];
   printf("\n\n=== V30 Monitor v%s ===\nType '?' for help.\n", VERSION_STR);
 
   while (true) {
+    bus_report_end();
+    watch_report_hit();
     printf("mon> ");
     int pos = 0;
+    int magic = 0; // Bytes of BIN_MAGIC matched so far, not echoed
     while (pos < 127) {
       int c = getchar();
+      if (c == BIN_MAGIC[magic]) {
+        if (BIN_MAGIC[++magic] == 0) {
+          binary_session();
+          pos = 0;
+          break;
+        }
+        continue;
+      }
+      magic = c == BIN_MAGIC[0];
+      if (magic)
+        continue;
       if (c == '\r' || c == '\n') {
         putchar('\n');
         break;
@@ -1471,17 +7381,68 @@ int main() {
              "infinite)\n");
       printf(" i [cycles]     : Run & Log IO only for specified cycles (0 or "
              "omit for infinite)\n");
-      printf(" g              : Run Loop (Key stop)\n");
-      printf(" c <kHz>        : Set V30 clock speed\n");
-      printf(" xr/xs          : XMODEM Recv/Send RAM\n");
-      printf(" xl             : XMODEM Send Log\n");
+      printf(" g [rate [ms]]  : Run Loop, COM1/COM2 to USB (Ctrl-] stop), "
+             "rate: cycles/s every ms\n");
+      printf(" uart [com1|com2] : Emulated 16550 status / input port for g\n");
+      printf(" ts [io|com2]   : Run & stream log to host (Key stop)\n");
+      printf(" tf [raw|compact] : Select trace log format\n");
+      printf(" c <kHz> [auto] : Set V30 clock speed (auto: tune sys clock)\n");
+      printf(" bus [sio|pio]  : Select bus engine (software poll / PIO)\n");
+      printf(" xr/xs [1k|bulk] [rle] : XMODEM (1K) / raw bulk Recv/Send RAM "
+             "(rle: PackBits)\n");
+      printf(" xl [1k|bulk] [rle] : XMODEM (1K) / raw bulk Send Log\n");
       printf(" v              : Version\n");
-      printf(" autotest [io]  : Full auto test (Rx -> Run -> Tx Log)\n");
+      printf(" autotest [io|com2] [stream] [raw|compact] [1k|bulk] [rle] : Full "
+             "auto test (Rx -> Run -> Tx Log)\n");
+      printf(" batch [run] [1k|bulk] [rle] : Batch autotest (Rx image to "
+             "flash -> Run all -> Tx results)\n");
       printf(" b              : Reboot to BOOTSEL mode\n");
       printf(" k              : Load boot.img into RAM\n");
-      printf(" h              : Start hidos vm\n");
+      printf(" mm [ram|rom|open <addr> <len> [offset]|reset] : Memory map "
+             "(4KB pages)\n");
+      printf(" dirty [clear]  : RAM pages written since the last clear/load\n");
+      printf(" h [boot] [loglevel] [stream [io|com2]] : Resume the hidos "
+             "snapshot or start hidos vm (stream: log to this port)\n");
+      printf(" snap [clear]   : HIDOS snapshot in flash (Ctrl-\\ in h saves)\n");
+      printf(" dk [save|clear] : Disk overlay status / write to flash / "
+             "discard\n");
+      printf(" tr [add|port|trig|pre|clear] ... : Trace filter rules and "
+             "trigger\n");
+      printf(" wp [<addr> [len] [r|w|rw]|del <n>|clear] : Memory watchpoints "
+             "(halt the V30)\n");
+      printf(" bp <addr>      : Breakpoint on instruction fetch (wp <addr> 1 "
+             "r)\n");
+      printf(" pf [on [16|256] [period]|off|clear|top [n]|save [1k|bulk] "
+             "[rle]] : "
+             "Sampling profiler\n");
+      printf(" stat [clear]   : Bus, HIDOS I/O and USB statistics\n");
+      printf(" bench [runs]   : Run a test program at every clock (overwrites "
+             "RAM)\n");
+      printf(" (02 02 'V30')  : Enter the binary host protocol\n");
     } else if (strcmp(cmd, "k") == 0)
       cmd_load_boot(args);
+    else if (strcmp(cmd, "tr") == 0)
+      cmd_trace_filter(args);
+    else if (strcmp(cmd, "wp") == 0)
+      cmd_watch(args, false);
+    else if (strcmp(cmd, "bp") == 0)
+      cmd_watch(args, true);
+    else if (strcmp(cmd, "pf") == 0)
+      cmd_profile(args);
+    else if (strcmp(cmd, "stat") == 0)
+      cmd_stat(args);
+    else if (strcmp(cmd, "mm") == 0)
+      cmd_memmap(args);
+    else if (strcmp(cmd, "dirty") == 0)
+      cmd_dirty(args);
+    else if (strcmp(cmd, "snap") == 0)
+      cmd_snap(args);
+    else if (strcmp(cmd, "uart") == 0)
+      cmd_uart(args);
+    else if (strcmp(cmd, "bench") == 0)
+      cmd_bench(args);
+    else if (strcmp(cmd, "batch") == 0)
+      cmd_batch(args);
     else if (strcmp(cmd, "d") == 0)
       cmd_dump(args);
     else if (strcmp(cmd, "e") == 0)
@@ -1542,37 +7503,93 @@ int main() {
         }
       }
     } else if (strcmp(cmd, "g") == 0) {
-      printf("Running V30 (No Log). Press any key to stop...\n");
+      uint32_t rate_ms = 0; // 0: no live report
+      if (strncmp(args, "rate", 4) == 0 && (args[4] == 0 || args[4] == ' ')) {
+        rate_ms = strtoul(&args[4], NULL, 10);
+        if (rate_ms == 0)
+          rate_ms = LIVE_RATE_MS;
+        else if (rate_ms < LIVE_RATE_MIN_MS)
+          rate_ms = LIVE_RATE_MIN_MS;
+      } else if (strlen(args) > 0) {
+        printf("Usage: g [rate [ms]]\n");
+        continue;
+      }
+      printf("Running V30 (No Log). Ctrl-] to stop, keys go to COM%d...\n",
+             uart_rx_port + 1);
       cycle_limit = 0x7FFFFFFF; // Effectively infinite for manual stop
+      uart_reset();
+      uart_bridged = true;
+      LiveSample live_start = live_sample();
+      LiveSample live_prev = live_start;
       multicore_fifo_push_blocking(CMD_RUN_NOLOG);
-      getchar();
-      stop_request = true;
-      multicore_fifo_pop_blocking(); // Wait for completion signal
+      uint32_t done;
+      while (!multicore_fifo_pop_timeout_us(CON_FLUSH_US, &done)) {
+        if (rate_ms && time_us_64() - live_prev.t_us >= rate_ms * 1000ull) {
+          uart_flush_tx(); // V30 output so far comes before the report
+          live_report(live_prev, live_start);
+        }
+        // With the console on its own port any key here stops, as before
+        bool key = console_itf() != USB_ITF_MONITOR &&
+                   getchar_timeout_us(0) != PICO_ERROR_TIMEOUT;
+        if (uart_service() || key) {
+          stop_request = true;
+          multicore_fifo_pop_blocking(); // Wait for completion signal
+          break;
+        }
+      }
+      uart_bridged = false;
+      uart_flush_tx(); // What the V30 sent last
+      printf("\n");
       int cycles = executed_cycles;
       int time_us = execution_time_us; // Read execution time
       printf("Stopped. Ran %d cycles in %d us.\n", cycles, time_us);
+    } else if (strcmp(cmd, "bus") == 0) {
+      if (strcmp(args, "sio") == 0) {
+        bus_engine = BUS_ENGINE_SIO;
+      } else if (strcmp(args, "pio") == 0) {
+        bus_engine = BUS_ENGINE_PIO;
+      } else if (strlen(args) > 0) {
+        printf("Usage: bus [sio|pio]\n");
+      }
+      printf("Bus engine: %s\n", bus_engine == BUS_ENGINE_PIO ? "pio" : "sio");
     } else if (strcmp(cmd, "c") == 0) {
       if (!args || strlen(args) == 0) {
-        printf("Usage: c <freq_khz>\n");
-        printf("Available frequencies (kHz):");
-        for (const auto &setting : freq_table) {
-          printf(" %lu", setting.freq_hz / 1000);
+        printf("Usage: c <freq_khz> [auto]\n");
+        printf("  auto: also pick the sys clock (%lu-%lu kHz) for the least "
+               "jitter\n",
+               (uint32_t)SYS_CLOCK_MIN_KHZ, (uint32_t)SYS_CLOCK_MAX_KHZ);
+        printf("Presets (kHz):");
+        for (uint32_t hz : freq_table) {
+          printf(" %lu", hz / 1000);
         }
-        printf("\nCurrent: %lu kHz\n", current_freq_hz / 1000);
+        printf("\nCurrent: %lu kHz (sys %lu kHz, wrap %lu, div %u+%u/16, "
+               "error %lu ppm)\n",
+               current_freq_hz / 1000, current_clock.sys_khz,
+               current_clock.top - 1, current_clock.div16 >> 4,
+               current_clock.div16 & 15, current_clock.err_ppm);
+        printf("Read turnaround: %lu sys clocks\n", bus_turnaround_cycles);
       } else {
-        uint32_t new_freq_khz = strtol(args, NULL, 10);
-        bool found = false;
-        for (const auto &setting : freq_table) {
-          if ((setting.freq_hz / 1000) == new_freq_khz) {
-            current_freq_hz = setting.freq_hz;
-            setup_clock(current_freq_hz);
-            found = true;
-            break;
-          }
-        }
-        if (!found) {
-          printf("Error: Unsupported frequency. Use 'c' to list available "
-                 "options.\n");
+        char *end;
+        uint32_t new_freq_khz = strtoul(args, &end, 10);
+        while (*end == ' ')
+          end++;
+        bool tune = strcmp(end, "auto") == 0;
+        if (end == args || (*end && !tune)) {
+          printf("Usage: c <freq_khz> [auto]\n");
+        } else if (!setup_clock(new_freq_khz * 1000, tune)) {
+          printf("Error: %lu kHz cannot be made from a %lu kHz sys clock.\n",
+                 new_freq_khz, (uint32_t)SYS_CLOCK_KHZ);
+        } else {
+          current_freq_hz = new_freq_khz * 1000;
+          printf("Clock set to %lu Hz (sys %lu kHz, wrap %lu, div %u+%u/16, "
+                 "error %lu ppm)\n",
+                 current_freq_hz, current_clock.sys_khz,
+                 current_clock.top - 1, current_clock.div16 >> 4,
+                 current_clock.div16 & 15, current_clock.err_ppm);
+          if (current_clock.div16 & 15)
+            printf("Note: fractional divider, edges jitter by one sys "
+                   "clock.\n");
+          printf("Read turnaround: %lu sys clocks\n", bus_turnaround_cycles);
         }
       }
     } else if (strcmp(cmd, "r") == 0) {
@@ -1613,18 +7630,7 @@ int main() {
       int cycles = executed_cycles;
       int time_us = execution_time_us; // Read execution time
       printf("--- Log (%d bus cycles executed, %d us) ---\n", cycles, time_us);
-      printf("ADDR  |B|TY|DATA\n");
-      for (int i = 0; i < MAX_CYCLES; i++) {
-        if (trace_log[i].type != LOG_UNUSED) {
-          const char *types[] = {"RD", "WR", "IR", "IW"};
-          // Type is now 1-based (0 is unused)
-          if (trace_log[i].type > 0 && trace_log[i].type <= 4) {
-            printf("%05lX|%s|%s|%04X\n", trace_log[i].address,
-                   (trace_log[i].ctrl & 1 ? "B" : "-"),
-                   types[trace_log[i].type - 1], trace_log[i].data);
-          }
-        }
-      }
+      print_trace_log(true);
     } else if (strcmp(cmd, "i") == 0) {
       int run_cycles_val = (strlen(args) > 0) ? strtol(args, NULL, 10) : 0;
       bool is_infinite = (run_cycles_val == 0);
@@ -1663,42 +7669,46 @@ int main() {
       int time_us = execution_time_us; // Read execution time
       printf("--- IO Log (%d bus cycles executed, %d us) ---\n", cycles,
              time_us);
-      printf("ADDR  |B|TY|DATA\n");
-      for (int i = 0; i < MAX_CYCLES; i++) {
-        if (trace_log[i].type != LOG_UNUSED) {
-          const char *types[] = {"RD", "WR", "IR", "IW"};
-          // Type is now 1-based (0 is unused)
-          if (trace_log[i].type > 0 && trace_log[i].type <= 4) {
-            printf("%05lX|%s|%s|%04X\n", trace_log[i].address,
-                   (trace_log[i].ctrl & 1 ? "B" : "-"),
-                   types[trace_log[i].type - 1], trace_log[i].data);
-          }
-        }
+      print_trace_log(false);
+    } else if (strcmp(cmd, "ts") == 0) {
+      uint32_t run_cmd = CMD_RUN_FULLLOG;
+      if (strcmp(args, "io") == 0)
+        run_cmd = CMD_RUN_IOLOG;
+      else if (strcmp(args, "com2") == 0)
+        run_cmd = CMD_RUN_COMLOG;
+      run_trace_stream(run_cmd);
+    } else if (strcmp(cmd, "tf") == 0) {
+      if (strcmp(args, "raw") == 0 || strcmp(args, "compact") == 0) {
+        set_trace_format(strcmp(args, "raw") == 0 ? TRACE_FMT_RAW
+                                                  : TRACE_FMT_COMPACT);
+      } else if (strlen(args) > 0) {
+        printf("Error: Unknown trace format '%s'. Use raw or compact.\n",
+               args);
       }
+      printf("Trace format: %s\n",
+             trace_format == TRACE_FMT_COMPACT ? "compact" : "raw");
     } else if (strcmp(cmd, "xr") == 0) {
-      if (xmodem_receive(ram, RAM_SIZE)) {
+      if (xfer_receive(parse_xfer_mode(args), ram, RAM_SIZE)) {
+        dirty_clear();
         printf("XMODEM receive completed successfully.\n");
       } else {
         printf("XMODEM receive failed.\n");
       }
     } else if (strcmp(cmd, "xs") == 0) {
-      if (xmodem_send(ram, RAM_SIZE)) {
+      if (xfer_send(parse_xfer_mode(args), ram, RAM_SIZE)) {
         printf("XMODEM send completed successfully.\n");
       } else {
         printf("XMODEM send failed.\n");
       }
     } else if (strcmp(cmd, "xl") == 0) {
-      int valid_cycles = 0;
-      for (int i = 0; i < MAX_CYCLES; i++) {
-        if (trace_log[i].type == LOG_UNUSED) {
-          break; // Stop at the first unused entry
-        }
-        valid_cycles++;
-      }
-      if (valid_cycles > 0) {
-        printf("Sending %d valid log entries (%d bytes)...\n", valid_cycles,
-               valid_cycles * sizeof(BusLog));
-        if (!xmodem_send((uint8_t *)trace_log, valid_cycles * sizeof(BusLog))) {
+      int valid_cycles;
+      int send_bytes = trace_log_send_size(&valid_cycles);
+      if (send_bytes > 0) {
+        printf("Sending %d valid log %s (%d bytes)...\n", valid_cycles,
+               trace_format == TRACE_FMT_COMPACT ? "bytes" : "entries",
+               send_bytes);
+        if (!xfer_send(parse_xfer_mode(args), (uint8_t *)trace_log,
+                       send_bytes)) {
           printf("Log send failed.\n");
         }
       } else {
@@ -1713,12 +7723,30 @@ int main() {
         args_ptr++;
       }
 
+      // Options: [io|com2] [stream] [raw|compact] [1k|bulk] [rle]
+      char opts[64];
+      strncpy(opts, args_ptr, sizeof(opts) - 1);
+      opts[sizeof(opts) - 1] = 0;
       uint32_t run_cmd = CMD_RUN_FULLLOG;
-      if (strcmp(args_ptr, "io") == 0) {
-        run_cmd = CMD_RUN_IOLOG;
+      bool stream = false;
+      XferMode xfer = XFER_XMODEM;
+      for (char *tok = strtok(opts, " "); tok; tok = strtok(NULL, " ")) {
+        if (strcmp(tok, "io") == 0)
+          run_cmd = CMD_RUN_IOLOG;
+        else if (strcmp(tok, "com2") == 0)
+          run_cmd = CMD_RUN_COMLOG;
+        else if (strcmp(tok, "stream") == 0)
+          stream = true;
+        else if (strcmp(tok, "compact") == 0)
+          set_trace_format(TRACE_FMT_COMPACT);
+        else if (strcmp(tok, "raw") == 0)
+          set_trace_format(TRACE_FMT_RAW);
+        else
+          xfer = xfer_mode_add(xfer, tok);
+      }
+      if (run_cmd == CMD_RUN_IOLOG) {
         printf("[AUTOTEST] Mode: I/O Log\n");
-      } else if (strcmp(args_ptr, "com2") == 0) {
-        run_cmd = CMD_RUN_COMLOG;
+      } else if (run_cmd == CMD_RUN_COMLOG) {
         printf("[AUTOTEST] Mode: COM Log\n");
       } else {
         printf("[AUTOTEST] Mode: Full Log\n");
@@ -1727,7 +7755,14 @@ int main() {
 
       printf("[AUTOTEST] Receiving test binary...\n");
       fflush(stdout);
-      if (xmodem_receive(ram, RAM_SIZE)) {
+      bool received = xfer_receive(xfer, ram, RAM_SIZE);
+      if (received)
+        dirty_clear();
+      if (received && stream) {
+        printf("[AUTOTEST] Receive success. Streaming test...\n");
+        fflush(stdout);
+        run_trace_stream(run_cmd);
+      } else if (received) {
         printf("[AUTOTEST] Receive success. Running test...\n");
         fflush(stdout);
         memset(trace_log, 0, sizeof(trace_log));
@@ -1743,22 +7778,19 @@ int main() {
         fflush(stdout);
 
         // Count the number of valid log entries
-        int valid_log_entries = 0;
-        for (int i = 0; i < MAX_CYCLES; i++) {
-          if (trace_log[i].type != LOG_UNUSED) {
-            valid_log_entries++;
-          }
-        }
+        int valid_log_entries;
+        int send_bytes = trace_log_send_size(&valid_log_entries);
 
         // Give receiver a moment to get ready
         sleep_ms(500);
 
-        if (valid_log_entries > 0) {
-          printf("[AUTOTEST] Sending log data (%d entries, %d bytes)...\n",
-                 valid_log_entries, valid_log_entries * (int)sizeof(BusLog));
+        if (send_bytes > 0) {
+          printf("[AUTOTEST] Sending log data (%d %s, %d bytes)...\n",
+                 valid_log_entries,
+                 trace_format == TRACE_FMT_COMPACT ? "bytes" : "entries",
+                 send_bytes);
           fflush(stdout);
-          if (!xmodem_send((uint8_t *)trace_log,
-                           valid_log_entries * sizeof(BusLog))) {
+          if (!xfer_send(xfer, (uint8_t *)trace_log, send_bytes)) {
             printf("[AUTOTEST] Failed to send log data.\n");
             fflush(stdout);
           }
@@ -1775,12 +7807,22 @@ int main() {
       }
       printf("[AUTOTEST] Handler finished. Returning to main loop.\n");
       fflush(stdout);
+    } else if (strcmp(cmd, "dk") == 0) {
+      if (strcmp(args, "save") == 0) {
+        if (disk_overlay_flush())
+          printf("Disk overlay saved to flash.\n");
+      } else if (strcmp(args, "clear") == 0) {
+        disk_overlay_discard();
+        printf("Disk overlay discarded.\n");
+      } else if (strlen(args) > 0) {
+        printf("Error: Unknown dk option '%s'. Use save or clear.\n", args);
+      }
+      printf("Disk: overlay %lu/%d blocks, flash log %lu/%d blocks, cache "
+             "hits %lu misses %lu\n",
+             disk_overlay_used, DISK_OVERLAY_BLOCKS, disk_log_used,
+             DISK_OVERLAY_LOG_BLOCKS, disk_cache_hits, disk_cache_misses);
     } else if (strcmp(cmd, "h") == 0) {
-      int loglevel = (strlen(args) > 0) ? strtol(args, NULL, 10) : 9;
-      cmd_load_boot("");
-      printf("Start embedded HIDOS machine\n");
-      multicore_fifo_push_blocking(CMD_RUN_HIDOSVM);
-      hidos_host(loglevel);
+      cmd_hidos(args);
     } else if (strcmp(cmd, "b") == 0) {
       reset_usb_boot(0, 0);
     } else
@@ -5,8 +5,734 @@ import struct
 import serial
 import argparse
 import io
+import os
+import json
+import binascii
 from xmodem import XMODEM
 
+LOG_ENTRY_SIZE = 8  # sizeof(BusLog) in C++
+
+def print_log(log_buffer, mode):
+    """
+    Decodes a buffer of packed BusLog records and prints it.
+    In com/com2 mode only the characters written to the COM port are shown.
+    """
+    if mode != 'com' and mode != 'com2':
+        print("\n=== Execution Log (Decoded on PC) ===")
+        print(f"{'Cycle':<5} | {'Address':<7} | {'BHE':<3} | {'A0':<2} | {'Type':<6} | {'Access':<9} | {'Data':<4} | {'Value':<10} |")
+        print("-" * 69)
+    else:
+        print("\n=== COM Port Output ===")
+
+    # Corresponds to enum LogType in C++
+    type_map = {
+        1: "MEM_RD",
+        2: "MEM_WR",
+        3: "IO_RD",
+        4: "IO_WR",
+    }
+
+    count = 0
+    for i in range(0, len(log_buffer), LOG_ENTRY_SIZE):
+        chunk = log_buffer[i:i+LOG_ENTRY_SIZE]
+        if len(chunk) < LOG_ENTRY_SIZE:
+            continue
+        
+        try:
+            # < = Little-endian, I = uint32, H = uint16, B = uint8 (for type and ctrl)
+            addr, data, btype, ctrl = struct.unpack('<IHBB', chunk)
+        except struct.error:
+            break
+        
+        # Type 0 is an unused entry, so we can stop.
+        if btype == 0:
+            break
+        # Type is EOL came from xmodem
+        if btype == 0x1A:
+            break
+
+        type_str = type_map.get(btype, "???")
+        
+        bhe_val = (ctrl & 1) # 1 if BHE# is Low (active), 0 if BHE# is High (inactive)
+        a0_val = addr & 1    # 0 if A0 is Low (even), 1 if A0 is High (odd)
+
+        # Determine Access Type based on BHE# and A0
+        access_type_str = "INVALID" # Default for BHE#=High, A0=High (0,1)
+        if bhe_val == 1: # BHE# is Low (active)
+            if a0_val == 0: # A0 is Low (even)
+                access_type_str = "WORD"
+            else: # A0 is High (odd)
+                access_type_str = "HIGH_BYTE"
+        else: # BHE# is High (inactive)
+            if a0_val == 0: # A0 is Low (even)
+                access_type_str = "LOW_BYTE"
+            # else: BHE# is High, A0 is High -> INVALID (default)
+        
+        byte_value = None
+        if access_type_str == "HIGH_BYTE":
+            byte_value = data >> 8
+        elif access_type_str == "LOW_BYTE":
+            byte_value = data & 0xFF
+
+        if mode == 'com':
+            if addr == 0x3F8 and type_str == "IO_WR" and byte_value is not None:
+                sys.stdout.write(chr(byte_value))
+                sys.stdout.flush()
+        elif mode == 'com2':
+            if addr == 0x2F8 and type_str == "IO_WR" and byte_value is not None:
+                sys.stdout.write(chr(byte_value))
+                sys.stdout.flush()
+        else:
+            # Format BHE# and A0 for display
+            bhe_display_str = "1" if bhe_val else "0"
+            a0_display_str = "1" if a0_val else "0"
+
+            # Calculate value to display in "Value" column
+            value_to_display_str = "----"
+            if access_type_str == "HIGH_BYTE":
+                value_to_display_str = f"{byte_value:02X}"
+            elif access_type_str == "LOW_BYTE":
+                value_to_display_str = f"{byte_value:02X}"
+            elif access_type_str == "WORD":
+                value_to_display_str = f"{data:04X}"
+            
+            if byte_value is not None and 32 <= byte_value <= 126: # Printable ASCII
+                value_to_display_str += f" '{chr(byte_value)}'"
+            # For "INVALID", it remains "----"
+
+            print(f"{count:<5} | {f'{addr:05X}':<7} | {bhe_display_str:<3} | {a0_display_str:<2} | {type_str:<6} | {access_type_str:<9} | {f'{data:04X}':<4} | {value_to_display_str:<10} |")
+            count += 1
+    
+    if mode != 'com':
+        print("-" * 69)
+        print(f"Total valid cycles logged: {count}")
+    else:
+        print()
+
+COMPACT_SYNC_INTERVAL = 64  # Same as main.cpp
+
+def decode_compact(buf):
+    """
+    Decodes compact trace records (see compact_encode() in main.cpp) into
+    packed 8-byte BusLog records, so print_log() can handle both formats.
+    """
+    out = bytearray()
+    prev_addr = [0, 0, 0, 0]
+    prev_data = 0
+    valid = 0
+    since_sync = 0
+    p = 0
+    while p < len(buf):
+        if since_sync == COMPACT_SYNC_INTERVAL:
+            valid = 0
+            since_sync = 0
+        since_sync += 1
+        hdr = buf[p]
+        p += 1
+        t = (hdr >> 3) & 3
+        am = hdr >> 6
+        dm = (hdr >> 1) & 3
+        if (am != 3 and not valid & (1 << t)) or (dm == 2 and not valid & 0x10):
+            print(f">>> Compact trace is corrupt at byte {p - 1}.")
+            break
+        addr = prev_addr[t]
+        if am == 0:
+            addr += 2
+        elif am == 1:
+            addr += struct.unpack_from('<b', buf, p)[0]
+            p += 1
+        elif am == 2:
+            addr += struct.unpack_from('<h', buf, p)[0]
+            p += 2
+        else:
+            addr = buf[p] | (buf[p+1] << 8) | (buf[p+2] << 16)
+            p += 3
+        addr &= 0xFFFFFFFF
+        data = prev_data
+        if dm == 0:
+            data = buf[p] | (buf[p+1] << 8)
+            p += 2
+        elif dm == 1:
+            data = buf[p]
+            p += 1
+        elif dm == 3:
+            data = buf[p] * 0x101
+            p += 1
+        prev_addr[t] = addr
+        prev_data = data
+        valid |= 0x10 | (1 << t)
+        out += struct.pack('<IHBB', addr, data, t + 1, (hdr >> 5) & 1)
+    return bytes(out)
+
+def decode_compact_log(log_buffer):
+    """
+    Strips the "V30C" header of a buffered compact log (and the XMODEM
+    padding after the payload), then decodes it.
+    """
+    if len(log_buffer) < 8 or log_buffer[:4] != b'V30C':
+        print(">>> Compact log header not found.")
+        return b''
+    size = struct.unpack_from('<I', log_buffer, 4)[0]
+    return decode_compact(log_buffer[8:8+size])
+
+def read_exact(ser, size, idle_timeout=10):
+    """
+    Reads exactly `size` bytes. Returns None if no data arrives for
+    `idle_timeout` seconds.
+    """
+    buf = bytearray()
+    last = time.time()
+    while len(buf) < size:
+        chunk = ser.read(size - len(buf))
+        if chunk:
+            buf += chunk
+            last = time.time()
+        elif time.time() - last > idle_timeout:
+            return None
+    return bytes(buf)
+
+def receive_stream(ser):
+    """
+    Receives trace stream frames ('TS'/'TC' data / 'TE' end, see
+    send_stream_frame() in main.cpp) and returns the concatenated BusLog
+    records. Every 'TC' block is decoded on its own.
+    Ctrl-C asks the Pico to stop the V30; the remaining frames are still read.
+    """
+    records = bytearray()
+    frames = 0
+    while True:
+        try:
+            hdr = read_exact(ser, 8)
+            if hdr is None:
+                print(">>> Stream timed out before the end frame.")
+                break
+            magic, count, dropped = struct.unpack('<2sHI', hdr)
+            if magic == b'TS':
+                data = read_exact(ser, count * LOG_ENTRY_SIZE)
+                if data is None:
+                    print(">>> Stream timed out inside a data frame.")
+                    break
+                records += data
+                frames += 1
+                if frames % 16 == 0:
+                    print(f">>> Streaming... {len(records) // LOG_ENTRY_SIZE} records, {dropped} dropped")
+            elif magic == b'TC':
+                data = read_exact(ser, count)
+                if data is None:
+                    print(">>> Stream timed out inside a data frame.")
+                    break
+                records += decode_compact(data)
+                frames += 1
+                if frames % 16 == 0:
+                    print(f">>> Streaming... {len(records) // LOG_ENTRY_SIZE} records, {dropped} dropped")
+            elif magic == b'TE':
+                tail = read_exact(ser, 16)
+                if tail is None:
+                    print(">>> Stream timed out inside the end frame.")
+                    break
+                total, cycles, time_us, end = struct.unpack('<IIII', tail)
+                end_str = RUN_END_NAMES[end] if end < len(RUN_END_NAMES) else str(end)
+                print(f">>> Stream end. Records: {total}, Dropped: {dropped}, Bus Cycles: {cycles}, Time: {time_us} us, End: {end_str}")
+                break
+            else:
+                print(f">>> Lost stream sync (header {hdr.hex()}).")
+                break
+        except KeyboardInterrupt:
+            print(">>> Stopping V30...")
+            ser.write(b' ')
+            ser.flush()
+    return bytes(records)
+
+def crc16_xmodem(data):
+    """CRC-16-CCITT as used by XMODEM (poly 0x1021, init 0)."""
+    return binascii.crc_hqx(data, 0)
+
+RAW_MAGIC = b'V30R'
+ACK = b'\x06'
+NAK = b'\x15'
+
+def raw_send(ser, data, retries=3):
+    """
+    Sends `data` with the raw bulk protocol (see raw_receive() in main.cpp):
+    "V30R" len:u32 data crc16:u16be, answered by ACK or NAK.
+    """
+    frame = RAW_MAGIC + struct.pack('<I', len(data)) + data + struct.pack('>H', crc16_xmodem(data))
+    for _ in range(retries):
+        ser.write(frame)
+        ser.flush()
+        reply = read_exact(ser, 1)
+        if reply == ACK:
+            return True
+        if reply != NAK:
+            break
+    return False
+
+def raw_recv(ser, retries=3):
+    """
+    Receives one raw bulk transfer (see raw_send() in main.cpp). Returns the
+    data, or None on failure.
+    """
+    ser.write(b'R')
+    ser.flush()
+    for _ in range(retries):
+        hdr = read_exact(ser, 8)
+        if hdr is None or hdr[:4] != RAW_MAGIC:
+            return None
+        size = struct.unpack_from('<I', hdr, 4)[0]
+        data = read_exact(ser, size + 2)
+        if data is None:
+            return None
+        payload, crc = data[:-2], struct.unpack('>H', data[-2:])[0]
+        if crc16_xmodem(payload) == crc:
+            ser.write(ACK)
+            ser.flush()
+            return payload
+        ser.write(NAK)
+        ser.flush()
+    return None
+
+PACK_MAGIC = b'V30P'
+
+def pack_tokens(data):
+    """
+    PackBits-compresses `data` (see pack_token() in main.cpp). 0-127: n+1
+    literal bytes follow, 129-255: the next byte is repeated 257-n times.
+    """
+    out = bytearray()
+    i, n = 0, len(data)
+    while i < n:
+        run = 1
+        while i + run < n and run < 128 and data[i + run] == data[i]:
+            run += 1
+        if run >= 3:
+            out += bytes((257 - run, data[i]))
+            i += run
+            continue
+        lit = 0
+        while i + lit < n and lit < 128 and not (
+                i + lit + 2 < n and data[i + lit] == data[i + lit + 1] == data[i + lit + 2]):
+            lit += 1
+        out.append(lit - 1)
+        out += data[i:i + lit]
+        i += lit
+    return bytes(out)
+
+def pack_rle(data):
+    """Packs `data` for an 'rle' transfer: "V30P" size:u32 tokens."""
+    return PACK_MAGIC + struct.pack('<I', len(data)) + pack_tokens(data)
+
+def unpack_rle(buf):
+    """
+    Expands an 'rle' transfer. Bytes after the last token (XMODEM padding)
+    are ignored. Returns None if the data does not match its header.
+    """
+    if len(buf) < 8 or buf[:4] != PACK_MAGIC:
+        print(">>> Packed transfer header not found.")
+        return None
+    size = struct.unpack_from('<I', buf, 4)[0]
+    out = bytearray()
+    i = 8
+    while len(out) < size and i < len(buf):
+        c = buf[i]
+        i += 1
+        if c < 128:
+            out += buf[i:i + c + 1]
+            i += c + 1
+        elif c > 128 and i < len(buf):
+            out += bytes((buf[i],)) * (257 - c)
+            i += 1
+    if len(out) != size:
+        print(f">>> Packed transfer is damaged ({len(out)} of {size} bytes).")
+        return None
+    return bytes(out)
+
+BIN_MAGIC = b'\x02\x02V30'
+BIN_MAX_PAYLOAD = 4096
+BIN_OP_PING, BIN_OP_WRITE_RAM, BIN_OP_READ_RAM, BIN_OP_FILL_RAM = 0x01, 0x02, 0x03, 0x04
+BIN_OP_SET_CLOCK, BIN_OP_SET_TRACE, BIN_OP_RUN = 0x05, 0x06, 0x07
+BIN_OP_LOG_INFO, BIN_OP_READ_LOG, BIN_OP_STATS, BIN_OP_SET_FILTER = 0x08, 0x09, 0x0A, 0x0B
+BIN_OP_SET_WATCH, BIN_OP_SET_PROFILE, BIN_OP_READ_PROFILE = 0x0C, 0x0D, 0x0E
+BIN_OP_CLEAR_STATS, BIN_OP_DIRTY_MAP, BIN_OP_READ_DIRTY = 0x0F, 0x10, 0x11
+BIN_OP_EXIT = 0x7F
+BIN_RUN_MODES = {'full': 1, 'io': 2, 'com': 2, 'com2': 3}
+BIN_ERR_CRC = 1
+BIN_END_WATCH = 6
+
+class BinaryLink:
+    """
+    Client for the framed binary host protocol (see binary_session() in
+    main.cpp):
+      request:  A5 op:u8 len:u16 payload crc16:u16be
+      response: 5A op:u8 status:u8 len:u16 payload crc16:u16be
+    """
+    def __init__(self, ser):
+        self.ser = ser
+
+    def enter(self):
+        self.ser.write(b'\r\n')
+        self.ser.flush()
+        time.sleep(0.2)
+        self.ser.reset_input_buffer()
+        self.ser.write(BIN_MAGIC)
+        self.ser.flush()
+
+    def request(self, op, payload=b'', retries=3, idle_timeout=10):
+        """Sends one request and returns the response payload. Raises on errors."""
+        body = struct.pack('<BH', op, len(payload)) + payload
+        frame = b'\xA5' + body + struct.pack('>H', crc16_xmodem(body))
+        for _ in range(retries):
+            self.ser.write(frame)
+            self.ser.flush()
+            while True:
+                start = read_exact(self.ser, 1, idle_timeout)
+                if start is None:
+                    raise IOError(f"binary protocol: no response to op {op:#04x}")
+                if start == b'\x5A':
+                    break
+            hdr = read_exact(self.ser, 4)
+            if hdr is None:
+                raise IOError("binary protocol: truncated response header")
+            r_op, status, size = struct.unpack('<BBH', hdr)
+            rest = read_exact(self.ser, size + 2)
+            if rest is None:
+                raise IOError("binary protocol: truncated response")
+            data, crc = rest[:-2], struct.unpack('>H', rest[-2:])[0]
+            if crc16_xmodem(hdr + data) != crc or status == BIN_ERR_CRC:
+                continue # Damaged in either direction, resend
+            if status != 0 or r_op != op:
+                raise IOError(f"binary protocol: op {op:#04x} failed with status {status}")
+            return data
+        raise IOError(f"binary protocol: op {op:#04x} failed after {retries} tries")
+
+    def ping(self):
+        data = self.request(BIN_OP_PING)
+        version = data[:8].rstrip(b'\0').decode()
+        ram_size, max_payload = struct.unpack_from('<IH', data, 8)
+        return version, ram_size, max_payload
+
+    def write_ram(self, addr, data):
+        step = BIN_MAX_PAYLOAD - 4
+        for off in range(0, len(data), step):
+            self.request(BIN_OP_WRITE_RAM, struct.pack('<I', addr + off) + data[off:off+step])
+
+    def read_ram(self, addr, size):
+        out = b''
+        while len(out) < size:
+            n = min(BIN_MAX_PAYLOAD, size - len(out))
+            out += self.request(BIN_OP_READ_RAM, struct.pack('<IH', addr + len(out), n))
+        return out
+
+    def fill_ram(self, value):
+        self.request(BIN_OP_FILL_RAM, bytes([value]))
+
+    def set_clock(self, freq_hz, tune_sys=False):
+        """
+        Returns (sys_khz, top, div16, err_ppm): the PWM setting the firmware
+        picked. tune_sys lets it change the RP2040 sys clock as well.
+        """
+        data = self.request(BIN_OP_SET_CLOCK,
+                            struct.pack('<IB', freq_hz, 1 if tune_sys else 0))
+        return struct.unpack('<IIHI', data)
+
+    def set_trace(self, compact):
+        self.request(BIN_OP_SET_TRACE, bytes([1 if compact else 0]))
+
+    def run(self, mode, cycles=0, timeout_ms=0):
+        """
+        Returns (bus_cycles, time_us, end_reason, watch_addr, watch_data,
+        watch_index). The watch fields are valid when end_reason is 6.
+        """
+        wait = float('inf') if timeout_ms == 0 else timeout_ms / 1000 + 10
+        data = self.request(BIN_OP_RUN, struct.pack('<BII', mode, cycles, timeout_ms),
+                            idle_timeout=wait)
+        return struct.unpack('<IIBIHB', data)
+
+    def read_log(self):
+        """Returns the log exactly as 'xl' would send it."""
+        fmt, entries, size = struct.unpack('<BII', self.request(BIN_OP_LOG_INFO))
+        out = b''
+        while len(out) < size:
+            n = min(BIN_MAX_PAYLOAD, size - len(out))
+            out += self.request(BIN_OP_READ_LOG, struct.pack('<IH', len(out), n))
+        return fmt, out
+
+    STAT_FIELDS = ['cycles', 'time_us', 'end_reason', 'stream_records', 'stream_dropped',
+                   'disk_overlay', 'disk_log', 'disk_cache_hits', 'disk_cache_misses',
+                   'prof_samples', 'mem_rd', 'mem_wr', 'io_rd', 'io_wr',
+                   'timeout_ale', 'timeout_strobe', 'resync', 'runs']
+    VMIO_DEVS = ['init', 'disk', 'con', 'aux', 'clock', 'printer', 'other']
+
+    def stats(self):
+        """Returns the STATS counters as a dict (see bin_stats() in main.cpp)."""
+        data = self.request(BIN_OP_STATS)
+        v = struct.unpack('<%dI' % (len(data) // 4), data)
+        n = len(self.STAT_FIELDS)
+        out = dict(zip(self.STAT_FIELDS, v))
+        out['run_cycles'] = v[n] | (v[n + 1] << 32)
+        out['run_time_us'] = v[n + 2] | (v[n + 3] << 32)
+        n += 4
+        out['vmio'] = {}
+        for dev in self.VMIO_DEVS:
+            out['vmio'][dev] = {'count': v[n], 'total_us': v[n + 1], 'max_us': v[n + 2]}
+            n += 3
+        out['usb_in'], out['usb_out'] = v[n], v[n + 1]
+        n += 2
+        if len(v) >= n + 3:
+            out['vmio']['queue'] = {'count': v[n], 'total_us': v[n + 1], 'max_us': v[n + 2]}
+        if len(v) >= n + 4:
+            out['rd_worst_ticks'] = v[n + 3]
+        return out
+
+    def clear_stats(self):
+        self.request(BIN_OP_CLEAR_STATS)
+
+    def set_filter(self, rules=(), com_port=0x2F8, trig=0, trig_types=0x0F, trig_arg=0, pre=0):
+        """
+        Sets the capture filter (see 'tr'). rules are (lo, hi, types) with
+        one types bit per LogType; trig is 0 off, 1 access, 2 after N cycles.
+        """
+        payload = struct.pack('<HBBIIB', com_port, trig, trig_types, trig_arg, pre, len(rules))
+        for lo, hi, types in rules:
+            payload += struct.pack('<IIB', lo, hi, types)
+        self.request(BIN_OP_SET_FILTER, payload)
+
+    def set_watch(self, points=()):
+        """Replaces the watchpoints; points are (addr, len, types), types 1 read, 2 write."""
+        self.request(BIN_OP_SET_WATCH, b''.join(struct.pack('<IIB', *w) for w in points))
+
+    def set_profile(self, period, bucket=16):
+        """Enables the sampling profiler (period 0 disables it) and clears the histogram."""
+        self.request(BIN_OP_SET_PROFILE, struct.pack('<IB', period, 4 if bucket == 16 else 8))
+
+    def read_profile(self, bucket=16):
+        """Returns the profiler histogram as a list of counts per bucket."""
+        size = (0x20000 // bucket) * 2
+        out = b''
+        while len(out) < size:
+            n = min(BIN_MAX_PAYLOAD, size - len(out))
+            out += self.request(BIN_OP_READ_PROFILE, struct.pack('<IH', len(out), n))
+        return list(struct.unpack('<%dH' % (size // 2), out))
+
+    def dirty_map(self, clear=False):
+        """
+        Returns (page_size, pages, [dirty page indexes]): the RAM pages
+        written since the last clear or whole-RAM load.
+        """
+        data = self.request(BIN_OP_DIRTY_MAP, bytes([1 if clear else 0]))
+        page_size, pages = struct.unpack('<HH', data[:4])
+        return page_size, pages, [i for i in range(pages) if data[4 + i // 8] & (1 << (i % 8))]
+
+    def read_dirty(self):
+        """Returns {page index: page data} for every dirty page."""
+        page_size, pages, _ = self.dirty_map()
+        out = {}
+        page = 0
+        while page < pages:
+            data = self.request(BIN_OP_READ_DIRTY, struct.pack('<H', page))
+            page = struct.unpack('<H', data[:2])[0]
+            for pos in range(2, len(data), 2 + page_size):
+                index = struct.unpack('<H', data[pos:pos+2])[0]
+                out[index] = data[pos+2:pos+2+page_size]
+        return out
+
+    def sync_ram(self, mirror):
+        """Copies the dirty pages into mirror (a bytearray of the RAM)."""
+        for index, data in self.read_dirty().items():
+            mirror[index * len(data):(index + 1) * len(data)] = data
+        return mirror
+
+    def exit(self):
+        self.request(BIN_OP_EXIT)
+
+def binary_autotest(ser, args):
+    """
+    Same test as 'autotest', driven through the binary protocol: fill RAM,
+    upload, run until the bus stops, fetch the log.
+    """
+    link = BinaryLink(ser)
+    link.enter()
+    version, ram_size, _ = link.ping()
+    print(f">>> Binary protocol: monitor v{version}, RAM {ram_size // 1024}KB")
+    with open(args.binfile, 'rb') as f:
+        image = f.read()
+    link.fill_ram(0xF4)
+    link.write_ram(0, image)
+    print(f">>> Uploaded {len(image)} bytes.")
+    link.set_trace(args.compact)
+    cycles, time_us, end, w_addr, w_data, w_index = link.run(BIN_RUN_MODES[args.mode], 0, args.timeout * 1000)
+    print(f">>> {cycles} bus cycles executed, {time_us} us (end reason {end})")
+    if end == BIN_END_WATCH:
+        print(f">>> Watchpoint {w_index} hit at {w_addr:05X} = {w_data:04X}")
+    page_size, _, dirty = link.dirty_map()
+    print(f">>> {len(dirty)} RAM pages of {page_size} bytes written by the run")
+    fmt, log_buffer = link.read_log()
+    print(f">>> Log Received. Total bytes: {len(log_buffer)}")
+    link.exit()
+    if fmt == 1:
+        log_buffer = decode_compact_log(log_buffer)
+    print_log(log_buffer, args.mode)
+
+BATCH_MODES = {'none': 0, 'full': 1, 'io': 2, 'com2': 3}
+BATCH_CHECK_NONE, BATCH_CHECK_RAM, BATCH_CHECK_COM = 0, 1, 2
+BATCH_STATUS = ['PASS', 'FAIL', 'BAD']
+BATCH_NO_MISMATCH = 0xFFFFFFFF
+RUN_END_NAMES = ['limit', 'stop', 'log full', 'bus idle', 'no strobe', 'resync', 'watch']
+
+def build_batch(path):
+    """
+    Builds a batch image (see cmd_batch() in main.cpp) from a JSON manifest:
+      {"tests": [{"bin": "test.bin", "mode": "none|full|io|com2",
+                  "load": 0, "fill": 0, "cycles": 0, "timeout_ms": 5000,
+                  "clock_khz": 0,
+                  "expect_ram": {"addr": "0x100", "hex": "03"} or
+                  "expect_com": "text"}, ...]}
+    Paths are relative to the manifest. Returns the image and the names.
+    """
+    with open(path) as f:
+        tests = json.load(f)['tests']
+    base = os.path.dirname(os.path.abspath(path))
+    data_off = 12 + 44 * len(tests)
+    entries, data, names = [], bytearray(), []
+    for t in tests:
+        with open(os.path.join(base, t['bin']), 'rb') as f:
+            binary = f.read()
+        packed = pack_tokens(binary)
+        bin_off = data_off + len(data)
+        data += packed
+        check, expect, expect_addr = BATCH_CHECK_NONE, b'', 0
+        if 'expect_ram' in t:
+            e = t['expect_ram']
+            check, expect_addr = BATCH_CHECK_RAM, int(str(e['addr']), 0)
+            if 'file' in e:
+                with open(os.path.join(base, e['file']), 'rb') as f:
+                    expect = f.read()
+            else:
+                expect = bytes.fromhex(e['hex'])
+        elif 'expect_com' in t:
+            check, expect = BATCH_CHECK_COM, t['expect_com'].encode()
+        expect_off = data_off + len(data)
+        data += expect
+        mode = t.get('mode', 'com2' if check == BATCH_CHECK_COM else 'none')
+        entries.append(struct.pack('<10I4B', bin_off, len(packed),
+                                   int(str(t.get('load', 0)), 0), len(binary),
+                                   t.get('cycles', 0), t.get('timeout_ms', 5000),
+                                   t.get('clock_khz', 0) * 1000,
+                                   expect_off, len(expect), expect_addr,
+                                   BATCH_MODES[mode], check, t.get('fill', 0), 0))
+        names.append(t['bin'])
+    body = b''.join(entries) + data
+    return b'V30B' + struct.pack('<HHI', len(tests), crc16_xmodem(body), len(body)) + body, names
+
+def print_batch_results(blob, names):
+    """
+    Prints the "V30T" result blob of 'batch'. Returns True if every test
+    passed.
+    """
+    if len(blob) < 8 or blob[:4] != b'V30T':
+        print(">>> Batch result header not found.")
+        return False
+    count, passed = struct.unpack_from('<HH', blob, 4)
+    output = blob[8 + 20 * count:]
+    print(f"\n=== Batch Results ({passed}/{count} passed) ===")
+    print(f"{'#':>3} | {'Status':<6} | {'Cycles':>9} | {'Time us':>9} | {'End':<9} | Test")
+    print("-" * 69)
+    for i in range(count):
+        cycles, time_us, mismatch, out_off, out_len, end, status, _ = \
+            struct.unpack_from('<IIIHHBBH', blob, 8 + 20 * i)
+        end_str = RUN_END_NAMES[end] if end < len(RUN_END_NAMES) else str(end)
+        name = names[i] if i < len(names) else '?'
+        print(f"{i + 1:>3} | {BATCH_STATUS[status]:<6} | {cycles:>9} | {time_us:>9} | {end_str:<9} | {name}")
+        if mismatch != BATCH_NO_MISMATCH:
+            print(f"      first mismatch at +{mismatch}")
+        if out_len:
+            text = output[out_off:out_off + out_len].decode(errors='replace')
+            print(f"      COM: {text!r}")
+    return passed == count
+
+def batch_autotest(ser, args, xm):
+    """
+    Runs every test of a manifest with one 'batch' command: uploads the
+    batch image, waits for the runs and receives the consolidated results.
+    """
+    image, names = build_batch(args.batch)
+    options = ['batch']
+    if args.xfer != 'xmodem':
+        options.append(args.xfer)
+    if args.rle:
+        options.append('rle')
+    command_str = ' '.join(options)
+    print(f">>> Sent '{command_str}' ({len(names)} tests, {len(image)} byte image).")
+    ser.reset_input_buffer()
+    ser.write(b'\r\n' + command_str.encode() + b'\r\n')
+    ser.flush()
+
+    def wait_for(message, idle_timeout):
+        last = time.time()
+        while time.time() - last < idle_timeout:
+            line = ser.readline()
+            if line:
+                last = time.time()
+                text = line.decode(errors='ignore').strip()
+                print(f"PICO: {text}")
+                if message in text:
+                    return True
+        return False
+
+    ready = "Ready to RECEIVE RAW..." if args.xfer == 'bulk' else "Ready to RECEIVE XMODEM (CRC)..."
+    if not wait_for(ready, 10):
+        print(">>> Pico did not become ready for the batch image.")
+        return False
+    data = pack_rle(image) if args.rle else image
+    ok = raw_send(ser, data) if args.xfer == 'bulk' else xm.send(io.BytesIO(data), quiet=False)
+    if not ok:
+        print(">>> Upload Failed.")
+        return False
+
+    # Every test prints a line, so only a silent Pico counts as a timeout
+    ready = "Ready to SEND RAW..." if args.xfer == 'bulk' else "Ready to SEND XMODEM..."
+    if not wait_for(ready, args.timeout):
+        print(">>> Timed out waiting for the batch results.")
+        return False
+    if args.xfer == 'bulk':
+        blob = raw_recv(ser) or b''
+    else:
+        stream = io.BytesIO()
+        blob = stream.getvalue() if xm.recv(stream, quiet=False) else b''
+    if blob and args.rle:
+        blob = unpack_rle(blob) or b''
+    return print_batch_results(blob, names)
+
+def hidos_stream(ser, args):
+    """
+    Starts HIDOS with 'h stream' and receives its bus log while the DOS
+    session stays usable on the second USB port. Ctrl-C stops the VM.
+    """
+    options = ['h', 'stream']
+    if args.mode in ['io', 'com']:
+        options.append('io')
+    elif args.mode in ['com2']:
+        options.append('com2')
+    command_str = ' '.join(options)
+    print(f">>> Sent '{command_str}'. Console on the second USB port, Ctrl-C stops the VM.")
+    ser.reset_input_buffer()
+    ser.write(b'\r\n' + command_str.encode() + b'\r\n')
+    ser.flush()
+    for _ in range(10):
+        line = ser.readline()
+        if not line:
+            continue
+        text = line.decode(errors='ignore').strip()
+        print(f"PICO: {text}")
+        if "Ready to STREAM trace..." in text:
+            break
+        if text.startswith("Error"):
+            return False
+    else:
+        print(">>> Pico did not start the stream.")
+        return False
+    print_log(receive_stream(ser), args.mode)
+    return True
+
 def main():
     """
     Main function to run the V30 test automation.
@@ -18,9 +744,19 @@ def main():
     parser = argparse.ArgumentParser(description='V30 Test Runner for Pico Monitor')
     parser.add_argument('--port', default='/dev/ttyACM0', help='Serial port for the Pico')
     parser.add_argument('--baud', default=115200, type=int, help='Serial baud rate')
-    parser.add_argument('--binfile', required=True, help='V30 binary file to upload')
+    parser.add_argument('--binfile', help='V30 binary file to upload')
     parser.add_argument('--mode', default='full', choices=['full', 'io', 'com', 'com2'], help='Logging mode for autotest (full, io, com or com2)')
+    parser.add_argument('--stream', action='store_true', help='Stream the log while the V30 runs instead of one buffered XMODEM transfer')
+    parser.add_argument('--compact', action='store_true', help='Use the compact delta-encoded trace format')
+    parser.add_argument('--xfer', default='xmodem', choices=['xmodem', '1k', 'bulk'], help='Transfer mode for the binary and the log (XMODEM, XMODEM-1K or raw bulk)')
+    parser.add_argument('--rle', action='store_true', help='PackBits-compress the binary and the log on the wire (the "rle" transfer option)')
+    parser.add_argument('--binary', action='store_true', help='Drive the monitor through the framed binary protocol instead of the text commands')
+    parser.add_argument('--timeout', default=60, type=int, help='Seconds before a --binary run is stopped (--batch: seconds without output from the Pico)')
+    parser.add_argument('--batch', metavar='MANIFEST', help='Run every test of a JSON manifest with one batch command instead of --binfile')
+    parser.add_argument('--hidos', action='store_true', help='Stream the bus log of a HIDOS session (h stream, --mode selects the cycles); the console stays on the second USB port')
     args = parser.parse_args()
+    if not args.binfile and not args.batch and not args.hidos:
+        parser.error('one of --binfile, --batch or --hidos is required')
 
     try:
         ser = serial.Serial(args.port, args.baud, timeout=1)
@@ -28,28 +764,60 @@ def main():
         print(f"Error: Could not open serial port {args.port}: {e}")
         sys.exit(1)
 
+    if args.binary:
+        try:
+            binary_autotest(ser, args)
+        except (IOError, FileNotFoundError) as e:
+            print(f">>> {e}")
+            sys.exit(1)
+        return
+
     xm = XMODEM(lambda size, timeout=1: ser.read(size) or None,
-                lambda data, timeout=1: ser.write(data))
+                lambda data, timeout=1: ser.write(data),
+                mode='xmodem1k' if args.xfer == '1k' else 'xmodem')
 
     print(f"--- V30 Auto Test System (Port: {args.port}) ---")
 
+    if args.hidos:
+        ok = hidos_stream(ser, args)
+        ser.close()
+        sys.exit(0 if ok else 1)
+
+    if args.batch:
+        try:
+            ok = batch_autotest(ser, args, xm)
+        except (IOError, KeyError, ValueError) as e:
+            print(f">>> Bad batch manifest: {e}")
+            ok = False
+        ser.close()
+        sys.exit(0 if ok else 1)
+
     # 1. Send 'autotest' command to Pico
     ser.reset_input_buffer()
+    options = []
     if args.mode in ['io', 'com']:
-        command = b'\r\nautotest io\r\n'
-        print(">>> Sent 'autotest io' command. Waiting for Pico to be ready...")
+        options.append('io')
     elif args.mode in ['com2']:
-        command = b'\r\nautotest com2\r\n'
-        print(">>> Sent 'autotest com2' command. Waiting for Pico to be ready...")
-    else:
-        command = b'\r\nautotest\r\n'
-        print(">>> Sent 'autotest' command. Waiting for Pico to be ready...")
+        options.append('com2')
+    if args.stream:
+        options.append('stream')
+    options.append('compact' if args.compact else 'raw')
+    if args.xfer != 'xmodem':
+        options.append(args.xfer)
+    if args.rle:
+        options.append('rle')
+    command_str = ' '.join(['autotest'] + options)
+    command = b'\r\n' + command_str.encode() + b'\r\n'
+    print(f">>> Sent '{command_str}' command. Waiting for Pico to be ready...")
     ser.write(command)
     ser.flush()
 
     # Wait for the specific "Ready to RECEIVE" message from the Pico
     # to ensure it's in the correct state.
-    ready_message = b"Ready to RECEIVE XMODEM (CRC)..."
+    if args.xfer == 'bulk':
+        ready_message = b"Ready to RECEIVE RAW..."
+    else:
+        ready_message = b"Ready to RECEIVE XMODEM (CRC)..."
     full_response = b""
     # Set a timeout for the initial readiness check
     original_timeout = ser.timeout
@@ -82,7 +850,14 @@ def main():
         with open(args.binfile, 'rb') as f:
             print(f">>> Uploading {args.binfile}...")
             # The xmodem library will now handle the 'C' handshake on a clean line.
-            if not xm.send(f, quiet=False):
+            data = f.read()
+            if args.rle:
+                data = pack_rle(data)
+            if args.xfer == 'bulk':
+                ok = raw_send(ser, data)
+            else:
+                ok = xm.send(io.BytesIO(data), quiet=False)
+            if not ok:
                 print(">>> Upload Failed. Aborting.")
                 ser.close()
                 sys.exit(1)
@@ -95,7 +870,10 @@ def main():
     
     pico_ready_to_send = False
     # Read lines from Pico until we see the "Ready to SEND" message or we time out.
-    log_send_ready_msg = b"Ready to SEND XMODEM..."
+    if args.stream:
+        log_send_ready_msg = b"Ready to STREAM trace..."
+    else:
+        log_send_ready_msg = b"Ready to SEND RAW..." if args.xfer == 'bulk' else b"Ready to SEND XMODEM..."
     for _ in range(60): # Try for up to 60 seconds
         try:
             line = ser.readline()
@@ -119,106 +897,29 @@ def main():
     print(">>> Pico is ready to send. Receiving binary log...")
     log_stream = io.BytesIO()
     
-    if not xm.recv(log_stream, quiet=False):
+    if args.stream:
+        log_buffer = receive_stream(ser)
+    elif args.xfer == 'bulk':
+        log_buffer = raw_recv(ser)
+        if log_buffer is None:
+            print(">>> Log Receive Failed. Pico may not have sent anything.")
+            log_buffer = b''
+        else:
+            print(f">>> Log Received. Total bytes: {len(log_buffer)}")
+    elif not xm.recv(log_stream, quiet=False):
         print(">>> Log Receive Failed. Pico may not have sent anything.")
         log_buffer = b'' # Ensure log_buffer is bytes
     else:
         log_buffer = log_stream.getvalue()
         print(f">>> Log Received. Total bytes: {len(log_buffer)}")
+    if not args.stream and log_buffer and args.rle:
+        log_buffer = unpack_rle(log_buffer) or b''
+        print(f">>> Unpacked log: {len(log_buffer)} bytes")
+    if not args.stream and log_buffer and args.compact:
+        log_buffer = decode_compact_log(log_buffer)
 
     # 5. Decode and print the log
-    if args.mode != 'com' and args.mode != 'com2':
-        print("\n=== Execution Log (Decoded on PC) ===")
-        print(f"{'Cycle':<5} | {'Address':<7} | {'BHE':<3} | {'A0':<2} | {'Type':<6} | {'Access':<9} | {'Data':<4} | {'Value':<10} |")
-        print("-" * 69)
-    else:
-        print("\n=== COM Port Output ===")
-
-    # Corresponds to enum LogType in C++
-    type_map = {
-        1: "MEM_RD",
-        2: "MEM_WR",
-        3: "IO_RD",
-        4: "IO_WR",
-    }
-
-    LOG_ENTRY_SIZE = 8  # sizeof(BusLog) in C++
-    count = 0
-    for i in range(0, len(log_buffer), LOG_ENTRY_SIZE):
-        chunk = log_buffer[i:i+LOG_ENTRY_SIZE]
-        if len(chunk) < LOG_ENTRY_SIZE:
-            continue
-        
-        try:
-            # < = Little-endian, I = uint32, H = uint16, B = uint8 (for type and ctrl)
-            addr, data, btype, ctrl = struct.unpack('<IHBB', chunk)
-        except struct.error:
-            break
-        
-        # Type 0 is an unused entry, so we can stop.
-        if btype == 0:
-            break
-        # Type is EOL came from xmodem
-        if btype == 0x1A:
-            break
-
-        type_str = type_map.get(btype, "???")
-        
-        bhe_val = (ctrl & 1) # 1 if BHE# is Low (active), 0 if BHE# is High (inactive)
-        a0_val = addr & 1    # 0 if A0 is Low (even), 1 if A0 is High (odd)
-
-        # Determine Access Type based on BHE# and A0
-        access_type_str = "INVALID" # Default for BHE#=High, A0=High (0,1)
-        if bhe_val == 1: # BHE# is Low (active)
-            if a0_val == 0: # A0 is Low (even)
-                access_type_str = "WORD"
-            else: # A0 is High (odd)
-                access_type_str = "HIGH_BYTE"
-        else: # BHE# is High (inactive)
-            if a0_val == 0: # A0 is Low (even)
-                access_type_str = "LOW_BYTE"
-            # else: BHE# is High, A0 is High -> INVALID (default)
-        
-        byte_value = None
-        if access_type_str == "HIGH_BYTE":
-            byte_value = data >> 8
-        elif access_type_str == "LOW_BYTE":
-            byte_value = data & 0xFF
-
-        if args.mode == 'com':
-            if addr == 0x3F8 and type_str == "IO_WR" and byte_value is not None:
-                sys.stdout.write(chr(byte_value))
-                sys.stdout.flush()
-        elif args.mode == 'com2':
-            if addr == 0x2F8 and type_str == "IO_WR" and byte_value is not None:
-                sys.stdout.write(chr(byte_value))
-                sys.stdout.flush()
-        else:
-            # Format BHE# and A0 for display
-            bhe_display_str = "1" if bhe_val else "0"
-            a0_display_str = "1" if a0_val else "0"
-
-            # Calculate value to display in "Value" column
-            value_to_display_str = "----"
-            if access_type_str == "HIGH_BYTE":
-                value_to_display_str = f"{byte_value:02X}"
-            elif access_type_str == "LOW_BYTE":
-                value_to_display_str = f"{byte_value:02X}"
-            elif access_type_str == "WORD":
-                value_to_display_str = f"{data:04X}"
-            
-            if byte_value is not None and 32 <= byte_value <= 126: # Printable ASCII
-                value_to_display_str += f" '{chr(byte_value)}'"
-            # For "INVALID", it remains "----"
-
-            print(f"{count:<5} | {f'{addr:05X}':<7} | {bhe_display_str:<3} | {a0_display_str:<2} | {type_str:<6} | {access_type_str:<9} | {f'{data:04X}':<4} | {value_to_display_str:<10} |")
-            count += 1
-    
-    if args.mode != 'com':
-        print("-" * 69)
-        print(f"Total valid cycles logged: {count}")
-    else:
-        print()
+    print_log(log_buffer, args.mode)
 
 if __name__ == "__main__":
     main()
@@ -0,0 +1,21 @@
+#ifndef TUSB_CONFIG_H
+#define TUSB_CONFIG_H
+
+// TinyUSB device configuration: two CDC ACM ports, monitor and V30 console.
+// Descriptors and the stdio driver are in main.cpp (USB section).
+// CFG_TUSB_MCU and CFG_TUSB_OS come from the Pico SDK.
+
+#define CFG_TUSB_RHPORT0_MODE OPT_MODE_DEVICE
+#define CFG_TUD_ENDPOINT0_SIZE 64
+
+#define CFG_TUD_CDC 2
+#define CFG_TUD_MSC 0
+#define CFG_TUD_HID 0
+#define CFG_TUD_MIDI 0
+#define CFG_TUD_VENDOR 0
+
+#define CFG_TUD_CDC_RX_BUFSIZE 256
+#define CFG_TUD_CDC_TX_BUFSIZE 1024 // Trace streams and bulk transfers
+#define CFG_TUD_CDC_EP_BUFSIZE 64
+
+#endif